@@ -11,9 +11,11 @@ common_src_files := \
 	fs/Ext4.cpp \
 	fs/F2fs.cpp \
 	fs/Ntfs.cpp \
+	fs/Sdcardfs.cpp \
 	fs/Vfat.cpp \
 	Loop.cpp \
 	Devmapper.cpp \
+	DeviceMapper.cpp \
 	ResponseCode.cpp \
 	CheckBattery.cpp \
 	Ext4Crypt.cpp \
@@ -21,21 +23,46 @@ common_src_files := \
 	cryptfs.cpp \
 	Disk.cpp \
 	DiskPartition.cpp \
+	PartitionTable.cpp \
+	PatternMatcher.cpp \
 	VolumeBase.cpp \
 	PublicVolume.cpp \
 	PrivateVolume.cpp \
 	EmulatedVolume.cpp \
 	Utils.cpp \
 	MoveTask.cpp \
+	NamespaceIndex.cpp \
+	TreeCopier.cpp \
+	TreeRemover.cpp \
 	Benchmark.cpp \
+	BenchmarkTrace.cpp \
+	BenchHistory.cpp \
+	BenchmarkProbe.cpp \
 	TrimTask.cpp \
+	Uevent.cpp \
+	Timings.cpp \
+	IoStats.cpp \
+	JobScheduler.cpp \
+	EventBatch.cpp \
+	AppFuse.cpp \
+	CommandQueue.cpp \
+	StorageState.cpp \
+	MountTable.cpp \
+	MountJournal.cpp \
+	FileDeviceUtils.cpp \
+	SecureDiscard.cpp \
+	FsckCache.cpp \
+	FsProbe.cpp \
+	Spawner.cpp \
 	KeyBuffer.cpp \
+	KdfCache.cpp \
 	Keymaster.cpp \
 	KeyStorage.cpp \
 	KeyUtil.cpp \
 	ScryptParameters.cpp \
 	secontext.cpp \
 	EncryptInplace.cpp \
+	EncryptProgress.cpp \
 	MetadataCrypt.cpp \
 
 common_c_includes := \
@@ -177,6 +204,7 @@ LOCAL_TIDY_FLAGS := $(common_local_tidy_flags)
 LOCAL_TIDY_CHECKS := $(common_local_tidy_checks)
 LOCAL_SRC_FILES:= \
     FileDeviceUtils.cpp \
+    SecureDiscard.cpp \
     secdiscard.cpp \
 
 LOCAL_MODULE:= secdiscard
@@ -186,4 +214,35 @@ LOCAL_CONLYFLAGS := $(vold_conlyflags)
 
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+LOCAL_MODULE := vold_benchmark
+LOCAL_CLANG := true
+LOCAL_TIDY := true
+LOCAL_TIDY_FLAGS := $(common_local_tidy_flags)
+LOCAL_TIDY_CHECKS := $(common_local_tidy_checks)
+LOCAL_SRC_FILES := bench/vold_benchmark.cpp
+LOCAL_C_INCLUDES := $(common_c_includes)
+LOCAL_CFLAGS := $(vold_cflags)
+LOCAL_CONLYFLAGS := $(vold_conlyflags)
+LOCAL_SHARED_LIBRARIES := $(common_shared_libraries)
+LOCAL_STATIC_LIBRARIES := libvold $(common_static_libraries)
+LOCAL_MODULE_TAGS := eng tests
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+LOCAL_MODULE := vold_crypto_benchmark
+LOCAL_CLANG := true
+LOCAL_SRC_FILES := bench/crypto_benchmark.cpp
+LOCAL_C_INCLUDES := $(common_c_includes)
+LOCAL_CFLAGS := $(vold_cflags)
+LOCAL_SHARED_LIBRARIES := $(common_shared_libraries)
+LOCAL_STATIC_LIBRARIES := libvold $(common_static_libraries)
+
+include $(BUILD_NATIVE_BENCHMARK)
+
 include $(LOCAL_PATH)/tests/Android.mk
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "AppFuse.h"
+#include "Spawner.h"
+#include "Utils.h"
+#include "VolumeManager.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+
+#include <map>
+#include <mutex>
+
+#include <limits.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using android::base::StringPrintf;
+using android::base::unique_fd;
+
+namespace android {
+namespace vold {
+
+namespace {
+
+enum : int32_t {
+    kMount = 1,
+    kUnmount = 2,
+};
+
+/* Mounts also pass the /dev/fuse fd */
+struct Request {
+    int32_t op;
+    uint32_t uid;
+    char path[PATH_MAX];
+};
+
+struct Helper {
+    pid_t pid;
+    unique_fd fd;
+};
+
+std::mutex sLock;
+/* Keyed by namespace inode */
+std::map<ino_t, Helper> sHelpers;
+
+}  // namespace
+
+static status_t mountAppFuse(uid_t uid, int deviceFd, const std::string& path) {
+    // Remove existing mount.
+    ForceUnmount(path);
+
+    const auto opts = StringPrintf(
+            "fd=%i,"
+            "rootmode=40000,"
+            "default_permissions,"
+            "allow_other,"
+            "user_id=%d,group_id=%d,"
+            "context=\"u:object_r:app_fuse_file:s0\","
+            "fscontext=u:object_r:app_fusefs:s0",
+            deviceFd,
+            uid,
+            uid);
+
+    const int result = TEMP_FAILURE_RETRY(mount(
+            "/dev/fuse", path.c_str(), "fuse",
+            MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_NOATIME, opts.c_str()));
+    if (result != 0) {
+        PLOG(ERROR) << "Failed to mount " << path;
+        return -errno;
+    }
+
+    return OK;
+}
+
+static status_t unmountAppFuse(const std::string& path) {
+    // If it's just after all FD opened on mount point are closed, umount2 can fail with
+    // EBUSY. To avoid the case, specify MNT_DETACH.
+    if (umount2(path.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) != 0 &&
+            errno != EINVAL && errno != ENOENT) {
+        PLOG(ERROR) << "Failed to unmount directory.";
+        return -errno;
+    }
+    if (rmdir(path.c_str()) != 0) {
+        PLOG(ERROR) << "Failed to remove the mount directory.";
+        return -errno;
+    }
+    return OK;
+}
+
+status_t RunAppFuseCommand(const std::string& command, uid_t uid, const std::string& path,
+        int deviceFd) {
+    if (command == "mount") {
+        return mountAppFuse(uid, deviceFd, path);
+    } else if (command == "unmount") {
+        return unmountAppFuse(path);
+    } else {
+        LOG(ERROR) << "Unknown appfuse command " << command;
+        return -EPERM;
+    }
+}
+
+/* Runs in the helper, until vold closes its end */
+static int serveRequests(int fd) {
+    while (true) {
+        Request req;
+        struct iovec iov = { &req, sizeof(req) };
+        char cbuf[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        ssize_t len = TEMP_FAILURE_RETRY(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC));
+        if (len <= 0) return 0;
+
+        int deviceFd = -1;
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(&deviceFd, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        int32_t status;
+        if (len != sizeof(req) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            status = -EINVAL;
+        } else {
+            req.path[PATH_MAX - 1] = '\0';
+            if (req.op == kMount && deviceFd != -1) {
+                status = mountAppFuse(req.uid, deviceFd, req.path);
+            } else if (req.op == kUnmount) {
+                status = unmountAppFuse(req.path);
+            } else {
+                status = -EINVAL;
+            }
+        }
+        // The mount has its own reference to the device
+        if (deviceFd != -1) close(deviceFd);
+        TEMP_FAILURE_RETRY(send(fd, &status, sizeof(status), MSG_NOSIGNAL));
+    }
+}
+
+static bool sendRequest(const Helper& helper, const Request& req, int deviceFd,
+        status_t* status) {
+    struct iovec iov = { const_cast<Request*>(&req), sizeof(req) };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    memset(cbuf, 0, sizeof(cbuf));
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (deviceFd != -1) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &deviceFd, sizeof(int));
+    }
+
+    int32_t reply;
+    if (TEMP_FAILURE_RETRY(sendmsg(helper.fd.get(), &msg, MSG_NOSIGNAL)) != sizeof(req)
+            || TEMP_FAILURE_RETRY(recv(helper.fd.get(), &reply, sizeof(reply), 0))
+                    != sizeof(reply)) {
+        return false;
+    }
+    *status = reply;
+    return true;
+}
+
+/* Closing a helper's socket is what ends it */
+static void pruneHelpersLocked() {
+    auto& index = VolumeManager::Instance()->getNamespaceIndex();
+    for (auto it = sHelpers.begin(); it != sHelpers.end();) {
+        if (index.hasMembers(it->first, it->second.pid)) {
+            ++it;
+        } else {
+            LOG(VERBOSE) << "Namespace " << it->first << " is gone; dropping helper "
+                    << it->second.pid;
+            it = sHelpers.erase(it);
+        }
+    }
+}
+
+status_t RunAppFuseCommandInNamespace(ino_t ns, int nsFd, const std::string& command,
+        uid_t uid, const std::string& path, int deviceFd) {
+    Request req = {};
+    if (command == "mount") {
+        req.op = kMount;
+    } else if (command == "unmount") {
+        req.op = kUnmount;
+    } else {
+        LOG(ERROR) << "Unknown appfuse command " << command;
+        return -EPERM;
+    }
+    if (path.size() >= sizeof(req.path)) return -EINVAL;
+    req.uid = uid;
+    strcpy(req.path, path.c_str());
+
+    std::lock_guard<std::mutex> lock(sLock);
+    pruneHelpersLocked();
+
+    status_t status;
+    auto it = sHelpers.find(ns);
+    if (it != sHelpers.end()) {
+        if (sendRequest(it->second, req, deviceFd, &status)) return status;
+        LOG(WARNING) << "Lost helper " << it->second.pid << "; starting another";
+        sHelpers.erase(it);
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+        PLOG(ERROR) << "Failed to create helper socket";
+        return -errno;
+    }
+    unique_fd fd(fds[0]);
+    pid_t pid;
+    status_t res = SpawnInNamespace(nsFd, fds[1], &serveRequests, &pid);
+    close(fds[1]);
+    if (res != OK) return res;
+    LOG(VERBOSE) << "Started helper " << pid << " for namespace " << ns;
+
+    Helper& helper = sHelpers[ns];
+    helper.pid = pid;
+    helper.fd = std::move(fd);
+    if (!sendRequest(helper, req, deviceFd, &status)) {
+        LOG(ERROR) << "Helper " << pid << " failed";
+        sHelpers.erase(ns);
+        return -EIO;
+    }
+    return status;
+}
+
+}  // namespace vold
+}  // namespace android
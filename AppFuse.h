@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_APP_FUSE_H
+#define ANDROID_VOLD_APP_FUSE_H
+
+#include <utils/Errors.h>
+
+#include <string>
+
+#include <sys/types.h>
+
+namespace android {
+namespace vold {
+
+/* Mounts or unmounts appfuse at |path| in the calling process's namespace */
+status_t RunAppFuseCommand(const std::string& command, uid_t uid, const std::string& path,
+        int deviceFd);
+
+/*
+ * Runs |command| in namespace |ns|, opened as |nsFd|, through a helper
+ * that stays in that namespace for later commands. Helpers are dropped
+ * once their namespace has no other members. Returns -ENOTCONN when no
+ * helper can be started, in which case callers should fork themselves.
+ */
+status_t RunAppFuseCommandInNamespace(ino_t ns, int nsFd, const std::string& command,
+        uid_t uid, const std::string& path, int deviceFd);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BenchHistory.h"
+#include "StorageState.h"
+#include "Utils.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <cutils/properties.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const char* kHistoryDir = "/data/misc/vold/bench_history";
+static const char* kHistorySuffix = ".history";
+
+static const uint32_t kMagic = 0x56424831;  // VBH1
+static const size_t kCapacity = 128;
+static const size_t kMaxKinds = 16;
+static const size_t kKindSize = 48;
+/* Runs averaged into a kind's baseline, and runs in its recent median */
+static const uint32_t kBaselineRuns = 5;
+static const size_t kRecentRuns = 5;
+static const int kDefaultRegressPct = 50;
+/* Smaller trims say more about fixed overhead than about the device */
+static const uint64_t kMinTrimBytes = 256 * 1024 * 1024;
+static const uint64_t kGiB = 1024 * 1024 * 1024;
+
+struct Baseline {
+    char kind[kKindSize];
+    int64_t value;
+    uint32_t runs;
+    uint32_t reserved;
+};
+
+struct Header {
+    uint32_t magic;
+    uint32_t capacity;
+    /* Slot the next run goes in, and how many slots are filled */
+    uint32_t next;
+    uint32_t count;
+    Baseline baselines[kMaxKinds];
+};
+
+struct Record {
+    char kind[kKindSize];
+    int64_t time;
+    int64_t value;
+};
+
+struct History {
+    Header header;
+    /* Oldest first */
+    std::vector<Record> records;
+};
+
+/* Benchmarks and trims run on different threads */
+static std::mutex sHistoryLock;
+
+static std::string historyPath(const std::string& key) {
+    return StringPrintf("%s/%s%s", kHistoryDir, key.c_str(), kHistorySuffix);
+}
+
+/*
+ * Adopted volumes by partition GUID, normalized as forgetPartition has it,
+ * and everything else by mount point
+ */
+static std::string keyForPath(const std::string& path) {
+    for (const auto& vol : GetStorageState()->volumes) {
+        std::string normalizedGuid;
+        if (vol.path == path && !vol.partGuid.empty()
+                && NormalizeHex(vol.partGuid, normalizedGuid) == OK) {
+            return normalizedGuid;
+        }
+    }
+    std::string key(path, path.find_first_not_of('/') == std::string::npos
+            ? path.size() : path.find_first_not_of('/'));
+    std::replace(key.begin(), key.end(), '/', '_');
+    return key.empty() ? "root" : key;
+}
+
+static bool readHistory(int fd, History* history) {
+    memset(&history->header, 0, sizeof(history->header));
+    history->records.clear();
+    Header& h = history->header;
+    if (TEMP_FAILURE_RETRY(pread(fd, &h, sizeof(h), 0)) != sizeof(h)
+            || h.magic != kMagic || h.capacity != kCapacity
+            || h.next >= kCapacity || h.count > kCapacity) {
+        memset(&h, 0, sizeof(h));
+        return false;
+    }
+
+    std::vector<Record> ring(kCapacity);
+    ssize_t len = kCapacity * sizeof(Record);
+    if (TEMP_FAILURE_RETRY(pread(fd, ring.data(), len, sizeof(h))) != len) {
+        memset(&h, 0, sizeof(h));
+        return false;
+    }
+    size_t start = (h.count < kCapacity) ? 0 : h.next;
+    for (size_t i = 0; i < h.count; i++) {
+        Record& rec = ring[(start + i) % kCapacity];
+        rec.kind[kKindSize - 1] = '\0';
+        history->records.push_back(rec);
+    }
+    return true;
+}
+
+static Baseline* findBaseline(Header& h, const std::string& kind, bool add) {
+    for (size_t i = 0; i < kMaxKinds; i++) {
+        Baseline& b = h.baselines[i];
+        if (b.kind[0] == '\0') {
+            if (!add) return nullptr;
+            strncpy(b.kind, kind.c_str(), kKindSize - 1);
+            return &b;
+        }
+        if (!strncmp(b.kind, kind.c_str(), kKindSize - 1)) {
+            return &b;
+        }
+    }
+    return nullptr;
+}
+
+static std::vector<BenchRun> runsOf(const History& history, const std::string& kind) {
+    std::vector<BenchRun> runs;
+    for (const auto& rec : history.records) {
+        if (!strncmp(rec.kind, kind.c_str(), kKindSize - 1)) {
+            runs.push_back(BenchRun{ rec.time, rec.value });
+        }
+    }
+    return runs;
+}
+
+static double regressThreshold() {
+    return property_get_int32("vold.bench_regress_pct", kDefaultRegressPct) / 100.0;
+}
+
+static nsecs_t median(std::vector<nsecs_t> values) {
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    return (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+BenchTrend ComputeBenchTrend(const std::vector<BenchRun>& runs, nsecs_t baseline,
+        double threshold) {
+    BenchTrend trend = {};
+    trend.runs = runs.size();
+    trend.baseline = baseline;
+    if (runs.empty()) {
+        return trend;
+    }
+
+    std::vector<nsecs_t> recent;
+    for (size_t i = runs.size() - std::min(runs.size(), kRecentRuns); i < runs.size(); i++) {
+        recent.push_back(runs[i].value);
+    }
+    trend.recent = median(recent);
+    if (baseline <= 0) {
+        return trend;
+    }
+    trend.change = (double) (trend.recent - baseline) / baseline;
+    trend.regressed = recent.size() == kRecentRuns && trend.change > threshold;
+
+    // Fitted in days from the first run, so the sums stay well conditioned
+    double n = runs.size();
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (const auto& run : runs) {
+        double x = (run.time - runs[0].time) / 86400.0;
+        double y = run.value;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    double var = n * sxx - sx * sx;
+    if (runs.size() > 1 && var > 0) {
+        trend.slope = (n * sxy - sx * sy) / var * 30 / baseline;
+    }
+    return trend;
+}
+
+static void record(const std::string& path, const std::string& kind, nsecs_t value) {
+    if (!property_get_bool("vold.bench_history", true) || value <= 0) {
+        return;
+    }
+    std::string key(keyForPath(path));
+
+    std::lock_guard<std::mutex> lock(sHistoryLock);
+    if (mkdir(kHistoryDir, 0700) != 0 && errno != EEXIST) {
+        PLOG(WARNING) << "Failed to create " << kHistoryDir;
+        return;
+    }
+    std::string file(historyPath(key));
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(file.c_str(),
+            O_RDWR | O_CREAT | O_CLOEXEC, 0600)));
+    if (fd == -1) {
+        PLOG(WARNING) << "Failed to open " << file;
+        return;
+    }
+
+    History history;
+    if (!readHistory(fd, &history)) {
+        // Missing or unreadable; either way the ring starts over
+        Header& h = history.header;
+        h.magic = kMagic;
+        h.capacity = kCapacity;
+        if (ftruncate(fd, sizeof(Header) + kCapacity * sizeof(Record)) != 0) {
+            PLOG(WARNING) << "Failed to size " << file;
+            return;
+        }
+    }
+    Header& h = history.header;
+
+    Record rec = {};
+    strncpy(rec.kind, kind.c_str(), kKindSize - 1);
+    rec.time = time(nullptr);
+    rec.value = value;
+    off_t offset = sizeof(Header) + h.next * sizeof(Record);
+    if (TEMP_FAILURE_RETRY(pwrite(fd, &rec, sizeof(rec), offset)) != sizeof(rec)) {
+        PLOG(WARNING) << "Failed to write " << file;
+        return;
+    }
+    h.next = (h.next + 1) % kCapacity;
+    h.count = std::min<uint32_t>(h.count + 1, kCapacity);
+    history.records.push_back(rec);
+    if (history.records.size() > kCapacity) {
+        history.records.erase(history.records.begin());
+    }
+
+    // The first runs of a kind set its baseline for good
+    Baseline* baseline = findBaseline(h, kind, true);
+    if (baseline == nullptr) {
+        LOG(WARNING) << key << " has no room for a baseline of " << kind;
+    } else if (baseline->runs < kBaselineRuns) {
+        baseline->value = (baseline->value * baseline->runs + value) / (baseline->runs + 1);
+        baseline->runs++;
+    }
+    if (TEMP_FAILURE_RETRY(pwrite(fd, &h, sizeof(h), 0)) != sizeof(h)) {
+        PLOG(WARNING) << "Failed to write " << file;
+        return;
+    }
+
+    if (baseline != nullptr && baseline->runs >= kBaselineRuns) {
+        auto trend = ComputeBenchTrend(runsOf(history, kind), baseline->value,
+                regressThreshold());
+        if (trend.regressed) {
+            LOG(WARNING) << key << " " << kind << " regressed: recent "
+                    << nanoseconds_to_milliseconds(trend.recent) << "ms against baseline "
+                    << nanoseconds_to_milliseconds(trend.baseline) << "ms";
+        }
+    }
+}
+
+void RecordBenchmark(const std::string& path, const std::string& kind, nsecs_t duration) {
+    record(path, kind, duration);
+}
+
+void RecordTrim(const std::string& path, uint64_t bytes, nsecs_t duration) {
+    if (bytes < kMinTrimBytes) {
+        return;
+    }
+    record(path, "trim", (nsecs_t) (duration * ((double) kGiB / bytes)));
+}
+
+void ForgetBenchHistory(const std::string& partGuid) {
+    std::lock_guard<std::mutex> lock(sHistoryLock);
+    std::string file(historyPath(partGuid));
+    if (unlink(file.c_str()) != 0 && errno != ENOENT) {
+        PLOG(WARNING) << "Failed to unlink " << file;
+    }
+}
+
+void DumpBenchHistory(std::vector<std::string>& lines) {
+    std::lock_guard<std::mutex> lock(sHistoryLock);
+    std::unique_ptr<DIR, int (*)(DIR*)> dirp(opendir(kHistoryDir), closedir);
+    if (!dirp) {
+        return;
+    }
+
+    // Sorted, so the dump reads the same from one run to the next
+    std::map<std::string, History> histories;
+    struct dirent* ent;
+    while ((ent = readdir(dirp.get())) != nullptr) {
+        std::string name(ent->d_name);
+        size_t suffix = strlen(kHistorySuffix);
+        if (name.size() <= suffix
+                || name.compare(name.size() - suffix, std::string::npos, kHistorySuffix)) {
+            continue;
+        }
+        std::string file(StringPrintf("%s/%s", kHistoryDir, name.c_str()));
+        android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(file.c_str(),
+                O_RDONLY | O_CLOEXEC)));
+        History history;
+        if (fd != -1 && readHistory(fd, &history)) {
+            histories[name.substr(0, name.size() - suffix)] = history;
+        }
+    }
+
+    double threshold = regressThreshold();
+    for (auto& it : histories) {
+        for (size_t i = 0; i < kMaxKinds; i++) {
+            const Baseline& b = it.second.header.baselines[i];
+            if (b.kind[0] == '\0') break;
+            std::string kind(b.kind, strnlen(b.kind, kKindSize));
+            auto trend = ComputeBenchTrend(runsOf(it.second, kind),
+                    b.runs >= kBaselineRuns ? b.value : 0, threshold);
+            lines.push_back(StringPrintf("%s %s runs=%zu baseline_ms=%.1f recent_ms=%.1f"
+                    " change=%+.0f%% slope=%+.1f%%/30d%s", it.first.c_str(), kind.c_str(),
+                    trend.runs, trend.baseline / 1e6, trend.recent / 1e6, trend.change * 100,
+                    trend.slope * 100, trend.regressed ? " REGRESSED" : ""));
+        }
+    }
+}
+
+}  // namespace vold
+}  // namespace android
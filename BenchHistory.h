@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_BENCH_HISTORY_H
+#define ANDROID_VOLD_BENCH_HISTORY_H
+
+#include <utils/Timers.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * Rolling history of benchmark and trim runs per volume, so that storage
+ * wearing out shows up as a trend rather than one slow run.
+ *
+ * Each volume has a fixed-size ring of recent runs under
+ * /data/misc/vold/bench_history, named by partition GUID for adopted
+ * volumes and by mount point otherwise. Alongside the ring, every kind of
+ * run keeps the baseline set by its first few runs, which the ring never
+ * overwrites. A kind is flagged once its recent median is slower than
+ * that baseline by more than vold.bench_regress_pct percent.
+ */
+
+struct BenchRun {
+    /* Wall clock time of the run, in seconds */
+    int64_t time;
+    /* Run time, or for trims the time per GiB trimmed */
+    nsecs_t value;
+};
+
+struct BenchTrend {
+    size_t runs;
+    nsecs_t baseline;
+    /* Median of the latest few runs */
+    nsecs_t recent;
+    /* Of recent against baseline, as a fraction; 0.5 is half as slow again */
+    double change;
+    /* Least-squares fit over |runs|, as a fraction of baseline per 30 days */
+    double slope;
+    bool regressed;
+};
+
+/* Trend of |runs|, oldest first, against |baseline| */
+BenchTrend ComputeBenchTrend(const std::vector<BenchRun>& runs, nsecs_t baseline,
+        double threshold);
+
+/* Records a benchmark of |kind| on the volume mounted at |path| */
+void RecordBenchmark(const std::string& path, const std::string& kind, nsecs_t duration);
+/* Records a trim of |bytes| on the volume mounted at |path| */
+void RecordTrim(const std::string& path, uint64_t bytes, nsecs_t duration);
+
+/* Drops the history of the adopted volume |partGuid| */
+void ForgetBenchHistory(const std::string& partGuid);
+
+/* One line per volume and kind of run, flagging regressions */
+void DumpBenchHistory(std::vector<std::string>& lines);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
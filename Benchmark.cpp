@@ -15,31 +15,125 @@
  */
 
 #include "Benchmark.h"
+#include "BenchHistory.h"
 #include "BenchmarkGen.h"
+#include "BenchmarkProbe.h"
+#include "BenchmarkTrace.h"
+#include "JobScheduler.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
-#include <cutils/iosched_policy.h>
+#include <android-base/stringprintf.h>
+#include <cutils/properties.h>
 #include <private/android_filesystem_config.h>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <vector>
+
 #define ENABLE_DROP_CACHES 1
 
 using android::base::ReadFileToString;
+using android::base::StringPrintf;
 using android::base::WriteStringToFile;
 
 namespace android {
 namespace vold {
 
-static void notifyResult(const std::string& path, int64_t create_d,
+/* Workloads shipped for the device, then any pushed for testing */
+static const char* kTraceDirs[] = {
+    "/system/etc/vold/bench",
+    "/data/misc/vold/bench_traces",
+};
+static const char* kTraceSuffix = ".vbt";
+
+/* Counters that tell device I/O apart from cache hits and writeback */
+static const std::vector<std::string> kVmstatKeys = {
+    "pgpgin", "pgpgout", "pgmajfault", "nr_dirtied", "nr_written",
+};
+/* In kB; these are levels, so their deltas can go negative */
+static const std::vector<std::string> kMeminfoKeys = {
+    "Cached", "Dirty", "Writeback",
+};
+
+typedef std::map<std::string, int64_t> VmStats;
+
+static void readStats(const std::string& path, const std::vector<std::string>& keys,
+        VmStats& stats) {
+    std::string data;
+    if (!ReadFileToString(path, &data)) {
+        PLOG(WARNING) << "Failed to read " << path;
+        return;
+    }
+    std::istringstream in(data);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        int64_t value;
+        if (!(fields >> key >> value)) continue;
+        if (!key.empty() && key.back() == ':') key.pop_back();
+        if (std::find(keys.begin(), keys.end(), key) != keys.end()) {
+            stats[key] = value;
+        }
+    }
+}
+
+static VmStats snapshotStats() {
+    VmStats stats;
+    readStats("/proc/vmstat", kVmstatKeys, stats);
+    readStats("/proc/meminfo", kMeminfoKeys, stats);
+    return stats;
+}
+
+/*
+ * Writes back and evicts only the benchmark's own files, leaving the
+ * rest of the page cache to the apps in the foreground. Dirty pages
+ * can't be dropped, hence the fsync first.
+ */
+static void evictFiles(const std::string& dir) {
+    std::unique_ptr<DIR, int (*)(DIR*)> dirp(opendir(dir.c_str()), closedir);
+    if (!dirp) {
+        PLOG(ERROR) << "Failed to open " << dir;
+        return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(dirp.get())) != nullptr) {
+        if (ent->d_type != DT_REG) continue;
+        int fd = openat(dirfd(dirp.get()), ent->d_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) continue;
+        if (fsync(fd) || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)) {
+            PLOG(WARNING) << "Failed to evict " << ent->d_name;
+        }
+        close(fd);
+    }
+}
+
+struct Workload {
+    std::string ident;
+    std::function<status_t()> create;
+    std::function<status_t()> run;
+    std::function<status_t()> destroy;
+    /* Left empty by workloads that only report totals */
+    std::function<std::vector<BenchmarkTrace::Latency>()> latencies;
+};
+
+static void notifyResult(const std::string& path, const std::string& ident, int64_t create_d,
         int64_t drop_d, int64_t run_d, int64_t destroy_d) {
     std::string res(path +
-            + " " + BenchmarkIdent()
+            + " " + ident
             + " " + std::to_string(create_d)
             + " " + std::to_string(drop_d)
             + " " + std::to_string(run_d)
@@ -48,7 +142,43 @@ static void notifyResult(const std::string& path, int64_t create_d,
             ResponseCode::BenchmarkResult, res.c_str(), false);
 }
 
-static nsecs_t benchmark(const std::string& path) {
+static void notifyLatency(const std::string& path, const std::string& ident,
+        const BenchmarkTrace::Latency& l) {
+    std::string res(path
+            + " " + ident
+            + " " + l.op
+            + " " + std::to_string(l.count)
+            + " " + std::to_string(l.p50)
+            + " " + std::to_string(l.p90)
+            + " " + std::to_string(l.p99)
+            + " " + std::to_string(l.max));
+    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(
+            ResponseCode::BenchmarkLatency, res.c_str(), false);
+}
+
+static void notifyVmStats(const std::string& path, const std::string& ident,
+        const std::string& phase, const VmStats& before, const VmStats& after) {
+    std::string res(path + " " + ident + " " + phase);
+    for (const auto& it : after) {
+        auto prev = before.find(it.first);
+        if (prev == before.end()) continue;
+        res += StringPrintf(" %s=%" PRId64, it.first.c_str(), it.second - prev->second);
+    }
+    LOG(INFO) << "vmstat " << res;
+    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(
+            ResponseCode::BenchmarkVmStats, res.c_str(), false);
+}
+
+static void notifyThroughput(const std::string& path, const ProbeResult& r) {
+    double secs = r.duration / 1e9;
+    std::string res(path + " " + r.name + StringPrintf(" %d %" PRIu64 " %" PRIu64 " %" PRId64
+            " %.2f %.0f", r.queueDepth, r.bytes, r.ops, r.duration,
+            r.bytes / secs / (1024 * 1024), r.ops / secs));
+    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(
+            ResponseCode::BenchmarkThroughput, res.c_str(), false);
+}
+
+static nsecs_t benchmark(const std::string& path, const Workload& workload) {
     errno = 0;
     int orig_prio = getpriority(PRIO_PROCESS, 0);
     if (errno != 0) {
@@ -60,16 +190,8 @@ static nsecs_t benchmark(const std::string& path) {
         return -1;
     }
 
-    IoSchedClass orig_clazz = IoSchedClass_NONE;
-    int orig_ioprio = 0;
-    if (android_get_ioprio(0, &orig_clazz, &orig_ioprio)) {
-        PLOG(ERROR) << "Failed to android_get_ioprio";
-        return -1;
-    }
-    if (android_set_ioprio(0, IoSchedClass_RT, 0)) {
-        PLOG(ERROR) << "Failed to android_set_ioprio";
-        return -1;
-    }
+    // Runs at real-time I/O priority, put back when the job ends
+    BackgroundJob job(BackgroundJob::Kind::kBenchmark, path);
 
     char orig_cwd[PATH_MAX];
     if (getcwd(orig_cwd, PATH_MAX) == NULL) {
@@ -83,36 +205,46 @@ static nsecs_t benchmark(const std::string& path) {
 
     sync();
 
-    LOG(INFO) << "Benchmarking " << path;
+    // "all" evicts every cache on the device, as older releases did
+    char evict[PROPERTY_VALUE_MAX];
+    property_get("vold.bench_evict", evict, "files");
+
+    LOG(INFO) << "Benchmarking " << path << " with " << workload.ident;
+    VmStats startStats = snapshotStats();
     nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
 
-    BenchmarkCreate();
+    workload.create();
     sync();
     nsecs_t create = systemTime(SYSTEM_TIME_BOOTTIME);
+    VmStats createStats = snapshotStats();
 
 #if ENABLE_DROP_CACHES
-    LOG(VERBOSE) << "Before drop_caches";
-    if (!WriteStringToFile("3", "/proc/sys/vm/drop_caches")) {
-        PLOG(ERROR) << "Failed to drop_caches";
+    if (!strcmp(evict, "all")) {
+        LOG(VERBOSE) << "Before drop_caches";
+        if (!WriteStringToFile("3", "/proc/sys/vm/drop_caches")) {
+            PLOG(ERROR) << "Failed to drop_caches";
+        }
+        LOG(VERBOSE) << "After drop_caches";
+    } else if (!strcmp(evict, "files")) {
+        evictFiles(".");
     }
-    LOG(VERBOSE) << "After drop_caches";
 #endif
     nsecs_t drop = systemTime(SYSTEM_TIME_BOOTTIME);
+    VmStats dropStats = snapshotStats();
 
-    BenchmarkRun();
+    workload.run();
     sync();
     nsecs_t run = systemTime(SYSTEM_TIME_BOOTTIME);
+    VmStats runStats = snapshotStats();
 
-    BenchmarkDestroy();
+    workload.destroy();
     sync();
     nsecs_t destroy = systemTime(SYSTEM_TIME_BOOTTIME);
+    VmStats destroyStats = snapshotStats();
 
     if (chdir(orig_cwd) != 0) {
         PLOG(ERROR) << "Failed to chdir";
     }
-    if (android_set_ioprio(0, orig_clazz, orig_ioprio)) {
-        PLOG(ERROR) << "Failed to android_set_ioprio";
-    }
     if (setpriority(PRIO_PROCESS, 0, orig_prio) != 0) {
         PLOG(ERROR) << "Failed to setpriority";
     }
@@ -127,7 +259,19 @@ static nsecs_t benchmark(const std::string& path) {
     LOG(INFO) << "run took " << nanoseconds_to_milliseconds(run_d) << "ms";
     LOG(INFO) << "destroy took " << nanoseconds_to_milliseconds(destroy_d) << "ms";
 
-    notifyResult(path, create_d, drop_d, run_d, destroy_d);
+    notifyResult(path, workload.ident, create_d, drop_d, run_d, destroy_d);
+    notifyVmStats(path, workload.ident, "create", startStats, createStats);
+    notifyVmStats(path, workload.ident, "drop", createStats, dropStats);
+    notifyVmStats(path, workload.ident, "run", dropStats, runStats);
+    notifyVmStats(path, workload.ident, "destroy", runStats, destroyStats);
+    if (workload.latencies) {
+        for (const auto& l : workload.latencies()) {
+            LOG(INFO) << l.op << ": " << l.count << " calls, p50 " << ns2us(l.p50) << "us, p90 "
+                    << ns2us(l.p90) << "us, p99 " << ns2us(l.p99) << "us, max "
+                    << ns2us(l.max) << "us";
+            notifyLatency(path, workload.ident, l);
+        }
+    }
 
     return run_d;
 }
@@ -146,7 +290,55 @@ nsecs_t BenchmarkPrivate(const std::string& path) {
     if (android::vold::PrepareDir(benchPath, 0700, AID_ROOT, AID_ROOT)) {
         return -1;
     }
-    return benchmark(benchPath);
+
+    // The built-in trace keeps its result comparable with older releases
+    nsecs_t res = benchmark(benchPath, Workload{ BenchmarkIdent(), &BenchmarkCreate,
+            &BenchmarkRun, &BenchmarkDestroy, nullptr });
+    RecordBenchmark(path, BenchmarkIdent(), res);
+    // Every call of every trace, left next to the benchmark for pulling off
+    bool keepSamples = property_get_bool("vold.bench_samples", false);
+    // Flat out stresses queue depth; paced shows what the app actually saw
+    bool paced = property_get_bool("vold.bench_paced", false);
+
+    for (const char* dir : kTraceDirs) {
+        std::unique_ptr<DIR, int (*)(DIR*)> dirp(opendir(dir), closedir);
+        if (!dirp) continue;
+        struct dirent* ent;
+        while ((ent = readdir(dirp.get())) != nullptr) {
+            std::string name(ent->d_name);
+            if (name.size() <= strlen(kTraceSuffix) || name.compare(
+                    name.size() - strlen(kTraceSuffix), std::string::npos, kTraceSuffix)) {
+                continue;
+            }
+            BenchmarkTrace trace;
+            if (trace.load(StringPrintf("%s/%s", dir, name.c_str())) != OK) continue;
+            trace.setKeepSamples(keepSamples);
+            trace.setPaced(paced);
+            nsecs_t run = benchmark(benchPath, Workload{ trace.ident(),
+                    [&trace]() { return trace.create(); },
+                    [&trace]() { return trace.run(); },
+                    [&trace]() { return trace.destroy(); },
+                    [&trace]() { return trace.latencies(); } });
+            RecordBenchmark(path, trace.ident(), run);
+            if (keepSamples) {
+                trace.writeSamples(StringPrintf("%s/%s.samples", benchPath.c_str(),
+                        trace.name().c_str()));
+            }
+        }
+    }
+
+    // Raw device numbers, to tell a slow card apart from a slow workload
+    if (property_get_bool("vold.bench_probe", true)) {
+        uint64_t size = (uint64_t) property_get_int32("vold.bench_probe_mb", 64) * 1024 * 1024;
+        nsecs_t budget = ms2ns(property_get_int32("vold.bench_probe_ms", 1000));
+        std::vector<ProbeResult> results;
+        if (RunThroughputProbe(benchPath, size, budget, results) == OK) {
+            for (const auto& r : results) {
+                notifyThroughput(path, r);
+            }
+        }
+    }
+    return res;
 }
 
 }  // namespace vold
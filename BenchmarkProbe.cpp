@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BenchmarkProbe.h"
+#include "Utils.h"
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+#include <atomic>
+#include <memory>
+#include <random>
+#include <thread>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using android::base::unique_fd;
+
+namespace android {
+namespace vold {
+
+static const size_t kSeqBlock = 1024 * 1024;
+static const size_t kRandBlock = 4096;
+/* O_DIRECT wants buffers aligned to the logical block size */
+static const size_t kAlign = 4096;
+static const int kQueueDepths[] = { 1, 4, 16 };
+static const char* kProbeFile = "probe";
+
+namespace {
+
+struct AlignedFree {
+    void operator()(char* p) const { free(p); }
+};
+typedef std::unique_ptr<char, AlignedFree> AlignedBuffer;
+
+AlignedBuffer allocBuffer(size_t len) {
+    void* p = nullptr;
+    if (posix_memalign(&p, kAlign, len)) return AlignedBuffer();
+    return AlignedBuffer(static_cast<char*>(p));
+}
+
+/* Works through one pattern and stops it at its time or byte budget */
+class Pattern {
+public:
+    Pattern(nsecs_t budget, uint64_t maxBytes) : mStart(systemTime(SYSTEM_TIME_MONOTONIC)),
+            mDeadline(mStart + budget), mMaxBytes(maxBytes), mBytes(0), mOps(0) {}
+
+    /* Claims |len| more bytes, or returns false once the budget is spent */
+    bool claim(size_t len) {
+        if (systemTime(SYSTEM_TIME_MONOTONIC) >= mDeadline) return false;
+        return mBytes.fetch_add(len) + len <= mMaxBytes;
+    }
+
+    void done() { mOps++; }
+
+    ProbeResult finish(const std::string& name, int queueDepth, size_t blockSize) {
+        nsecs_t duration = systemTime(SYSTEM_TIME_MONOTONIC) - mStart;
+        uint64_t ops = mOps;
+        return ProbeResult{ name, queueDepth, ops * blockSize, ops, duration };
+    }
+
+private:
+    nsecs_t mStart;
+    nsecs_t mDeadline;
+    uint64_t mMaxBytes;
+    std::atomic<uint64_t> mBytes;
+    std::atomic<uint64_t> mOps;
+};
+
+}  // namespace
+
+static void evict(int fd, bool direct) {
+    if (!direct) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+static void logResult(const ProbeResult& r) {
+    double secs = r.duration / 1e9;
+    LOG(INFO) << "Probe " << r.name << " qd" << r.queueDepth << ": "
+            << (r.bytes / secs / (1024 * 1024)) << " MB/s, " << (r.ops / secs) << " IOPS";
+}
+
+static ProbeResult sequentialIo(int fd, bool write, uint64_t size, nsecs_t budget,
+        char* buf) {
+    Pattern pattern(budget, size);
+    for (uint64_t off = 0; pattern.claim(kSeqBlock); off += kSeqBlock) {
+        ssize_t n = write
+                ? TEMP_FAILURE_RETRY(pwrite(fd, buf, kSeqBlock, off))
+                : TEMP_FAILURE_RETRY(pread(fd, buf, kSeqBlock, off));
+        if (n != (ssize_t) kSeqBlock) {
+            PLOG(WARNING) << "Probe stopped short at " << off;
+            break;
+        }
+        pattern.done();
+    }
+    // Written data only counts once it's on the device
+    if (write) fdatasync(fd);
+    return pattern.finish(write ? "seq_write" : "seq_read", 1, kSeqBlock);
+}
+
+static ProbeResult randomIo(int fd, bool write, uint64_t size, int queueDepth,
+        nsecs_t budget, const char* data) {
+    Pattern pattern(budget, size);
+    uint64_t blocks = size / kRandBlock;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < queueDepth; t++) {
+        threads.emplace_back([&, t]() {
+            AlignedBuffer buf = allocBuffer(kRandBlock);
+            if (!buf) return;
+            memcpy(buf.get(), data, kRandBlock);
+            std::minstd_rand rng(t + 1);
+            std::uniform_int_distribution<uint64_t> pick(0, blocks - 1);
+            while (pattern.claim(kRandBlock)) {
+                off64_t off = pick(rng) * kRandBlock;
+                ssize_t n = write
+                        ? TEMP_FAILURE_RETRY(pwrite(fd, buf.get(), kRandBlock, off))
+                        : TEMP_FAILURE_RETRY(pread(fd, buf.get(), kRandBlock, off));
+                if (n != (ssize_t) kRandBlock) return;
+                pattern.done();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (write) fdatasync(fd);
+    return pattern.finish(write ? "rand_write" : "rand_read", queueDepth, kRandBlock);
+}
+
+status_t RunThroughputProbe(const std::string& dir, uint64_t fileSize, nsecs_t budget,
+        std::vector<ProbeResult>& results) {
+    std::string path = dir + "/" + kProbeFile;
+    bool direct = true;
+    unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(),
+            O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0600)));
+    if (fd == -1 && errno == EINVAL) {
+        LOG(VERBOSE) << "No O_DIRECT on " << dir << "; evicting instead";
+        direct = false;
+        fd.reset(TEMP_FAILURE_RETRY(open(path.c_str(),
+                O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
+    }
+    if (fd == -1) {
+        PLOG(ERROR) << "Failed to create " << path;
+        return -errno;
+    }
+
+    // Random data, so that compressing or deduplicating media can't flatter the results
+    AlignedBuffer buf = allocBuffer(kSeqBlock);
+    if (!buf || ReadRandomBytes(kSeqBlock, buf.get()) != OK) {
+        LOG(ERROR) << "Failed to prepare probe buffer";
+        unlink(path.c_str());
+        return -ENOMEM;
+    }
+
+    results.clear();
+    results.push_back(sequentialIo(fd, true, fileSize, budget, buf.get()));
+    // Later patterns only cover what the write got through
+    uint64_t size = results.back().bytes;
+    if (size < kSeqBlock) {
+        LOG(ERROR) << "Probe failed to write " << path;
+        unlink(path.c_str());
+        return -EIO;
+    }
+
+    evict(fd, direct);
+    results.push_back(sequentialIo(fd, false, size, budget, buf.get()));
+    for (int qd : kQueueDepths) {
+        evict(fd, direct);
+        results.push_back(randomIo(fd, false, size, qd, budget, buf.get()));
+    }
+    for (int qd : kQueueDepths) {
+        results.push_back(randomIo(fd, true, size, qd, budget, buf.get()));
+    }
+
+    for (const auto& r : results) {
+        logResult(r);
+    }
+    unlink(path.c_str());
+    return OK;
+}
+
+}  // namespace vold
+}  // namespace android
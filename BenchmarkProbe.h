@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_BENCHMARK_PROBE_H
+#define ANDROID_VOLD_BENCHMARK_PROBE_H
+
+#include <utils/Errors.h>
+#include <utils/Timers.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/* Outcome of one pattern at one queue depth */
+struct ProbeResult {
+    std::string name;
+    int queueDepth;
+    uint64_t bytes;
+    uint64_t ops;
+    nsecs_t duration;
+};
+
+/*
+ * Measures raw throughput in |dir| with a scratch file of up to |fileSize|
+ * bytes: sequential write and read in 1MB blocks, then 4K random reads
+ * and writes at a few queue depths, each given one thread per request in
+ * flight. Every pattern stops at |budget| or after moving |fileSize|
+ * bytes, whichever comes first. Caching is bypassed with O_DIRECT where
+ * the filesystem allows it, and by evicting the file otherwise.
+ */
+status_t RunThroughputProbe(const std::string& dir, uint64_t fileSize, nsecs_t budget,
+        std::vector<ProbeResult>& results);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -0,0 +1,524 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BenchmarkTrace.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <private/android_filesystem_config.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <tuple>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+/* Followed by the format version */
+static const char kMagic[4] = { 'V', 'B', 'T', '1' };
+
+/* Same per-call cap benchgen.py has always applied */
+static const int64_t kMaxIoSize = 1024 * 1024;
+static const uint32_t kMaxFiles = 4096;
+static const uint32_t kMaxHandles = 65536;
+static const uint32_t kMaxThreads = 256;
+static const uint64_t kMaxEvents = 1 << 20;
+static const uint64_t kMaxTotalSize = 2ULL * 1024 * 1024 * 1024;
+/* An hour, far longer than anything worth replaying paced */
+static const int64_t kMaxTimeUs = 3600LL * 1000000;
+
+/*
+ * Latencies are bucketed in quarter powers of two of microseconds, which
+ * keeps percentiles within 19% without recording every call.
+ */
+static const size_t kSubBuckets = 4;
+static const size_t kLatencyBuckets = 40 * kSubBuckets;
+
+enum Class : uint8_t {
+    kClassOpen,
+    kClassRead4k,
+    kClassRead64k,
+    kClassRead1m,
+    kClassWrite4k,
+    kClassWrite64k,
+    kClassWrite1m,
+    kClassSync,
+    kClassCount,
+    /* Seeks and closes aren't worth timing */
+    kClassNone = kClassCount,
+};
+
+static const char* kClassNames[kClassCount] = {
+    "open", "read_4k", "read_64k", "read_1m", "write_4k", "write_64k", "write_1m", "sync",
+};
+
+namespace {
+
+/* Reads little-endian fields off the front of a buffer */
+class Reader {
+public:
+    explicit Reader(const std::string& data) : mData(data), mPos(0) {}
+
+    bool bytes(void* out, size_t len) {
+        if (mData.size() - mPos < len) return false;
+        memcpy(out, mData.data() + mPos, len);
+        mPos += len;
+        return true;
+    }
+
+    template <class T>
+    bool value(T* out) {
+        uint8_t raw[sizeof(T)];
+        if (!bytes(raw, sizeof(raw))) return false;
+        uint64_t v = 0;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            v |= (uint64_t) raw[i] << (8 * i);
+        }
+        *out = (T) v;
+        return true;
+    }
+
+    bool atEnd() const { return mPos == mData.size(); }
+
+private:
+    const std::string& mData;
+    size_t mPos;
+};
+
+}  // namespace
+
+const uint32_t BenchmarkTrace::kUnordered;
+
+BenchmarkTrace::BenchmarkTrace() : mHandles(0), mKeepSamples(false), mPaced(false) {
+}
+
+BenchmarkTrace::~BenchmarkTrace() {
+}
+
+status_t BenchmarkTrace::load(const std::string& path) {
+    std::string data;
+    if (!android::base::ReadFileToString(path, &data)) {
+        PLOG(ERROR) << "Failed to read " << path;
+        return -errno;
+    }
+    status_t res = parse(data);
+    if (res != OK) {
+        LOG(ERROR) << "Malformed benchmark trace " << path;
+    }
+    return res;
+}
+
+status_t BenchmarkTrace::parse(const std::string& data) {
+    Reader in(data);
+    char magic[sizeof(kMagic)];
+    uint32_t files, threads, nameLen;
+    if (!in.bytes(magic, sizeof(magic)) || memcmp(magic, kMagic, sizeof(kMagic) - 1)
+            || (magic[3] != '1' && magic[3] != '2')
+            || !in.value(&files) || !in.value(&mHandles) || !in.value(&threads)
+            || !in.value(&nameLen)) {
+        return -EINVAL;
+    }
+    bool timed = (magic[3] == '2');
+    if (files > kMaxFiles || mHandles > kMaxHandles || threads > kMaxThreads
+            || nameLen > 64) {
+        return -EINVAL;
+    }
+    mName.resize(nameLen);
+    if (!in.bytes(&mName[0], nameLen)) return -EINVAL;
+    // The name goes into file names and broadcasts
+    for (char c : mName) {
+        if (!isalnum(c) && c != '_' && c != '-') return -EINVAL;
+    }
+
+    uint64_t total = 0;
+    mFileSizes.resize(files);
+    for (auto& size : mFileSizes) {
+        if (!in.value(&size)) return -EINVAL;
+        total += std::min(size, kMaxTotalSize);
+    }
+    if (total > kMaxTotalSize) return -EINVAL;
+
+    uint64_t events = 0;
+    // Untimed traces can't order calls across threads, so can't share handles
+    // between them; timed ones are ordered on shared handles below
+    std::vector<uint32_t> owners(mHandles, kUnordered);
+    std::vector<bool> shared(mHandles, false);
+    mThreads.assign(threads, std::vector<Event>());
+    for (uint32_t t = 0; t < threads; t++) {
+        auto& thread = mThreads[t];
+        uint32_t count;
+        if (!in.value(&count)) return -EINVAL;
+        events += count;
+        if (events > kMaxEvents) return -EINVAL;
+        thread.resize(count);
+        int64_t last = 0;
+        for (auto& e : thread) {
+            uint16_t reserved;
+            if (!in.value(&e.op) || !in.value(&e.flags) || !in.value(&reserved)
+                    || !in.value(&e.handle) || !in.value(&e.arg) || !in.value(&e.mode)
+                    || !in.value(&e.offset) || !in.value(&e.count)) {
+                return -EINVAL;
+            }
+            e.time = 0;
+            e.seq = kUnordered;
+            if (timed) {
+                if (!in.value(&e.time) || e.time < last || e.time > kMaxTimeUs) {
+                    return -EINVAL;
+                }
+                last = e.time;
+            }
+            if (e.op < kOpen || e.op > kFdatasync || e.handle >= mHandles) return -EINVAL;
+            if (owners[e.handle] != kUnordered && owners[e.handle] != t) {
+                if (!timed) return -EINVAL;
+                shared[e.handle] = true;
+            }
+            owners[e.handle] = t;
+            if (e.op == kOpen && e.arg >= files) return -EINVAL;
+            if (e.op == kLseek && e.arg != SEEK_SET && e.arg != SEEK_CUR
+                    && e.arg != SEEK_END) {
+                return -EINVAL;
+            }
+            if (e.count < 0 || e.count > kMaxIoSize) return -EINVAL;
+            if ((e.op == kPread || e.op == kPwrite) && e.offset < 0) return -EINVAL;
+        }
+    }
+    if (!in.atEnd()) return -EINVAL;
+
+    /*
+     * Number the calls on each shared handle in trace time. Ties go to the
+     * lower thread, and each thread's own calls are already in order, so
+     * any call only ever waits on one that sorts before it and replay
+     * can't deadlock.
+     */
+    std::vector<std::tuple<int64_t, uint32_t, uint32_t>> ordered;
+    for (uint32_t t = 0; t < threads; t++) {
+        for (uint32_t i = 0; i < mThreads[t].size(); i++) {
+            if (shared[mThreads[t][i].handle]) {
+                ordered.emplace_back(mThreads[t][i].time, t, i);
+            }
+        }
+    }
+    std::sort(ordered.begin(), ordered.end());
+    std::vector<uint32_t> next(mHandles, 0);
+    for (const auto& o : ordered) {
+        Event& e = mThreads[std::get<1>(o)][std::get<2>(o)];
+        e.seq = next[e.handle]++;
+    }
+    return OK;
+}
+
+std::string BenchmarkTrace::ident() const {
+    int reads = 0, writes = 0, syncs = 0;
+    for (const auto& thread : mThreads) {
+        for (const auto& e : thread) {
+            if (e.op == kRead || e.op == kPread) reads++;
+            if (e.op == kWrite || e.op == kPwrite) writes++;
+            if (e.op == kFsync || e.op == kFdatasync) syncs++;
+        }
+    }
+    return StringPrintf("%s:r%d:w%d:s%d%s", mName.c_str(), reads, writes, syncs,
+            mPaced ? ":paced" : "");
+}
+
+static std::string fileName(size_t i) {
+    return StringPrintf("file%zu", i);
+}
+
+status_t BenchmarkTrace::create() {
+    std::string buf;
+    if (ReadRandomBytes(65536, buf) != OK) {
+        LOG(ERROR) << "Failed to read random data";
+        return -EIO;
+    }
+    for (size_t i = 0; i < mFileSizes.size(); i++) {
+        std::string name(fileName(i));
+        int out = TEMP_FAILURE_RETRY(open(name.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (out < 0) {
+            PLOG(ERROR) << "Failed to open " << name;
+            return -errno;
+        }
+        uint64_t len = mFileSizes[i];
+        while (len > 0) {
+            ssize_t n = TEMP_FAILURE_RETRY(write(out, buf.data(),
+                    std::min<uint64_t>(len, buf.size())));
+            if (n < 0) {
+                PLOG(ERROR) << "Failed to write " << name;
+                close(out);
+                return -errno;
+            }
+            len -= n;
+        }
+        close(out);
+    }
+    return OK;
+}
+
+status_t BenchmarkTrace::destroy() {
+    status_t res = OK;
+    for (size_t i = 0; i < mFileSizes.size(); i++) {
+        if (unlink(fileName(i).c_str()) && errno != ENOENT) {
+            res = -errno;
+        }
+    }
+    return res;
+}
+
+static int openFlags(uint8_t flags) {
+    int res = O_CLOEXEC;
+    if (flags & BenchmarkTrace::kReadWrite) {
+        res |= O_RDWR;
+    } else if (flags & BenchmarkTrace::kWriteOnly) {
+        res |= O_WRONLY;
+    }
+    if (flags & BenchmarkTrace::kCreate) res |= O_CREAT;
+    if (flags & BenchmarkTrace::kTruncate) res |= O_TRUNC;
+    if (flags & BenchmarkTrace::kAppend) res |= O_APPEND;
+    if (flags & BenchmarkTrace::kExclusive) res |= O_EXCL;
+    return res;
+}
+
+static uint8_t classFor(const BenchmarkTrace::Event& e) {
+    uint8_t sized;
+    switch (e.op) {
+    case BenchmarkTrace::kOpen:
+        return kClassOpen;
+    case BenchmarkTrace::kRead:
+    case BenchmarkTrace::kPread:
+        sized = kClassRead4k;
+        break;
+    case BenchmarkTrace::kWrite:
+    case BenchmarkTrace::kPwrite:
+        sized = kClassWrite4k;
+        break;
+    case BenchmarkTrace::kFsync:
+    case BenchmarkTrace::kFdatasync:
+        return kClassSync;
+    default:
+        return kClassNone;
+    }
+    if (e.count > 64 * 1024) return sized + 2;
+    if (e.count > 4 * 1024) return sized + 1;
+    return sized;
+}
+
+static size_t bucketFor(nsecs_t duration) {
+    uint64_t us = ns2us(duration);
+    if (us < kSubBuckets) return us;
+    size_t msb = 63 - __builtin_clzll(us);
+    size_t bucket = (msb - 1) * kSubBuckets + ((us >> (msb - 2)) & (kSubBuckets - 1));
+    return std::min(bucket, kLatencyBuckets - 1);
+}
+
+/* Upper bound of |bucket|, so percentiles err on the slow side */
+static nsecs_t bucketLimit(size_t bucket) {
+    bucket++;
+    if (bucket < kSubBuckets) return us2ns(bucket);
+    size_t msb = bucket / kSubBuckets + 1;
+    return us2ns((uint64_t) (kSubBuckets + bucket % kSubBuckets) << (msb - 2));
+}
+
+static void record(BenchmarkTrace::Histogram& h, nsecs_t duration) {
+    if (h.buckets.empty()) h.buckets.resize(kLatencyBuckets);
+    h.buckets[bucketFor(duration)]++;
+    h.count++;
+    h.max = std::max(h.max, duration);
+}
+
+/*
+ * Failed calls are ignored, as in the generated benchmark; a trace of a
+ * real app includes calls that failed when it was captured too.
+ */
+static void replayCall(const BenchmarkTrace::Event& e, int& fd, char* buf) {
+    switch (e.op) {
+    case BenchmarkTrace::kOpen:
+        if (fd != -1) close(fd);
+        fd = TEMP_FAILURE_RETRY(open(fileName(e.arg).c_str(), openFlags(e.flags), e.mode));
+        break;
+    case BenchmarkTrace::kClose:
+        close(fd);
+        fd = -1;
+        break;
+    case BenchmarkTrace::kLseek:
+        TEMP_FAILURE_RETRY(lseek(fd, e.offset, e.arg));
+        break;
+    case BenchmarkTrace::kRead:
+        TEMP_FAILURE_RETRY(read(fd, buf, e.count));
+        break;
+    case BenchmarkTrace::kWrite:
+        TEMP_FAILURE_RETRY(write(fd, buf, e.count));
+        break;
+    case BenchmarkTrace::kPread:
+        TEMP_FAILURE_RETRY(pread(fd, buf, e.count, e.offset));
+        break;
+    case BenchmarkTrace::kPwrite:
+        TEMP_FAILURE_RETRY(pwrite(fd, buf, e.count, e.offset));
+        break;
+    case BenchmarkTrace::kFsync:
+        TEMP_FAILURE_RETRY(fsync(fd));
+        break;
+    case BenchmarkTrace::kFdatasync:
+        TEMP_FAILURE_RETRY(fdatasync(fd));
+        break;
+    }
+}
+
+/* State shared by the threads of one run() */
+struct BenchmarkTrace::Replay {
+    /* A slot is only touched by its owning thread, or in turn once shared */
+    std::vector<int> fds;
+    nsecs_t start;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    /* Calls completed so far on each shared handle */
+    std::vector<uint32_t> done;
+
+    void waitTurn(const Event& e) {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [&]() { return done[e.handle] == e.seq; });
+    }
+
+    void endTurn(const Event& e) {
+        std::lock_guard<std::mutex> guard(lock);
+        done[e.handle]++;
+        cond.notify_all();
+    }
+};
+
+void BenchmarkTrace::runThread(const std::vector<Event>& events, Replay& replay,
+        std::vector<Histogram>& histograms, std::vector<Sample>& samples) {
+    std::vector<char> buf(kMaxIoSize);
+    for (const auto& e : events) {
+        if (mPaced) {
+            nsecs_t due = replay.start + us2ns(e.time);
+            struct timespec ts = { (time_t) (due / 1000000000), (long) (due % 1000000000) };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+            }
+        }
+        if (e.seq != kUnordered) replay.waitTurn(e);
+
+        int& fd = replay.fds[e.handle];
+        bool skip = (e.op != kOpen && fd == -1);
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (!skip) replayCall(e, fd, buf.data());
+        nsecs_t duration = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+        // Even a skipped call takes its turn, or later ones would wait forever
+        if (e.seq != kUnordered) replay.endTurn(e);
+
+        uint8_t klass = classFor(e);
+        if (skip || klass == kClassNone) continue;
+        record(histograms[klass], duration);
+        if (mKeepSamples) {
+            samples.push_back(Sample{ klass, e.offset, e.count, duration });
+        }
+    }
+}
+
+status_t BenchmarkTrace::run() {
+    Replay replay;
+    replay.fds.assign(mHandles, -1);
+    replay.done.assign(mHandles, 0);
+    // Each thread records on its own, so timing adds no contention
+    std::vector<std::vector<Histogram>> histograms(mThreads.size(),
+            std::vector<Histogram>(kClassCount, Histogram{ {}, 0, 0 }));
+    std::vector<std::vector<Sample>> samples(mThreads.size());
+    replay.start = systemTime(SYSTEM_TIME_MONOTONIC);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < mThreads.size(); i++) {
+        threads.emplace_back(&BenchmarkTrace::runThread, this, std::cref(mThreads[i]),
+                std::ref(replay), std::ref(histograms[i]), std::ref(samples[i]));
+    }
+    if (!mThreads.empty()) {
+        runThread(mThreads[0], replay, histograms[0], samples[0]);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (int fd : replay.fds) {
+        if (fd != -1) close(fd);
+    }
+
+    mHistograms.assign(kClassCount, Histogram{ std::vector<uint64_t>(kLatencyBuckets), 0, 0 });
+    mSamples.clear();
+    for (size_t t = 0; t < mThreads.size(); t++) {
+        for (size_t c = 0; c < kClassCount; c++) {
+            const Histogram& from = histograms[t][c];
+            Histogram& to = mHistograms[c];
+            for (size_t b = 0; b < from.buckets.size(); b++) {
+                to.buckets[b] += from.buckets[b];
+            }
+            to.count += from.count;
+            to.max = std::max(to.max, from.max);
+        }
+        mSamples.insert(mSamples.end(), samples[t].begin(), samples[t].end());
+    }
+    return OK;
+}
+
+static nsecs_t percentile(const BenchmarkTrace::Histogram& h, uint64_t pct) {
+    // Rank of the call at |pct|, counting from one
+    uint64_t rank = std::max<uint64_t>(1, (h.count * pct + 99) / 100);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < h.buckets.size(); b++) {
+        seen += h.buckets[b];
+        if (seen >= rank) return std::min(bucketLimit(b), h.max);
+    }
+    return h.max;
+}
+
+std::vector<BenchmarkTrace::Latency> BenchmarkTrace::latencies() const {
+    std::vector<Latency> res;
+    for (size_t c = 0; c < mHistograms.size(); c++) {
+        const Histogram& h = mHistograms[c];
+        if (!h.count) continue;
+        res.push_back(Latency{ kClassNames[c], h.count, percentile(h, 50), percentile(h, 90),
+                percentile(h, 99), h.max });
+    }
+    return res;
+}
+
+status_t BenchmarkTrace::writeSamples(const std::string& path) const {
+    std::string out;
+    for (const auto& s : mSamples) {
+        out += StringPrintf("%s %" PRId64 " %" PRId64 " %" PRId64 "\n", kClassNames[s.klass],
+                s.offset, s.count, s.duration);
+    }
+    if (!android::base::WriteStringToFile(out, path + ".tmp", 0600, AID_ROOT, AID_ROOT)
+            || rename((path + ".tmp").c_str(), path.c_str())) {
+        PLOG(ERROR) << "Failed to write " << path;
+        unlink((path + ".tmp").c_str());
+        return -EIO;
+    }
+    return OK;
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_BENCHMARK_TRACE_H
+#define ANDROID_VOLD_BENCHMARK_TRACE_H
+
+#include "Utils.h"
+
+#include <utils/Timers.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * Storage workload loaded from a trace file and replayed in the current
+ * directory, as written by "bench/benchgen.py --binary".
+ *
+ * All fields are little-endian:
+ *
+ *   header   "VBT1" or "VBT2", u32 file count, u32 handle count,
+ *            u32 thread count, u32 name length, then the name
+ *   files    u64 size of each file<N> to create before the run
+ *   threads  per thread, u32 event count then that many events:
+ *            u8 op, u8 flags, u16 reserved, u32 handle, u32 file or whence,
+ *            u32 mode, s64 offset, s64 count, and for "VBT2" only,
+ *            s64 microseconds since the trace started
+ *
+ * Each thread replays its own events in order, concurrently with the
+ * others, so the queue depth a multi-threaded app produces is kept
+ * rather than flattened into one sequence. "VBT2" traces may also share
+ * a handle between threads; each call on a shared handle then waits for
+ * the call before it in trace time, wherever that ran. When paced, each
+ * call is also held back until its offset into the trace.
+ *
+ * Every open, read, write and sync is timed during run(), so that a
+ * handful of slow calls can be told apart from uniformly slow ones.
+ */
+class BenchmarkTrace {
+public:
+    BenchmarkTrace();
+    ~BenchmarkTrace();
+
+    enum Op : uint8_t {
+        kOpen = 1,
+        kClose = 2,
+        kLseek = 3,
+        kRead = 4,
+        kWrite = 5,
+        kPread = 6,
+        kPwrite = 7,
+        kFsync = 8,
+        kFdatasync = 9,
+    };
+
+    /* Portable open flags, since O_* values differ between ABIs */
+    enum OpenFlags : uint8_t {
+        kReadOnly = 0,
+        kWriteOnly = 1 << 0,
+        kReadWrite = 1 << 1,
+        kCreate = 1 << 2,
+        kTruncate = 1 << 3,
+        kAppend = 1 << 4,
+        kExclusive = 1 << 5,
+    };
+
+    struct Event {
+        uint8_t op;
+        uint8_t flags;
+        uint32_t handle;
+        /* File index for kOpen, whence for kLseek */
+        uint32_t arg;
+        uint32_t mode;
+        int64_t offset;
+        int64_t count;
+        /* Microseconds into the trace, or zero for "VBT1" */
+        int64_t time;
+        /* Position among calls on a shared handle, or kUnordered */
+        uint32_t seq;
+    };
+    static const uint32_t kUnordered = UINT32_MAX;
+
+    /* Rejects anything malformed, since traces come from outside vold */
+    status_t load(const std::string& path);
+    status_t parse(const std::string& data);
+
+    const std::string& name() const { return mName; }
+    /* Name, operation counts and replay mode, as reported with results */
+    std::string ident() const;
+
+    status_t create();
+    status_t run();
+    status_t destroy();
+
+    /* Keeps the captured gaps between calls instead of running flat out */
+    void setPaced(bool paced) { mPaced = paced; }
+
+    /* Distribution of one class of call, such as "read_64k", in the last run */
+    struct Latency {
+        std::string op;
+        uint64_t count;
+        nsecs_t p50;
+        nsecs_t p90;
+        nsecs_t p99;
+        nsecs_t max;
+    };
+    std::vector<Latency> latencies() const;
+
+    /* When set before run(), every call is also kept for writeSamples() */
+    void setKeepSamples(bool keep) { mKeepSamples = keep; }
+    /* One "class offset count latency_ns" line per call, in replay order */
+    status_t writeSamples(const std::string& path) const;
+
+    struct Histogram {
+        std::vector<uint64_t> buckets;
+        uint64_t count;
+        nsecs_t max;
+    };
+    struct Sample {
+        uint8_t klass;
+        int64_t offset;
+        int64_t count;
+        nsecs_t duration;
+    };
+
+private:
+    std::string mName;
+    std::vector<uint64_t> mFileSizes;
+    uint32_t mHandles;
+    std::vector<std::vector<Event>> mThreads;
+    bool mKeepSamples;
+    bool mPaced;
+    /* Indexed by class, merged from every thread once the run is over */
+    std::vector<Histogram> mHistograms;
+    std::vector<Sample> mSamples;
+
+    struct Replay;
+    void runThread(const std::vector<Event>& events, Replay& replay,
+            std::vector<Histogram>& histograms, std::vector<Sample>& samples);
+
+    DISALLOW_COPY_AND_ASSIGN(BenchmarkTrace);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -42,29 +42,68 @@
 #include <sysutils/SocketClient.h>
 #include <private/android_filesystem_config.h>
 
+#include "AppFuse.h"
 #include "CommandListener.h"
+#include "CommandQueue.h"
 #include "VolumeManager.h"
 #include "VolumeBase.h"
 #include "ResponseCode.h"
 #include "Process.h"
 #include "Loop.h"
 #include "Devmapper.h"
+#include "JobScheduler.h"
 #include "MoveTask.h"
 #include "TrimTask.h"
+#include "Timings.h"
+#include "IoStats.h"
+#include "BenchHistory.h"
+#include "StorageState.h"
+#include "EventBatch.h"
 
 #define DUMP_ARGS 0
 #define DEBUG_APPFUSE 0
 
 using android::base::unique_fd;
 
+static bool never(int /*argc*/, char ** /*argv*/) {
+    return false;
+}
+
+static bool inlineVolumeCmd(int argc, char **argv) {
+    // list reads the published snapshot
+    return argc > 1 && !strcmp(argv[1], "list");
+}
+
+static bool callerVolumeCmd(int argc, char **argv) {
+    // batch keeps hold of the caller's client
+    return argc > 1 && !strcmp(argv[1], "batch");
+}
+
+static bool inlineAsecCmd(int argc, char **argv) {
+    return argc > 1 && (!strcmp(argv[1], "list") || !strcmp(argv[1], "path")
+            || !strcmp(argv[1], "fspath"));
+}
+
+static bool inlineStorageCmd(int argc, char **argv) {
+    return argc > 1 && !strcmp(argv[1], "users");
+}
+
 CommandListener::CommandListener() :
                  FrameworkListener("vold", true) {
+    using android::vold::AsyncCommand;
+    // Anything that changes state goes through mQueue, in the order it came in
     registerCmd(new DumpCmd());
-    registerCmd(new VolumeCmd());
-    registerCmd(new AsecCmd());
-    registerCmd(new ObbCmd());
-    registerCmd(new StorageCmd());
-    registerCmd(new FstrimCmd());
+    registerCmd(new IoStatsCmd());
+    // Tasks only touch the job scheduler, so they answer while the queue is busy
+    registerCmd(new TaskCmd());
+    registerCmd(new AsyncCommand(new VolumeCmd(), &inlineVolumeCmd, &mQueue,
+            &callerVolumeCmd));
+    registerCmd(new AsyncCommand(new AsecCmd(), &inlineAsecCmd, &mQueue));
+    registerCmd(new AsyncCommand(new ObbCmd(), &never, &mQueue));
+    registerCmd(new AsyncCommand(new StorageCmd(), &inlineStorageCmd, &mQueue));
+    registerCmd(new AsyncCommand(new FstrimCmd(), &never, &mQueue, nullptr,
+            "No permission to run fstrim commands"));
+    // Appfuse only touches the namespace index, which has a lock of its own
     registerCmd(new AppFuseCmd());
 }
 
@@ -113,7 +152,43 @@ CommandListener::DumpCmd::DumpCmd() :
 }
 
 int CommandListener::DumpCmd::runCommand(SocketClient *cli,
-                                         int /*argc*/, char ** /*argv*/) {
+                                         int argc, char **argv) {
+    if (argc > 1 && !strcmp(argv[1], "timings")) {
+        std::vector<std::string> lines;
+        android::vold::DumpTimings(lines);
+        for (const auto& line : lines) {
+            cli->sendMsg(0, line.c_str(), false);
+        }
+        cli->sendMsg(ResponseCode::CommandOkay, "dump complete", false);
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+        std::vector<std::string> lines;
+        android::vold::DumpBenchHistory(lines);
+        for (const auto& line : lines) {
+            cli->sendMsg(0, line.c_str(), false);
+        }
+        cli->sendMsg(ResponseCode::CommandOkay, "dump complete", false);
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "iostats")) {
+        std::vector<std::string> lines;
+        android::vold::DumpIoStats(lines);
+        for (const auto& line : lines) {
+            cli->sendMsg(0, line.c_str(), false);
+        }
+        cli->sendMsg(ResponseCode::CommandOkay, "dump complete", false);
+        return 0;
+    }
+
+    cli->sendMsg(0, "Dumping storage state", false);
+    {
+        std::vector<std::string> lines;
+        android::vold::DumpStorageState(lines);
+        for (const auto& line : lines) {
+            cli->sendMsg(0, line.c_str(), false);
+        }
+    }
     cli->sendMsg(0, "Dumping loop status", false);
     if (Loop::dumpState(cli)) {
         cli->sendMsg(ResponseCode::CommandOkay, "Loop dump failed", true);
@@ -137,6 +212,57 @@ int CommandListener::DumpCmd::runCommand(SocketClient *cli,
     return 0;
 }
 
+CommandListener::IoStatsCmd::IoStatsCmd() :
+                 VoldCommand("iostats") {
+}
+
+int CommandListener::IoStatsCmd::runCommand(SocketClient *cli,
+                                            int /*argc*/, char ** /*argv*/) {
+    std::vector<std::string> records;
+    android::vold::ListIoStats(records);
+    for (const auto& record : records) {
+        cli->sendMsg(ResponseCode::IoStatsListResult, record.c_str(), false);
+    }
+    cli->sendMsg(ResponseCode::CommandOkay, "iostats complete", false);
+    return 0;
+}
+
+CommandListener::TaskCmd::TaskCmd() :
+                 VoldCommand("task") {
+}
+
+int CommandListener::TaskCmd::runCommand(SocketClient *cli,
+                                         int argc, char **argv) {
+    if ((cli->getUid() != 0) && (cli->getUid() != AID_SYSTEM)) {
+        cli->sendMsg(ResponseCode::CommandNoPermission, "No permission to run task commands", false);
+        return 0;
+    }
+
+    std::string cmd(argc > 1 ? argv[1] : "list");
+    if (cmd == "list") {
+        std::vector<std::string> records;
+        android::vold::ListJobs(records);
+        for (const auto& record : records) {
+            cli->sendMsg(ResponseCode::TaskListResult, record.c_str(), false);
+        }
+        cli->sendMsg(ResponseCode::CommandOkay, "task list complete", false);
+        return 0;
+    } else if (cmd == "cancel" && argc > 2) {
+        // task cancel <id>
+        return sendGenericOkFail(cli, !android::vold::CancelJob(strtoull(argv[2], nullptr, 10)));
+    } else if (cmd == "screen" && argc > 2) {
+        // task screen on|off
+        android::vold::SetJobsScreenOn(!strcmp(argv[2], "on"));
+        return sendGenericOkFail(cli, 0);
+    } else if (cmd == "pause" || cmd == "resume") {
+        android::vold::SetJobsPaused(cmd == "pause");
+        return sendGenericOkFail(cli, 0);
+    }
+    cli->sendMsg(ResponseCode::CommandSyntaxError,
+            "Usage: task [list|cancel <id>|screen on|off|pause|resume]", false);
+    return 0;
+}
+
 CommandListener::VolumeCmd::VolumeCmd() :
                  VoldCommand("volume") {
 }
@@ -150,12 +276,22 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
         return 0;
     }
 
+    std::string cmd(argv[1]);
+    if (cmd == "list") {
+        // Answered from the snapshot, so never waits on a mount
+        std::vector<std::string> lines;
+        android::vold::DumpStorageState(lines);
+        for (const auto& line : lines) {
+            cli->sendMsg(ResponseCode::VolumeListResult, line.c_str(), false);
+        }
+        return cli->sendMsg(ResponseCode::CommandOkay, "Volumes listed", false);
+    }
+
     VolumeManager *vm = VolumeManager::Instance();
     std::lock_guard<std::mutex> lock(vm->getLock());
 
     // TODO: tease out methods not directly related to volumes
 
-    std::string cmd(argv[1]);
     if (cmd == "reset") {
         return sendGenericOkFail(cli, vm->reset());
 
@@ -165,6 +301,15 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
     } else if (cmd == "debug") {
         return sendGenericOkFail(cli, vm->setDebug(true));
 
+    } else if (cmd == "batch" && argc > 2) {
+        // batch [on|off]
+        std::string mode(argv[2]);
+        if (mode != "on" && mode != "off") {
+            return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown mode", false);
+        }
+        android::vold::SetEventBatching(cli, mode == "on");
+        return sendGenericOkFail(cli, 0);
+
     } else if (cmd == "partition" && argc > 3) {
         // partition [diskId] [public|private|mixed] [ratio]
         std::string id(argv[2]);
@@ -173,6 +318,8 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
             return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown disk", false);
         }
 
+        // Their loop devices would keep the disk's volumes busy
+        vm->releaseWarmObbs();
         std::string type(argv[3]);
         if (type == "public") {
             return sendGenericOkFail(cli, disk->partitionPublic());
@@ -219,10 +366,18 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
         int mountFlags = (argc > 3) ? atoi(argv[3]) : 0;
         userid_t mountUserId = (argc > 4) ? atoi(argv[4]) : -1;
 
-        vol->setMountFlags(mountFlags);
-        vol->setMountUserId(mountUserId);
+        // Mount away from the listener thread, so that other volumes aren't
+        // stuck behind this one's fsck
+        if (vm->mountAsync(vol, mountFlags, mountUserId)) {
+            return sendGenericOkFail(cli, 0);
+        }
 
-        int res = vol->mount();
+        int res = OK;
+        if (!vol->adoptWarmMount(mountFlags, mountUserId)) {
+            vol->setMountFlags(mountFlags);
+            vol->setMountUserId(mountUserId);
+            res = vol->mount();
+        }
         if (mountFlags & android::vold::VolumeBase::MountFlags::kPrimary) {
             vm->setPrimary(vol);
         }
@@ -236,18 +391,22 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
             return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown volume", false);
         }
 
+        // Their loop devices would keep the volume busy
+        vm->releaseWarmObbs();
         return sendGenericOkFail(cli, vol->unmount());
 
     } else if (cmd == "format" && argc > 3) {
-        // format [volId] [fsType|auto]
+        // format [volId] [fsType|auto] [quick]
         std::string id(argv[2]);
         std::string fsType(argv[3]);
+        bool quick = argc > 4 && !strcmp(argv[4], "quick");
         auto vol = vm->findVolume(id);
         if (vol == nullptr) {
             return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown volume", false);
         }
 
-        return sendGenericOkFail(cli, vol->format(fsType));
+        vm->releaseWarmObbs();
+        return sendGenericOkFail(cli, vol->format(fsType, quick));
 
     } else if (cmd == "move_storage" && argc > 3) {
         // move_storage [fromVolId] [toVolId]
@@ -257,6 +416,7 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
             return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown volume", false);
         }
 
+        vm->releaseWarmObbs();
         (new android::vold::MoveTask(fromVol, toVol))->start();
         return sendGenericOkFail(cli, 0);
 
@@ -277,6 +437,15 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
         uid_t uid = atoi(argv[2]);
         std::string mode(argv[3]);
         return sendGenericOkFail(cli, vm->remountUid(uid, mode));
+
+    } else if (cmd == "remount_uids" && argc > 3) {
+        // remount_uids [none|default|read|write] [uid...]
+        std::string mode(argv[2]);
+        std::vector<uid_t> uids;
+        for (int i = 3; i < argc; i++) {
+            uids.push_back(atoi(argv[i]));
+        }
+        return sendGenericOkFail(cli, vm->remountUids(uids, mode));
     }
 
     return cli->sendMsg(ResponseCode::CommandSyntaxError, nullptr, false);
@@ -354,41 +523,14 @@ CommandListener::AsecCmd::AsecCmd() :
 }
 
 void CommandListener::AsecCmd::listAsecsInDirectory(SocketClient *cli, const char *directory) {
-    DIR *d = opendir(directory);
-
-    if (!d) {
+    std::vector<std::string> ids;
+    if (VolumeManager::Instance()->listAsecs(directory, ids)) {
         cli->sendMsg(ResponseCode::OperationFailed, "Failed to open asec dir", true);
         return;
     }
-
-    size_t dirent_len = offsetof(struct dirent, d_name) +
-            fpathconf(dirfd(d), _PC_NAME_MAX) + 1;
-
-    struct dirent *dent = (struct dirent *) malloc(dirent_len);
-    if (dent == NULL) {
-        cli->sendMsg(ResponseCode::OperationFailed, "Failed to allocate memory", true);
-        return;
-    }
-
-    struct dirent *result;
-
-    while (!readdir_r(d, dent, &result) && result != NULL) {
-        if (dent->d_name[0] == '.')
-            continue;
-        if (dent->d_type != DT_REG)
-            continue;
-        size_t name_len = strlen(dent->d_name);
-        if (name_len > 5 && name_len < 260 &&
-                !strcmp(&dent->d_name[name_len - 5], ".asec")) {
-            char id[255];
-            memset(id, 0, sizeof(id));
-            strlcpy(id, dent->d_name, name_len - 4);
-            cli->sendMsg(ResponseCode::AsecListResult, id, false);
-        }
+    for (const auto& id : ids) {
+        cli->sendMsg(ResponseCode::AsecListResult, id.c_str(), false);
     }
-    closedir(d);
-
-    free(dent);
 }
 
 int CommandListener::AsecCmd::runCommand(SocketClient *cli,
@@ -625,7 +767,26 @@ int CommandListener::FstrimCmd::runCommand(SocketClient *cli,
                 | android::vold::TrimTask::Flags::kBenchmarkAfter;
     }
 
-    (new android::vold::TrimTask(flags))->start();
+    // Optional I/O priority class and time budget for idle maintenance
+    IoSchedClass ioClass = IoSchedClass_NONE;
+    nsecs_t budget = 0;
+    if (argc > 2) {
+        std::string clazz(argv[2]);
+        if (clazz == "idle") {
+            ioClass = IoSchedClass_IDLE;
+        } else if (clazz == "be") {
+            ioClass = IoSchedClass_BE;
+        } else if (clazz != "default") {
+            cli->sendMsg(ResponseCode::CommandSyntaxError,
+                    "Usage: fstrim <cmd> [idle|be|default [<budget_seconds>]]", false);
+            return 0;
+        }
+    }
+    if (argc > 3) {
+        budget = seconds_to_nanoseconds(atoi(argv[3]));
+    }
+
+    (new android::vold::TrimTask(flags, ioClass, budget))->start();
     return sendGenericOkFail(cli, 0);
 }
 
@@ -646,33 +807,6 @@ static android::status_t getMountPath(uid_t uid, const std::string& name, std::s
     return android::OK;
 }
 
-static android::status_t mountInNamespace(uid_t uid, int device_fd, const std::string& path) {
-    // Remove existing mount.
-    android::vold::ForceUnmount(path);
-
-    const auto opts = android::base::StringPrintf(
-            "fd=%i,"
-            "rootmode=40000,"
-            "default_permissions,"
-            "allow_other,"
-            "user_id=%d,group_id=%d,"
-            "context=\"u:object_r:app_fuse_file:s0\","
-            "fscontext=u:object_r:app_fusefs:s0",
-            device_fd,
-            uid,
-            uid);
-
-    const int result = TEMP_FAILURE_RETRY(mount(
-            "/dev/fuse", path.c_str(), "fuse",
-            MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_NOATIME, opts.c_str()));
-    if (result != 0) {
-        PLOG(ERROR) << "Failed to mount " << path;
-        return -errno;
-    }
-
-    return android::OK;
-}
-
 static android::status_t runCommandInNamespace(const std::string& command,
                                                uid_t uid,
                                                pid_t pid,
@@ -714,25 +848,20 @@ static android::status_t runCommandInNamespace(const std::string& command,
     }
 
     // Matches so far, but refuse to touch if in root namespace
-    {
-        char rootName[PATH_MAX];
-        char pidName[PATH_MAX];
-        const int root_result =
-                android::vold::SaneReadLinkAt(dir.get(), "1/ns/mnt", rootName, PATH_MAX);
-        const int pid_result =
-                android::vold::SaneReadLinkAt(pid_fd.get(), "ns/mnt", pidName, PATH_MAX);
-        if (root_result == -1) {
-            LOG(ERROR) << "Failed to readlink for /proc/1/ns/mnt";
-            return -EPERM;
-        }
-        if (pid_result == -1) {
-            LOG(ERROR) << "Failed to readlink for /proc/" << pid << "/ns/mnt";
-            return -EPERM;
-        }
-        if (!strcmp(rootName, pidName)) {
-            LOG(ERROR) << "Don't mount appfuse in root namespace";
-            return -EPERM;
-        }
+    auto& index = VolumeManager::Instance()->getNamespaceIndex();
+    const ino_t root_ns = index.getRootNamespace();
+    const ino_t pid_ns = index.findByPid(pid);
+    if (root_ns == 0) {
+        LOG(ERROR) << "Failed to find root namespace";
+        return -EPERM;
+    }
+    if (pid_ns == 0) {
+        LOG(ERROR) << "Failed to find namespace for /proc/" << pid;
+        return -EPERM;
+    }
+    if (pid_ns == root_ns) {
+        LOG(ERROR) << "Don't mount appfuse in root namespace";
+        return -EPERM;
     }
 
     // We purposefully leave the namespace open across the fork
@@ -741,6 +870,21 @@ static android::status_t runCommandInNamespace(const std::string& command,
         PLOG(ERROR) << "Failed to open namespace for /proc/" << pid << "/ns/mnt";
         return -errno;
     }
+    {
+        // The pid may have moved since the index last saw it
+        struct stat sb;
+        if (fstat(ns_fd.get(), &sb) != 0 || sb.st_ino != pid_ns) {
+            LOG(ERROR) << "Namespace for /proc/" << pid << " changed";
+            return -EPERM;
+        }
+    }
+
+    // Helpers stay in the namespace, so only its first command pays for a fork
+    const android::status_t res = android::vold::RunAppFuseCommandInNamespace(
+            pid_ns, ns_fd.get(), command, uid, path, device_fd);
+    if (res != -ENOTCONN) {
+        return res;
+    }
 
     int child = fork();
     if (child == 0) {
@@ -748,26 +892,7 @@ static android::status_t runCommandInNamespace(const std::string& command,
             PLOG(ERROR) << "Failed to setns";
             _exit(-errno);
         }
-
-        if (command == "mount") {
-            _exit(mountInNamespace(uid, device_fd, path));
-        } else if (command == "unmount") {
-            // If it's just after all FD opened on mount point are closed, umount2 can fail with
-            // EBUSY. To avoid the case, specify MNT_DETACH.
-            if (umount2(path.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) != 0 &&
-                    errno != EINVAL && errno != ENOENT) {
-                PLOG(ERROR) << "Failed to unmount directory.";
-                _exit(-errno);
-            }
-            if (rmdir(path.c_str()) != 0) {
-                PLOG(ERROR) << "Failed to remove the mount directory.";
-                _exit(-errno);
-            }
-            _exit(android::OK);
-        } else {
-            LOG(ERROR) << "Unknown appfuse command " << command;
-            _exit(-EPERM);
-        }
+        _exit(android::vold::RunAppFuseCommand(command, uid, path, device_fd));
     }
 
     if (child == -1) {
@@ -19,6 +19,7 @@
 
 #include <sysutils/FrameworkListener.h>
 #include <utils/Errors.h>
+#include "CommandQueue.h"
 #include "VoldCommand.h"
 
 class CommandListener : public FrameworkListener {
@@ -27,6 +28,8 @@ public:
     virtual ~CommandListener() {}
 
 private:
+    android::vold::CommandQueue mQueue;
+
     static void dumpArgs(int argc, char **argv, int argObscure);
     static int sendGenericOkFail(SocketClient *cli, int cond);
 
@@ -37,6 +40,20 @@ private:
         int runCommand(SocketClient *c, int argc, char ** argv);
     };
 
+    class IoStatsCmd : public VoldCommand {
+    public:
+        IoStatsCmd();
+        virtual ~IoStatsCmd() {}
+        int runCommand(SocketClient *c, int argc, char ** argv);
+    };
+
+    class TaskCmd : public VoldCommand {
+    public:
+        TaskCmd();
+        virtual ~TaskCmd() {}
+        int runCommand(SocketClient *c, int argc, char ** argv);
+    };
+
     class VolumeCmd : public VoldCommand {
     public:
         VolumeCmd();
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CommandQueue.h"
+#include "ResponseCode.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <cutils/properties.h>
+#include <private/android_filesystem_config.h>
+#include <sysutils/SocketClient.h>
+
+#include <thread>
+
+#include <sys/socket.h>
+
+namespace android {
+namespace vold {
+
+CommandQueue::CommandQueue() : mRunning(false) {
+}
+
+void CommandQueue::post(SocketClient* client, FrameworkCommand* command, int argc,
+        char** argv) {
+    // argv is only good until the listener moves on to its next command
+    Request req{ client, client->getCmdNum(), command, std::vector<std::string>(argv,
+            argv + argc) };
+    client->incRef();
+
+    std::lock_guard<std::mutex> lock(mLock);
+    mOutstanding[client]++;
+    mRequests.push_back(std::move(req));
+    if (!mRunning) {
+        mRunning = true;
+        std::thread(&CommandQueue::run, this).detach();
+    }
+}
+
+bool CommandQueue::isBusy(SocketClient* client) {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mOutstanding.count(client) != 0;
+}
+
+void CommandQueue::run() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (!mRequests.empty()) {
+        Request req = std::move(mRequests.front());
+        mRequests.pop_front();
+        lock.unlock();
+
+        runRequest(req);
+
+        lock.lock();
+        // Only once the reply is out, so anything run in place after this
+        // answers after it too
+        auto it = mOutstanding.find(req.client);
+        if (--it->second == 0) {
+            mOutstanding.erase(it);
+        }
+        lock.unlock();
+        req.client->decRef();
+        lock.lock();
+    }
+    mRunning = false;
+}
+
+void CommandQueue::runRequest(Request& req) {
+    // The listener sets the client's sequence number for each command it
+    // reads, so the command writes through a client of our own that keeps
+    // the number it came in with. Each message it sends is one packet on
+    // the relay, passed on whole through the caller's client, under that
+    // client's write lock.
+    int relay[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, relay) != 0) {
+        PLOG(ERROR) << "Failed to create reply relay";
+        std::string msg(android::base::StringPrintf("%d Failed to queue command", req.cmdNum));
+        req.client->sendMsg(ResponseCode::OperationFailed, msg.c_str(), false, false);
+        return;
+    }
+    android::base::unique_fd ours(relay[0]);
+
+    std::thread forward([&]() {
+        std::vector<char> buf;
+        while (true) {
+            ssize_t len = TEMP_FAILURE_RETRY(recv(ours.get(), nullptr, 0, MSG_PEEK | MSG_TRUNC));
+            if (len <= 0) break;
+            buf.resize(len);
+            len = TEMP_FAILURE_RETRY(recv(ours.get(), buf.data(), buf.size(), 0));
+            if (len <= 0) break;
+            req.client->sendData(buf.data(), len);
+        }
+    });
+
+    {
+        SocketClient client(relay[1], true, true);
+        client.setCmdNum(req.cmdNum);
+        std::vector<char*> argv;
+        for (auto& arg : req.args) {
+            argv.push_back(&arg[0]);
+        }
+        argv.push_back(nullptr);
+        if (req.command->runCommand(&client, req.args.size(), argv.data())) {
+            LOG(WARNING) << "Handler '" << req.command->getCommand() << "' failed";
+        }
+    }
+    // Our client closed its end, so the relay drains and stops
+    forward.join();
+}
+
+AsyncCommand::AsyncCommand(FrameworkCommand* command, InlineFn runsInline,
+        CommandQueue* queue, InlineFn needsCaller, const char* denied) :
+        VoldCommand(command->getCommand()), mCommand(command), mRunsInline(runsInline),
+        mQueue(queue), mNeedsCaller(needsCaller), mDenied(denied) {
+}
+
+int AsyncCommand::runCommand(SocketClient* c, int argc, char** argv) {
+    if ((mNeedsCaller && mNeedsCaller(argc, argv))
+            || !property_get_bool("vold.async_commands", true)
+            || (mRunsInline(argc, argv) && !mQueue->isBusy(c))) {
+        return mCommand->runCommand(c, argc, argv);
+    }
+    if (mDenied && c->getUid() != AID_ROOT && c->getUid() != AID_SYSTEM) {
+        c->sendMsg(ResponseCode::CommandNoPermission, mDenied, false);
+        return 0;
+    }
+    mQueue->post(c, mCommand.get(), argc, argv);
+    return 0;
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_COMMAND_QUEUE_H
+#define ANDROID_VOLD_COMMAND_QUEUE_H
+
+#include "Utils.h"
+#include "VoldCommand.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class SocketClient;
+
+namespace android {
+namespace vold {
+
+/*
+ * Runs commands in order on a worker thread of its own, so that slow
+ * ones don't hold up the listener. Replies carry the sequence number of
+ * the command they answer, whenever they're sent, and go out through the
+ * caller's own client, so that they never interleave with broadcasts or
+ * with replies sent by the listener.
+ */
+class CommandQueue {
+public:
+    CommandQueue();
+    virtual ~CommandQueue() {}
+
+    void post(SocketClient* client, FrameworkCommand* command, int argc, char** argv);
+    /* Whether |client| still has commands queued or running */
+    bool isBusy(SocketClient* client);
+
+private:
+    struct Request {
+        SocketClient* client;
+        int cmdNum;
+        FrameworkCommand* command;
+        std::vector<std::string> args;
+    };
+
+    std::mutex mLock;
+    std::deque<Request> mRequests;
+    /* Commands posted but not yet answered, by client */
+    std::map<SocketClient*, int> mOutstanding;
+    /* Whether a worker is draining mRequests */
+    bool mRunning;
+
+    void run();
+    void runRequest(Request& req);
+
+    DISALLOW_COPY_AND_ASSIGN(CommandQueue);
+};
+
+/*
+ * Wraps |command| so that it runs through |queue|, except for calls that
+ * |runsInline| picks: quick ones that only read state. Those run on the
+ * listener thread and answer at once, unless the same client still has
+ * commands in the queue, in which case they queue behind them rather
+ * than see their changes half made. Calls that |needsCaller| picks always
+ * run in place, since they keep hold of the caller's own client. Setting
+ * vold.async_commands to false runs everything in place.
+ *
+ * Queued commands see the credentials of the queue's relay rather than
+ * the caller's, so a command that's only for root and system passes
+ * |denied|, and anyone else gets it back as the reply before anything is
+ * queued.
+ */
+class AsyncCommand : public VoldCommand {
+public:
+    typedef bool (*InlineFn)(int argc, char** argv);
+
+    AsyncCommand(FrameworkCommand* command, InlineFn runsInline, CommandQueue* queue,
+            InlineFn needsCaller = nullptr, const char* denied = nullptr);
+    virtual ~AsyncCommand() {}
+    int runCommand(SocketClient* c, int argc, char** argv);
+
+private:
+    std::unique_ptr<FrameworkCommand> mCommand;
+    InlineFn mRunsInline;
+    CommandQueue* mQueue;
+    InlineFn mNeedsCaller;
+    const char* mDenied;
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -32,6 +32,7 @@
 
 #include <algorithm>
 #include <thread>
+#include <vector>
 
 #define LOG_TAG "VoldCryptCmdListener"
 
@@ -45,6 +46,7 @@
 #include <sysutils/SocketClient.h>
 #include <private/android_filesystem_config.h>
 
+#include "CommandQueue.h"
 #include "CryptCommandListener.h"
 #include "Process.h"
 #include "ResponseCode.h"
@@ -55,9 +57,16 @@
 
 #define DUMP_ARGS 0
 
+/* Reads of the crypto footer; anything touching cryptfs state waits its turn */
+static bool inlineCryptfsCmd(int argc, char **argv) {
+    return argc > 1 && (!strcmp(argv[1], "cryptocomplete") || !strcmp(argv[1], "getpwtype")
+            || !strcmp(argv[1], "isConvertibleToFBE"));
+}
+
 CryptCommandListener::CryptCommandListener() :
 FrameworkListener("cryptd", true) {
-    registerCmd(new CryptfsCmd());
+    registerCmd(new android::vold::AsyncCommand(new CryptfsCmd(), &inlineCryptfsCmd, &mQueue,
+            nullptr, "No permission to run cryptfs commands"));
 }
 
 #if DUMP_ARGS
@@ -328,6 +337,22 @@ int CryptCommandListener::CryptfsCmd::runCommand(SocketClient *cli,
         if (!check_argc(cli, subcommand, argc, 4, "<fieldname> <value>")) return 0;
         dumpArgs(argc, argv, -1);
         rc = cryptfs_setfield(argv[2], argv[3]);
+    } else if (subcommand == "setfields") {
+        // Any number of pairs, saved together
+        if (argc < 4 || argc % 2) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError,
+                    "Usage: cryptfs setfields <fieldname> <value> [<fieldname> <value> ...]",
+                    false);
+            return 0;
+        }
+        dumpArgs(argc, argv, -1);
+        std::vector<const char*> fieldnames;
+        std::vector<const char*> values;
+        for (int i = 2; i < argc; i += 2) {
+            fieldnames.push_back(argv[i]);
+            values.push_back(argv[i + 1]);
+        }
+        rc = cryptfs_setfields(fieldnames.data(), values.data(), fieldnames.size());
     } else if (subcommand == "mountdefaultencrypted") {
         if (!check_argc(cli, subcommand, argc, 2, "")) return 0;
         SLOGD("cryptfs mountdefaultencrypted");
@@ -418,6 +443,21 @@ int CryptCommandListener::CryptfsCmd::runCommand(SocketClient *cli,
         return sendGenericOkFailOnBool(cli, e4crypt_unlock_user_key(
             atoi(argv[2]), atoi(argv[3]), argv[4], argv[5]));
 
+    } else if (subcommand == "unlock_user_keys") {
+        if (argc < 6 || (argc - 2) % 4 != 0) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: cryptfs unlock_user_keys "
+                    "<user> <serial> <token> <secret> [<user> <serial> <token> <secret> ...]",
+                    false);
+            return 0;
+        }
+        std::vector<e4crypt_user_unlock> unlocks;
+        for (int i = 2; i < argc; i += 4) {
+            unlocks.push_back({static_cast<userid_t>(atoi(argv[i])), atoi(argv[i + 1]),
+                    argv[i + 2], argv[i + 3]});
+        }
+        return sendGenericOkFailOnBool(cli, e4crypt_unlock_user_keys(unlocks.data(),
+                unlocks.size()));
+
     } else if (subcommand == "lock_user_key") {
         if (!check_argc(cli, subcommand, argc, 3, "<user>")) return 0;
         return sendGenericOkFailOnBool(cli, e4crypt_lock_user_key(atoi(argv[2])));
@@ -19,6 +19,7 @@
 
 #include <sysutils/FrameworkListener.h>
 #include <utils/Errors.h>
+#include "CommandQueue.h"
 #include "VoldCommand.h"
 
 class CryptCommandListener : public FrameworkListener {
@@ -27,6 +28,8 @@ public:
     virtual ~CryptCommandListener() {}
 
 private:
+    android::vold::CommandQueue mQueue;
+
     static void dumpArgs(int argc, char **argv, int argObscure);
     static int sendGenericOkFailOnBool(SocketClient *cli, bool success);
 
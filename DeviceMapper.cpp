@@ -0,0 +1,490 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DeviceMapper.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <cutils/properties.h>
+
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+
+using android::base::StringPrintf;
+using namespace std::chrono_literals;
+
+namespace android {
+namespace vold {
+
+/* Room for a few targets with long parameters; grows when needed */
+static const size_t kDefaultArenaSize = 16 * 1024;
+static const size_t kMaxArenaSize = 1024 * 1024;
+
+/* Loading a table can fail while the underlying device is still busy */
+static const int kTableLoadRetries = 10;
+static const auto kTableLoadRetryDelay = 500ms;
+
+/* Active devices by name, loaded once from DM_LIST_DEVICES */
+static std::mutex sCacheLock;
+static bool sCacheLoaded = false;
+static std::map<std::string, dev_t> sCache;
+
+static size_t align8(size_t size) {
+    return (size + 7) & ~static_cast<size_t>(7);
+}
+
+/* The kernel hands back device numbers in its new_encode_dev() format */
+static dev_t decodeDev(uint64_t dev) {
+    return makedev((dev & 0xfff00) >> 8, (dev & 0xff) | ((dev >> 12) & 0xfff00));
+}
+
+static void cacheDevice(const std::string& name, dev_t dev) {
+    std::lock_guard<std::mutex> lock(sCacheLock);
+    if (sCacheLoaded) {
+        sCache[name] = dev;
+    }
+}
+
+static void uncacheDevice(const std::string& name) {
+    std::lock_guard<std::mutex> lock(sCacheLock);
+    sCache.erase(name);
+}
+
+DeviceMapper::DeviceMapper() {}
+
+DeviceMapper::~DeviceMapper() {
+    wipe();
+}
+
+std::string DeviceMapper::devicePath(dev_t dev) {
+    return "/dev/block/dm-" + std::to_string(minor(dev));
+}
+
+bool DeviceMapper::open() {
+    if (mFd.get() != -1) {
+        return true;
+    }
+    mFd.reset(TEMP_FAILURE_RETRY(::open("/dev/device-mapper", O_RDWR | O_CLOEXEC)));
+    if (mFd.get() == -1) {
+        PLOG(ERROR) << "Failed to open device-mapper";
+        return false;
+    }
+    return true;
+}
+
+void DeviceMapper::wipe() {
+    memset_s(mArena.data(), 0, mArena.size() * sizeof(uint64_t));
+}
+
+struct dm_ioctl* DeviceMapper::prepare(const std::string& name, size_t dataSize,
+        uint32_t flags) {
+    dataSize = std::max(align8(dataSize), kDefaultArenaSize);
+    if (dataSize > kMaxArenaSize || name.size() >= DM_NAME_LEN) {
+        return nullptr;
+    }
+    if (mArena.size() * sizeof(uint64_t) < dataSize) {
+        // Don't leave the old contents behind in freed memory
+        wipe();
+        mArena.assign(dataSize / sizeof(uint64_t), 0);
+    } else {
+        memset(mArena.data(), 0, dataSize);
+    }
+
+    struct dm_ioctl* io = reinterpret_cast<struct dm_ioctl*>(mArena.data());
+    io->data_size = dataSize;
+    io->data_start = sizeof(struct dm_ioctl);
+    io->version[0] = 4;
+    io->version[1] = 0;
+    io->version[2] = 0;
+    io->flags = flags;
+    name.copy(io->name, sizeof(io->name) - 1);
+    return io;
+}
+
+/* Size of the DM_TABLE_LOAD request for |targets|, or 0 if they're invalid */
+static size_t tableSize(const std::string& name, const std::vector<DeviceMapper::Target>& targets) {
+    size_t size = sizeof(struct dm_ioctl);
+    for (const auto& target : targets) {
+        if (target.type.size() >= DM_MAX_TYPE_NAME) {
+            LOG(ERROR) << "Invalid target type " << target.type;
+            return 0;
+        }
+        size += sizeof(struct dm_target_spec) + align8(target.params.size() + 1);
+    }
+    if (targets.empty() || size > kMaxArenaSize) {
+        LOG(ERROR) << "Invalid table for " << name;
+        return 0;
+    }
+    return size;
+}
+
+status_t DeviceMapper::loadTable(const std::string& name, const std::vector<Target>& targets,
+        size_t size) {
+    // Targets are packed back to back, each with its parameter string
+    struct dm_ioctl* io = prepare(name, size, DM_STATUS_TABLE_FLAG);
+    if (!io) return -EINVAL;
+    io->target_count = targets.size();
+    char* base = reinterpret_cast<char*>(io);
+    size_t offset = io->data_start;
+    for (const auto& target : targets) {
+        auto spec = reinterpret_cast<struct dm_target_spec*>(base + offset);
+        spec->sector_start = target.start;
+        spec->length = target.length;
+        spec->status = 0;
+        target.type.copy(spec->target_type, sizeof(spec->target_type) - 1);
+        char* params = base + offset + sizeof(struct dm_target_spec);
+        memcpy(params, target.params.data(), target.params.size());
+        params[target.params.size()] = '\0';
+        spec->next = sizeof(struct dm_target_spec) + align8(target.params.size() + 1);
+        offset += spec->next;
+    }
+
+    status_t res = OK;
+    for (int i = 0; ; i++) {
+        if (!ioctl(mFd.get(), DM_TABLE_LOAD, io)) {
+            if (i > 0) LOG(INFO) << "Took " << (i + 1) << " tries to load " << name;
+            break;
+        }
+        if (i + 1 >= kTableLoadRetries) {
+            PLOG(ERROR) << "Failed to load table for " << name;
+            res = -errno;
+            break;
+        }
+        PLOG(INFO) << "Failed to load table for " << name << ", retrying";
+        std::this_thread::sleep_for(kTableLoadRetryDelay);
+    }
+    // The table is the only copy of the key; don't keep it around
+    wipe();
+    return res;
+}
+
+status_t DeviceMapper::createDevice(const std::string& name,
+        const std::vector<Target>& targets, std::string* devPath, const char* geometry) {
+    if (!open()) return -errno;
+
+    size_t size = tableSize(name, targets);
+    if (!size) return -EINVAL;
+
+    struct dm_ioctl* io = prepare(name, 0);
+    if (!io) return -EINVAL;
+    if (ioctl(mFd.get(), DM_DEV_CREATE, io)) {
+        PLOG(ERROR) << "Failed to create " << name;
+        return -errno;
+    }
+    // Creating reports the device number, so there's no need to ask for status
+    dev_t dev = decodeDev(io->dev);
+
+    status_t res = OK;
+    if (geometry) {
+        io = prepare(name, sizeof(struct dm_ioctl) + strlen(geometry) + 1);
+        strcpy(reinterpret_cast<char*>(io) + io->data_start, geometry);
+        if (ioctl(mFd.get(), DM_DEV_SET_GEOMETRY, io)) {
+            PLOG(ERROR) << "Failed to set geometry of " << name;
+            res = -errno;
+        }
+    }
+
+    if (res == OK) {
+        res = loadTable(name, targets, size);
+    }
+
+    if (res == OK) {
+        io = prepare(name, 0);
+        if (ioctl(mFd.get(), DM_DEV_SUSPEND, io)) {
+            PLOG(ERROR) << "Failed to resume " << name;
+            res = -errno;
+        }
+    }
+
+    if (res != OK) {
+        io = prepare(name, 0);
+        if (ioctl(mFd.get(), DM_DEV_REMOVE, io)) {
+            PLOG(WARNING) << "Failed to clean up " << name;
+        }
+        return res;
+    }
+
+    cacheDevice(name, dev);
+    *devPath = devicePath(dev);
+    return OK;
+}
+
+status_t DeviceMapper::reloadDevice(const std::string& name, const std::vector<Target>& targets) {
+    if (!open()) return -errno;
+
+    size_t size = tableSize(name, targets);
+    if (!size) return -EINVAL;
+    status_t res = loadTable(name, targets, size);
+    if (res != OK) return res;
+
+    // Resuming with an inactive table suspends the device, waiting for
+    // in-flight I/O, and swaps the new table in
+    struct dm_ioctl* io = prepare(name, 0);
+    if (ioctl(mFd.get(), DM_DEV_SUSPEND, io)) {
+        PLOG(ERROR) << "Failed to resume " << name << " with its new table";
+        res = -errno;
+        io = prepare(name, 0);
+        if (ioctl(mFd.get(), DM_TABLE_CLEAR, io)) {
+            PLOG(WARNING) << "Failed to clear the inactive table of " << name;
+        }
+    }
+    return res;
+}
+
+status_t DeviceMapper::getTable(const std::string& name, std::vector<Target>* targets) {
+    if (!open()) return -errno;
+
+    size_t size = kDefaultArenaSize;
+    struct dm_ioctl* io;
+    while (true) {
+        io = prepare(name, size, DM_STATUS_TABLE_FLAG);
+        if (!io) return -ENOMEM;
+        if (ioctl(mFd.get(), DM_TABLE_STATUS, io)) {
+            if (errno != ENXIO) {
+                PLOG(ERROR) << "Failed to get table of " << name;
+            }
+            return -errno;
+        }
+        if (!(io->flags & DM_BUFFER_FULL_FLAG)) break;
+        size *= 2;
+    }
+
+    // Unlike when loading, each spec's next is an offset from the start of
+    // the data rather than from the spec itself
+    targets->clear();
+    char* data = reinterpret_cast<char*>(io) + io->data_start;
+    size_t offset = 0;
+    for (uint32_t i = 0; i < io->target_count; i++) {
+        auto spec = reinterpret_cast<struct dm_target_spec*>(data + offset);
+        Target target;
+        target.start = spec->sector_start;
+        target.length = spec->length;
+        target.type = std::string(spec->target_type,
+                strnlen(spec->target_type, sizeof(spec->target_type)));
+        const char* params = data + offset + sizeof(struct dm_target_spec);
+        target.params = KeyBuffer() + params;
+        targets->push_back(std::move(target));
+        offset = spec->next;
+    }
+    // Crypt tables carry their key
+    wipe();
+    return OK;
+}
+
+status_t DeviceMapper::deleteDevice(const std::string& name) {
+    if (!open()) return -errno;
+
+    struct dm_ioctl* io = prepare(name, 0);
+    if (!io) return -EINVAL;
+    if (ioctl(mFd.get(), DM_DEV_REMOVE, io)) {
+        int err = errno;
+        if (err != ENXIO) {
+            PLOG(ERROR) << "Failed to remove " << name;
+        } else {
+            uncacheDevice(name);
+        }
+        return -err;
+    }
+    uncacheDevice(name);
+    return OK;
+}
+
+status_t DeviceMapper::getDeviceStatus(const std::string& name, struct dm_ioctl* status) {
+    if (!open()) return -errno;
+
+    struct dm_ioctl* io = prepare(name, 0);
+    if (!io) return -EINVAL;
+    if (ioctl(mFd.get(), DM_DEV_STATUS, io)) {
+        if (errno != ENXIO) {
+            PLOG(ERROR) << "Failed to get status of " << name;
+        }
+        return -errno;
+    }
+    *status = *io;
+    return OK;
+}
+
+status_t DeviceMapper::getDevicePath(const std::string& name, std::string* devPath) {
+    bool loaded;
+    {
+        std::lock_guard<std::mutex> lock(sCacheLock);
+        loaded = sCacheLoaded;
+        auto it = sCache.find(name);
+        if (it != sCache.end()) {
+            *devPath = devicePath(it->second);
+            return OK;
+        }
+    }
+    if (!loaded) {
+        std::vector<Device> devices;
+        listDevices(&devices);
+    }
+
+    // Someone else may have created it since the cache was loaded
+    struct dm_ioctl status;
+    status_t res = getDeviceStatus(name, &status);
+    if (res != OK) {
+        return res;
+    }
+    dev_t dev = decodeDev(status.dev);
+    cacheDevice(name, dev);
+    *devPath = devicePath(dev);
+    return OK;
+}
+
+status_t DeviceMapper::listDevices(std::vector<Device>* devices) {
+    if (!open()) return -errno;
+
+    size_t size = kDefaultArenaSize;
+    struct dm_ioctl* io;
+    while (true) {
+        io = prepare("", size);
+        if (!io) return -ENOMEM;
+        if (ioctl(mFd.get(), DM_LIST_DEVICES, io)) {
+            PLOG(ERROR) << "Failed to list devices";
+            return -errno;
+        }
+        if (!(io->flags & DM_BUFFER_FULL_FLAG)) break;
+        size *= 2;
+    }
+
+    devices->clear();
+    char* base = reinterpret_cast<char*>(io);
+    auto n = reinterpret_cast<struct dm_name_list*>(base + io->data_start);
+    if (n->dev) {
+        while (true) {
+            devices->push_back(Device{n->name, decodeDev(n->dev)});
+            if (!n->next) break;
+            n = reinterpret_cast<struct dm_name_list*>(reinterpret_cast<char*>(n) + n->next);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(sCacheLock);
+    sCache.clear();
+    for (const auto& device : *devices) {
+        sCache[device.name] = device.dev;
+    }
+    sCacheLoaded = true;
+    return OK;
+}
+
+status_t DeviceMapper::getTargetVersion(const std::string& type, uint32_t version[3]) {
+    if (!open()) return -errno;
+
+    struct dm_ioctl* io = prepare("", 0);
+    if (ioctl(mFd.get(), DM_LIST_VERSIONS, io)) {
+        PLOG(ERROR) << "Failed to list target versions";
+        return -errno;
+    }
+
+    char* base = reinterpret_cast<char*>(io);
+    auto v = reinterpret_cast<struct dm_target_versions*>(base + io->data_start);
+    while (true) {
+        if (type == v->name) {
+            memcpy(version, v->version, sizeof(v->version));
+            return OK;
+        }
+        if (!v->next) break;
+        v = reinterpret_cast<struct dm_target_versions*>(reinterpret_cast<char*>(v) + v->next);
+    }
+    return -ENOENT;
+}
+
+/* dm-crypt target version that first accepted each optional argument */
+struct CryptArg {
+    const char* name;
+    const char* property;
+    uint32_t major;
+    uint32_t minor;
+};
+
+static const CryptArg kCryptArgs[] = {
+    { "allow_discards", nullptr, 1, 11 },
+    { "same_cpu_crypt", "vold.dm_crypt.same_cpu_crypt", 1, 14 },
+    { "submit_from_crypt_cpus", "vold.dm_crypt.submit_from_crypt_cpus", 1, 14 },
+    { "no_read_workqueue", "vold.dm_crypt.no_read_workqueue", 1, 22 },
+    { "no_write_workqueue", "vold.dm_crypt.no_write_workqueue", 1, 22 },
+};
+
+static bool versionAtLeast(const uint32_t version[3], uint32_t major, uint32_t minor) {
+    return version[0] > major || (version[0] == major && version[1] >= minor);
+}
+
+static bool validSectorSize(int sectorSize) {
+    return sectorSize >= 512 && sectorSize <= 4096 && !(sectorSize & (sectorSize - 1));
+}
+
+uint32_t DeviceMapper::getNewCryptSectorSize() {
+    int sectorSize = property_get_int32("ro.crypto.dm_crypt_sector_size", 512);
+    if (sectorSize == 512) {
+        return 512;
+    }
+    uint32_t version[3];
+    if (!validSectorSize(sectorSize) || getTargetVersion("crypt", version) != OK
+            || !versionAtLeast(version, 1, 17)) {
+        LOG(ERROR) << "Unsupported dm-crypt sector size " << sectorSize;
+        return 512;
+    }
+    return sectorSize;
+}
+
+status_t DeviceMapper::getCryptOptionalArgs(uint32_t sectorSize, std::string* res) {
+    res->clear();
+    uint32_t version[3];
+    if (getTargetVersion("crypt", version) != OK) {
+        // Without the version only the default sector size can be mapped
+        return sectorSize == 512 ? OK : -EOPNOTSUPP;
+    }
+
+    std::vector<std::string> args;
+    for (const auto& arg : kCryptArgs) {
+        if (arg.property && !property_get_bool(arg.property, false)) continue;
+        if (versionAtLeast(version, arg.major, arg.minor)) {
+            args.push_back(arg.name);
+        } else {
+            LOG(WARNING) << "dm-crypt " << version[0] << "." << version[1]
+                    << " doesn't support " << arg.name;
+        }
+    }
+
+    if (sectorSize != 512) {
+        // Mapping the data with any other sector size would read garbage
+        if (!versionAtLeast(version, 1, 17) || !validSectorSize(sectorSize)) {
+            LOG(ERROR) << "Can't map dm-crypt sector size " << sectorSize;
+            return -EOPNOTSUPP;
+        }
+        args.push_back(StringPrintf("sector_size:%u", sectorSize));
+    }
+
+    if (args.empty()) {
+        return OK;
+    }
+    *res = std::to_string(args.size());
+    for (const auto& arg : args) {
+        *res += " " + arg;
+    }
+    LOG(INFO) << "dm-crypt optional arguments: " << *res;
+    return OK;
+}
+
+}  // namespace vold
+}  // namespace android
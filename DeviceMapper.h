@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_DEVICE_MAPPER_H
+#define ANDROID_VOLD_DEVICE_MAPPER_H
+
+#include "KeyBuffer.h"
+#include "Utils.h"
+
+#include <android-base/unique_fd.h>
+
+#include <linux/dm-ioctl.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * Device-mapper ioctls shared by ASEC, cryptfs and metadata encryption.
+ *
+ * Every request is built in one arena that's reused across calls and
+ * wiped when the instance goes away, since tables carry keys. Device
+ * numbers come back from the ioctls that change a device, so creating one
+ * takes a single CREATE, LOAD and RESUME. Names of active devices are
+ * cached from DM_LIST_DEVICES and kept current by this class.
+ */
+class DeviceMapper {
+public:
+    struct Target {
+        uint64_t start;
+        uint64_t length;
+        std::string type;
+        /* Often holds a key, so it's zeroed when freed */
+        KeyBuffer params;
+    };
+
+    struct Device {
+        std::string name;
+        dev_t dev;
+    };
+
+    DeviceMapper();
+    ~DeviceMapper();
+
+    /*
+     * Creates and activates |name| with a table of one or more |targets|,
+     * returning its /dev/block/dm-N path. |geometry| optionally sets the
+     * legacy "cylinders heads sectors start" geometry before the table is
+     * loaded. Nothing is left behind on failure.
+     */
+    status_t createDevice(const std::string& name, const std::vector<Target>& targets,
+            std::string* devPath, const char* geometry = nullptr);
+    /*
+     * Swaps the table of active device |name| for |targets|, waiting for
+     * in-flight I/O; the device keeps its number and stays open.
+     */
+    status_t reloadDevice(const std::string& name, const std::vector<Target>& targets);
+    /* The live table of |name|, keys included; returns -ENXIO if there's no such device */
+    status_t getTable(const std::string& name, std::vector<Target>* targets);
+    /* Returns -ENXIO if there's no such device */
+    status_t deleteDevice(const std::string& name);
+    /* Returns -ENXIO if there's no such device */
+    status_t getDevicePath(const std::string& name, std::string* devPath);
+    /* Fills |status| with the kernel's view of |name|, without its table */
+    status_t getDeviceStatus(const std::string& name, struct dm_ioctl* status);
+    status_t listDevices(std::vector<Device>* devices);
+    status_t getTargetVersion(const std::string& type, uint32_t version[3]);
+
+    /*
+     * Encryption sector size to record for a new dm-crypt volume:
+     * ro.crypto.dm_crypt_sector_size when the running crypt target
+     * supports it, else 512. It changes the on-disk format, so existing
+     * volumes must keep using the size they were encrypted with.
+     */
+    uint32_t getNewCryptSectorSize();
+    /*
+     * Optional dm-crypt table arguments as "<count> <arg>...", or empty,
+     * for data encrypted with |sectorSize| byte sectors. discards are
+     * always allowed and the vold.dm_crypt.* properties add CPU and
+     * workqueue tuning; arguments the running crypt target is too old
+     * for are left out. Fails if the target can't map |sectorSize|.
+     */
+    status_t getCryptOptionalArgs(uint32_t sectorSize, std::string* res);
+
+    static std::string devicePath(dev_t dev);
+
+private:
+    android::base::unique_fd mFd;
+    /* Kept as 64-bit words since the kernel expects 8-byte aligned specs */
+    std::vector<uint64_t> mArena;
+
+    bool open();
+    status_t loadTable(const std::string& name, const std::vector<Target>& targets, size_t size);
+    struct dm_ioctl* prepare(const std::string& name, size_t dataSize, uint32_t flags = 0);
+    void wipe();
+
+    DISALLOW_COPY_AND_ASSIGN(DeviceMapper);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -27,13 +27,10 @@ public:
     static int create(const char *name, const char *loopFile, const char *key,
                       unsigned long numSectors, char *buffer, size_t len);
     static int destroy(const char *name);
+    /* Reloads the live table of |name| with a new length, keeping its key */
+    static int resize(const char *name, unsigned long numSectors);
     static int lookupActive(const char *name, char *buffer, size_t len);
     static int dumpState(SocketClient *c);
-
-private:
-    static void *_align(void *ptr, unsigned int a);
-    static void ioctlInit(struct dm_ioctl *io, size_t data_size,
-                          const char *name, unsigned flags);
 };
 
 #endif
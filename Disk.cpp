@@ -15,13 +15,17 @@
  */
 
 #include "Disk.h"
+#include "PartitionTable.h"
 #include "PublicVolume.h"
 #include "PrivateVolume.h"
 #include "Utils.h"
 #include "VolumeBase.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
+#include "EventBatch.h"
 #include "Ext4Crypt.h"
+#include "IoStats.h"
+#include "StorageState.h"
 
 #include <android-base/file.h>
 #include <android-base/properties.h>
@@ -78,6 +82,9 @@ static const char* kGptLinuxFilesystem = "0FC63DAF-8483-4772-8E79-3D69D8477DE4";
 static const char* kGptAndroidMeta = "19A710A2-B3CA-11E4-B026-10604B889DCF";
 static const char* kGptAndroidExpand = "193D1EA4-B3CA-11E4-B075-10604B889DCF";
 
+// Room set aside for the android_meta partition
+static const uint64_t kMetaPartitionSize = 16 * 1024 * 1024;
+
 enum class Table {
     kUnknown,
     kMbr,
@@ -155,12 +162,14 @@ status_t Disk::create() {
     notifyEvent(ResponseCode::DiskCreated, StringPrintf("%d", mFlags));
     readMetadata();
     readPartitions();
+    TrackIoStats(getId(), mSysPath);
     return OK;
 }
 
 status_t Disk::destroy() {
     CHECK(mCreated);
     destroyAllVolumes();
+    UntrackIoStats(mSysPath);
     mCreated = false;
     notifyEvent(ResponseCode::DiskDestroyed);
     return OK;
@@ -180,6 +189,7 @@ void Disk::createPublicVolume(dev_t device,
     }
 
     mVolumes.push_back(vol);
+    mVolumeScans.push_back(ScannedVolume{ device, "", "", 0, 0, "" });
     vol->setDiskId(getId());
     vol->create();
 }
@@ -210,6 +220,7 @@ void Disk::createPrivateVolume(dev_t device, const std::string& partGuid) {
     }
 
     mVolumes.push_back(vol);
+    mVolumeScans.push_back(ScannedVolume{ device, partGuid, "", 0, 0, "" });
     vol->setDiskId(getId());
     vol->setPartGuid(partGuid);
     vol->create();
@@ -220,6 +231,35 @@ void Disk::destroyAllVolumes() {
         vol->destroy();
     }
     mVolumes.clear();
+    mVolumeScans.clear();
+}
+
+// Many cards leave the MBR signature zeroed, so it tells nothing apart
+static bool isKnownId(const std::string& id) {
+    return id.find_first_not_of("0-") != std::string::npos;
+}
+
+bool Disk::ScannedVolume::sameAs(const ScannedVolume& other) const {
+    // Two cards in the stock layout differ only in their filesystems
+    if (!isKnownId(tableId) && fsUuid.empty()) return false;
+    return device == other.device && partGuid == other.partGuid && tableId == other.tableId
+            && sectors != 0 && firstLba == other.firstLba && sectors == other.sectors
+            && fsUuid == other.fsUuid;
+}
+
+// Reads the filesystem UUID through a node of our own, since the volume
+// that will own the partition may not exist yet
+static std::string readPartitionUuid(dev_t device) {
+    std::string path(StringPrintf("/dev/block/vold/scan:%d,%d", major(device), minor(device)));
+    if (CreateDeviceNode(path, device) != OK) return "";
+    std::string fsType;
+    std::string fsUuid;
+    std::string unused;
+    if (ReadMetadataUntrusted(path, fsType, fsUuid, unused) != OK) {
+        fsUuid.clear();
+    }
+    DestroyDeviceNode(path);
+    return fsUuid;
 }
 
 status_t Disk::readMetadata() {
@@ -296,98 +336,192 @@ status_t Disk::readMetadata() {
 }
 
 status_t Disk::readPartitions() {
-    int8_t maxMinors = getMaxMinors();
-    if (maxMinors < 0) {
-        return -ENOTSUP;
-    }
-
-    if (mSkipChange) {
-        mSkipChange = false;
-        LOG(INFO) << "Skip first change";
-        return OK;
-    }
-
-    destroyAllVolumes();
-
-    // Parse partition table
+    PartitionScan scan;
+    scanPartitions(scan);
+    return applyPartitions(scan);
+}
 
+/*
+ * Fallback for devices the native reader can't handle; fills |table| from
+ * the text output of "sgdisk --android-dump".
+ */
+static status_t dumpPartitionsWithSgdisk(const std::string& devPath, PartitionTable& table) {
     std::vector<std::string> cmd;
     cmd.push_back(kSgdiskPath);
     cmd.push_back("--android-dump");
-    cmd.push_back(mDevPath);
+    cmd.push_back(devPath);
 
-    std::vector<std::string> output;
-    status_t res = ForkExecvp(cmd, output);
-    if (res != OK) {
-        LOG(WARNING) << "sgdisk failed to scan " << mDevPath;
-        notifyEvent(ResponseCode::DiskScanned);
-        mJustPartitioned = false;
-        return res;
-    }
-
-    Table table = Table::kUnknown;
-    bool foundParts = false;
-    for (const auto& line : output) {
-        char* cline = (char*) line.c_str();
+    // strtok() needs a writable copy; reuse it across lines
+    std::string copy;
+    status_t res = ForkExecvpStream(cmd, [&](const std::string& line) {
+        copy.assign(line);
+        char* cline = &copy[0];
         char* token = strtok(cline, kSgdiskToken);
-        if (token == nullptr) continue;
+        if (token == nullptr) return true;
 
         if (!strcmp(token, "DISK")) {
             const char* type = strtok(nullptr, kSgdiskToken);
             if (!strcmp(type, "mbr")) {
-                table = Table::kMbr;
+                table.type = PartitionTable::Type::kMbr;
             } else if (!strcmp(type, "gpt")) {
-                table = Table::kGpt;
+                table.type = PartitionTable::Type::kGpt;
             }
         } else if (!strcmp(token, "PART")) {
-            foundParts = true;
-            int i = strtol(strtok(nullptr, kSgdiskToken), nullptr, 10);
-            if (i <= 0 || i > maxMinors) {
-                LOG(WARNING) << mId << " is ignoring partition " << i
-                        << " beyond max supported devices";
-                continue;
-            }
-            dev_t partDevice = makedev(major(mDevice), minor(mDevice) + i);
-
-            if (table == Table::kMbr) {
-                const char* type = strtok(nullptr, kSgdiskToken);
-
-                switch (strtol(type, nullptr, 16)) {
-                case 0x06: // FAT16
-                case 0x07: // NTFS/exFAT
-                case 0x0b: // W95 FAT32 (LBA)
-                case 0x0c: // W95 FAT32 (LBA)
-                case 0x0e: // W95 FAT16 (LBA)
-                case 0x83: // Linux EXT4/F2FS/...
-                    createPublicVolume(partDevice);
-                    break;
-                }
-            } else if (table == Table::kGpt) {
+            PartitionTable::Partition part;
+            part.index = strtol(strtok(nullptr, kSgdiskToken), nullptr, 10);
+            part.mbrType = 0;
+            if (table.type == PartitionTable::Type::kMbr) {
+                part.mbrType = strtol(strtok(nullptr, kSgdiskToken), nullptr, 16);
+            } else if (table.type == PartitionTable::Type::kGpt) {
                 const char* typeGuid = strtok(nullptr, kSgdiskToken);
                 const char* partGuid = strtok(nullptr, kSgdiskToken);
+                part.typeGuid = typeGuid ? typeGuid : "";
+                part.partGuid = partGuid ? partGuid : "";
+            }
+            table.partitions.push_back(part);
+        }
+        return true;
+    });
+    if (res != OK) {
+        LOG(WARNING) << "sgdisk failed to scan " << devPath;
+        return res;
+    }
+    return OK;
+}
 
-                if (!strcasecmp(typeGuid, kGptBasicData)
-                        || !strcasecmp(typeGuid, kGptLinuxFilesystem)) {
-                    createPublicVolume(partDevice);
-                } else if (!strcasecmp(typeGuid, kGptAndroidExpand)) {
-                    createPrivateVolume(partDevice, partGuid);
-                }
+void Disk::scanPartitions(PartitionScan& scan) {
+    int8_t maxMinors = getMaxMinors();
+    if (maxMinors < 0) {
+        scan.res = -ENOTSUP;
+        return;
+    }
+
+    // Parse partition table
+
+    PartitionTable table;
+    if (ReadPartitionTable(mDevPath, table) != OK) {
+        table = PartitionTable();
+        status_t res = dumpPartitionsWithSgdisk(mDevPath, table);
+        if (res != OK) {
+            scan.res = res;
+            return;
+        }
+    }
+
+    for (const auto& part : table.partitions) {
+        int i = part.index;
+        if (i <= 0 || i > maxMinors) {
+            LOG(WARNING) << mId << " is ignoring partition " << i
+                    << " beyond max supported devices";
+            continue;
+        }
+        dev_t partDevice = makedev(major(mDevice), minor(mDevice) + i);
+
+        ScannedVolume vol{ partDevice, "", table.diskId, part.firstLba, part.sectors, "" };
+        bool wanted = false;
+        if (table.type == PartitionTable::Type::kMbr) {
+            switch (part.mbrType) {
+            case 0x06: // FAT16
+            case 0x07: // NTFS/exFAT
+            case 0x0b: // W95 FAT32 (LBA)
+            case 0x0c: // W95 FAT32 (LBA)
+            case 0x0e: // W95 FAT16 (LBA)
+            case 0x83: // Linux EXT4/F2FS/...
+                wanted = true;
+                break;
+            }
+        } else if (table.type == PartitionTable::Type::kGpt) {
+            if (!strcasecmp(part.typeGuid.c_str(), kGptBasicData)
+                    || !strcasecmp(part.typeGuid.c_str(), kGptLinuxFilesystem)) {
+                wanted = true;
+            } else if (!strcasecmp(part.typeGuid.c_str(), kGptAndroidExpand)) {
+                vol.partGuid = part.partGuid;
+                wanted = true;
             }
         }
+        if (wanted) {
+            vol.fsUuid = readPartitionUuid(partDevice);
+            scan.volumes.push_back(vol);
+        }
     }
 
     // Ugly last ditch effort, treat entire disk as partition
-    if (table == Table::kUnknown || !foundParts) {
+    if (table.type == PartitionTable::Type::kUnknown || table.partitions.empty()) {
         LOG(WARNING) << mId << " has unknown partition table; trying entire device";
 
         std::string fsType;
+        std::string fsUuid;
         std::string unused;
-        if (ReadMetadataUntrusted(mDevPath, fsType, unused, unused) == OK) {
-            createPublicVolume(mDevice);
+        if (ReadMetadataUntrusted(mDevPath, fsType, fsUuid, unused) == OK) {
+            // Only the filesystem tells one medium from the next
+            uint64_t sectors = (fsUuid.empty() || mSize == (uint64_t) -1) ? 0 : mSize / 512;
+            scan.volumes.push_back(ScannedVolume{ mDevice, "", fsUuid, 0, sectors, fsUuid });
         } else {
             LOG(WARNING) << mId << " failed to identify, giving up";
         }
     }
+}
+
+status_t Disk::applyPartitions(const PartitionScan& scan) {
+    if (scan.res == -ENOTSUP) {
+        return scan.res;
+    }
+
+    if (mSkipChange) {
+        mSkipChange = false;
+        LOG(INFO) << "Skip first change";
+        return OK;
+    }
+
+    // Freshly partitioned disks get every volume formatted as it's created
+    if (scan.res != OK || mJustPartitioned) {
+        destroyAllVolumes();
+    }
+
+    if (scan.res != OK) {
+        notifyEvent(ResponseCode::DiskScanned);
+        mJustPartitioned = false;
+        return scan.res;
+    }
+
+    // Volumes whose partition hasn't moved stay up, mounted or not; change
+    // events often leave the table alone, such as media polls on readers
+    std::vector<bool> wanted(scan.volumes.size(), true);
+    size_t kept = 0;
+    for (size_t i = 0; i < mVolumes.size(); i++) {
+        size_t j = 0;
+        while (j < scan.volumes.size()
+                && !(wanted[j] && scan.volumes[j].sameAs(mVolumeScans[i]))) {
+            j++;
+        }
+        if (j < scan.volumes.size()) {
+            wanted[j] = false;
+            mVolumes[kept] = mVolumes[i];
+            mVolumeScans[kept] = mVolumeScans[i];
+            kept++;
+        } else {
+            mVolumes[i]->destroy();
+        }
+    }
+    size_t destroyed = mVolumes.size() - kept;
+    mVolumes.resize(kept);
+    mVolumeScans.resize(kept);
+
+    for (size_t j = 0; j < scan.volumes.size(); j++) {
+        if (!wanted[j]) continue;
+        const auto& vol = scan.volumes[j];
+        size_t before = mVolumes.size();
+        if (vol.partGuid.empty()) {
+            createPublicVolume(vol.device);
+        } else {
+            createPrivateVolume(vol.device, vol.partGuid);
+        }
+        if (mVolumes.size() > before) {
+            mVolumeScans.back() = vol;
+        }
+    }
+    LOG(DEBUG) << mId << " kept " << kept << " volumes, destroyed " << destroyed
+            << ", now has " << mVolumes.size();
 
     notifyEvent(ResponseCode::DiskScanned);
     mJustPartitioned = false;
@@ -401,6 +535,32 @@ status_t Disk::unmountAll() {
     return OK;
 }
 
+bool Disk::hasMountedVolumes() {
+    for (const auto& vol : mVolumes) {
+        if (vol->getState() == VolumeBase::State::kMounted) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Disk::announce() {
+    notifyEvent(ResponseCode::DiskCreated, StringPrintf("%d", mFlags));
+    notifyEvent(ResponseCode::DiskSizeChanged, StringPrintf("%" PRIu64, mSize));
+    notifyEvent(ResponseCode::DiskLabelChanged, mLabel);
+    notifyEvent(ResponseCode::DiskSysPathChanged, mSysPath);
+    for (const auto& vol : mVolumes) {
+        vol->announce();
+    }
+    notifyEvent(ResponseCode::DiskScanned);
+}
+
+void Disk::releaseWarmMounts() {
+    for (const auto& vol : mVolumes) {
+        vol->releaseWarmMount();
+    }
+}
+
 status_t Disk::partitionPublic() {
     int res;
 
@@ -414,30 +574,31 @@ status_t Disk::partitionPublic() {
     cmd.push_back("--android-dump");
     cmd.push_back(mDevPath);
 
-    std::vector<std::string> output;
-    res = ForkExecvp(cmd, output);
-    if (res != OK) {
-        LOG(WARNING) << "sgdisk failed to scan " << mDevPath;
-        mJustPartitioned = false;
-        return res;
-    }
-
+    // Only the DISK line matters, so stop reading once it's seen
     Table table = Table::kUnknown;
-    for (auto line : output) {
-        char* cline = (char*) line.c_str();
+    std::string copy;
+    res = ForkExecvpStream(cmd, [&](const std::string& line) {
+        copy.assign(line);
+        char* cline = &copy[0];
         char* token = strtok(cline, kSgdiskToken);
-        if (token == nullptr) continue;
+        if (token == nullptr) return true;
 
         if (!strcmp(token, "DISK")) {
             const char* type = strtok(nullptr, kSgdiskToken);
-            if (!strcmp(type, "mbr")) {
+            if (type && !strcmp(type, "mbr")) {
                 table = Table::kMbr;
-                break;
-            } else if (!strcmp(type, "gpt")) {
+                return false;
+            } else if (type && !strcmp(type, "gpt")) {
                 table = Table::kGpt;
-                break;
+                return false;
             }
         }
+        return true;
+    });
+    if (res != OK) {
+        LOG(WARNING) << "sgdisk failed to scan " << mDevPath;
+        mJustPartitioned = false;
+        return res;
     }
 
     if (table == Table::kMbr) {
@@ -469,7 +630,8 @@ status_t Disk::partitionPublic() {
     dinfo.device = strdup(mDevPath.c_str());
     dinfo.scheme = PART_SCHEME_MBR;
     dinfo.sect_size = 512;
-    dinfo.skip_lba = 2048;
+    // Start the partition on an erase block boundary
+    dinfo.skip_lba = getAlignment() / 512;
     dinfo.num_lba = 0;
     dinfo.num_parts = 1;
 
@@ -531,7 +693,7 @@ status_t Disk::partitionMixed(int8_t ratio) {
     }
 
     std::string keyRaw;
-    if (ReadRandomBytes(16, keyRaw) != OK) {
+    if (ReadRandomBytes(PrivateVolume::getNewKeySize(), keyRaw) != OK) {
         LOG(ERROR) << "Failed to generate key";
         return -EIO;
     }
@@ -546,10 +708,12 @@ status_t Disk::partitionMixed(int8_t ratio) {
         LOG(DEBUG) << "Persisted key for GUID " << partGuid;
     }
 
-    // Now let's build the new GPT table. We heavily rely on sgdisk to
-    // force optimal alignment on the created partitions.
+    // Now let's build the new GPT table, with every partition starting on
+    // an erase block boundary; sgdisk only knows about 1MiB by itself
+    uint64_t alignment = getAlignment();
     cmd.clear();
     cmd.push_back(kSgdiskPath);
+    cmd.push_back(StringPrintf("--set-alignment=%" PRIu64, alignment / 512));
 
     // If requested, create a public partition first. Mixed-mode partitioning
     // like this is an experimental feature.
@@ -559,8 +723,9 @@ status_t Disk::partitionMixed(int8_t ratio) {
             return -EINVAL;
         }
 
-        uint64_t splitMb = ((mSize / 100) * ratio) / 1024 / 1024;
-        cmd.push_back(StringPrintf("--new=0:0:+%" PRId64 "M", splitMb));
+        uint64_t split = (mSize / 100) * ratio;
+        split -= split % alignment;
+        cmd.push_back(StringPrintf("--new=0:0:+%" PRIu64 "K", split / 1024));
         cmd.push_back(StringPrintf("--typecode=0:%s", kGptBasicData));
         cmd.push_back("--change-name=0:shared");
     }
@@ -568,7 +733,8 @@ status_t Disk::partitionMixed(int8_t ratio) {
     // Define a metadata partition which is designed for future use; there
     // should only be one of these per physical device, even if there are
     // multiple private volumes.
-    cmd.push_back("--new=0:0:+16M");
+    uint64_t meta = (kMetaPartitionSize + alignment - 1) / alignment * alignment;
+    cmd.push_back(StringPrintf("--new=0:0:+%" PRIu64 "K", meta / 1024));
     cmd.push_back(StringPrintf("--typecode=0:%s", kGptAndroidMeta));
     cmd.push_back("--change-name=0:android_meta");
 
@@ -588,14 +754,36 @@ status_t Disk::partitionMixed(int8_t ratio) {
     return OK;
 }
 
+uint64_t Disk::getAlignment() {
+    auto geometry = GetBlockGeometry(mDevice);
+    LOG(INFO) << mId << " has erase size " << geometry.eraseSize << ", optimal I/O size "
+            << geometry.optimalIo << ", discard granularity " << geometry.discardGranularity
+            << "; aligning partitions to " << geometry.alignment;
+    return geometry.alignment;
+}
+
+void Disk::publishState(int event) {
+    if (event == ResponseCode::DiskDestroyed) {
+        RemoveDiskState(mId);
+        return;
+    }
+    UpdateDiskState(mId, [&](DiskState& s) {
+        s.flags = mFlags;
+        s.size = mSize;
+        s.label = mLabel;
+        s.sysPath = mSysPath;
+    });
+}
+
 void Disk::notifyEvent(int event) {
-    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(event,
-            getId().c_str(), false);
+    // Published first, so that anyone acting on the event sees it
+    publishState(event);
+    SendEvent(ResponseCode::DiskSnapshot, getId(), event);
 }
 
 void Disk::notifyEvent(int event, const std::string& value) {
-    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(event,
-            StringPrintf("%s %s", getId().c_str(), value.c_str()).c_str(), false);
+    publishState(event);
+    SendEvent(ResponseCode::DiskSnapshot, getId(), event, value);
 }
 
 int Disk::getMaxMinors() {
@@ -22,6 +22,7 @@
 
 #include <utils/Errors.h>
 
+#include <utility>
 #include <vector>
 
 namespace android {
@@ -72,11 +73,47 @@ public:
     virtual status_t create();
     virtual status_t destroy();
 
+    /* A volume the partition table calls for, and enough to tell it apart */
+    struct ScannedVolume {
+        dev_t device;
+        /* Set for private volumes only */
+        std::string partGuid;
+        /* MBR signature, GPT disk GUID, or filesystem UUID for a bare disk */
+        std::string tableId;
+        /* Extent in sectors; zero when unknown, which never matches */
+        uint64_t firstLba;
+        uint64_t sectors;
+        /* UUID of the filesystem on the volume, if it has one */
+        std::string fsUuid;
+
+        bool sameAs(const ScannedVolume& other) const;
+    };
+
+    /* Result of reading the partition table, before any volumes change */
+    struct PartitionScan {
+        status_t res = OK;
+        std::vector<ScannedVolume> volumes;
+    };
+
     virtual status_t readMetadata();
     virtual status_t readPartitions();
 
+    /*
+     * readPartitions() in two halves: scanning touches only the device and
+     * can run without the VolumeManager lock; applying swaps in the new
+     * volumes and must hold it.
+     */
+    virtual void scanPartitions(PartitionScan& scan);
+    virtual status_t applyPartitions(const PartitionScan& scan);
+
     status_t unmountAll();
 
+    /* Whether any volume on the disk is mounted, ignoring stacked volumes */
+    bool hasMountedVolumes();
+    /* Re-sends the disk to a newly connected framework; see VolumeBase::announce() */
+    void announce();
+    void releaseWarmMounts();
+
     virtual status_t partitionPublic();
     virtual status_t partitionPrivate();
     virtual status_t partitionMixed(int8_t ratio);
@@ -101,6 +138,8 @@ protected:
     std::string mLabel;
     /* Current partitions on disk */
     std::vector<std::shared_ptr<VolumeBase>> mVolumes;
+    /* What each of mVolumes was created from, in the same order */
+    std::vector<ScannedVolume> mVolumeScans;
     /* Nickname for this disk */
     std::string mNickname;
     /* Flags applicable to this disk */
@@ -112,6 +151,8 @@ protected:
     /* Flag that we need to skip first disk change events after partitioning*/
     bool mSkipChange;
 
+    void publishState(int event);
+
     void createPublicVolume(dev_t device,
                     const std::string& fstype = "",
                     const std::string& mntopts = "");
@@ -120,6 +161,8 @@ protected:
     void destroyAllVolumes();
 
     int getMaxMinors();
+    /* Bytes partition boundaries should be a multiple of */
+    uint64_t getAlignment();
 
     DISALLOW_COPY_AND_ASSIGN(Disk);
 };
@@ -16,6 +16,7 @@
 
 #include "EmulatedVolume.h"
 #include "Utils.h"
+#include "fs/Sdcardfs.h"
 
 #include <android-base/stringprintf.h>
 #include <android-base/logging.h>
@@ -36,6 +37,7 @@ namespace android {
 namespace vold {
 
 static const char* kFusePath = "/system/bin/sdcard";
+static constexpr std::chrono::seconds kFuseTimeout = std::chrono::seconds(20);
 
 EmulatedVolume::EmulatedVolume(const std::string& rawPath) :
         VolumeBase(Type::kEmulated), mFusePid(0) {
@@ -76,6 +78,12 @@ status_t EmulatedVolume::doMount() {
         return -errno;
     }
 
+    if (sdcardfs::IsSupported()) {
+        // Same views the daemon would mount, without waiting for it to start
+        return sdcardfs::MountViews(mRawPath, label, AID_MEDIA_RW, AID_MEDIA_RW, 0,
+                true, true, true);
+    }
+
     dev_t before = GetDevice(mFuseWrite);
 
     if (!(mFusePid = fork())) {
@@ -100,12 +108,23 @@ status_t EmulatedVolume::doMount() {
         return -errno;
     }
 
-    while (before == GetDevice(mFuseWrite)) {
-        LOG(VERBOSE) << "Waiting for FUSE to spin up...";
-        usleep(50000); // 50ms
+    // The write view is mounted last; sdcardfs exits once it is, FUSE keeps running
+    bool exited;
+    status_t res = WaitForMount(mFuseWrite, before, mFusePid, &exited, kFuseTimeout);
+    if (!exited) {
+        TEMP_FAILURE_RETRY(waitpid(mFusePid, nullptr, WNOHANG));
+    } else {
+        mFusePid = 0;
+    }
+    if (res != OK) {
+        LOG(ERROR) << getId() << " failed to spin up FUSE";
+        if (mFusePid > 0) {
+            kill(mFusePid, SIGTERM);
+            TEMP_FAILURE_RETRY(waitpid(mFusePid, nullptr, 0));
+            mFusePid = 0;
+        }
+        return res;
     }
-    /* sdcardfs will have exited already. FUSE will still be running */
-    TEMP_FAILURE_RETRY(waitpid(mFusePid, nullptr, WNOHANG));
 
     return OK;
 }
@@ -29,25 +29,22 @@
 #include <f2fs_sparseblock.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "cutils/properties.h"
 #define LOG_TAG "EncryptInplace"
 #include "cutils/log.h"
 #include "CheckBattery.h"
+#include "EncryptProgress.h"
+#include "JobScheduler.h"
 
 // HORRIBLE HACK, FIXME
 #include "cryptfs.h"
 
-// FIXME horrible cut-and-paste code
-static inline int unix_read(int  fd, void*  buff, int  len)
-{
-    return TEMP_FAILURE_RETRY(read(fd, buff, len));
-}
-
-static inline int unix_write(int  fd, const void*  buff, int  len)
-{
-    return TEMP_FAILURE_RETRY(write(fd, buff, len));
-}
+using android::vold::EncryptProgress;
 
 #define CRYPT_SECTORS_PER_BUFSIZE (CRYPT_INPLACE_BUFSIZE / CRYPT_SECTOR_SIZE)
 
@@ -60,212 +57,461 @@ static inline int unix_write(int  fd, const void*  buff, int  len)
 #define BLOCKS_AT_A_TIME 1024
 #endif
 
+/* Number of BLOCKS_AT_A_TIME buffers kept in flight between the reader
+ * and writer stages of the ext4 copy pipeline.
+ */
+#define DEFAULT_INFLIGHT_BUFFERS 4
+#define MAX_INFLIGHT_BUFFERS 32
+
+/* Number of threads encrypt_groups() spreads ext4 block groups across. With
+ * one worker, groups are encrypted in order on the calling thread.
+ */
+#define DEFAULT_GROUP_WORKERS 1
+#define MAX_GROUP_WORKERS 16
+
+/* Copies extents from the real device to the crypto device with up to
+ * |depth| reads in flight. Extents are queued by the caller, read ahead by
+ * a reader thread and written back in submission order by a writer thread,
+ * so the device always has the next run queued while dm-crypt is encrypting
+ * the current one. Because writes complete strictly in order,
+ * lastWrittenSector() always describes a contiguous prefix of the queued
+ * extents that has been fully written.
+ */
+class InplaceCopier {
+  public:
+    InplaceCopier(int realfd, int cryptofd, const char* real_blkdev,
+                  const char* crypto_blkdev, size_t buf_size, int depth)
+        : mRealFd(realfd), mCryptoFd(cryptofd), mRealBlkdev(real_blkdev),
+          mCryptoBlkdev(crypto_blkdev), mBufSize(buf_size),
+          mDepth(std::max(1, std::min(depth, MAX_INFLIGHT_BUFFERS))),
+          mSlots(mDepth) {}
+
+    ~InplaceCopier() {
+        finish();
+        for (auto& slot : mSlots) {
+            free(slot.buf);
+        }
+    }
+
+    bool start() {
+        for (auto& slot : mSlots) {
+            slot.buf = (char*) malloc(mBufSize);
+            if (!slot.buf) {
+                SLOGE("Failed to allocate crypto buffer");
+                return false;
+            }
+        }
+        mReader = std::thread(&InplaceCopier::readLoop, this);
+        mWriter = std::thread(&InplaceCopier::writeLoop, this);
+        return true;
+    }
+
+    /* Queues |len| bytes at |offset|; blocks while every buffer is busy. */
+    int submit(off64_t offset, size_t len) {
+        std::unique_lock<std::mutex> lock(mLock);
+        mCond.wait(lock, [&] { return mError || mSubmitted - mWritten < (size_t) mDepth; });
+        if (mError) return -1;
+        Slot& slot = mSlots[mSubmitted % mDepth];
+        slot.offset = offset;
+        slot.len = std::min(len, mBufSize);
+        mSubmitted++;
+        mCond.notify_all();
+        return 0;
+    }
+
+    /* Waits until everything queued so far has been written. */
+    int drain() {
+        std::unique_lock<std::mutex> lock(mLock);
+        mCond.wait(lock, [&] { return mError || mWritten == mSubmitted; });
+        return mError ? -1 : 0;
+    }
+
+    /* Flushes anything still queued, then stops both stages. */
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mStopping = true;
+            mCond.notify_all();
+        }
+        if (mReader.joinable()) mReader.join();
+        if (mWriter.joinable()) mWriter.join();
+    }
+
+    off64_t lastWrittenSector() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mLastWrittenSector;
+    }
+
+  private:
+    struct Slot {
+        char* buf = nullptr;
+        off64_t offset = 0;
+        size_t len = 0;
+    };
+
+    void readLoop() {
+        while (true) {
+            Slot* slot;
+            {
+                std::unique_lock<std::mutex> lock(mLock);
+                mCond.wait(lock, [&] { return mStopping || mError || mRead < mSubmitted; });
+                if (mError || mRead == mSubmitted) return;
+                slot = &mSlots[mRead % mDepth];
+            }
+            bool ok = pread64(mRealFd, slot->buf, slot->len, slot->offset) > 0;
+            std::lock_guard<std::mutex> lock(mLock);
+            if (!ok) {
+                SLOGE("Error reading real_blkdev %s for inplace encrypt", mRealBlkdev);
+                mError = true;
+            } else {
+                mRead++;
+            }
+            mCond.notify_all();
+        }
+    }
+
+    void writeLoop() {
+        while (true) {
+            Slot* slot;
+            {
+                std::unique_lock<std::mutex> lock(mLock);
+                mCond.wait(lock, [&] {
+                    return mError || mWritten < mRead || (mStopping && mWritten == mSubmitted);
+                });
+                if (mError || mWritten == mRead) return;
+                slot = &mSlots[mWritten % mDepth];
+            }
+            bool ok = pwrite64(mCryptoFd, slot->buf, slot->len, slot->offset) > 0;
+            std::lock_guard<std::mutex> lock(mLock);
+            if (!ok) {
+                SLOGE("Error writing crypto_blkdev %s for inplace encrypt", mCryptoBlkdev);
+                mError = true;
+            } else {
+                mLastWrittenSector = (slot->offset + slot->len) / CRYPT_SECTOR_SIZE - 1;
+                mWritten++;
+            }
+            mCond.notify_all();
+        }
+    }
+
+    const int mRealFd;
+    const int mCryptoFd;
+    const char* mRealBlkdev;
+    const char* mCryptoBlkdev;
+    const size_t mBufSize;
+    const int mDepth;
+    std::vector<Slot> mSlots;
+
+    std::mutex mLock;
+    std::condition_variable mCond;
+    size_t mSubmitted = 0;
+    size_t mRead = 0;
+    size_t mWritten = 0;
+    bool mStopping = false;
+    bool mError = false;
+    off64_t mLastWrittenSector = 0;
+
+    std::thread mReader;
+    std::thread mWriter;
+};
+
+static int get_inflight_buffers()
+{
+    return property_get_int32("vold.encrypt_inflight_buffers", DEFAULT_INFLIGHT_BUFFERS);
+}
+
+static int get_group_workers()
+{
+    int workers = property_get_int32("vold.encrypt_group_workers", DEFAULT_GROUP_WORKERS);
+    return std::max(1, std::min(workers, MAX_GROUP_WORKERS));
+}
+
 struct encryptGroupsData
 {
     int realfd;
     int cryptofd;
     off64_t numblocks;
-    off64_t one_pct, cur_pct, new_pct;
     off64_t blocks_already_done, tot_numblocks;
-    off64_t used_blocks_already_done, tot_used_blocks;
+    off64_t tot_used_blocks;
     char* real_blkdev, * crypto_blkdev;
     int count;
     off64_t offset;
-    char* buffer;
     off64_t last_written_sector;
     int completed;
-    time_t time_started;
-    int remaining_time;
+    InplaceCopier* copier;
+    EncryptProgress* progress;
+
+    /* Shared between encrypt_groups() workers */
+    std::mutex* lock;
+    u32 next_group;
+    u32 committed_groups;
+    std::vector<bool>* group_done;
+    bool stop;
+    bool failed;
 };
 
-static void update_progress(struct encryptGroupsData* data, int is_used)
+/* Returns the index of the first bit at or after |pos| and before |end| that
+ * is |set| in the little-endian ext4 |bitmap|, or |end| if there is none.
+ * Scans a 64-bit word at a time, so empty and full stretches of a group cost
+ * one load per 64 blocks. |bitmap| must be readable up to the 64-bit word
+ * containing bit |end| - 1.
+ */
+static u32 find_bit(const u8* bitmap, u32 pos, u32 end, bool set)
 {
-    data->blocks_already_done++;
-
-    if (is_used) {
-        data->used_blocks_already_done++;
-    }
-    if (data->tot_used_blocks) {
-        data->new_pct = data->used_blocks_already_done / data->one_pct;
-    } else {
-        data->new_pct = data->blocks_already_done / data->one_pct;
-    }
-
-    if (data->new_pct > data->cur_pct) {
-        char buf[8];
-        data->cur_pct = data->new_pct;
-        snprintf(buf, sizeof(buf), "%" PRId64, data->cur_pct);
-        property_set("vold.encrypt_progress", buf);
-    }
-
-    if (data->cur_pct >= 5) {
-        struct timespec time_now;
-        if (clock_gettime(CLOCK_MONOTONIC, &time_now)) {
-            SLOGW("Error getting time");
-        } else {
-            double elapsed_time = difftime(time_now.tv_sec, data->time_started);
-            off64_t remaining_blocks = data->tot_used_blocks
-                                       - data->used_blocks_already_done;
-            int remaining_time = (int)(elapsed_time * remaining_blocks
-                                       / data->used_blocks_already_done);
-
-            // Change time only if not yet set, lower, or a lot higher for
-            // best user experience
-            if (data->remaining_time == -1
-                || remaining_time < data->remaining_time
-                || remaining_time > data->remaining_time + 60) {
-                char buf[8];
-                snprintf(buf, sizeof(buf), "%d", remaining_time);
-                property_set("vold.encrypt_time_remaining", buf);
-                data->remaining_time = remaining_time;
-            }
+    static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "ext4 bitmaps are little-endian");
+    while (pos < end) {
+        u64 word;
+        memcpy(&word, bitmap + (pos / 64) * sizeof(word), sizeof(word));
+        if (!set) {
+            word = ~word;
         }
+        word >>= pos % 64;
+        if (word == 0) {
+            pos = (pos / 64 + 1) * 64;
+            continue;
+        }
+        return std::min(pos + (u32)__builtin_ctzll(word), end);
     }
+    return end;
 }
 
-static void log_progress(struct encryptGroupsData const* data, bool completed)
+/* Finds the next run of used blocks at or after |pos| and before |end|. */
+static bool find_used_run(const u8* bitmap, u32 pos, u32 end, u32* run_start, u32* run_end)
 {
-    // Precondition - if completed data = 0 else data != 0
+    *run_start = find_bit(bitmap, pos, end, true);
+    if (*run_start >= end) {
+        return false;
+    }
+    *run_end = find_bit(bitmap, *run_start, end, false);
+    return true;
+}
 
-    // Track progress so we can skip logging blocks
-    static off64_t offset = -1;
+/* Per-thread state of an encrypt_groups() worker */
+struct encryptGroupsWorker
+{
+    int realfd;
+    int cryptofd;
+    InplaceCopier* copier;
+    int count;
+    off64_t offset;
+    /* End of the range last logged, or -1 once it has been closed */
+    off64_t log_offset;
+};
 
+/* Logs the ranges each worker encrypts, merging contiguous runs. Each worker
+ * keeps its own range so interleaved workers don't split each other's.
+ */
+static void log_progress(struct encryptGroupsWorker* worker, off64_t offset, off64_t count,
+                         bool completed)
+{
     // Need to close existing 'Encrypting from' log?
-    if (completed || (offset != -1 && data->offset != offset)) {
+    if (worker->log_offset != -1 && (completed || offset != worker->log_offset)) {
         SLOGI("Encrypted to sector %" PRId64,
-              offset / info.block_size * CRYPT_SECTOR_SIZE);
-        offset = -1;
+              worker->log_offset / info.block_size * CRYPT_SECTOR_SIZE);
+        worker->log_offset = -1;
+    }
+    if (completed) {
+        return;
     }
 
     // Need to start new 'Encrypting from' log?
-    if (!completed && offset != data->offset) {
+    if (worker->log_offset != offset) {
         SLOGI("Encrypting from sector %" PRId64,
-              data->offset / info.block_size * CRYPT_SECTOR_SIZE);
-    }
-
-    // Update offset
-    if (!completed) {
-        offset = data->offset + (off64_t)data->count * info.block_size;
+              offset / info.block_size * CRYPT_SECTOR_SIZE);
     }
+    worker->log_offset = offset + count * info.block_size;
 }
 
-static int flush_outstanding_data(struct encryptGroupsData* data)
+static int flush_outstanding_data(struct encryptGroupsData* data,
+                                  struct encryptGroupsWorker* worker)
 {
-    if (data->count == 0) {
+    if (worker->count == 0) {
         return 0;
     }
 
-    SLOGV("Copying %d blocks at offset %" PRIx64, data->count, data->offset);
-
-    if (pread64(data->realfd, data->buffer,
-                info.block_size * data->count, data->offset)
-        <= 0) {
-        SLOGE("Error reading real_blkdev %s for inplace encrypt",
-              data->real_blkdev);
-        return -1;
-    }
+    SLOGV("Queueing %d blocks at offset %" PRIx64, worker->count, worker->offset);
 
-    if (pwrite64(data->cryptofd, data->buffer,
-                 info.block_size * data->count, data->offset)
-        <= 0) {
-        SLOGE("Error writing crypto_blkdev %s for inplace encrypt",
-              data->crypto_blkdev);
+    if (worker->copier->submit(worker->offset, info.block_size * worker->count)) {
         return -1;
-    } else {
-      log_progress(data, false);
     }
 
-    data->count = 0;
-    data->last_written_sector = (data->offset + data->count)
-                                / info.block_size * CRYPT_SECTOR_SIZE - 1;
+    worker->count = 0;
     return 0;
 }
 
-static int encrypt_groups(struct encryptGroupsData* data)
+/* Encrypts the used blocks of group |i| and waits for them to hit the disk */
+static int encrypt_group(struct encryptGroupsData* data, struct encryptGroupsWorker* worker,
+                         u32 i, u8* block_bitmap)
 {
-    unsigned int i;
-    u8 *block_bitmap = 0;
     unsigned int block;
     off64_t ret;
-    int rc = -1;
 
-    data->buffer = (char*) malloc(info.block_size * BLOCKS_AT_A_TIME);
-    if (!data->buffer) {
-        SLOGE("Failed to allocate crypto buffer");
-        goto errout;
-    }
+    SLOGI("Encrypting group %d", i);
 
-    block_bitmap = (u8*) malloc(info.block_size);
-    if (!block_bitmap) {
-        SLOGE("failed to allocate block bitmap");
-        goto errout;
+    u32 first_block = aux_info.first_data_block + i * info.blocks_per_group;
+    u32 block_count = std::min(info.blocks_per_group,
+                         (u32)(aux_info.len_blocks - first_block));
+
+    off64_t offset = (u64)info.block_size
+                     * aux_info.bg_desc[i].bg_block_bitmap;
+
+    ret = pread64(worker->realfd, block_bitmap, info.block_size, offset);
+    if (ret != (int)info.block_size) {
+        SLOGE("failed to read all of block group bitmap %d", i);
+        return -1;
     }
 
-    for (i = 0; i < aux_info.groups; ++i) {
-        SLOGI("Encrypting group %d", i);
+    worker->count = 0;
 
-        u32 first_block = aux_info.first_data_block + i * info.blocks_per_group;
-        u32 block_count = std::min(info.blocks_per_group,
-                             (u32)(aux_info.len_blocks - first_block));
+    /* Walk runs of used blocks, splitting each on BLOCKS_AT_A_TIME aligned
+     * boundaries so writes stay aligned, and account progress once per run.
+     */
+    block = 0;
+    if (!(aux_info.bg_desc[i].bg_flags & EXT4_BG_BLOCK_UNINIT)) {
+        u32 run_start, run_end;
+        while (find_used_run(block_bitmap, block, block_count, &run_start, &run_end)) {
+            for (u32 b = run_start; b < run_end;) {
+                u32 abs_block = first_block + b;
+                u32 n = std::min(run_end - b,
+                                 (u32)(BLOCKS_AT_A_TIME - abs_block % BLOCKS_AT_A_TIME));
+                worker->offset = (off64_t)info.block_size * abs_block;
+                worker->count = n;
+                if (flush_outstanding_data(data, worker)) {
+                    return -1;
+                }
+                b += n;
+            }
 
-        off64_t offset = (u64)info.block_size
-                         * aux_info.bg_desc[i].bg_block_bitmap;
+            data->progress->add(run_end - run_start);
+            log_progress(worker, (off64_t)info.block_size * (first_block + run_start),
+                         run_end - run_start, false);
+            block = run_end;
 
-        ret = pread64(data->realfd, block_bitmap, info.block_size, offset);
-        if (ret != (int)info.block_size) {
-            SLOGE("failed to read all of block group bitmap %d", i);
-            goto errout;
+            if (!is_battery_ok_to_continue()) {
+                SLOGE("Stopping encryption due to low battery");
+                std::lock_guard<std::mutex> lock(*data->lock);
+                data->stop = true;
+                return 0;
+            }
         }
+    }
+    if (flush_outstanding_data(data, worker)) {
+        return -1;
+    }
+    if (worker->copier->drain()) {
+        return -1;
+    }
 
-        offset = (u64)info.block_size * first_block;
+    std::lock_guard<std::mutex> lock(*data->lock);
 
-        data->count = 0;
+    /* Advance the watermark over every group that is now fully written, so
+     * last_written_sector only ever covers a contiguous encrypted prefix.
+     */
+    (*data->group_done)[i] = true;
+    while (data->committed_groups < aux_info.groups
+           && (*data->group_done)[data->committed_groups]) {
+        data->committed_groups++;
+    }
+    if (data->committed_groups > 0) {
+        u32 g = data->committed_groups - 1;
+        u64 end_block = std::min((u64)aux_info.first_data_block + (u64)(g + 1) * info.blocks_per_group,
+                                 (u64)aux_info.len_blocks);
+        data->last_written_sector = end_block * info.block_size / CRYPT_SECTOR_SIZE - 1;
+    }
+    return 0;
+}
 
-        for (block = 0; block < block_count; block++) {
-            int used = (aux_info.bg_desc[i].bg_flags & EXT4_BG_BLOCK_UNINIT) ?
-                    0 : bitmap_get_bit(block_bitmap, block);
-            update_progress(data, used);
-            if (used) {
-                if (data->count == 0) {
-                    data->offset = offset;
-                }
-                data->count++;
-            } else {
-                if (flush_outstanding_data(data)) {
-                    goto errout;
-                }
-            }
+static void encrypt_groups_worker(struct encryptGroupsData* data, int realfd, int cryptofd)
+{
+    struct encryptGroupsWorker worker;
+    memset(&worker, 0, sizeof(worker));
+    worker.realfd = realfd;
+    worker.cryptofd = cryptofd;
+    worker.log_offset = -1;
 
-            offset += info.block_size;
+    InplaceCopier copier(realfd, cryptofd, data->real_blkdev, data->crypto_blkdev,
+                         info.block_size * BLOCKS_AT_A_TIME, get_inflight_buffers());
+    worker.copier = &copier;
 
-            /* Write data if we are aligned or buffer size reached */
-            if (offset % (info.block_size * BLOCKS_AT_A_TIME) == 0
-                || data->count == BLOCKS_AT_A_TIME) {
-                if (flush_outstanding_data(data)) {
-                    goto errout;
-                }
-            }
+    u8* block_bitmap = (u8*) malloc(info.block_size);
+    if (!block_bitmap) {
+        SLOGE("failed to allocate block bitmap");
+    }
 
-            if (!is_battery_ok_to_continue()) {
-                SLOGE("Stopping encryption due to low battery");
-                rc = 0;
-                goto errout;
+    bool ok = block_bitmap && copier.start();
+    while (ok) {
+        u32 i;
+        {
+            std::lock_guard<std::mutex> lock(*data->lock);
+            if (data->stop || data->failed || data->next_group >= aux_info.groups) {
+                break;
             }
+            i = data->next_group++;
+        }
+        ok = encrypt_group(data, &worker, i, block_bitmap) == 0;
+    }
+    copier.finish();
+    log_progress(&worker, 0, 0, true);
+
+    if (!ok) {
+        std::lock_guard<std::mutex> lock(*data->lock);
+        data->failed = true;
+    }
+    free(block_bitmap);
+}
 
+static int encrypt_groups(struct encryptGroupsData* data)
+{
+    int workers = std::min((u32)get_group_workers(), aux_info.groups);
+    std::mutex lock;
+    std::vector<bool> group_done(aux_info.groups, false);
+    std::vector<std::thread> threads;
+    std::vector<int> fds;
+
+    data->lock = &lock;
+    data->group_done = &group_done;
+    data->next_group = 0;
+    data->committed_groups = 0;
+    data->stop = false;
+    data->failed = false;
+
+    if (workers <= 1) {
+        encrypt_groups_worker(data, data->realfd, data->cryptofd);
+    } else {
+        SLOGI("Encrypting %d groups with %d workers", aux_info.groups, workers);
+        for (int w = 0; w < workers; w++) {
+            int realfd = open(data->real_blkdev, O_RDONLY|O_CLOEXEC);
+            int cryptofd = open(data->crypto_blkdev, O_WRONLY|O_CLOEXEC);
+            if (realfd < 0 || cryptofd < 0) {
+                SLOGE("Error opening devices for encryption worker %d", w);
+                if (realfd >= 0) close(realfd);
+                if (cryptofd >= 0) close(cryptofd);
+                std::lock_guard<std::mutex> guard(lock);
+                data->failed = true;
+                break;
+            }
+            fds.push_back(realfd);
+            fds.push_back(cryptofd);
+            threads.emplace_back(&encrypt_groups_worker, data, realfd, cryptofd);
         }
-        if (flush_outstanding_data(data)) {
-            goto errout;
+        for (auto& t : threads) {
+            t.join();
+        }
+        for (int fd : fds) {
+            close(fd);
         }
     }
 
-    data->completed = 1;
-    rc = 0;
+    data->lock = nullptr;
+    data->group_done = nullptr;
 
-errout:
-    log_progress(0, true);
-    free(data->buffer);
-    free(block_bitmap);
-    return rc;
+    if (data->failed) {
+        return -1;
+    }
+    if (!data->stop) {
+        data->completed = 1;
+    }
+    return 0;
 }
 
 static int cryptfs_enable_inplace_ext4(char *crypto_blkdev,
@@ -279,7 +525,6 @@ static int cryptfs_enable_inplace_ext4(char *crypto_blkdev,
     struct encryptGroupsData data;
     int rc; // Can't initialize without causing warning -Wclobbered
     int retries = RETRY_MOUNT_ATTEMPTS;
-    struct timespec time_started = {0};
 
     if (previously_encrypted_upto > *size_already_done) {
         SLOGD("Not fast encrypting since resuming part way through");
@@ -334,17 +579,14 @@ static int cryptfs_enable_inplace_ext4(char *crypto_blkdev,
       data.tot_used_blocks -= aux_info.bg_desc[i].bg_free_blocks_count;
     }
 
-    data.one_pct = data.tot_used_blocks / 100;
-    data.cur_pct = 0;
-
-    if (clock_gettime(CLOCK_MONOTONIC, &time_started)) {
-        SLOGW("Error getting time at start");
-        // Note - continue anyway - we'll run with 0
+    {
+        EncryptProgress progress(data.tot_used_blocks);
+        data.progress = &progress;
+        progress.start(0);
+        rc = encrypt_groups(&data);
+        progress.stop();
+        data.progress = nullptr;
     }
-    data.time_started = time_started.tv_sec;
-    data.remaining_time = -1;
-
-    rc = encrypt_groups(&data);
     if (rc) {
         SLOGE("Error encrypting groups");
         goto errout;
@@ -360,7 +602,7 @@ errout:
     return rc;
 }
 
-static void log_progress_f2fs(u64 block, bool completed)
+static void log_progress_f2fs(u64 block, u64 count, bool completed)
 {
     // Precondition - if completed data = 0 else data != 0
 
@@ -380,31 +622,78 @@ static void log_progress_f2fs(u64 block, bool completed)
 
     // Update offset
     if (!completed) {
-        last_block = block;
+        last_block = block + count - 1;
     }
 }
 
-static int encrypt_one_block_f2fs(u64 pos, void *data)
+/* Longest run of f2fs blocks queued as a single I/O */
+#define F2FS_BLOCKS_PER_RUN 256
+
+/* Queues the pending run of used f2fs blocks to the copier */
+static int flush_f2fs_run(struct encryptGroupsData* data)
 {
-    struct encryptGroupsData *priv_dat = (struct encryptGroupsData *)data;
+    if (data->count == 0) {
+        return 0;
+    }
+
+    u64 first = data->offset / CRYPT_INPLACE_BUFSIZE;
+    if (data->copier->submit(data->offset, (size_t)data->count * CRYPT_INPLACE_BUFSIZE)) {
+        SLOGE("Error encrypting f2fs blocks %" PRId64 "+%d", first, data->count);
+        return -1;
+    }
 
-    priv_dat->blocks_already_done = pos - 1;
-    update_progress(priv_dat, 1);
+    data->blocks_already_done = first + data->count - 1;
+    data->progress->add(data->count);
+    log_progress_f2fs(first, data->count, false);
 
+    data->count = 0;
+
+    if (!is_battery_ok_to_continue()) {
+        SLOGE("Stopping encryption due to low battery");
+        data->stop = true;
+        return 1;
+    }
+    return 0;
+}
+
+/* run_on_used_blocks() callback; only extends the current run of used
+ * blocks, which is handed to the pipelined copier as one I/O when it breaks
+ * or reaches F2FS_BLOCKS_PER_RUN.
+ */
+static int encrypt_one_block_f2fs(u64 pos, void *data)
+{
+    struct encryptGroupsData *priv_dat = (struct encryptGroupsData *)data;
     off64_t offset = pos * CRYPT_INPLACE_BUFSIZE;
 
-    if (pread64(priv_dat->realfd, priv_dat->buffer, CRYPT_INPLACE_BUFSIZE, offset) <= 0) {
-        SLOGE("Error reading real_blkdev %s for f2fs inplace encrypt", priv_dat->crypto_blkdev);
-        return -1;
+    if (priv_dat->count > 0
+            && (offset != priv_dat->offset + (off64_t)priv_dat->count * CRYPT_INPLACE_BUFSIZE
+                || priv_dat->count == F2FS_BLOCKS_PER_RUN)) {
+        if (flush_f2fs_run(priv_dat)) {
+            return -1;
+        }
     }
 
-    if (pwrite64(priv_dat->cryptofd, priv_dat->buffer, CRYPT_INPLACE_BUFSIZE, offset) <= 0) {
-        SLOGE("Error writing crypto_blkdev %s for f2fs inplace encrypt", priv_dat->crypto_blkdev);
-        return -1;
-    } else {
-        log_progress_f2fs(pos, false);
+    if (priv_dat->count == 0) {
+        priv_dat->offset = offset;
     }
+    priv_dat->count++;
+    return 0;
+}
 
+struct countUsedBlocksData
+{
+    u64 end;
+    u64 count;
+};
+
+/* run_on_used_blocks() callback counting the used blocks before |end| */
+static int count_used_block_f2fs(u64 pos, void *data)
+{
+    struct countUsedBlocksData *priv_dat = (struct countUsedBlocksData *)data;
+    if (pos >= priv_dat->end) {
+        return 1;
+    }
+    priv_dat->count++;
     return 0;
 }
 
@@ -417,11 +706,11 @@ static int cryptfs_enable_inplace_f2fs(char *crypto_blkdev,
 {
     struct encryptGroupsData data;
     struct f2fs_info *f2fs_info = NULL;
+    EncryptProgress* progress = nullptr;
     int rc = ENABLE_INPLACE_ERR_OTHER;
-    if (previously_encrypted_upto > *size_already_done) {
-        SLOGD("Not fast encrypting since resuming part way through");
-        return ENABLE_INPLACE_ERR_OTHER;
-    }
+    u64 start_block = 0;
+    u64 used_blocks_done = 0;
+    bool resuming = previously_encrypted_upto > *size_already_done;
     memset(&data, 0, sizeof(data));
     data.real_blkdev = real_blkdev;
     data.crypto_blkdev = crypto_blkdev;
@@ -439,31 +728,77 @@ static int cryptfs_enable_inplace_f2fs(char *crypto_blkdev,
         goto errout;
     }
 
-    f2fs_info = generate_f2fs_info(data.realfd);
+    if (!resuming) {
+        f2fs_info = generate_f2fs_info(data.realfd);
+    } else {
+        /* Everything up to the watermark went out in whole blocks, so resume
+         * at the first block past it. The metadata was walked first and is
+         * encrypted by now, so it has to be read back through dm-crypt.
+         */
+        start_block = (previously_encrypted_upto + 1 - *size_already_done)
+                      / CRYPT_SECTORS_PER_BUFSIZE;
+        int metafd = open64(crypto_blkdev, O_RDONLY|O_CLOEXEC);
+        if (metafd < 0) {
+            SLOGE("Error opening crypto_blkdev %s to resume f2fs inplace encrypt. err=%d(%s)\n",
+                  crypto_blkdev, errno, strerror(errno));
+            rc = ENABLE_INPLACE_ERR_DEV;
+            goto errout;
+        }
+        f2fs_info = generate_f2fs_info(metafd);
+        close(metafd);
+        if (f2fs_info && f2fs_info->main_blkaddr > start_block) {
+            SLOGD("Not fast encrypting since f2fs metadata is only partly encrypted");
+            goto errout;
+        }
+        if (f2fs_info) {
+            SLOGI("Resuming f2fs inplace encryption at block %" PRIu64, start_block);
+        }
+    }
     if (!f2fs_info)
       goto errout;
 
     data.numblocks = size / CRYPT_SECTORS_PER_BUFSIZE;
     data.tot_numblocks = tot_size / CRYPT_SECTORS_PER_BUFSIZE;
     data.blocks_already_done = *size_already_done / CRYPT_SECTORS_PER_BUFSIZE;
+    if (!resuming) {
+        start_block = data.blocks_already_done;
+    }
 
     data.tot_used_blocks = get_num_blocks_used(f2fs_info);
+    if (resuming) {
+        /* Only walks the bitmaps, so this costs no data I/O */
+        struct countUsedBlocksData count = { start_block, 0 };
+        run_on_used_blocks(0, f2fs_info, &count_used_block_f2fs, &count);
+        used_blocks_done = count.count;
+    }
 
-    data.one_pct = data.tot_used_blocks / 100;
-    data.cur_pct = 0;
-    data.time_started = time(NULL);
-    data.remaining_time = -1;
+    progress = new EncryptProgress(data.tot_used_blocks);
+    data.progress = progress;
+    progress->start(used_blocks_done);
 
-    data.buffer = (char*) malloc(f2fs_info->block_size);
-    if (!data.buffer) {
-        SLOGE("Failed to allocate crypto buffer");
+    data.copier = new InplaceCopier(data.realfd, data.cryptofd, real_blkdev, crypto_blkdev,
+                                    (size_t)F2FS_BLOCKS_PER_RUN * CRYPT_INPLACE_BUFSIZE,
+                                    get_inflight_buffers());
+    if (!data.copier->start()) {
         goto errout;
     }
 
     data.count = 0;
 
-    /* Currently, this either runs to completion, or hits a nonrecoverable error */
-    rc = run_on_used_blocks(data.blocks_already_done, f2fs_info, &encrypt_one_block_f2fs, &data);
+    /* Runs to completion, stops on low battery or hits a nonrecoverable error */
+    rc = run_on_used_blocks(start_block, f2fs_info, &encrypt_one_block_f2fs, &data);
+    if (data.stop) {
+        rc = 0;
+    }
+    if (!rc) {
+        rc = flush_f2fs_run(&data);
+        if (data.stop) {
+            rc = 0;
+        }
+    }
+    if (!rc) {
+        rc = data.copier->drain();
+    }
 
     if (rc) {
         SLOGE("Error in running over f2fs blocks");
@@ -471,136 +806,210 @@ static int cryptfs_enable_inplace_f2fs(char *crypto_blkdev,
         goto errout;
     }
 
-    *size_already_done += size;
+    if (data.stop) {
+        /* Writes complete in order, so every used block up to the last
+         * written sector is encrypted; checkpoint that as the watermark.
+         */
+        data.last_written_sector = std::max(data.copier->lastWrittenSector(),
+                (off64_t)(start_block * CRYPT_SECTORS_PER_BUFSIZE) - 1);
+        *size_already_done += std::max(data.last_written_sector, (off64_t)0);
+    } else {
+        *size_already_done += size;
+    }
     rc = 0;
 
 errout:
     if (rc)
         SLOGE("Failed to encrypt f2fs filesystem on %s", real_blkdev);
 
-    log_progress_f2fs(0, true);
+    delete data.copier;
+    delete progress;
+    log_progress_f2fs(0, 0, true);
     free(f2fs_info);
-    free(data.buffer);
     close(data.realfd);
     close(data.cryptofd);
 
     return rc;
 }
 
+/* Bounds for the vold.encrypt_full_bufsize_kb buffer used by the full-device copier */
+#define FULL_COPY_DEFAULT_BUFSIZE (1024 * 1024)
+#define FULL_COPY_MIN_BUFSIZE (1024 * 1024)
+#define FULL_COPY_MAX_BUFSIZE (16 * 1024 * 1024)
+
+static size_t get_full_copy_bufsize()
+{
+    off64_t size = (off64_t) property_get_int32("vold.encrypt_full_bufsize_kb",
+                                                FULL_COPY_DEFAULT_BUFSIZE / 1024) * 1024;
+    size = std::max((off64_t) FULL_COPY_MIN_BUFSIZE, std::min(size, (off64_t) FULL_COPY_MAX_BUFSIZE));
+    return size - size % CRYPT_INPLACE_BUFSIZE;
+}
+
+static void set_direct_io(int fd, bool direct)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) return;
+    flags = direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    if (fcntl(fd, F_SETFL, flags) == -1) {
+        SLOGW("Failed to %s O_DIRECT: %s", direct ? "set" : "clear", strerror(errno));
+    }
+}
+
+/* Opens |path|, asking for O_DIRECT if |*direct| and falling back to buffered
+ * I/O (clearing |*direct|) when the device refuses it.
+ */
+static int open_for_full_copy(const char* path, int flags, bool* direct)
+{
+    if (*direct) {
+        int fd = open(path, flags | O_DIRECT);
+        if (fd >= 0 || errno != EINVAL) return fd;
+        SLOGW("O_DIRECT not supported on %s, using buffered I/O", path);
+        *direct = false;
+    }
+    return open(path, flags);
+}
+
+/* Copies |len| bytes at |offset| from realfd to cryptofd through |buf|,
+ * finishing short reads and writes.
+ */
+static int copy_range(int realfd, int cryptofd, char* buf, off64_t offset, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = TEMP_FAILURE_RETRY(pread64(realfd, buf + done, len - done, offset + done));
+        if (n <= 0) return -1;
+        done += n;
+    }
+    done = 0;
+    while (done < len) {
+        ssize_t n = TEMP_FAILURE_RETRY(pwrite64(cryptofd, buf + done, len - done, offset + done));
+        if (n <= 0) return -2;
+        done += n;
+    }
+    return 0;
+}
+
+/* Copies |count| sectors starting at |sector| in a single read and write;
+ * O_DIRECT is dropped for the duration unless both ends are 4K aligned.
+ */
+static int copy_sectors(int realfd, int cryptofd, char* buf, bool direct,
+                        off64_t sector, off64_t count,
+                        const char* real_blkdev, const char* crypto_blkdev)
+{
+    bool aligned = sector % CRYPT_SECTORS_PER_BUFSIZE == 0
+            && count % CRYPT_SECTORS_PER_BUFSIZE == 0;
+    if (direct && !aligned) {
+        set_direct_io(realfd, false);
+        set_direct_io(cryptofd, false);
+    }
+
+    int rc = copy_range(realfd, cryptofd, buf, sector * CRYPT_SECTOR_SIZE,
+                        count * CRYPT_SECTOR_SIZE);
+    if (rc == -1) {
+        SLOGE("Error reading real_blkdev %s for inplace encrypt", real_blkdev);
+    } else if (rc == -2) {
+        SLOGE("Error writing crypto_blkdev %s for inplace encrypt", crypto_blkdev);
+    } else {
+        SLOGD("Encrypted %" PRId64 " sectors at %" PRId64, count, sector);
+    }
+
+    if (direct && !aligned) {
+        if (fdatasync(cryptofd)) {
+            SLOGW("Failed to sync unaligned sectors to %s", crypto_blkdev);
+        }
+        set_direct_io(realfd, true);
+        set_direct_io(cryptofd, true);
+    }
+    return rc;
+}
+
 static int cryptfs_enable_inplace_full(char *crypto_blkdev, char *real_blkdev,
                                        off64_t size, off64_t *size_already_done,
                                        off64_t tot_size,
                                        off64_t previously_encrypted_upto)
 {
     int realfd, cryptofd;
-    char *buf[CRYPT_INPLACE_BUFSIZE];
+    char *buf = nullptr;
     int rc = ENABLE_INPLACE_ERR_OTHER;
-    off64_t numblocks, i, remainder;
-    off64_t one_pct, cur_pct, new_pct;
-    off64_t blocks_already_done, tot_numblocks;
-
-    if ( (realfd = open(real_blkdev, O_RDONLY|O_CLOEXEC)) < 0) {
+    off64_t i, head, chunk;
+    off64_t blocks_already_done;
+    EncryptProgress progress(tot_size / CRYPT_SECTORS_PER_BUFSIZE);
+    bool direct = property_get_bool("vold.encrypt_direct_io", false);
+    size_t bufsize = get_full_copy_bufsize();
+    off64_t sectors_per_buf = bufsize / CRYPT_SECTOR_SIZE;
+
+    if ( (realfd = open_for_full_copy(real_blkdev, O_RDONLY|O_CLOEXEC, &direct)) < 0) {
         SLOGE("Error opening real_blkdev %s for inplace encrypt\n", real_blkdev);
         return ENABLE_INPLACE_ERR_OTHER;
     }
 
-    if ( (cryptofd = open(crypto_blkdev, O_WRONLY|O_CLOEXEC)) < 0) {
+    if ( (cryptofd = open_for_full_copy(crypto_blkdev, O_WRONLY|O_CLOEXEC, &direct)) < 0) {
         SLOGE("Error opening crypto_blkdev %s for inplace encrypt. err=%d(%s)\n",
               crypto_blkdev, errno, strerror(errno));
         close(realfd);
         return ENABLE_INPLACE_ERR_DEV;
     }
+    if (!direct) {
+        /* Keep both fds consistent if only one of them accepted O_DIRECT */
+        set_direct_io(realfd, false);
+    }
 
-    /* This is pretty much a simple loop of reading 4K, and writing 4K.
-     * The size passed in is the number of 512 byte sectors in the filesystem.
-     * So compute the number of whole 4K blocks we should read/write,
-     * and the remainder.
+    if (posix_memalign((void**) &buf, std::max(getpagesize(), CRYPT_INPLACE_BUFSIZE), bufsize)) {
+        SLOGE("Failed to allocate %zu byte crypto buffer", bufsize);
+        buf = nullptr;
+        goto errout;
+    }
+
+    /* The size passed in is the number of 512 byte sectors in the filesystem.
+     * Copy up to the first 4K boundary in one I/O, then the bulk of the
+     * device in aligned |bufsize| chunks, with any unaligned tail going out
+     * as part of the final chunk.
      */
-    numblocks = size / CRYPT_SECTORS_PER_BUFSIZE;
-    remainder = size % CRYPT_SECTORS_PER_BUFSIZE;
-    tot_numblocks = tot_size / CRYPT_SECTORS_PER_BUFSIZE;
     blocks_already_done = *size_already_done / CRYPT_SECTORS_PER_BUFSIZE;
 
-    SLOGE("Encrypting filesystem in place...");
+    SLOGI("Encrypting filesystem in place with %zu byte buffer%s...", bufsize,
+          direct ? " and O_DIRECT" : "");
 
     i = previously_encrypted_upto + 1 - *size_already_done;
 
-    if (lseek64(realfd, i * CRYPT_SECTOR_SIZE, SEEK_SET) < 0) {
-        SLOGE("Cannot seek to previously encrypted point on %s", real_blkdev);
-        goto errout;
-    }
-
-    if (lseek64(cryptofd, i * CRYPT_SECTOR_SIZE, SEEK_SET) < 0) {
-        SLOGE("Cannot seek to previously encrypted point on %s", crypto_blkdev);
-        goto errout;
-    }
-
-    for (;i < size && i % CRYPT_SECTORS_PER_BUFSIZE != 0; ++i) {
-        if (unix_read(realfd, buf, CRYPT_SECTOR_SIZE) <= 0) {
-            SLOGE("Error reading initial sectors from real_blkdev %s for "
-                  "inplace encrypt\n", crypto_blkdev);
-            goto errout;
-        }
-        if (unix_write(cryptofd, buf, CRYPT_SECTOR_SIZE) <= 0) {
-            SLOGE("Error writing initial sectors to crypto_blkdev %s for "
-                  "inplace encrypt\n", crypto_blkdev);
+    head = std::min(size - i, (CRYPT_SECTORS_PER_BUFSIZE - i % CRYPT_SECTORS_PER_BUFSIZE)
+                              % CRYPT_SECTORS_PER_BUFSIZE);
+    if (head > 0) {
+        if (copy_sectors(realfd, cryptofd, buf, direct, i, head, real_blkdev, crypto_blkdev)) {
             goto errout;
-        } else {
-            SLOGI("Encrypted 1 block at %" PRId64, i);
         }
+        i += head;
     }
 
-    one_pct = tot_numblocks / 100;
-    cur_pct = 0;
-    /* process the majority of the filesystem in blocks */
-    for (i/=CRYPT_SECTORS_PER_BUFSIZE; i<numblocks; i++) {
-        new_pct = (i + blocks_already_done) / one_pct;
-        if (new_pct > cur_pct) {
-            char buf[8];
-
-            cur_pct = new_pct;
-            snprintf(buf, sizeof(buf), "%" PRId64, cur_pct);
-            property_set("vold.encrypt_progress", buf);
-        }
-        if (unix_read(realfd, buf, CRYPT_INPLACE_BUFSIZE) <= 0) {
-            SLOGE("Error reading real_blkdev %s for inplace encrypt", crypto_blkdev);
+    progress.start(i / CRYPT_SECTORS_PER_BUFSIZE + blocks_already_done);
+    for (; i < size; i += chunk) {
+        chunk = std::min(sectors_per_buf, size - i);
+        off64_t aligned = chunk - chunk % CRYPT_SECTORS_PER_BUFSIZE;
+        if (aligned > 0 && copy_sectors(realfd, cryptofd, buf, direct, i, aligned,
+                                        real_blkdev, crypto_blkdev)) {
             goto errout;
         }
-        if (unix_write(cryptofd, buf, CRYPT_INPLACE_BUFSIZE) <= 0) {
-            SLOGE("Error writing crypto_blkdev %s for inplace encrypt", crypto_blkdev);
+        if (aligned < chunk && copy_sectors(realfd, cryptofd, buf, direct, i + aligned,
+                                            chunk - aligned, real_blkdev, crypto_blkdev)) {
             goto errout;
-        } else {
-            SLOGD("Encrypted %d block at %" PRId64,
-                  CRYPT_SECTORS_PER_BUFSIZE,
-                  i * CRYPT_SECTORS_PER_BUFSIZE);
         }
 
-       if (!is_battery_ok_to_continue()) {
+        progress.set((i + chunk) / CRYPT_SECTORS_PER_BUFSIZE + blocks_already_done);
+
+        if (!is_battery_ok_to_continue()) {
             SLOGE("Stopping encryption due to low battery");
-            *size_already_done += (i + 1) * CRYPT_SECTORS_PER_BUFSIZE - 1;
+            *size_already_done += i + chunk - 1;
             rc = 0;
             goto errout;
         }
     }
 
-    /* Do any remaining sectors */
-    for (i=0; i<remainder; i++) {
-        if (unix_read(realfd, buf, CRYPT_SECTOR_SIZE) <= 0) {
-            SLOGE("Error reading final sectors from real_blkdev %s for inplace encrypt", crypto_blkdev);
-            goto errout;
-        }
-        if (unix_write(cryptofd, buf, CRYPT_SECTOR_SIZE) <= 0) {
-            SLOGE("Error writing final sectors to crypto_blkdev %s for inplace encrypt", crypto_blkdev);
-            goto errout;
-        } else {
-            SLOGI("Encrypted 1 block at next location");
-        }
-    }
-
     *size_already_done += size;
     rc = 0;
 
 errout:
+    progress.stop();
+    free(buf);
     close(realfd);
     close(cryptofd);
 
@@ -622,6 +1031,7 @@ int cryptfs_enable_inplace(char *crypto_blkdev, char *real_blkdev,
         *size_already_done += size;
         return 0;
     }
+    android::vold::BackgroundJob job(android::vold::BackgroundJob::Kind::kEncrypt, real_blkdev);
 
     /* TODO: identify filesystem type.
      * As is, cryptfs_enable_inplace_ext4 will fail on an f2fs partition, and
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EncryptProgress.h"
+#include "JobScheduler.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "cutils/properties.h"
+#define LOG_TAG "EncryptProgress"
+#include "cutils/log.h"
+
+namespace android {
+namespace vold {
+
+static const int kDefaultIntervalMs = 500;
+static const int kMinIntervalMs = 50;
+
+/* Weight of the newest sample in the throughput moving average */
+static const double kRateSmoothing = 0.2;
+
+/* Don't publish an estimate until this much is done, it's wild before that */
+static const int kMinPctForEstimate = 5;
+
+EncryptProgress::EncryptProgress(off64_t total) :
+        mTotal(total), mJob(BackgroundJob::current()), mDone(0), mStopping(false), mLastPct(0), mLastDone(0), mRate(0),
+        mRemainingTime(-1) {
+    mInterval = std::chrono::milliseconds(std::max(kMinIntervalMs,
+            property_get_int32("vold.encrypt_progress_interval_ms", kDefaultIntervalMs)));
+}
+
+EncryptProgress::~EncryptProgress() {
+    stop();
+}
+
+void EncryptProgress::start(off64_t done) {
+    set(done);
+    mLastDone = done;
+    mLastTick = std::chrono::steady_clock::now();
+    mStopping = false;
+    mThread = std::thread(&EncryptProgress::run, this);
+}
+
+void EncryptProgress::stop() {
+    if (!mThread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStopping = true;
+    }
+    mCond.notify_all();
+    mThread.join();
+    publish();
+}
+
+void EncryptProgress::run() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (!mStopping) {
+        mCond.wait_for(lock, mInterval);
+        if (mStopping) break;
+        lock.unlock();
+        publish();
+        lock.lock();
+    }
+}
+
+void EncryptProgress::publish() {
+    off64_t done = this->done();
+    if (mJob) mJob->setProgress(done, mTotal);
+    off64_t onePct = std::max(mTotal / 100, (off64_t) 1);
+    off64_t pct = done / onePct;
+
+    if (pct > mLastPct) {
+        char buf[8];
+        mLastPct = pct;
+        snprintf(buf, sizeof(buf), "%" PRId64, pct);
+        property_set("vold.encrypt_progress", buf);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - mLastTick).count();
+    if (elapsed <= 0) return;
+
+    double rate = (done - mLastDone) / elapsed;
+    mRate = (mRate == 0) ? rate : kRateSmoothing * rate + (1 - kRateSmoothing) * mRate;
+    mLastDone = done;
+    mLastTick = now;
+
+    if (pct < kMinPctForEstimate || mRate <= 0) return;
+
+    int remainingTime = (int) (std::max(mTotal - done, (off64_t) 0) / mRate);
+
+    // Change time only if not yet set, lower, or a lot higher for
+    // best user experience
+    if (mRemainingTime == -1
+        || remainingTime < mRemainingTime
+        || remainingTime > mRemainingTime + 60) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "%d", remainingTime);
+        property_set("vold.encrypt_time_remaining", buf);
+        mRemainingTime = remainingTime;
+    }
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_ENCRYPT_PROGRESS_H
+#define ANDROID_VOLD_ENCRYPT_PROGRESS_H
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace android {
+namespace vold {
+
+class BackgroundJob;
+
+/*
+ * Publishes in-place encryption progress to vold.encrypt_progress and
+ * vold.encrypt_time_remaining from a background ticker thread.
+ *
+ * I/O workers only bump an atomic counter through add(), so no syscalls
+ * happen on the data path. The ticker wakes up every
+ * vold.encrypt_progress_interval_ms, publishes the percentage when it
+ * changes and estimates the remaining time from a moving average of the
+ * observed throughput. Progress also goes to the background job in scope
+ * where the tracker was created, if there is one.
+ */
+class EncryptProgress {
+  public:
+    /* |total| is the number of units that make up 100% */
+    explicit EncryptProgress(off64_t total);
+    ~EncryptProgress();
+
+    /* Starts the ticker with |done| units already accounted for */
+    void start(off64_t done);
+    /* Stops the ticker after publishing the final state */
+    void stop();
+
+    void add(off64_t units) { mDone.fetch_add(units, std::memory_order_relaxed); }
+    void set(off64_t units) { mDone.store(units, std::memory_order_relaxed); }
+    off64_t done() const { return mDone.load(std::memory_order_relaxed); }
+
+  private:
+    void run();
+    void publish();
+
+    const off64_t mTotal;
+    BackgroundJob* mJob;
+    std::atomic<off64_t> mDone;
+    std::chrono::milliseconds mInterval;
+
+    std::mutex mLock;
+    std::condition_variable mCond;
+    bool mStopping;
+    std::thread mThread;
+
+    /* Only touched by the ticker */
+    off64_t mLastPct;
+    off64_t mLastDone;
+    std::chrono::steady_clock::time_point mLastTick;
+    double mRate;
+    int mRemainingTime;
+
+    EncryptProgress(const EncryptProgress&) = delete;
+    EncryptProgress& operator=(const EncryptProgress&) = delete;
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
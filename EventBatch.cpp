@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EventBatch.h"
+#include "ResponseCode.h"
+#include "VolumeManager.h"
+
+#include <sysutils/SocketClient.h>
+#include <sysutils/SocketClientCommand.h>
+#include <sysutils/SocketListener.h>
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+namespace {
+
+struct Snapshot {
+    int code;
+    std::string id;
+    /* Event and latest value, in the order first raised */
+    std::vector<std::pair<int, std::string>> events;
+};
+
+struct Batch {
+    int depth;
+    std::vector<Snapshot> snapshots;
+};
+
+typedef std::function<void(SocketClient*, bool batched)> ClientFn;
+
+std::mutex sLock;
+/* Each holds a reference, so a new client can't turn up at a closed one's address */
+std::set<SocketClient*> sBatched;
+thread_local Batch tBatch;
+
+class ClientCommand : public SocketClientCommand {
+public:
+    explicit ClientCommand(const ClientFn& fn) : mFn(fn) {}
+
+    void runSocketCommand(SocketClient* client) override {
+        mSeen.insert(client);
+        mFn(client, sBatched.count(client) != 0);
+    }
+
+    bool seen(SocketClient* client) const { return mSeen.count(client) != 0; }
+
+private:
+    const ClientFn& mFn;
+    std::set<SocketClient*> mSeen;
+};
+
+}  // namespace
+
+/* Must be called with sLock held */
+static void forEachClient(const ClientFn& fn) {
+    ClientCommand command(fn);
+    VolumeManager::Instance()->getBroadcaster()->runOnEachSocket(&command);
+    // Batched clients the listener no longer has have disconnected
+    for (auto it = sBatched.begin(); it != sBatched.end();) {
+        if (command.seen(*it)) {
+            ++it;
+        } else {
+            (*it)->decRef();
+            it = sBatched.erase(it);
+        }
+    }
+}
+
+static void putU16(std::string& out, uint16_t v) {
+    out.push_back(v >> 8);
+    out.push_back(v & 0xff);
+}
+
+static void putU32(std::string& out, uint32_t v) {
+    putU16(out, v >> 16);
+    putU16(out, v & 0xffff);
+}
+
+static std::string encode(const Snapshot& snapshot) {
+    std::string out;
+    putU16(out, snapshot.id.size());
+    out += snapshot.id;
+    putU16(out, snapshot.events.size());
+    for (const auto& event : snapshot.events) {
+        putU16(out, event.first);
+        putU32(out, event.second.size());
+        out += event.second;
+    }
+    return out;
+}
+
+/* Must be called with sLock held */
+static void sendSnapshots(const std::vector<Snapshot>& snapshots) {
+    std::vector<std::string> encoded;
+    for (const auto& snapshot : snapshots) {
+        encoded.push_back(encode(snapshot));
+    }
+    forEachClient([&](SocketClient* client, bool batched) {
+        if (!batched) return;
+        for (size_t i = 0; i < snapshots.size(); i++) {
+            client->sendBinaryMsg(snapshots[i].code, encoded[i].data(), encoded[i].size());
+        }
+    });
+}
+
+static bool isLifecycleEvent(int event) {
+    return event == ResponseCode::DiskCreated || event == ResponseCode::DiskDestroyed
+            || event == ResponseCode::VolumeCreated || event == ResponseCode::VolumeDestroyed;
+}
+
+static void send(int snapshotCode, const std::string& id, int event, const std::string& msg,
+        const std::string& value) {
+    std::lock_guard<std::mutex> lock(sLock);
+    if (sBatched.empty()) {
+        VolumeManager::Instance()->getBroadcaster()->sendBroadcast(event, msg.c_str(), false);
+        return;
+    }
+    forEachClient([&](SocketClient* client, bool batched) {
+        if (!batched) client->sendMsg(event, msg.c_str(), false);
+    });
+
+    std::vector<Snapshot> single;
+    auto& snapshots = tBatch.depth ? tBatch.snapshots : single;
+    // Only the latest snapshot of |id| takes more events, and a creation or
+    // destruction always starts a new one, so that a batch that destroys
+    // and recreates an id reports both lives, in order
+    auto latest = std::find_if(snapshots.rbegin(), snapshots.rend(), [&](const Snapshot& s) {
+        return s.code == snapshotCode && s.id == id;
+    });
+    if (latest == snapshots.rend() || isLifecycleEvent(event)) {
+        snapshots.push_back(Snapshot{ snapshotCode, id, {} });
+        latest = snapshots.rbegin();
+    }
+    auto& events = latest->events;
+    auto it = std::find_if(events.begin(), events.end(),
+            [&](const std::pair<int, std::string>& e) { return e.first == event; });
+    if (it == events.end()) {
+        events.emplace_back(event, value);
+    } else {
+        it->second = value;
+    }
+
+    if (!tBatch.depth) sendSnapshots(single);
+}
+
+EventBatch::EventBatch() {
+    tBatch.depth++;
+}
+
+EventBatch::~EventBatch() {
+    if (--tBatch.depth || tBatch.snapshots.empty()) return;
+    std::vector<Snapshot> snapshots;
+    std::swap(snapshots, tBatch.snapshots);
+    std::lock_guard<std::mutex> lock(sLock);
+    if (!sBatched.empty()) sendSnapshots(snapshots);
+}
+
+void SendEvent(int snapshotCode, const std::string& id, int event) {
+    send(snapshotCode, id, event, id, "");
+}
+
+void SendEvent(int snapshotCode, const std::string& id, int event, const std::string& value) {
+    send(snapshotCode, id, event, id + " " + value, value);
+}
+
+void SetEventBatching(SocketClient* client, bool batched) {
+    std::lock_guard<std::mutex> lock(sLock);
+    if (batched) {
+        if (sBatched.insert(client).second) client->incRef();
+    } else if (sBatched.erase(client)) {
+        client->decRef();
+    }
+}
+
+}  // namespace vold
+}  // namespace android
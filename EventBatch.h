@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_EVENT_BATCH_H
+#define ANDROID_VOLD_EVENT_BATCH_H
+
+#include "Utils.h"
+
+#include <string>
+
+class SocketClient;
+
+namespace android {
+namespace vold {
+
+/*
+ * Disk and volume events raised on this thread while a batch is in scope
+ * reach batched clients as one snapshot per disk or volume, sent when the
+ * outermost batch ends. Other clients still get one line per event, as
+ * they come.
+ *
+ * A snapshot is a binary message with code DiskSnapshot or VolumeSnapshot,
+ * all integers big-endian:
+ *
+ *   u16 id_len, id, u16 count, then count times: u16 event, u32 len, value
+ *
+ * Each event appears once, with its latest value, in the order it was
+ * first raised. A disk or volume created or destroyed within the batch
+ * starts a new snapshot, so one that's destroyed and created again gets a
+ * snapshot for each life, in order, and events only join the latest.
+ */
+class EventBatch {
+public:
+    EventBatch();
+    ~EventBatch();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(EventBatch);
+};
+
+/* Sends |event| about |id|, as part of a |snapshotCode| snapshot if batched */
+void SendEvent(int snapshotCode, const std::string& id, int event);
+void SendEvent(int snapshotCode, const std::string& id, int event, const std::string& value);
+
+/* Opts |client| in or out of snapshots for the life of its connection */
+void SetEventBatching(SocketClient* client, bool batched);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
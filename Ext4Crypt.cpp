@@ -16,26 +16,39 @@
 
 #include "Ext4Crypt.h"
 
+#include "KdfCache.h"
 #include "KeyStorage.h"
 #include "KeyUtil.h"
+#include "Timings.h"
+#include "TreeRemover.h"
 #include "Utils.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <map>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fts.h>
 #include <unistd.h>
 #include <limits.h>
+#include <linux/fs.h>
 #include <selinux/android.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 
 #include <private/android_filesystem_config.h>
 
@@ -52,7 +65,9 @@
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/properties.h>
 #include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
 
 using android::base::StringPrintf;
 using android::base::WriteStringToFile;
@@ -63,6 +78,10 @@ using android::vold::KeyBuffer;
 static constexpr int FLAG_STORAGE_DE = 1 << 0;
 static constexpr int FLAG_STORAGE_CE = 1 << 1;
 
+// Keymaster round trips dominate key loading, so a few threads are plenty
+static constexpr int DEFAULT_DE_KEY_WORKERS = 4;
+static constexpr int MAX_DE_KEY_WORKERS = 8;
+
 namespace {
 
 const std::string device_key_dir = std::string() + DATA_MNT_POINT + e4crypt_unencrypted_folder;
@@ -83,6 +102,28 @@ std::map<userid_t, std::string> s_ce_key_raw_refs;
 // TODO abolish this map, per b/26948053
 std::map<userid_t, KeyBuffer> s_ce_keys;
 
+// Filesystem id, inode and inode generation; none of them repeat for a new
+// directory, even on a reformatted volume reusing the same device number
+typedef std::tuple<uint64_t, ino_t, uint32_t> PolicyKey;
+
+// Directories already known to carry a policy, with its key reference
+std::map<PolicyKey, std::string> s_verified_policies;
+
+struct EncryptionModes {
+    const char* contents;
+    const char* filenames;
+};
+
+}
+
+// They come from the fstab, so they can't change while we run
+static const EncryptionModes& get_encryption_modes() {
+    static const EncryptionModes modes = [] {
+        EncryptionModes m;
+        cryptfs_get_file_encryption_modes(&m.contents, &m.filenames);
+        return m;
+    }();
+    return modes;
 }
 
 static bool e4crypt_is_emulated() {
@@ -155,11 +196,13 @@ static bool get_ce_key_new_path(const std::string& directory_path,
 // No point in acting on errors in this; ignore them.
 static void fixate_user_ce_key(const std::string& directory_path, const std::string &to_fix,
                                const std::vector<std::string>& paths) {
+    std::vector<std::string> others;
     for (auto const other_path: paths) {
         if (other_path != to_fix) {
-            android::vold::destroyKey(other_path);
+            others.push_back(other_path);
         }
     }
+    android::vold::destroyKeys(others);
     auto const current_path = get_ce_key_current_path(directory_path);
     if (to_fix != current_path) {
         LOG(DEBUG) << "Renaming " << to_fix << " to " << current_path;
@@ -208,15 +251,46 @@ static bool prepare_dir(const std::string& dir, mode_t mode, uid_t uid, gid_t gi
     return true;
 }
 
-static bool destroy_dir(const std::string& dir) {
-    LOG(DEBUG) << "Destroying: " << dir;
-    if (rmdir(dir.c_str()) != 0 && errno != ENOENT) {
-        PLOG(ERROR) << "Failed to destroy " << dir;
+// False if the filesystem can't say which generation the inode is in, and
+// the directory's policy then has to be checked every time
+static bool get_policy_key(const std::string& path, PolicyKey* key) {
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(),
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)));
+    if (fd == -1) return false;
+    struct stat sb;
+    struct statfs sfs;
+    int generation;
+    if (fstat(fd, &sb) != 0 || fstatfs(fd, &sfs) != 0
+            || ioctl(fd, FS_IOC_GETVERSION, &generation) != 0) {
         return false;
     }
+    uint64_t fsid;
+    static_assert(sizeof(fsid) == sizeof(sfs.f_fsid), "unexpected fsid size");
+    memcpy(&fsid, &sfs.f_fsid, sizeof(fsid));
+    *key = std::make_tuple(fsid, sb.st_ino, static_cast<uint32_t>(generation));
     return true;
 }
 
+static bool destroy_dir(const std::string& dir) {
+    LOG(DEBUG) << "Destroying: " << dir;
+    PolicyKey key;
+    if (get_policy_key(dir, &key)) {
+        s_verified_policies.erase(key);
+    }
+    if (rmdir(dir.c_str()) == 0 || errno == ENOENT) {
+        return true;
+    }
+    if (errno == ENOTEMPTY || errno == EEXIST) {
+        // Anything left behind belongs to a user that is going away
+        LOG(INFO) << "Removing remaining contents of " << dir;
+        if (android::vold::TreeRemover(dir, 0).run(nullptr) == android::OK) {
+            return true;
+        }
+    }
+    PLOG(ERROR) << "Failed to destroy " << dir;
+    return false;
+}
+
 // NB this assumes that there is only one thread listening for crypt commands, because
 // it creates keys in a fixed location.
 static bool create_and_install_user_keys(userid_t user_id, bool create_ephemeral) {
@@ -262,17 +336,120 @@ static bool lookup_key_ref(const std::map<userid_t, std::string>& key_map, useri
 }
 
 static bool ensure_policy(const std::string& raw_ref, const std::string& path) {
-    const char *contents_mode;
-    const char *filenames_mode;
-
-    cryptfs_get_file_encryption_modes(&contents_mode, &filenames_mode);
+    // Cheaper than reading back and comparing the policy
+    PolicyKey key;
+    bool have_key = get_policy_key(path, &key);
+    if (have_key) {
+        auto it = s_verified_policies.find(key);
+        if (it != s_verified_policies.end() && it->second == raw_ref) {
+            return true;
+        }
+    }
 
+    const auto& modes = get_encryption_modes();
     if (e4crypt_policy_ensure(path.c_str(),
                               raw_ref.data(), raw_ref.size(),
-                              contents_mode, filenames_mode) != 0) {
+                              modes.contents, modes.filenames) != 0) {
         LOG(ERROR) << "Failed to set policy on: " << path;
         return false;
     }
+    if (have_key) {
+        s_verified_policies[key] = raw_ref;
+    }
+    return true;
+}
+
+namespace {
+
+struct PrepareDir {
+    std::string path;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    /* Relabel the whole tree once its key is in place */
+    bool restorecon;
+};
+
+}  // namespace
+
+/* Set once a directory's policy and labels are known good for a build and key */
+static const char* kPreparedXattr = "trusted.vold.prepared";
+
+static std::string prepared_marker(const std::string& raw_ref) {
+    // File contexts can only change with the build, and the policy with the key
+    std::string hex;
+    android::vold::StrToHex(raw_ref, hex);
+    return android::base::GetProperty("ro.build.fingerprint", "") + " " + hex;
+}
+
+static bool is_prepared(int fd, const std::string& marker) {
+    std::string value(marker.size() + 1, '\0');
+    ssize_t len = fgetxattr(fd, kPreparedXattr, &value[0], value.size());
+    return len == static_cast<ssize_t>(marker.size()) && value.compare(0, len, marker) == 0;
+}
+
+/*
+ * Like prepare_dir() and ensure_policy() in turn on each of |dirs|, but
+ * with each parent opened once and everything else done through fds.
+ * With |raw_ref| set, the policy and any restorecon are skipped for
+ * directories already marked as prepared for this build and key.
+ */
+static bool prepare_dirs(const std::vector<PrepareDir>& dirs, const std::string& raw_ref) {
+    std::map<std::string, android::base::unique_fd> parents;
+    std::vector<android::base::unique_fd> fds;
+    for (const auto& dir : dirs) {
+        LOG(DEBUG) << "Preparing: " << dir.path;
+        auto slash = dir.path.rfind('/');
+        auto parent_path = dir.path.substr(0, slash);
+        auto name = dir.path.substr(slash + 1);
+        auto& parent = parents[parent_path];
+        if (parent == -1) {
+            parent.reset(TEMP_FAILURE_RETRY(open(parent_path.c_str(),
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+        }
+        if (parent == -1) {
+            PLOG(ERROR) << "Failed to open parent of " << dir.path;
+            return false;
+        }
+        if (mkdirat(parent, name.c_str(), dir.mode) != 0 && errno != EEXIST) {
+            PLOG(ERROR) << "Failed to prepare " << dir.path;
+            return false;
+        }
+        android::base::unique_fd fd(TEMP_FAILURE_RETRY(openat(parent, name.c_str(),
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)));
+        struct stat sb;
+        if (fd == -1 || fstat(fd, &sb) != 0) {
+            PLOG(ERROR) << "Failed to prepare " << dir.path;
+            return false;
+        }
+        // Owner first, since chown can clear mode bits
+        if ((sb.st_uid != dir.uid || sb.st_gid != dir.gid) && fchown(fd, dir.uid, dir.gid) != 0) {
+            PLOG(ERROR) << "Failed to chown " << dir.path;
+            return false;
+        }
+        if ((sb.st_mode & 07777) != dir.mode && fchmod(fd, dir.mode) != 0) {
+            PLOG(ERROR) << "Failed to chmod " << dir.path;
+            return false;
+        }
+        fds.push_back(std::move(fd));
+    }
+    if (raw_ref.empty()) return true;
+
+    bool use_markers = android::base::GetBoolProperty("vold.prepared_markers", true);
+    auto marker = prepared_marker(raw_ref);
+    for (size_t i = 0; i < dirs.size(); i++) {
+        if (use_markers && is_prepared(fds[i], marker)) {
+            LOG(DEBUG) << "Already prepared: " << dirs[i].path;
+            continue;
+        }
+        if (!ensure_policy(raw_ref, dirs[i].path)) return false;
+        if (dirs[i].restorecon) {
+            android::vold::RestoreconRecursive(dirs[i].path);
+        }
+        if (fsetxattr(fds[i], kPreparedXattr, marker.data(), marker.size(), 0) != 0) {
+            PLOG(VERBOSE) << "Failed to mark " << dirs[i].path << " as prepared";
+        }
+    }
     return true;
 }
 
@@ -283,13 +460,41 @@ static bool is_numeric(const char* name) {
     return true;
 }
 
+struct DeKeyLoad {
+    userid_t user_id;
+    std::string raw_ref;
+    bool ok;
+};
+
+static int get_key_workers(const char* prop) {
+    int workers = property_get_int32(prop, DEFAULT_DE_KEY_WORKERS);
+    return std::max(1, std::min(workers, MAX_DE_KEY_WORKERS));
+}
+
+// Each load is independent file I/O and keymaster work, so they're spread
+// over a few threads; the keymaster HAL keeps their operations apart.
+static void load_de_keys_worker(const std::string& de_dir, std::vector<DeKeyLoad>* loads,
+                                std::atomic<size_t>* next) {
+    size_t i;
+    while ((i = (*next)++) < loads->size()) {
+        auto& load = (*loads)[i];
+        auto key_path = de_dir + "/" + std::to_string(load.user_id);
+        KeyBuffer key;
+        load.ok = android::vold::retrieveKey(key_path, kEmptyAuthentication, &key) &&
+                  android::vold::installKey(key, &load.raw_ref);
+        if (load.ok) LOG(DEBUG) << "Installed de key for user " << load.user_id;
+    }
+}
+
 static bool load_all_de_keys() {
+    android::vold::Timing timing("load_all_de_keys");
     auto de_dir = user_key_dir + "/de";
     auto dirp = std::unique_ptr<DIR, int (*)(DIR*)>(opendir(de_dir.c_str()), closedir);
     if (!dirp) {
         PLOG(ERROR) << "Unable to read de key directory";
         return false;
     }
+    std::vector<DeKeyLoad> loads;
     for (;;) {
         errno = 0;
         auto entry = readdir(dirp.get());
@@ -306,18 +511,36 @@ static bool load_all_de_keys() {
         }
         userid_t user_id = atoi(entry->d_name);
         if (s_de_key_raw_refs.count(user_id) == 0) {
-            auto key_path = de_dir + "/" + entry->d_name;
-            KeyBuffer key;
-            if (!android::vold::retrieveKey(key_path, kEmptyAuthentication, &key)) return false;
-            std::string raw_ref;
-            if (!android::vold::installKey(key, &raw_ref)) return false;
-            s_de_key_raw_refs[user_id] = raw_ref;
-            LOG(DEBUG) << "Installed de key for user " << user_id;
+            loads.push_back({user_id, "", false});
+        }
+    }
+
+    std::atomic<size_t> next(0);
+    size_t workers = std::min<size_t>(get_key_workers("vold.de_key_workers"), loads.size());
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; w++) {
+        threads.emplace_back(&load_de_keys_worker, std::cref(de_dir), &loads, &next);
+    }
+    load_de_keys_worker(de_dir, &loads, &next);
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    // Only this thread touches the map, once the workers are done. Keys
+    // that did install are recorded even if others failed, so that they
+    // can still be evicted later.
+    bool success = true;
+    for (const auto& load : loads) {
+        if (load.ok) {
+            s_de_key_raw_refs[load.user_id] = load.raw_ref;
+        } else {
+            LOG(ERROR) << "Failed to load de key for user " << load.user_id;
+            success = false;
         }
     }
     // ext4enc:TODO: go through all DE directories, ensure that all user dirs have the
     // correct policy set on them, and that no rogue ones exist.
-    return true;
+    return success;
 }
 
 bool e4crypt_initialize_global_de() {
@@ -328,10 +551,8 @@ bool e4crypt_initialize_global_de() {
         return true;
     }
 
-    const char *contents_mode;
-    const char *filenames_mode;
-    cryptfs_get_file_encryption_modes(&contents_mode, &filenames_mode);
-    std::string modestring = std::string(contents_mode) + ":" + filenames_mode;
+    const auto& modes = get_encryption_modes();
+    std::string modestring = std::string(modes.contents) + ":" + modes.filenames;
 
     std::string mode_filename = std::string("/data") + e4crypt_key_mode;
     if (!android::base::WriteStringToFile(modestring, mode_filename)) {
@@ -356,6 +577,7 @@ bool e4crypt_initialize_global_de() {
 
 bool e4crypt_init_user0() {
     LOG(DEBUG) << "e4crypt_init_user0";
+    android::vold::Timing timing("e4crypt_init_user0");
     if (e4crypt_is_native()) {
         if (!prepare_dir(user_key_dir, 0700, AID_ROOT, AID_ROOT)) return false;
         if (!prepare_dir(user_key_dir + "/ce", 0700, AID_ROOT, AID_ROOT)) return false;
@@ -411,14 +633,103 @@ static void drop_caches() {
     }
 }
 
+/* CE trees of |user_id| on internal storage and on every adopted volume */
+static std::vector<std::string> get_ce_trees(userid_t user_id) {
+    std::vector<std::string> trees = {
+        android::vold::BuildDataSystemCePath(user_id),
+        android::vold::BuildDataMiscCePath(user_id),
+        android::vold::BuildDataMediaCePath(nullptr, user_id),
+        android::vold::BuildDataUserCePath(nullptr, user_id),
+    };
+    auto dir = std::unique_ptr<DIR, int (*)(DIR*)>(opendir("/mnt/expand"), closedir);
+    if (dir) {
+        struct dirent* de;
+        while ((de = readdir(dir.get())) != nullptr) {
+            if (de->d_name[0] == '.' || de->d_type != DT_DIR) continue;
+            trees.push_back(android::vold::BuildDataMediaCePath(de->d_name, user_id));
+            trees.push_back(android::vold::BuildDataUserCePath(de->d_name, user_id));
+        }
+    }
+    return trees;
+}
+
+/*
+ * Drops the page cache of only |user_id|'s CE files, after syncing just
+ * the filesystems they live on. Has to run while the key is still there
+ * to open them. Names and inodes can't be dropped per file; see
+ * shrink_inode_caches().
+ */
+static void evict_ce_caches(userid_t user_id) {
+    android::vold::Timing timing("evict_ce_caches");
+    auto start = std::chrono::steady_clock::now();
+
+    auto trees = get_ce_trees(user_id);
+    std::set<dev_t> synced;
+    std::vector<char*> argv;
+    for (const auto& tree : trees) {
+        android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(tree.c_str(),
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+        struct stat sb;
+        if (fd == -1 || fstat(fd, &sb) != 0) continue;
+        if (synced.insert(sb.st_dev).second && syncfs(fd) != 0) {
+            PLOG(WARNING) << "Failed to sync filesystem of " << tree;
+        }
+        argv.push_back(const_cast<char*>(tree.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    size_t files = 0;
+    FTS* fts = argv.size() > 1
+            ? fts_open(argv.data(), FTS_PHYSICAL | FTS_NOCHDIR | FTS_XDEV, nullptr) : nullptr;
+    if (fts != nullptr) {
+        FTSENT* p;
+        while ((p = fts_read(fts)) != nullptr) {
+            if (p->fts_info != FTS_F) continue;
+            android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(p->fts_accpath,
+                    O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
+            if (fd == -1) continue;
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            files++;
+        }
+        fts_close(fts);
+    }
+
+    LOG(INFO) << "Evicted caches of " << files << " CE files of user " << user_id << " in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count() << "ms";
+}
+
+/*
+ * Shrinks the dentry and inode caches as a whole, which is cheap next to
+ * refilling every user's page cache. Has to run once the key is gone, so
+ * that no per-file key or plaintext name outlives it. Evicted inodes take
+ * their pages along, which covers whatever was read after the fadvise pass.
+ */
+static void shrink_inode_caches() {
+    android::vold::Timing timing("shrink_inode_caches");
+    if (!WriteStringToFile("2", "/proc/sys/vm/drop_caches")) {
+        PLOG(ERROR) << "Failed to drop dentry and inode caches during key eviction";
+    }
+}
+
 static bool evict_ce_key(userid_t user_id) {
     s_ce_keys.erase(user_id);
     bool success = true;
     std::string raw_ref;
     // If we haven't loaded the CE key, no need to evict it.
     if (lookup_key_ref(s_ce_key_raw_refs, user_id, &raw_ref)) {
+        // "global" syncs everything and drops every user's caches
+        bool targeted = android::base::GetProperty("vold.ce_evict_mode", "global") == "targeted";
+        if (targeted) {
+            evict_ce_caches(user_id);
+        }
         success &= android::vold::evictKey(raw_ref);
-        drop_caches();
+        if (targeted) {
+            shrink_inode_caches();
+        } else {
+            android::vold::Timing timing("drop_caches");
+            drop_caches();
+        }
     }
     s_ce_key_raw_refs.erase(user_id);
     return success;
@@ -439,15 +750,15 @@ bool e4crypt_destroy_user_key(userid_t user_id) {
     if (it != s_ephemeral_users.end()) {
         s_ephemeral_users.erase(it);
     } else {
-        for (auto const path: get_ce_key_paths(get_ce_key_directory_path(user_id))) {
-            success &= android::vold::destroyKey(path);
-        }
+        // Destroy every key together, so their files are discarded in one batch
+        auto paths = get_ce_key_paths(get_ce_key_directory_path(user_id));
         auto de_key_path = get_de_key_path(user_id);
         if (android::vold::pathExists(de_key_path)) {
-            success &= android::vold::destroyKey(de_key_path);
+            paths.push_back(de_key_path);
         } else {
             LOG(INFO) << "Not present so not erasing: " << de_key_path;
         }
+        success &= android::vold::destroyKeys(paths);
     }
     return success;
 }
@@ -566,9 +877,84 @@ bool e4crypt_unlock_user_key(userid_t user_id, int serial, const char* token_hex
     return true;
 }
 
+struct CeKeyRead {
+    userid_t user_id;
+    android::vold::KeyAuthentication auth;
+    KeyBuffer key;
+    bool ok;
+};
+
+// Each user's keys live in a directory of their own, so reading and
+// fixating them can go in parallel like DE key loading.
+static void read_ce_keys_worker(std::vector<CeKeyRead>* reads, std::atomic<size_t>* next) {
+    size_t i;
+    while ((i = (*next)++) < reads->size()) {
+        auto& read = (*reads)[i];
+        read.ok = read_and_fixate_user_ce_key(read.user_id, read.auth, &read.key);
+    }
+}
+
+bool e4crypt_unlock_user_keys(const struct e4crypt_user_unlock* unlocks, size_t count) {
+    LOG(DEBUG) << "e4crypt_unlock_user_keys for " << count << " users";
+    bool success = true;
+    if (!e4crypt_is_native()) {
+        // Nothing to read; just the chmods
+        for (size_t i = 0; i < count; i++) {
+            success &= e4crypt_unlock_user_key(unlocks[i].user_id, unlocks[i].serial,
+                    unlocks[i].token, unlocks[i].secret);
+        }
+        return success;
+    }
+    android::vold::Timing timing("e4crypt_unlock_user_keys");
+
+    std::vector<CeKeyRead> reads;
+    std::set<userid_t> seen;
+    for (size_t i = 0; i < count; i++) {
+        auto user_id = unlocks[i].user_id;
+        if (s_ce_key_raw_refs.count(user_id) != 0 || !seen.insert(user_id).second) {
+            LOG(WARNING) << "Tried to unlock already-unlocked key for user " << user_id;
+            continue;
+        }
+        std::string token, secret;
+        if (!parse_hex(unlocks[i].token, &token) || !parse_hex(unlocks[i].secret, &secret)) {
+            success = false;
+            continue;
+        }
+        reads.push_back({user_id, android::vold::KeyAuthentication(token, secret), KeyBuffer(),
+                false});
+    }
+
+    std::atomic<size_t> next(0);
+    size_t workers = std::min<size_t>(get_key_workers("vold.ce_key_workers"), reads.size());
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; w++) {
+        threads.emplace_back(&read_ce_keys_worker, &reads, &next);
+    }
+    read_ce_keys_worker(&reads, &next);
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    // Install on this thread only, in the order the caller gave, so that a
+    // parent is unlocked before its profiles
+    for (auto& read : reads) {
+        std::string ce_raw_ref;
+        if (!read.ok || !android::vold::installKey(read.key, &ce_raw_ref)) {
+            LOG(ERROR) << "Couldn't read key for " << read.user_id;
+            success = false;
+            continue;
+        }
+        s_ce_keys[read.user_id] = std::move(read.key);
+        s_ce_key_raw_refs[read.user_id] = ce_raw_ref;
+        LOG(DEBUG) << "Installed ce key for user " << read.user_id;
+    }
+    return success;
+}
+
 // TODO: rename to 'evict' for consistency
 bool e4crypt_lock_user_key(userid_t user_id) {
     LOG(DEBUG) << "e4crypt_lock_user_key " << user_id;
+    android::vold::ClearKdfCache();
     if (e4crypt_is_native()) {
         return evict_ce_key(user_id);
     } else if (e4crypt_is_emulated()) {
@@ -601,24 +987,24 @@ bool e4crypt_prepare_user_storage(const char* volume_uuid, userid_t user_id, int
         auto misc_de_path = android::vold::BuildDataMiscDePath(user_id);
         auto user_de_path = android::vold::BuildDataUserDePath(volume_uuid, user_id);
 
-        if (!prepare_dir(system_legacy_path, 0700, AID_SYSTEM, AID_SYSTEM)) return false;
+        if (!prepare_dirs({
+                { system_legacy_path, 0700, AID_SYSTEM, AID_SYSTEM, false },
 #if MANAGE_MISC_DIRS
-        if (!prepare_dir(misc_legacy_path, 0750, multiuser_get_uid(user_id, AID_SYSTEM),
-                multiuser_get_uid(user_id, AID_EVERYBODY))) return false;
+                { misc_legacy_path, 0750, multiuser_get_uid(user_id, AID_SYSTEM),
+                        multiuser_get_uid(user_id, AID_EVERYBODY), false },
 #endif
-        if (!prepare_dir(profiles_de_path, 0771, AID_SYSTEM, AID_SYSTEM)) return false;
+                { profiles_de_path, 0771, AID_SYSTEM, AID_SYSTEM, false },
+            }, "")) return false;
 
-        if (!prepare_dir(system_de_path, 0770, AID_SYSTEM, AID_SYSTEM)) return false;
-        if (!prepare_dir(misc_de_path, 01771, AID_SYSTEM, AID_MISC)) return false;
-        if (!prepare_dir(user_de_path, 0771, AID_SYSTEM, AID_SYSTEM)) return false;
-
-        if (e4crypt_is_native()) {
-            std::string de_raw_ref;
-            if (!lookup_key_ref(s_de_key_raw_refs, user_id, &de_raw_ref)) return false;
-            if (!ensure_policy(de_raw_ref, system_de_path)) return false;
-            if (!ensure_policy(de_raw_ref, misc_de_path)) return false;
-            if (!ensure_policy(de_raw_ref, user_de_path)) return false;
+        std::string de_raw_ref;
+        if (e4crypt_is_native() && !lookup_key_ref(s_de_key_raw_refs, user_id, &de_raw_ref)) {
+            return false;
         }
+        if (!prepare_dirs({
+                { system_de_path, 0770, AID_SYSTEM, AID_SYSTEM, false },
+                { misc_de_path, 01771, AID_SYSTEM, AID_MISC, false },
+                { user_de_path, 0771, AID_SYSTEM, AID_SYSTEM, false },
+            }, de_raw_ref)) return false;
     }
 
     if (flags & FLAG_STORAGE_CE) {
@@ -628,25 +1014,19 @@ bool e4crypt_prepare_user_storage(const char* volume_uuid, userid_t user_id, int
         auto media_ce_path = android::vold::BuildDataMediaCePath(volume_uuid, user_id);
         auto user_ce_path = android::vold::BuildDataUserCePath(volume_uuid, user_id);
 
-        if (!prepare_dir(system_ce_path, 0770, AID_SYSTEM, AID_SYSTEM)) return false;
-        if (!prepare_dir(misc_ce_path, 01771, AID_SYSTEM, AID_MISC)) return false;
-        if (!prepare_dir(media_ce_path, 0770, AID_MEDIA_RW, AID_MEDIA_RW)) return false;
-        if (!prepare_dir(user_ce_path, 0771, AID_SYSTEM, AID_SYSTEM)) return false;
-
-        if (e4crypt_is_native()) {
-            std::string ce_raw_ref;
-            if (!lookup_key_ref(s_ce_key_raw_refs, user_id, &ce_raw_ref)) return false;
-            if (!ensure_policy(ce_raw_ref, system_ce_path)) return false;
-            if (!ensure_policy(ce_raw_ref, misc_ce_path)) return false;
-            if (!ensure_policy(ce_raw_ref, media_ce_path)) return false;
-            if (!ensure_policy(ce_raw_ref, user_ce_path)) return false;
-
-            // Now that credentials have been installed, we can run restorecon
-            // over these paths
-            // NOTE: these paths need to be kept in sync with libselinux
-            android::vold::RestoreconRecursive(system_ce_path);
-            android::vold::RestoreconRecursive(misc_ce_path);
+        std::string ce_raw_ref;
+        if (e4crypt_is_native() && !lookup_key_ref(s_ce_key_raw_refs, user_id, &ce_raw_ref)) {
+            return false;
         }
+        // Once credentials have been installed, restorecon can run over
+        // system_ce and misc_ce
+        // NOTE: these paths need to be kept in sync with libselinux
+        if (!prepare_dirs({
+                { system_ce_path, 0770, AID_SYSTEM, AID_SYSTEM, true },
+                { misc_ce_path, 01771, AID_SYSTEM, AID_MISC, true },
+                { media_ce_path, 0770, AID_MEDIA_RW, AID_MEDIA_RW, false },
+                { user_ce_path, 0771, AID_SYSTEM, AID_SYSTEM, false },
+            }, ce_raw_ref)) return false;
     }
 
     return true;
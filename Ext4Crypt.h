@@ -15,6 +15,7 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/cdefs.h>
 
 #include <cutils/multiuser.h>
@@ -33,6 +34,15 @@ bool e4crypt_add_user_key_auth(userid_t user_id, int serial, const char* token,
 bool e4crypt_fixate_newest_user_key_auth(userid_t user_id);
 
 bool e4crypt_unlock_user_key(userid_t user_id, int serial, const char* token, const char* secret);
+
+struct e4crypt_user_unlock {
+    userid_t user_id;
+    int serial;
+    const char* token;
+    const char* secret;
+};
+// Reads several users' CE keys concurrently, then installs them in order
+bool e4crypt_unlock_user_keys(const struct e4crypt_user_unlock* unlocks, size_t count);
 bool e4crypt_lock_user_key(userid_t user_id);
 
 bool e4crypt_prepare_user_storage(const char* volume_uuid, userid_t user_id, int serial, int flags);
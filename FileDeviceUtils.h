@@ -17,6 +17,7 @@
 #ifndef ANDROID_VOLD_FILEDEVICEUTILS_H
 #define ANDROID_VOLD_FILEDEVICEUTILS_H
 
+#include <memory>
 #include <string>
 #include <linux/fiemap.h>
 
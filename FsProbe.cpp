@@ -0,0 +1,511 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FsProbe.h"
+
+#include <android-base/logging.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace android {
+namespace vold {
+
+/* Holds every superblock and boot sector signature we look for */
+static const size_t kHeadSize = 4096;
+/* Most of a directory we'll scan for a volume label */
+static const size_t kMaxDirSize = 32 * 1024;
+/* How long a sandboxed probe may take before we give up on it */
+static const int kSandboxTimeoutMs = 5000;
+
+/*
+ * What a probe found. Fixed-size and plain, since the sandboxed child
+ * can't allocate and hands this back through a pipe.
+ */
+struct ProbeResult {
+    char type[16];
+    char uuid[40];
+    char label[128];
+    /* Set when something matched but we couldn't finish the job */
+    bool uncertain;
+    int matches;
+};
+
+static uint16_t get16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return get16(p) | ((uint32_t) get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t* p) {
+    return get32(p) | ((uint64_t) get32(p + 4) << 32);
+}
+
+static bool isPowerOfTwo(uint32_t n) {
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+static bool readFully(int fd, uint8_t* buf, size_t len, off64_t offset) {
+    while (len > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(pread64(fd, buf, len, offset));
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static void setType(ProbeResult* r, const char* type) {
+    strncpy(r->type, type, sizeof(r->type) - 1);
+    r->matches++;
+}
+
+/* Copies a padded on-disk string, dropping trailing spaces like blkid */
+static void setLabel(ProbeResult* r, const uint8_t* src, size_t len) {
+    size_t n = 0;
+    while (n < len && n < sizeof(r->label) - 1 && src[n] != '\0') {
+        r->label[n] = src[n];
+        n++;
+    }
+    while (n > 0 && r->label[n - 1] == ' ') n--;
+    r->label[n] = '\0';
+}
+
+static void setUtf16Label(ProbeResult* r, const uint8_t* src, size_t units) {
+    size_t n = 0;
+    for (size_t i = 0; i < units; i++) {
+        uint16_t c = get16(src + i * 2);
+        if (c == 0) break;
+        if (n + 4 > sizeof(r->label)) break;
+        if (c < 0x80) {
+            r->label[n++] = c;
+        } else if (c < 0x800) {
+            r->label[n++] = 0xC0 | (c >> 6);
+            r->label[n++] = 0x80 | (c & 0x3F);
+        } else {
+            r->label[n++] = 0xE0 | (c >> 12);
+            r->label[n++] = 0x80 | ((c >> 6) & 0x3F);
+            r->label[n++] = 0x80 | (c & 0x3F);
+        }
+    }
+    while (n > 0 && r->label[n - 1] == ' ') n--;
+    r->label[n] = '\0';
+}
+
+static void appendHex(char*& out, uint8_t b, bool upper) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    *out++ = digits[b >> 4];
+    *out++ = digits[b & 0xF];
+}
+
+/* Formats a 16-byte UUID, or nothing when it's all zeros like blkid */
+static void setUuid16(ProbeResult* r, const uint8_t* uuid) {
+    bool zero = true;
+    for (int i = 0; i < 16; i++) zero &= (uuid[i] == 0);
+    if (zero) return;
+
+    char* out = r->uuid;
+    for (int i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) *out++ = '-';
+        appendHex(out, uuid[i], false);
+    }
+    *out = '\0';
+}
+
+/* FAT and exFAT serials are shown as "ABCD-1234" */
+static void setSerial32(ProbeResult* r, const uint8_t* serial) {
+    char* out = r->uuid;
+    appendHex(out, serial[3], true);
+    appendHex(out, serial[2], true);
+    *out++ = '-';
+    appendHex(out, serial[1], true);
+    appendHex(out, serial[0], true);
+    *out = '\0';
+}
+
+static void probeExt(const uint8_t* head, ProbeResult* r) {
+    const uint8_t* sb = head + 1024;
+    if (get16(sb + 0x38) != 0xEF53) return;
+
+    uint32_t compat = get32(sb + 0x5C);
+    uint32_t incompat = get32(sb + 0x60);
+    uint32_t roCompat = get32(sb + 0x64);
+    uint32_t flags = get32(sb + 0x160);
+    // Leave journal devices and test filesystems to blkid
+    if ((incompat & 0x0008) || (flags & 0x0004)) {
+        r->uncertain = true;
+        return;
+    }
+
+    // Anything beyond what ext3 understands makes it ext4, as in blkid
+    static const uint32_t kExt3Incompat = 0x0002 | 0x0004 | 0x0010;
+    static const uint32_t kExt3RoCompat = 0x0001 | 0x0002 | 0x0004;
+    if ((incompat & ~kExt3Incompat) || (roCompat & ~kExt3RoCompat)) {
+        setType(r, "ext4");
+    } else if (compat & 0x0004) {
+        setType(r, "ext3");
+    } else {
+        setType(r, "ext2");
+    }
+    setUuid16(r, sb + 0x68);
+    setLabel(r, sb + 0x78, 16);
+}
+
+static void probeF2fs(const uint8_t* head, ProbeResult* r) {
+    const uint8_t* sb = head + 1024;
+    if (get32(sb) != 0xF2F52010) return;
+
+    setType(r, "f2fs");
+    setUuid16(r, sb + 108);
+    // 512 UTF-16 units would run past our read, but labels are far shorter
+    setUtf16Label(r, sb + 124, (kHeadSize - 1024 - 124) / 2);
+}
+
+/* Scans 32-byte directory entries of |dir| for a volume label */
+static bool scanFatDir(const uint8_t* dir, size_t len, const uint8_t** label) {
+    for (size_t off = 0; off + 32 <= len; off += 32) {
+        const uint8_t* e = dir + off;
+        if (e[0] == 0x00) return true;
+        if (e[0] == 0xE5 || get16(e + 20) || get16(e + 26)) continue;
+        uint8_t attr = e[11];
+        if ((attr & 0x0F) == 0x0F) continue;
+        if ((attr & (0x08 | 0x10)) == 0x08) {
+            *label = e;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void probeVfat(int fd, const uint8_t* head, ProbeResult* r) {
+    if (head[510] != 0x55 || head[511] != 0xAA) return;
+    if (!memcmp(head + 3, "NTFS    ", 8) || !memcmp(head + 3, "EXFAT   ", 8)) return;
+
+    uint32_t bytesPerSector = get16(head + 11);
+    uint32_t sectorsPerCluster = head[13];
+    uint32_t reserved = get16(head + 14);
+    uint32_t fats = head[16];
+    if (bytesPerSector < 512 || bytesPerSector > 4096 || !isPowerOfTwo(bytesPerSector)
+            || !isPowerOfTwo(sectorsPerCluster) || reserved == 0 || fats == 0 || fats > 2) {
+        return;
+    }
+
+    bool fat32 = (get16(head + 22) == 0);
+    const uint8_t* boot = fat32 ? head + 0x40 : head + 0x24;
+    if (fat32 ? memcmp(head + 0x52, "FAT32   ", 8)
+            : (memcmp(head + 0x36, "FAT1", 4) && memcmp(head + 0x36, "FAT     ", 8))) {
+        return;
+    }
+    setType(r, "vfat");
+    setSerial32(r, boot + 3);
+
+    // A label entry in the root directory wins over the boot sector copy
+    off64_t dirOffset;
+    uint64_t dirSize;
+    if (fat32) {
+        uint32_t rootCluster = get32(head + 0x2C);
+        if (rootCluster < 2) {
+            r->uncertain = true;
+            return;
+        }
+        uint64_t dataStart = (uint64_t) (reserved + fats * get32(head + 0x24)) * bytesPerSector;
+        dirSize = (uint64_t) sectorsPerCluster * bytesPerSector;
+        dirOffset = dataStart + (uint64_t) (rootCluster - 2) * dirSize;
+    } else {
+        dirOffset = (uint64_t) (reserved + fats * get16(head + 22)) * bytesPerSector;
+        dirSize = (uint64_t) get16(head + 17) * 32;
+    }
+
+    uint8_t dir[kMaxDirSize];
+    size_t len = dirSize < kMaxDirSize ? dirSize : kMaxDirSize;
+    if (!readFully(fd, dir, len, dirOffset)) {
+        r->uncertain = true;
+        return;
+    }
+    const uint8_t* label = nullptr;
+    if (!scanFatDir(dir, len, &label) && (fat32 || len < dirSize)) {
+        // Label might be further along the cluster chain
+        r->uncertain = true;
+        return;
+    }
+
+    if (label == nullptr) label = boot + 7;
+    if (memcmp(label, "NO NAME    ", 11)) {
+        setLabel(r, label, 11);
+    }
+}
+
+static void probeExfat(int fd, const uint8_t* head, ProbeResult* r) {
+    if (memcmp(head + 3, "EXFAT   ", 8)) return;
+
+    uint32_t sectorShift = head[108];
+    uint32_t clusterShift = head[109];
+    if (sectorShift < 9 || sectorShift > 12 || sectorShift + clusterShift > 25) return;
+
+    setType(r, "exfat");
+    setSerial32(r, head + 100);
+
+    uint32_t rootCluster = get32(head + 96);
+    if (rootCluster < 2) {
+        r->uncertain = true;
+        return;
+    }
+    uint64_t clusterSize = (uint64_t) 1 << (sectorShift + clusterShift);
+    off64_t dirOffset = ((uint64_t) get32(head + 88) << sectorShift)
+            + (rootCluster - 2) * clusterSize;
+
+    uint8_t dir[kMaxDirSize];
+    size_t len = clusterSize < kMaxDirSize ? clusterSize : kMaxDirSize;
+    if (!readFully(fd, dir, len, dirOffset)) {
+        r->uncertain = true;
+        return;
+    }
+    for (size_t off = 0; off + 32 <= len; off += 32) {
+        const uint8_t* e = dir + off;
+        if (e[0] == 0x00) return;
+        if (e[0] == 0x83) {
+            setUtf16Label(r, e + 2, e[1] < 11 ? e[1] : 11);
+            return;
+        }
+    }
+    r->uncertain = true;
+}
+
+static void probeNtfs(int fd, const uint8_t* head, ProbeResult* r) {
+    if (memcmp(head + 3, "NTFS    ", 8)) return;
+
+    uint32_t bytesPerSector = get16(head + 11);
+    uint32_t sectorsPerCluster = head[13];
+    if (sectorsPerCluster > 0x80) {
+        sectorsPerCluster = 1 << (256 - sectorsPerCluster);
+    }
+    if (bytesPerSector < 256 || bytesPerSector > 4096 || !isPowerOfTwo(bytesPerSector)
+            || !isPowerOfTwo(sectorsPerCluster)) {
+        return;
+    }
+    // Fields that FAT uses must all be zero
+    if (get16(head + 14) || head[16] || get16(head + 17) || get16(head + 19)
+            || get16(head + 22)) {
+        return;
+    }
+
+    setType(r, "ntfs");
+    char* out = r->uuid;
+    uint64_t serial = get64(head + 0x48);
+    for (int i = 7; i >= 0; i--) {
+        appendHex(out, (serial >> (i * 8)) & 0xFF, true);
+    }
+    *out = '\0';
+
+    // The label is the $VOLUME_NAME attribute of $Volume, MFT record 3
+    uint64_t clusterSize = (uint64_t) bytesPerSector * sectorsPerCluster;
+    int8_t perRecord = (int8_t) head[0x40];
+    uint64_t recordSize = perRecord > 0 ? perRecord * clusterSize
+            : (perRecord < -9 && perRecord > -17) ? (uint64_t) 1 << -perRecord : 0;
+    if (recordSize < 256 || recordSize > kMaxDirSize) {
+        r->uncertain = true;
+        return;
+    }
+
+    uint8_t rec[kMaxDirSize];
+    off64_t offset = get64(head + 0x30) * clusterSize + 3 * recordSize;
+    if (!readFully(fd, rec, recordSize, offset) || memcmp(rec, "FILE", 4)) {
+        r->uncertain = true;
+        return;
+    }
+    for (uint64_t off = get16(rec + 0x14); off + 24 <= recordSize;) {
+        const uint8_t* attr = rec + off;
+        uint32_t type = get32(attr);
+        uint32_t len = get32(attr + 4);
+        if (type == 0xFFFFFFFF || len < 24 || off + len > recordSize) break;
+        if (type == 0x60 && attr[8] == 0) {
+            uint32_t valueLen = get32(attr + 0x10);
+            uint32_t valueOff = get16(attr + 0x14);
+            if ((uint64_t) valueOff + valueLen <= len) {
+                setUtf16Label(r, attr + valueOff, valueLen / 2);
+            }
+            break;
+        }
+        off += len;
+    }
+}
+
+/* Only does reads and arithmetic, so it can run inside the sandbox */
+static bool probe(int fd, ProbeResult* r) {
+    uint8_t head[kHeadSize];
+    if (!readFully(fd, head, sizeof(head), 0)) {
+        return false;
+    }
+
+    probeExt(head, r);
+    probeF2fs(head, r);
+    probeVfat(fd, head, r);
+    probeExfat(fd, head, r);
+    probeNtfs(fd, head, r);
+
+    // Conflicting signatures are for blkid to sort out
+    return r->matches == 1 && !r->uncertain;
+}
+
+#if defined(__aarch64__)
+#define PROBE_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#elif defined(__arm__)
+#define PROBE_AUDIT_ARCH AUDIT_ARCH_ARM
+#elif defined(__x86_64__)
+#define PROBE_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define PROBE_AUDIT_ARCH AUDIT_ARCH_I386
+#endif
+
+#define PROBE_ALLOW(nr) \
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 1), \
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+
+/* Limits the calling process to reading, writing and exiting */
+static bool enterSandbox() {
+#ifdef PROBE_AUDIT_ARCH
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PROBE_AUDIT_ARCH, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        PROBE_ALLOW(__NR_read),
+        PROBE_ALLOW(__NR_pread64),
+        PROBE_ALLOW(__NR_write),
+        PROBE_ALLOW(__NR_exit),
+        PROBE_ALLOW(__NR_exit_group),
+        PROBE_ALLOW(__NR_rt_sigreturn),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL),
+    };
+    struct sock_fprog prog = {
+        .len = (unsigned short) (sizeof(filter) / sizeof(filter[0])),
+        .filter = filter,
+    };
+    return prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0
+            && prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) == 0;
+#else
+    return false;
+#endif
+}
+
+static bool probeSandboxed(int fd, ProbeResult* r) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC)) {
+        PLOG(ERROR) << "Failed to create pipe";
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        ProbeResult result;
+        memset(&result, 0, sizeof(result));
+        if (!enterSandbox() || !probe(fd, &result)) {
+            _exit(1);
+        }
+        _exit(write(fds[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+    }
+    close(fds[1]);
+    if (pid == -1) {
+        PLOG(ERROR) << "Failed to fork";
+        close(fds[0]);
+        return false;
+    }
+
+    bool ok = false;
+    struct pollfd pfd = { fds[0], POLLIN, 0 };
+    if (TEMP_FAILURE_RETRY(poll(&pfd, 1, kSandboxTimeoutMs)) == 1) {
+        ok = TEMP_FAILURE_RETRY(read(fds[0], r, sizeof(*r))) == sizeof(*r);
+    } else {
+        LOG(WARNING) << "Sandboxed probe timed out";
+        kill(pid, SIGKILL);
+    }
+    close(fds[0]);
+
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) == -1) {
+        PLOG(ERROR) << "Failed to wait for sandboxed probe";
+        return false;
+    }
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Drops anything from a sandboxed answer that blkid output couldn't hold */
+static bool isValidResult(ProbeResult* r) {
+    r->type[sizeof(r->type) - 1] = '\0';
+    r->uuid[sizeof(r->uuid) - 1] = '\0';
+    r->label[sizeof(r->label) - 1] = '\0';
+
+    static const char* kTypes[] = { "ext2", "ext3", "ext4", "f2fs", "vfat", "exfat", "ntfs" };
+    bool known = false;
+    for (const char* type : kTypes) {
+        known |= !strcmp(r->type, type);
+    }
+    if (!known) return false;
+
+    // The UUID names mount points, so keep it to hex digits and dashes
+    for (const char* p = r->uuid; *p; p++) {
+        if (!isxdigit(*p) && *p != '-') return false;
+    }
+    for (char* p = r->label; *p; p++) {
+        if ((uint8_t) *p < 0x20 || *p == '"' || *p == 0x7F) {
+            *p = '\0';
+            break;
+        }
+    }
+    return true;
+}
+
+status_t ProbeFilesystem(const std::string& path, std::string& fsType,
+        std::string& fsUuid, std::string& fsLabel, bool untrusted) {
+    int fd = TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        PLOG(WARNING) << "Failed to open " << path;
+        return -errno;
+    }
+
+    ProbeResult result;
+    memset(&result, 0, sizeof(result));
+    bool ok = untrusted ? probeSandboxed(fd, &result) : probe(fd, &result);
+    close(fd);
+    if (!ok || !isValidResult(&result)) {
+        return -ENOENT;
+    }
+
+    fsType = result.type;
+    fsUuid = result.uuid;
+    fsLabel = result.label;
+    return OK;
+}
+
+}  // namespace vold
+}  // namespace android
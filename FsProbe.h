@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_FS_PROBE_H
+#define ANDROID_VOLD_FS_PROBE_H
+
+#include <utils/Errors.h>
+
+#include <string>
+
+namespace android {
+namespace vold {
+
+/*
+ * In-process replacement for the blkid TYPE/UUID/LABEL lookup, covering
+ * the filesystems vold mounts: vfat, exfat, ntfs and ext2/3/4, f2fs.
+ *
+ * Every signature lives in the first 4KiB, which is read once; only
+ * labels kept in a directory (vfat, exfat, ntfs) cost one more read.
+ * Values are formatted exactly like blkid, since they name mount points.
+ *
+ * With |untrusted|, parsing happens in a forked child confined by a
+ * seccomp filter to reading the device and writing back its answer.
+ *
+ * Returns -ENOENT when the device isn't confidently recognized, in which
+ * case callers should fall back to blkid.
+ */
+status_t ProbeFilesystem(const std::string& path, std::string& fsType,
+        std::string& fsUuid, std::string& fsLabel, bool untrusted);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
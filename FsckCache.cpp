@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FsckCache.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <cutils/properties.h>
+#include <openssl/sha.h>
+#include <private/android_filesystem_config.h>
+
+#include <algorithm>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const char* kCachePath = "/data/misc/vold/fsck_cache";
+
+static const int kDefaultMaxAgeSecs = 24 * 60 * 60;
+/* Plenty for the cards a user swaps between; the oldest are dropped first */
+static const size_t kMaxRecords = 32;
+
+/* Volumes mount in parallel, so serialize updates to the cache file */
+static std::mutex sCacheLock;
+
+struct Record {
+    std::string fsType;
+    std::string fsUuid;
+    std::string digest;
+    int64_t time;
+};
+
+static uint16_t le16(const std::string& buf, size_t off) {
+    return (uint8_t) buf[off] | ((uint8_t) buf[off + 1] << 8);
+}
+
+static uint32_t le32(const std::string& buf, size_t off) {
+    return le16(buf, off) | ((uint32_t) le16(buf, off + 2) << 16);
+}
+
+static bool readAt(int fd, off64_t offset, size_t len, std::string& out) {
+    std::string buf(len, '\0');
+    if (TEMP_FAILURE_RETRY(pread64(fd, &buf[0], len, offset)) != (ssize_t) len) {
+        return false;
+    }
+    out += buf;
+    return true;
+}
+
+/*
+ * Appends the metadata that every writer of |fsType| has to update, or
+ * fails when the filesystem doesn't look cleanly unmounted.
+ */
+static bool readWriteState(int fd, const std::string& fsType, std::string& out) {
+    size_t base = out.size();
+    if (fsType == "ext4") {
+        if (!readAt(fd, 1024, 1024, out)) return false;
+        // s_state must be valid without errors
+        uint16_t state = le16(out, base + 0x3A);
+        return le16(out, base + 0x38) == 0xEF53 && (state & 0x1) && !(state & 0x2);
+
+    } else if (fsType == "f2fs") {
+        if (!readAt(fd, 1024, 1024, out)) return false;
+        uint32_t logBlockSize = le32(out, base + 16);
+        uint32_t logBlocksPerSeg = le32(out, base + 20);
+        if (le32(out, base) != 0xF2F52010 || logBlockSize != 12 || logBlocksPerSeg > 12) {
+            return false;
+        }
+        // Both checkpoint packs start with a version bumped by every checkpoint
+        off64_t cp = (off64_t) le32(out, base + 76) << logBlockSize;
+        off64_t cpSize = (off64_t) 1 << (logBlocksPerSeg + logBlockSize);
+        return readAt(fd, cp, 64, out) && readAt(fd, cp + cpSize, 64, out);
+
+    } else if (fsType == "vfat") {
+        if (!readAt(fd, 0, 512, out)) return false;
+        uint16_t bytesPerSector = le16(out, base + 11);
+        uint16_t reservedSectors = le16(out, base + 14);
+        if (bytesPerSector < 512 || bytesPerSector > 4096
+                || (bytesPerSector & (bytesPerSector - 1))) {
+            return false;
+        }
+        // FAT[1] carries the clean shutdown and no-error bits
+        return readAt(fd, (off64_t) reservedSectors * bytesPerSector, 8, out);
+    }
+    return false;
+}
+
+static bool isCacheable(const std::string& fsType, const std::string& fsUuid) {
+    if (property_get_int32("vold.fsck_cache_max_age", kDefaultMaxAgeSecs) <= 0) {
+        return false;
+    }
+    if (fsUuid.empty() || fsUuid.find_first_of(" \t\n") != std::string::npos) {
+        return false;
+    }
+    return fsType == "ext4" || fsType == "f2fs" || fsType == "vfat";
+}
+
+static bool computeDigest(const std::string& fsType, const std::string& devPath,
+        std::string& digest) {
+    int fd = TEMP_FAILURE_RETRY(open(devPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        PLOG(WARNING) << "Failed to open " << devPath;
+        return false;
+    }
+
+    off64_t size = lseek64(fd, 0, SEEK_END);
+    std::string state = StringPrintf("%s %" PRId64 "\n", fsType.c_str(), (int64_t) size);
+    bool ok = (size > 0) && readWriteState(fd, fsType, state);
+    close(fd);
+    if (!ok) {
+        return false;
+    }
+
+    std::string hash(SHA256_DIGEST_LENGTH, '\0');
+    SHA256(reinterpret_cast<const uint8_t*>(state.data()), state.size(),
+            reinterpret_cast<uint8_t*>(&hash[0]));
+    return StrToHex(hash, digest) == OK;
+}
+
+static std::vector<Record> loadRecords() {
+    std::vector<Record> records;
+    std::string content;
+    if (!android::base::ReadFileToString(kCachePath, &content)) {
+        return records;
+    }
+
+    std::istringstream in(content);
+    std::string line;
+    while (std::getline(in, line)) {
+        Record rec;
+        std::istringstream fields(line);
+        if (fields >> rec.fsType >> rec.fsUuid >> rec.digest >> rec.time) {
+            records.push_back(rec);
+        }
+    }
+    return records;
+}
+
+static void saveRecords(const std::vector<Record>& records) {
+    std::string content;
+    for (const auto& rec : records) {
+        content += StringPrintf("%s %s %s %" PRId64 "\n", rec.fsType.c_str(),
+                rec.fsUuid.c_str(), rec.digest.c_str(), rec.time);
+    }
+
+    std::string tmpPath = StringPrintf("%s.tmp", kCachePath);
+    if (!android::base::WriteStringToFile(content, tmpPath, 0600, AID_ROOT, AID_ROOT)) {
+        PLOG(WARNING) << "Failed to write " << tmpPath;
+        return;
+    }
+    if (rename(tmpPath.c_str(), kCachePath)) {
+        PLOG(WARNING) << "Failed to rename " << tmpPath;
+        unlink(tmpPath.c_str());
+    }
+}
+
+static std::vector<Record>::iterator findRecord(std::vector<Record>& records,
+        const std::string& fsType, const std::string& fsUuid) {
+    return std::find_if(records.begin(), records.end(), [&](const Record& rec) {
+        return rec.fsType == fsType && rec.fsUuid == fsUuid;
+    });
+}
+
+bool ConsumeCleanUnmount(const std::string& fsType, const std::string& fsUuid,
+        const std::string& devPath) {
+    if (!isCacheable(fsType, fsUuid)) {
+        return false;
+    }
+
+    Record rec;
+    {
+        std::lock_guard<std::mutex> lock(sCacheLock);
+        auto records = loadRecords();
+        auto it = findRecord(records, fsType, fsUuid);
+        if (it == records.end()) {
+            return false;
+        }
+        rec = *it;
+        records.erase(it);
+        saveRecords(records);
+    }
+
+    int64_t age = time(nullptr) - rec.time;
+    if (age < 0 || age > property_get_int32("vold.fsck_cache_max_age", kDefaultMaxAgeSecs)) {
+        LOG(DEBUG) << fsUuid << " clean unmount record expired";
+        return false;
+    }
+
+    std::string digest;
+    if (!computeDigest(fsType, devPath, digest) || digest != rec.digest) {
+        LOG(INFO) << fsUuid << " changed since its last clean unmount";
+        return false;
+    }
+    return true;
+}
+
+void RecordCleanUnmount(const std::string& fsType, const std::string& fsUuid,
+        const std::string& devPath) {
+    if (!isCacheable(fsType, fsUuid)) {
+        return;
+    }
+
+    std::string digest;
+    if (!computeDigest(fsType, devPath, digest)) {
+        LOG(DEBUG) << fsUuid << " doesn't look clean after unmount";
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(sCacheLock);
+    auto records = loadRecords();
+    auto it = findRecord(records, fsType, fsUuid);
+    if (it != records.end()) {
+        records.erase(it);
+    }
+    records.push_back(Record{fsType, fsUuid, digest, (int64_t) time(nullptr)});
+    if (records.size() > kMaxRecords) {
+        records.erase(records.begin(), records.end() - kMaxRecords);
+    }
+    saveRecords(records);
+}
+
+}  // namespace vold
+}  // namespace android
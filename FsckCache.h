@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_FSCK_CACHE_H
+#define ANDROID_VOLD_FSCK_CACHE_H
+
+#include "Utils.h"
+
+#include <string>
+
+namespace android {
+namespace vold {
+
+/*
+ * Remembers filesystems that vold cleanly unmounted, so that mounting the
+ * same filesystem again can skip fsck.
+ *
+ * A record holds a digest of the metadata that any writer has to touch:
+ * the ext4 superblock, the f2fs superblock and checkpoint headers, or the
+ * vfat boot sector and FAT dirty bits. If another host mounts the
+ * filesystem in between, or vold itself never got to unmount it cleanly,
+ * the digest no longer matches. Records expire after
+ * vold.fsck_cache_max_age seconds; 0 disables the cache.
+ */
+
+/*
+ * Whether |devPath| is unchanged since its last clean unmount. The record
+ * is consumed either way, since the caller is about to mount it.
+ */
+bool ConsumeCleanUnmount(const std::string& fsType, const std::string& fsUuid,
+        const std::string& devPath);
+
+/* Records that |devPath| was just cleanly unmounted after a good check */
+void RecordCleanUnmount(const std::string& fsType, const std::string& fsUuid,
+        const std::string& devPath);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "IoStats.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <string.h>
+
+using android::base::ReadFileToString;
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const char* kSysBlock = "/sys/block";
+static const char* kDmPrefix = "dm-";
+/* Reporting windows, in seconds */
+static const int kWindows[] = { 10, 60, 300 };
+static const int kLongestWindow = 300;
+/* Units of the sector counts in the stat file, whatever the device */
+static const uint64_t kSectorSize = 512;
+
+namespace {
+
+/* Field order of /sys/block/<dev>/stat; see Documentation/block/stat.txt */
+enum Field {
+    kReadIos, kReadMerges, kReadSectors, kReadTicks,
+    kWriteIos, kWriteMerges, kWriteSectors, kWriteTicks,
+    kInFlight, kIoTicks, kTimeInQueue,
+    kFieldCount,
+};
+
+struct Sample {
+    nsecs_t time;
+    uint64_t fields[kFieldCount];
+    uint64_t inflightReads;
+    uint64_t inflightWrites;
+};
+
+struct Device {
+    std::string name;
+    /* dm devices are found by the sampler and dropped once they go away */
+    bool managed;
+    std::deque<Sample> samples;
+};
+
+/* Counter deltas over one window */
+struct Window {
+    nsecs_t elapsed;
+    uint64_t fields[kFieldCount];
+};
+
+std::mutex sLock;
+/* Keyed by the device's sysfs path */
+std::map<std::string, Device> sDevices;
+size_t sMaxSamples = 0;
+
+}  // namespace
+
+static bool readSample(const std::string& sysPath, Sample& sample) {
+    std::string stat;
+    if (!ReadFileToString(sysPath + "/stat", &stat)) return false;
+    std::istringstream in(stat);
+    for (auto& field : sample.fields) {
+        if (!(in >> field)) return false;
+    }
+    // Older kernels have no inflight file; the stat file's total will do
+    std::string inflight;
+    sample.inflightReads = 0;
+    sample.inflightWrites = sample.fields[kInFlight];
+    if (ReadFileToString(sysPath + "/inflight", &inflight)) {
+        std::istringstream in2(inflight);
+        in2 >> sample.inflightReads >> sample.inflightWrites;
+    }
+    sample.time = systemTime(SYSTEM_TIME_MONOTONIC);
+    return true;
+}
+
+/* Picks up dm devices created since the last pass */
+static void scanDm() {
+    std::unique_ptr<DIR, int (*)(DIR*)> dirp(opendir(kSysBlock), closedir);
+    if (!dirp) return;
+    struct dirent* ent;
+    while ((ent = readdir(dirp.get())) != nullptr) {
+        std::string dev(ent->d_name);
+        if (dev.compare(0, strlen(kDmPrefix), kDmPrefix)) continue;
+        std::string sysPath = StringPrintf("%s/%s", kSysBlock, dev.c_str());
+        if (sDevices.count(sysPath)) continue;
+        std::string name;
+        ReadFileToString(sysPath + "/dm/name", &name);
+        name.erase(name.find_last_not_of(" \n") + 1);
+        sDevices[sysPath] = Device{ name.empty() ? dev : dev + ":" + name, false, {} };
+    }
+}
+
+static void sampleAll() {
+    std::lock_guard<std::mutex> lock(sLock);
+    scanDm();
+    for (auto it = sDevices.begin(); it != sDevices.end();) {
+        Sample sample;
+        if (!readSample(it->first, sample)) {
+            if (!it->second.managed) {
+                it = sDevices.erase(it);
+                continue;
+            }
+        } else {
+            auto& samples = it->second.samples;
+            samples.push_back(sample);
+            while (samples.size() > sMaxSamples) samples.pop_front();
+        }
+        ++it;
+    }
+}
+
+void StartIoStats(nsecs_t interval) {
+    {
+        std::lock_guard<std::mutex> lock(sLock);
+        sMaxSamples = seconds_to_nanoseconds(kLongestWindow) / interval + 1;
+    }
+    LOG(VERBOSE) << "Sampling I/O stats every " << nanoseconds_to_milliseconds(interval) << "ms";
+    std::thread([interval]() {
+        while (true) {
+            sampleAll();
+            std::this_thread::sleep_for(std::chrono::nanoseconds(interval));
+        }
+    }).detach();
+}
+
+void TrackIoStats(const std::string& name, const std::string& sysPath) {
+    std::lock_guard<std::mutex> lock(sLock);
+    sDevices[sysPath] = Device{ name, true, {} };
+}
+
+void UntrackIoStats(const std::string& sysPath) {
+    std::lock_guard<std::mutex> lock(sLock);
+    sDevices.erase(sysPath);
+}
+
+/* Deltas from the oldest sample within |seconds| to the newest one */
+static bool windowFor(const std::deque<Sample>& samples, int seconds, Window& window) {
+    if (samples.size() < 2) return false;
+    const Sample& last = samples.back();
+    const Sample* first = nullptr;
+    for (const auto& sample : samples) {
+        if (last.time - sample.time <= seconds_to_nanoseconds(seconds)) {
+            first = &sample;
+            break;
+        }
+    }
+    if (first == nullptr || first == &last) return false;
+    window.elapsed = last.time - first->time;
+    for (int i = 0; i < kFieldCount; i++) {
+        // In flight is a level rather than a counter
+        if (i == kInFlight) {
+            window.fields[i] = last.fields[i];
+            continue;
+        }
+        // Counters restart when a device is recreated under the same path
+        if (last.fields[i] < first->fields[i]) return false;
+        window.fields[i] = last.fields[i] - first->fields[i];
+    }
+    return true;
+}
+
+static double perSecond(uint64_t count, nsecs_t elapsed) {
+    return count * 1e9 / elapsed;
+}
+
+static double average(uint64_t total, uint64_t count) {
+    return count ? (double) total / count : 0;
+}
+
+void DumpIoStats(std::vector<std::string>& lines) {
+    std::lock_guard<std::mutex> lock(sLock);
+    for (const auto& it : sDevices) {
+        const auto& samples = it.second.samples;
+        if (samples.empty()) continue;
+        lines.push_back(StringPrintf("%s: %" PRIu64 " reads and %" PRIu64
+                " writes in flight", it.second.name.c_str(), samples.back().inflightReads,
+                samples.back().inflightWrites));
+        for (int seconds : kWindows) {
+            Window w;
+            if (!windowFor(samples, seconds, w)) continue;
+            lines.push_back(StringPrintf("  %ds: read %.2fMB/s %.0f IOPS %.2fms,"
+                    " write %.2fMB/s %.0f IOPS %.2fms, %.0f%% busy", seconds,
+                    perSecond(w.fields[kReadSectors] * kSectorSize, w.elapsed) / (1024 * 1024),
+                    perSecond(w.fields[kReadIos], w.elapsed),
+                    average(w.fields[kReadTicks], w.fields[kReadIos]),
+                    perSecond(w.fields[kWriteSectors] * kSectorSize, w.elapsed) / (1024 * 1024),
+                    perSecond(w.fields[kWriteIos], w.elapsed),
+                    average(w.fields[kWriteTicks], w.fields[kWriteIos]),
+                    100.0 * ms2ns(w.fields[kIoTicks]) / w.elapsed));
+        }
+    }
+}
+
+void ListIoStats(std::vector<std::string>& records) {
+    std::lock_guard<std::mutex> lock(sLock);
+    for (const auto& it : sDevices) {
+        const auto& samples = it.second.samples;
+        for (int seconds : kWindows) {
+            Window w;
+            if (!windowFor(samples, seconds, w)) continue;
+            records.push_back(StringPrintf("%s %d %" PRId64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+                    " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64,
+                    it.second.name.c_str(), seconds, nanoseconds_to_milliseconds(w.elapsed),
+                    w.fields[kReadIos], w.fields[kWriteIos],
+                    w.fields[kReadSectors] * kSectorSize, w.fields[kWriteSectors] * kSectorSize,
+                    w.fields[kReadTicks], w.fields[kWriteTicks], w.fields[kIoTicks],
+                    samples.back().inflightReads, samples.back().inflightWrites));
+        }
+    }
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_IO_STATS_H
+#define ANDROID_VOLD_IO_STATS_H
+
+#include <utils/Timers.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * Samples the block layer counters of every tracked disk, and of every
+ * dm device, each |interval| on a background thread. Enough samples are
+ * kept to cover the longest reporting window.
+ */
+void StartIoStats(nsecs_t interval);
+
+/* Samples the disk at |sysPath| under |name| until untracked */
+void TrackIoStats(const std::string& name, const std::string& sysPath);
+void UntrackIoStats(const std::string& sysPath);
+
+/* Throughput, IOPS, latency and utilization per device and window */
+void DumpIoStats(std::vector<std::string>& lines);
+
+/*
+ * The counter deltas behind DumpIoStats(), one record per device and
+ * window: "name window_s elapsed_ms read_ios write_ios read_bytes
+ * write_bytes read_ms write_ms busy_ms inflight_reads inflight_writes".
+ */
+void ListIoStats(std::vector<std::string>& records);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
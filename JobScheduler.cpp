@@ -0,0 +1,444 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "JobScheduler.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <hardware_legacy/power.h>
+#include <utils/Timers.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+namespace {
+
+struct Policy {
+    const char* name;
+    IoSchedClass ioClass;
+    int ioLevel;
+    /* Moves into vold.jobs_cgroup */
+    bool background;
+    bool pauseOnScreen;
+    bool pauseOnPressure;
+    bool cancellable;
+    /* What setProgress() counts */
+    const char* unit;
+};
+
+/* Indexed by BackgroundJob::Kind */
+const Policy kPolicies[] = {
+    // Idle maintenance, so it gets out of the way of everything
+    { "trim", IoSchedClass_IDLE, 7, true, true, true, true, "filesystems" },
+    // The user is usually watching the progress, so only yield to I/O
+    { "move", IoSchedClass_BE, 7, true, false, true, true, "bytes" },
+    // Nothing else runs while encrypting, and stopping halfway isn't safe
+    { "encrypt", IoSchedClass_BE, 4, false, false, false, false, "blocks" },
+    // Measures the device, so it must not be held back
+    { "benchmark", IoSchedClass_RT, 0, false, false, false, true, "runs" },
+};
+
+/* How often held jobs look again at what's holding them */
+constexpr std::chrono::seconds kRecheckInterval = std::chrono::seconds(1);
+/* How long pressure alone may hold a job at one checkpoint */
+const nsecs_t kMaxPressurePause = s2ns(30);
+/* Pressure is read at most this often */
+const nsecs_t kPressureInterval = ms2ns(500);
+
+constexpr int kDefaultWorkers = 2;
+constexpr int kMaxWorkers = 4;
+/* Held jobs can grow the pool to at most this many times its size */
+constexpr int kMaxPoolGrowth = 2;
+
+const char* kPressurePath = "/proc/pressure/io";
+
+struct JobRecord {
+    BackgroundJob::Kind kind;
+    std::string target;
+    bool queued;
+    /* Started through the queue, so it runs on a pool worker */
+    bool pooled;
+    bool cancelled;
+    IoSchedClass ioClass;
+    int ioLevel;
+    std::string cgroup;
+    /* When queued, then when started */
+    nsecs_t started;
+    /* Threads of the job currently held at a checkpoint */
+    int pausedThreads;
+    nsecs_t pausedSince;
+    nsecs_t pausedTotal;
+    uint64_t done;
+    uint64_t total;
+    /* Wake lock the job holds while running, and whether it's let go */
+    const char* wakeLock;
+    bool wakeLockReleased;
+};
+
+struct QueuedJob {
+    uint64_t id;
+    BackgroundJob::Kind kind;
+    std::string target;
+    IoSchedClass ioClass;
+    std::function<void(BackgroundJob&)> run;
+};
+
+std::mutex sLock;
+std::condition_variable sCond;
+std::map<uint64_t, JobRecord> sJobs;
+uint64_t sNextId = 1;
+bool sScreenOn = false;
+bool sPaused = false;
+nsecs_t sPressureRead = 0;
+bool sPressureHigh = false;
+
+std::condition_variable sQueueCond;
+std::deque<QueuedJob> sQueue;
+int sWorkers = 0;
+int sIdleWorkers = 0;
+/* Workers whose job is held at a checkpoint, which don't count against the pool */
+int sHeldWorkers = 0;
+
+thread_local BackgroundJob* sCurrent = nullptr;
+/* vold.jobs_cgroup while the thread is in it, else empty */
+thread_local std::string tCgroup;
+
+}  // namespace
+
+static const Policy& policyFor(BackgroundJob::Kind kind) {
+    return kPolicies[static_cast<size_t>(kind)];
+}
+
+static const char* ioClassName(IoSchedClass clazz) {
+    switch (clazz) {
+        case IoSchedClass_RT: return "rt";
+        case IoSchedClass_BE: return "be";
+        case IoSchedClass_IDLE: return "idle";
+        default: return "none";
+    }
+}
+
+static bool moveToCgroup(const std::string& dir) {
+    // cgroup v2 only moves single threads through cgroup.threads
+    std::string path = dir + "/cgroup.threads";
+    if (access(path.c_str(), W_OK) != 0) {
+        path = dir + "/tasks";
+    }
+    if (!android::base::WriteStringToFile(std::to_string(gettid()), path)) {
+        PLOG(WARNING) << "Failed to move thread into " << path;
+        return false;
+    }
+    return true;
+}
+
+static std::string parentOf(const std::string& dir) {
+    auto pos = dir.find_last_of('/');
+    return (pos == std::string::npos || pos == 0) ? "/" : dir.substr(0, pos);
+}
+
+/* Must be called with sLock held */
+static bool ioPressureHighLocked(nsecs_t now) {
+    int threshold = android::base::GetIntProperty("vold.jobs_pause_pressure", 0);
+    if (threshold <= 0) return false;
+    if (now - sPressureRead < kPressureInterval) return sPressureHigh;
+    sPressureRead = now;
+    sPressureHigh = false;
+
+    std::string content;
+    if (!android::base::ReadFileToString(kPressurePath, &content)) return false;
+    float avg10;
+    if (sscanf(content.c_str(), "some avg10=%f", &avg10) == 1) {
+        sPressureHigh = avg10 >= threshold;
+    }
+    return sPressureHigh;
+}
+
+/* Must be called with sLock held */
+static uint64_t addRecordLocked(BackgroundJob::Kind kind, const std::string& target,
+        bool queued) {
+    uint64_t id = sNextId++;
+    sJobs.emplace(id, JobRecord{ kind, target, queued, queued, false, IoSchedClass_NONE, 0, "",
+            systemTime(SYSTEM_TIME_BOOTTIME), 0, 0, 0, 0, 0, nullptr, false });
+    return id;
+}
+
+void RunQueuedJobs();
+
+static int maxWorkers() {
+    return std::min(kMaxWorkers, std::max(1,
+            android::base::GetIntProperty("vold.task_workers", kDefaultWorkers)));
+}
+
+/* Must be called with sLock held */
+static void startWorkerLocked() {
+    int max = maxWorkers();
+    if (sQueue.empty()) {
+        return;
+    } else if (sIdleWorkers == 0 && sWorkers - sHeldWorkers < max
+            && sWorkers < max * kMaxPoolGrowth) {
+        // Workers stay around once started, waiting for more jobs
+        sWorkers++;
+        std::thread(&RunQueuedJobs).detach();
+    } else {
+        sQueueCond.notify_one();
+    }
+}
+
+BackgroundJob::BackgroundJob(Kind kind, const std::string& target, IoSchedClass ioClass) :
+        BackgroundJob(kind, 0, target, ioClass) {
+}
+
+BackgroundJob::BackgroundJob(Kind kind, uint64_t id, const std::string& target,
+        IoSchedClass ioClass) : mKind(kind), mId(id), mOrigClass(IoSchedClass_NONE),
+        mOrigLevel(0), mOuterCgroup(tCgroup), mOuter(sCurrent) {
+    const auto& policy = policyFor(kind);
+    IoSchedClass clazz = (ioClass != IoSchedClass_NONE) ? ioClass : policy.ioClass;
+
+    if (android_get_ioprio(0, &mOrigClass, &mOrigLevel)) {
+        PLOG(WARNING) << "Failed to get I/O priority";
+    }
+    if (android_set_ioprio(0, clazz, policy.ioLevel)) {
+        PLOG(WARNING) << "Failed to set " << policy.name << " I/O priority";
+    }
+    if (policy.background) {
+        std::string cgroup = android::base::GetProperty("vold.jobs_cgroup", "");
+        if (!cgroup.empty() && cgroup != tCgroup && moveToCgroup(cgroup)) {
+            tCgroup = cgroup;
+        }
+    } else if (!tCgroup.empty() && moveToCgroup(parentOf(tCgroup))) {
+        // Started from inside a background job, like the benchmark after a
+        // trim, and mustn't be held back along with it
+        tCgroup.clear();
+    }
+
+    std::lock_guard<std::mutex> lock(sLock);
+    if (mId == 0) {
+        mId = addRecordLocked(kind, target, false);
+    }
+    auto& r = sJobs.at(mId);
+    r.queued = false;
+    r.ioClass = clazz;
+    r.ioLevel = policy.ioLevel;
+    r.cgroup = tCgroup;
+    r.started = systemTime(SYSTEM_TIME_BOOTTIME);
+    sCurrent = this;
+    LOG(DEBUG) << "Started " << policy.name << " job " << mId << " on " << target;
+}
+
+BackgroundJob::~BackgroundJob() {
+    {
+        std::lock_guard<std::mutex> lock(sLock);
+        sJobs.erase(mId);
+    }
+    sCurrent = mOuter;
+    if (tCgroup != mOuterCgroup) {
+        moveToCgroup(mOuterCgroup.empty() ? parentOf(tCgroup) : mOuterCgroup);
+        tCgroup = mOuterCgroup;
+    }
+    if (android_set_ioprio(0, mOrigClass, mOrigLevel)) {
+        PLOG(WARNING) << "Failed to restore I/O priority";
+    }
+    LOG(DEBUG) << "Finished " << policyFor(mKind).name << " job " << mId;
+}
+
+BackgroundJob* BackgroundJob::current() {
+    return sCurrent;
+}
+
+void BackgroundJob::setWakeLock(const char* name) {
+    std::lock_guard<std::mutex> lock(sLock);
+    sJobs.at(mId).wakeLock = name;
+}
+
+/* Must be called with sLock held */
+static void keepAwakeLocked(JobRecord& r, bool awake) {
+    if (r.wakeLock == nullptr || r.wakeLockReleased != awake) return;
+    if (awake) {
+        acquire_wake_lock(PARTIAL_WAKE_LOCK, r.wakeLock);
+    } else {
+        release_wake_lock(r.wakeLock);
+    }
+    r.wakeLockReleased = !awake;
+}
+
+bool BackgroundJob::checkpoint() {
+    const auto& policy = policyFor(mKind);
+    std::unique_lock<std::mutex> lock(sLock);
+    auto it = sJobs.find(mId);
+    if (!policy.pauseOnScreen && !policy.pauseOnPressure) return !it->second.cancelled;
+
+    nsecs_t pressureStart = 0;
+    bool held = false;
+    while (!it->second.cancelled) {
+        nsecs_t now = systemTime(SYSTEM_TIME_BOOTTIME);
+        bool hold = sPaused || (policy.pauseOnScreen && sScreenOn);
+        if (!hold && policy.pauseOnPressure && ioPressureHighLocked(now)) {
+            if (pressureStart == 0) pressureStart = now;
+            hold = now - pressureStart < kMaxPressurePause;
+        }
+        if (!hold) break;
+        if (!held) {
+            held = true;
+            if (it->second.pausedThreads++ == 0) {
+                it->second.pausedSince = now;
+                LOG(DEBUG) << "Holding " << policy.name << " job " << mId;
+                if (it->second.pooled) {
+                    // Don't let a trim waiting for the screen to go off
+                    // keep a move the user started from running
+                    sHeldWorkers++;
+                    startWorkerLocked();
+                }
+            }
+        }
+        // While the screen is on the device stays awake anyway, and keeping
+        // the lock lets the job carry on once it goes off, before a suspend
+        keepAwakeLocked(it->second, policy.pauseOnScreen && sScreenOn);
+        sCond.wait_for(lock, kRecheckInterval);
+    }
+    keepAwakeLocked(it->second, true);
+    if (held && --it->second.pausedThreads == 0) {
+        if (it->second.pooled) {
+            sHeldWorkers--;
+            // Lets workers the hold added go away if they're now spare
+            sQueueCond.notify_all();
+        }
+        it->second.pausedTotal += systemTime(SYSTEM_TIME_BOOTTIME) - it->second.pausedSince;
+        LOG(DEBUG) << "Resuming " << policy.name << " job " << mId;
+    }
+    return !it->second.cancelled;
+}
+
+bool BackgroundJob::isCancelled() {
+    std::lock_guard<std::mutex> lock(sLock);
+    return sJobs.at(mId).cancelled;
+}
+
+void BackgroundJob::setProgress(uint64_t done, uint64_t total) {
+    std::lock_guard<std::mutex> lock(sLock);
+    auto& r = sJobs.at(mId);
+    r.done = done;
+    r.total = total;
+}
+
+void RunQueuedJobs() {
+    std::unique_lock<std::mutex> lock(sLock);
+    while (true) {
+        // Workers started while others' jobs were held leave once those
+        // jobs carry on and the pool is over its size again
+        if (sWorkers - sHeldWorkers > maxWorkers()) {
+            sWorkers--;
+            // Pass on a job this worker may have been woken for
+            startWorkerLocked();
+            return;
+        }
+        if (sQueue.empty()) {
+            sIdleWorkers++;
+            sQueueCond.wait(lock);
+            sIdleWorkers--;
+            continue;
+        }
+        QueuedJob queued = std::move(sQueue.front());
+        sQueue.pop_front();
+        lock.unlock();
+        {
+            BackgroundJob job(queued.kind, queued.id, queued.target, queued.ioClass);
+            queued.run(job);
+        }
+        lock.lock();
+    }
+}
+
+uint64_t StartBackgroundJob(BackgroundJob::Kind kind, const std::string& target,
+        IoSchedClass ioClass, const std::function<void(BackgroundJob&)>& run) {
+    std::lock_guard<std::mutex> lock(sLock);
+    uint64_t id = addRecordLocked(kind, target, true);
+    sQueue.push_back(QueuedJob{ id, kind, target, ioClass, run });
+    startWorkerLocked();
+    LOG(DEBUG) << "Queued " << policyFor(kind).name << " job " << id << " on " << target;
+    return id;
+}
+
+bool CancelJob(uint64_t id) {
+    std::lock_guard<std::mutex> lock(sLock);
+    auto it = sJobs.find(id);
+    if (it == sJobs.end() || !policyFor(it->second.kind).cancellable) return false;
+    it->second.cancelled = true;
+    sCond.notify_all();
+    LOG(INFO) << "Cancelling " << policyFor(it->second.kind).name << " job " << id;
+    return true;
+}
+
+void SetJobsScreenOn(bool on) {
+    std::lock_guard<std::mutex> lock(sLock);
+    sScreenOn = on;
+    sCond.notify_all();
+}
+
+void SetJobsPaused(bool paused) {
+    std::lock_guard<std::mutex> lock(sLock);
+    sPaused = paused;
+    sCond.notify_all();
+}
+
+static const char* stateName(const JobRecord& r) {
+    if (r.cancelled) return "cancelling";
+    if (r.queued) return "queued";
+    return r.pausedThreads > 0 ? "paused" : "running";
+}
+
+void ListJobs(std::vector<std::string>& records) {
+    std::lock_guard<std::mutex> lock(sLock);
+    nsecs_t now = systemTime(SYSTEM_TIME_BOOTTIME);
+    for (const auto& job : sJobs) {
+        const auto& r = job.second;
+        nsecs_t running = r.queued ? 0 : now - r.started;
+        nsecs_t paused = r.pausedTotal + (r.pausedThreads > 0 ? now - r.pausedSince : 0);
+        // Rate over the time spent actually working
+        nsecs_t active = running - paused;
+        double rate = active > 0 ? r.done / (active / 1e9) : 0;
+        int64_t eta = -1;
+        if (rate > 0 && r.total >= r.done) {
+            eta = static_cast<int64_t>((r.total - r.done) / rate * 1000);
+        }
+        records.push_back(StringPrintf("%" PRIu64 " %s %s %s %s %d %s %" PRId64 " %" PRId64
+                " %" PRIu64 " %" PRIu64 " %s %.0f %" PRId64,
+                job.first, policyFor(r.kind).name, r.target.c_str(), stateName(r),
+                ioClassName(r.ioClass), r.ioLevel, r.cgroup.empty() ? "-" : r.cgroup.c_str(),
+                nanoseconds_to_milliseconds(running), nanoseconds_to_milliseconds(paused),
+                r.done, r.total, policyFor(r.kind).unit, rate, eta));
+    }
+    records.push_back(StringPrintf("scheduler screen=%s paused=%d queued=%zu workers=%d held=%d",
+            sScreenOn ? "on" : "off", sPaused, sQueue.size(), sWorkers, sHeldWorkers));
+}
+
+}  // namespace vold
+}  // namespace android
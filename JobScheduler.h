@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_JOB_SCHEDULER_H
+#define ANDROID_VOLD_JOB_SCHEDULER_H
+
+#include "Utils.h"
+
+#include <cutils/iosched_policy.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * One long-running job, such as a trim or a move, for as long as it's in
+ * scope on the thread doing the work.
+ *
+ * Each kind of job has a policy: the I/O priority its thread runs at, and
+ * whether it moves into the background cgroup named by vold.jobs_cgroup.
+ * Threads the job starts afterwards inherit both. A job that isn't in the
+ * background, started from inside one that is, leaves that cgroup for its
+ * parent. Everything is put back when the job goes out of scope.
+ *
+ * Jobs call checkpoint() between units of work, which blocks while the
+ * scheduler holds jobs of that kind: while the screen is on, while jobs
+ * are paused by command, or while I/O pressure is above
+ * vold.jobs_pause_pressure percent. It returns false once the job has
+ * been cancelled, and the job should then wind down as if it had failed.
+ */
+class BackgroundJob {
+public:
+    enum class Kind {
+        kTrim,
+        kMove,
+        kEncrypt,
+        kBenchmark,
+    };
+
+    /* Uses |ioClass| instead of the policy's unless it's IoSchedClass_NONE */
+    BackgroundJob(Kind kind, const std::string& target, IoSchedClass ioClass = IoSchedClass_NONE);
+    ~BackgroundJob();
+
+    uint64_t getId() const { return mId; }
+
+    /* Returns whether the job may carry on; any thread of the job may call it */
+    bool checkpoint();
+    bool isCancelled();
+    /* |done| of |total| units of work, in the unit the policy names */
+    void setProgress(uint64_t done, uint64_t total);
+    /*
+     * Names the wake lock the job holds while it runs, so checkpoint() can
+     * let it go while the job is held and take it again on resume
+     */
+    void setWakeLock(const char* name);
+
+    /* The innermost job in scope on the calling thread, if any */
+    static BackgroundJob* current();
+
+private:
+    Kind mKind;
+    uint64_t mId;
+    IoSchedClass mOrigClass;
+    int mOrigLevel;
+    /* Cgroup the thread was in before the job, to go back to */
+    std::string mOuterCgroup;
+    BackgroundJob* mOuter;
+
+    /* Takes over the queued record |id| */
+    BackgroundJob(Kind kind, uint64_t id, const std::string& target, IoSchedClass ioClass);
+
+    friend void RunQueuedJobs();
+
+    DISALLOW_COPY_AND_ASSIGN(BackgroundJob);
+};
+
+/*
+ * Queues |run| as a job of |kind| on a pool of threads, and returns its
+ * id. At most vold.task_workers of them run jobs that aren't held at a
+ * checkpoint, so a trim waiting for the screen to go off doesn't keep
+ * a move queued behind it, and held jobs grow the pool to at most twice
+ * that; the extra workers leave once it shrinks back. Cancelling a job before it starts still
+ * runs it, so it can report failure the usual way, but its first
+ * checkpoint() returns false.
+ */
+uint64_t StartBackgroundJob(BackgroundJob::Kind kind, const std::string& target,
+        IoSchedClass ioClass, const std::function<void(BackgroundJob&)>& run);
+
+/* False if there's no job |id| or its kind can't be cancelled */
+bool CancelJob(uint64_t id);
+
+/* Reported by the framework; jobs that yield to the user hold while on */
+void SetJobsScreenOn(bool on);
+/* Holds every pausable job until resumed */
+void SetJobsPaused(bool paused);
+
+/*
+ * One record per queued or running job: "id kind target state io_class
+ * io_level cgroup running_ms paused_ms done total unit rate_per_s eta_ms",
+ * with an eta_ms of -1 when unknown, followed by a "scheduler" record
+ * giving the screen and pause state.
+ */
+void ListJobs(std::vector<std::string>& records);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
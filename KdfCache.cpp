@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "KdfCache.h"
+#include "Utils.h"
+
+#include <android-base/logging.h>
+
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include <map>
+#include <mutex>
+
+#include <time.h>
+
+namespace android {
+namespace vold {
+
+/* Long enough to cover one unlock sequence, and no longer */
+static const int64_t kKdfCacheTtlNs = 15 * 1000000000LL;
+/* A handful of users and profiles */
+static const size_t kKdfCacheMaxEntries = 8;
+static const size_t kHmacKeyBytes = 32;
+
+struct Entry {
+    KeyBuffer derived;
+    int64_t expiry;
+};
+
+static std::mutex sLock;
+static KeyBuffer sHmacKey;
+static std::map<std::string, Entry> sEntries;
+
+/* Boot time keeps counting through suspend, so entries can't outlive it */
+static int64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void expireLocked() {
+    int64_t t = now();
+    for (auto it = sEntries.begin(); it != sEntries.end();) {
+        if (it->second.expiry <= t) {
+            it = sEntries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/* Empty if there's no HMAC key, in which case nothing is cached */
+static std::string digestLocked(const KeyBuffer& inputs) {
+    if (sHmacKey.empty()) {
+        std::string key;
+        if (ReadRandomBytes(kHmacKeyBytes, key) != OK) {
+            LOG(WARNING) << "Failed to key KDF cache; caching disabled";
+            return "";
+        }
+        sHmacKey.assign(key.begin(), key.end());
+        memset_s(&key[0], 0, key.size());
+    }
+
+    std::string digest(SHA512_DIGEST_LENGTH, '\0');
+    unsigned int len = digest.size();
+    if (!HMAC(EVP_sha512(), sHmacKey.data(), sHmacKey.size(),
+            reinterpret_cast<const uint8_t*>(inputs.data()), inputs.size(),
+            reinterpret_cast<uint8_t*>(&digest[0]), &len)) {
+        return "";
+    }
+    digest.resize(len);
+    return digest;
+}
+
+KdfCacheKey::KdfCacheKey(const std::string& kdf, const std::string& params) {
+    add(kdf);
+    add(params);
+}
+
+KdfCacheKey& KdfCacheKey::add(const void* data, size_t len) {
+    // Length-prefixed so that fields can't run into each other
+    uint64_t len64 = len;
+    const char* p = reinterpret_cast<const char*>(&len64);
+    mInputs.insert(mInputs.end(), p, p + sizeof(len64));
+    p = reinterpret_cast<const char*>(data);
+    mInputs.insert(mInputs.end(), p, p + len);
+    return *this;
+}
+
+bool KdfCacheKey::lookup(KeyBuffer* derived) const {
+    std::lock_guard<std::mutex> lock(sLock);
+    expireLocked();
+    if (sEntries.empty()) return false;
+
+    std::string digest = digestLocked(mInputs);
+    auto it = sEntries.find(digest);
+    if (digest.empty() || it == sEntries.end()) return false;
+    derived->assign(it->second.derived.begin(), it->second.derived.end());
+    return true;
+}
+
+void KdfCacheKey::store(const KeyBuffer& derived) const {
+    std::lock_guard<std::mutex> lock(sLock);
+    expireLocked();
+    std::string digest = digestLocked(mInputs);
+    if (digest.empty()) return;
+
+    if (sEntries.size() >= kKdfCacheMaxEntries && sEntries.find(digest) == sEntries.end()) {
+        auto oldest = sEntries.begin();
+        for (auto it = sEntries.begin(); it != sEntries.end(); ++it) {
+            if (it->second.expiry < oldest->second.expiry) oldest = it;
+        }
+        sEntries.erase(oldest);
+    }
+    Entry& entry = sEntries[digest];
+    entry.derived.assign(derived.begin(), derived.end());
+    entry.expiry = now() + kKdfCacheTtlNs;
+}
+
+void ClearKdfCache() {
+    std::lock_guard<std::mutex> lock(sLock);
+    sEntries.clear();
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_KDF_CACHE_H
+#define ANDROID_VOLD_KDF_CACHE_H
+
+#include "KeyBuffer.h"
+
+#include <string>
+
+namespace android {
+namespace vold {
+
+/*
+ * Short-lived cache of password-derived keys.
+ *
+ * Unlocking several users or checking the same password twice in a row
+ * would otherwise rerun scrypt (and a keymaster sign) each time for
+ * identical inputs. Results are held in zeroing buffers for a few seconds
+ * only, and entries are looked up by an HMAC of the inputs under a
+ * per-boot random key so that no password hash sits in memory.
+ */
+class KdfCacheKey {
+public:
+    /* |kdf| names the function and |params| everything else it depends on */
+    KdfCacheKey(const std::string& kdf, const std::string& params);
+
+    KdfCacheKey& add(const void* data, size_t len);
+    KdfCacheKey& add(const std::string& data) { return add(data.data(), data.size()); }
+
+    /* Returns true and fills |derived| if an unexpired entry exists */
+    bool lookup(KeyBuffer* derived) const;
+    void store(const KeyBuffer& derived) const;
+
+private:
+    KeyBuffer mInputs;
+};
+
+/* Drops every cached key, e.g. once a password has been changed */
+void ClearKdfCache();
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -17,11 +17,117 @@
 #include "KeyBuffer.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <mutex>
+
+#include <sys/mman.h>
+
+#include <android-base/logging.h>
 
 namespace android {
 namespace vold {
 
+/*
+ * Keys are 64 bytes, and their hex forms and dm parameters a few hundred,
+ * so a handful of power-of-two size classes in a small arena covers them.
+ * Freed blocks go on a per-class free list, linked through their own
+ * (zeroed) first bytes.
+ */
+static constexpr size_t kArenaSize = 64 * 1024;
+static constexpr size_t kMinBlock = 32;
+static constexpr size_t kMaxBlock = 4096;
+static constexpr int kClasses = 8;  // 32 .. 4096
+static_assert(kMinBlock << (kClasses - 1) == kMaxBlock, "Size classes don't reach kMaxBlock");
+
+namespace {
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+struct Arena {
+    std::mutex lock;
+    bool initialized = false;
+    // Set once, but read without the lock when freeing
+    std::atomic<char*> base{nullptr};
+    size_t used = 0;
+    FreeBlock* free[kClasses] = {};
+};
+
+}  // namespace
+
+static Arena sArena;
+
+static int sizeClass(size_t n) {
+    int c = 0;
+    while ((kMinBlock << c) < n) c++;
+    return c;
+}
+
+static void initArenaLocked() {
+    sArena.initialized = true;
+    void* base = mmap(nullptr, kArenaSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        PLOG(WARNING) << "Failed to map key arena; key material stays on the heap";
+        return;
+    }
+    // Without the lock the arena could be swapped out just like the heap
+    if (mlock(base, kArenaSize) != 0) {
+        PLOG(WARNING) << "Failed to lock key arena; key material stays on the heap";
+        munmap(base, kArenaSize);
+        return;
+    }
+    madvise(base, kArenaSize, MADV_DONTDUMP);
+    sArena.base = static_cast<char*>(base);
+}
+
+void* AllocateKeyMemory(size_t n) {
+    if (n > 0 && n <= kMaxBlock) {
+        std::lock_guard<std::mutex> lock(sArena.lock);
+        if (!sArena.initialized) initArenaLocked();
+        if (sArena.base != nullptr) {
+            int c = sizeClass(n);
+            if (sArena.free[c] != nullptr) {
+                FreeBlock* block = sArena.free[c];
+                sArena.free[c] = block->next;
+                block->next = nullptr;
+                return block;
+            }
+            size_t size = kMinBlock << c;
+            if (sArena.used + size <= kArenaSize) {
+                void* block = sArena.base.load() + sArena.used;
+                sArena.used += size;
+                return block;
+            }
+        }
+    }
+    return ::operator new(n);
+}
+
+bool IsLockedKeyMemory(const void* p) {
+    auto c = static_cast<const char*>(p);
+    const char* base = sArena.base.load();
+    return base != nullptr && c >= base && c < base + kArenaSize;
+}
+
+void FreeKeyMemory(void* p, size_t n) {
+    if (p == nullptr) return;
+    if (IsLockedKeyMemory(p)) {
+        int c = sizeClass(n);
+        // The whole block, in case an earlier user of it was longer
+        memset_s(p, 0, kMinBlock << c);
+        std::lock_guard<std::mutex> lock(sArena.lock);
+        auto block = static_cast<FreeBlock*>(p);
+        block->next = sArena.free[c];
+        sArena.free[c] = block;
+        return;
+    }
+    memset_s(p, 0, n);
+    ::operator delete(p);
+}
+
 KeyBuffer operator+(KeyBuffer&& lhs, const KeyBuffer& rhs) {
     std::copy(rhs.begin(), rhs.end(), std::back_inserter(lhs));
     return std::move(lhs);
@@ -32,6 +138,18 @@ KeyBuffer operator+(KeyBuffer&& lhs, const char* rhs) {
     return std::move(lhs);
 }
 
+KeyBuffer ConcatKeyBuffer(std::initializer_list<KeyBufferPiece> pieces) {
+    size_t size = 0;
+    for (const auto& piece : pieces) {
+        size += piece.size;
+    }
+    KeyBuffer res;
+    res.reserve(size);
+    for (const auto& piece : pieces) {
+        res.insert(res.end(), piece.data, piece.data + piece.size);
+    }
+    return res;
+}
+
 }  // namespace vold
 }  // namespace android
-
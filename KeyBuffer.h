@@ -18,6 +18,7 @@
 #define ANDROID_VOLD_KEYBUFFER_H
 
 #include <cstring>
+#include <initializer_list>
 #include <memory>
 #include <vector>
 
@@ -39,14 +40,26 @@ inline OPTNONE void* memset_s(void* s, int c, size_t n) {
 }
 #undef OPTNONE
 
-// Allocator that delegates useful work to standard one but zeroes data before deallocating.
-class ZeroingAllocator : public std::allocator<char> {
+// Memory for key material: small blocks come from a fixed, mlock()ed arena
+// that is kept out of core dumps, larger ones from the heap. Either way a
+// block is zeroed when it is freed.
+void* AllocateKeyMemory(size_t n);
+void FreeKeyMemory(void* p, size_t n);
+// Whether |p| lies in the locked arena
+bool IsLockedKeyMemory(const void* p);
+
+class ZeroingAllocator {
     public:
-    void deallocate(pointer p, size_type n)
-    {
-        memset_s(p, 0, n);
-        std::allocator<char>::deallocate(p, n);
-    }
+    using value_type = char;
+    template <class U> struct rebind { using other = ZeroingAllocator; };
+
+    ZeroingAllocator() = default;
+
+    char* allocate(size_t n) { return static_cast<char*>(AllocateKeyMemory(n)); }
+    void deallocate(char* p, size_t n) { FreeKeyMemory(p, n); }
+
+    bool operator==(const ZeroingAllocator&) const { return true; }
+    bool operator!=(const ZeroingAllocator&) const { return false; }
 };
 
 // Char vector that zeroes memory when deallocating.
@@ -56,6 +69,19 @@ using KeyBuffer = std::vector<char, ZeroingAllocator>;
 KeyBuffer operator+(KeyBuffer&& lhs, const KeyBuffer& rhs);
 KeyBuffer operator+(KeyBuffer&& lhs, const char* rhs);
 
+// A piece of a key buffer built by ConcatKeyBuffer()
+struct KeyBufferPiece {
+    KeyBufferPiece(const char* s) : data(s), size(strlen(s)) {}
+    KeyBufferPiece(const KeyBuffer& b) : data(b.data()), size(b.size()) {}
+
+    const char* data;
+    size_t size;
+};
+
+// Joins |pieces| into a buffer allocated once at its final size, so no
+// partial copies of the key are left behind by reallocation.
+KeyBuffer ConcatKeyBuffer(std::initializer_list<KeyBufferPiece> pieces);
+
 }  // namespace vold
 }  // namespace android
 
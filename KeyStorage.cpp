@@ -16,8 +16,10 @@
 
 #include "KeyStorage.h"
 
+#include "KdfCache.h"
 #include "Keymaster.h"
 #include "ScryptParameters.h"
+#include "SecureDiscard.h"
 #include "Utils.h"
 
 #include <vector>
@@ -66,7 +68,6 @@ static constexpr uint32_t AUTH_TIMEOUT = 30; // Seconds
 
 static const char* kCurrentVersion = "1";
 static const char* kRmPath = "/system/bin/rm";
-static const char* kSecdiscardPath = "/system/bin/secdiscard";
 static const char* kStretch_none = "none";
 static const char* kStretch_nopassword = "nopassword";
 static const std::string kStretchPrefix_scrypt = "scrypt ";
@@ -228,13 +229,11 @@ static bool encryptWithKeymasterKey(Keymaster& keymaster, const std::string& dir
     // nonceBlob here is just a pointer into existing data, must not be freed
     std::string nonce(reinterpret_cast<const char*>(&nonceBlob.value()[0]), nonceBlob.value().size());
     if (!checkSize("nonce", nonce.size(), GCM_NONCE_BYTES)) return false;
-    std::string body;
-    if (!opHandle.updateCompletely(message, &body)) return false;
-
-    std::string mac;
-    if (!opHandle.finish(&mac)) return false;
-    if (!checkSize("mac", mac.size(), GCM_MAC_BYTES)) return false;
-    *ciphertext = nonce + body + mac;
+    // The body and MAC come back together from one finish call
+    std::string bodyAndMac;
+    if (!opHandle.updateAndFinish(message, &bodyAndMac)) return false;
+    if (!checkSize("ciphertext", bodyAndMac.size(), message.size() + GCM_MAC_BYTES)) return false;
+    *ciphertext = nonce + bodyAndMac;
     return true;
 }
 
@@ -247,9 +246,7 @@ static bool decryptWithKeymasterKey(Keymaster& keymaster, const std::string& dir
             .Authorization(TAG_NONCE, blob2hidlVec(nonce));
     auto opHandle = begin(keymaster, dir, KeyPurpose::DECRYPT, keyParams, opParams, nullptr);
     if (!opHandle) return false;
-    if (!opHandle.updateCompletely(bodyAndMac, message)) return false;
-    if (!opHandle.finish(nullptr)) return false;
-    return true;
+    return opHandle.updateAndFinish(bodyAndMac, message);
 }
 
 static std::string getStretching(const KeyAuthentication& auth) {
@@ -287,6 +284,13 @@ static bool stretchSecret(const std::string& stretching, const std::string& secr
             LOG(ERROR) << "Unable to parse scrypt params in stretching: " << stretching;
             return false;
         }
+        KdfCacheKey cacheKey("KeyStorage scrypt", stretching);
+        cacheKey.add(secret).add(salt);
+        KeyBuffer cached;
+        if (cacheKey.lookup(&cached)) {
+            stretched->assign(cached.begin(), cached.end());
+            return true;
+        }
         stretched->assign(STRETCHED_BYTES, '\0');
         if (crypto_scrypt(reinterpret_cast<const uint8_t*>(secret.data()), secret.size(),
                           reinterpret_cast<const uint8_t*>(salt.data()), salt.size(),
@@ -295,6 +299,7 @@ static bool stretchSecret(const std::string& stretching, const std::string& secr
             LOG(ERROR) << "scrypt failed with params: " << stretching;
             return false;
         }
+        cacheKey.store(KeyBuffer(stretched->begin(), stretched->end()));
     } else {
         LOG(ERROR) << "Unknown stretching type: " << stretching;
         return false;
@@ -324,8 +329,8 @@ static void logOpensslError() {
     LOG(ERROR) << "Openssl error: " << ERR_get_error();
 }
 
-static bool encryptWithoutKeymaster(const std::string& preKey,
-                                    const KeyBuffer& plaintext, std::string* ciphertext) {
+bool encryptWithoutKeymaster(const std::string& preKey,
+                             const KeyBuffer& plaintext, std::string* ciphertext) {
     auto key = hashWithPrefix(kHashPrefix_keygen, preKey);
     key.resize(AES_KEY_BYTES);
     if (!readRandomBytesOrLog(GCM_NONCE_BYTES, ciphertext)) return false;
@@ -370,8 +375,8 @@ static bool encryptWithoutKeymaster(const std::string& preKey,
     return true;
 }
 
-static bool decryptWithoutKeymaster(const std::string& preKey,
-                                    const std::string& ciphertext, KeyBuffer* plaintext) {
+bool decryptWithoutKeymaster(const std::string& preKey,
+                             const std::string& ciphertext, KeyBuffer* plaintext) {
     if (ciphertext.size() < GCM_NONCE_BYTES + GCM_MAC_BYTES) {
         LOG(ERROR) << "GCM ciphertext too small: " << ciphertext.size();
         return false;
@@ -519,31 +524,27 @@ static bool deleteKey(const std::string& dir) {
     return true;
 }
 
-static bool runSecdiscard(const std::string& dir) {
-    if (ForkExecvp(
-            std::vector<std::string>{kSecdiscardPath, "--",
-                dir + "/" + kFn_encrypted_key,
-                dir + "/" + kFn_keymaster_key_blob,
-                dir + "/" + kFn_secdiscardable,
-                }) != 0) {
-        LOG(ERROR) << "secdiscard failed";
-        return false;
+// As when this ran as a separate binary, failures are only logged and the
+// files are unlinked regardless.
+static void runSecdiscard(const std::vector<std::string>& dirs) {
+    std::vector<std::string> files;
+    for (const auto& dir : dirs) {
+        files.push_back(dir + "/" + kFn_encrypted_key);
+        files.push_back(dir + "/" + kFn_keymaster_key_blob);
+        files.push_back(dir + "/" + kFn_secdiscardable);
     }
-    return true;
+    SecdiscardPaths(files, true);
 }
 
 bool runSecdiscardSingle(const std::string& file) {
-    if (ForkExecvp(
-            std::vector<std::string>{kSecdiscardPath, "--",
-                file}) != 0) {
-        LOG(ERROR) << "secdiscard failed";
-        return false;
-    }
+    SecdiscardPaths(std::vector<std::string>{file}, true);
     return true;
 }
 
-static bool recursiveDeleteKey(const std::string& dir) {
-    if (ForkExecvp(std::vector<std::string>{kRmPath, "-rf", dir}) != 0) {
+static bool recursiveDeleteKeys(const std::vector<std::string>& dirs) {
+    std::vector<std::string> args{kRmPath, "-rf"};
+    args.insert(args.end(), dirs.begin(), dirs.end());
+    if (ForkExecvp(args) != 0) {
         LOG(ERROR) << "recursive delete failed";
         return false;
     }
@@ -551,11 +552,18 @@ static bool recursiveDeleteKey(const std::string& dir) {
 }
 
 bool destroyKey(const std::string& dir) {
+    return destroyKeys(std::vector<std::string>{dir});
+}
+
+bool destroyKeys(const std::vector<std::string>& dirs) {
+    if (dirs.empty()) return true;
     bool success = true;
     // Try each thing, even if previous things failed.
-    success &= deleteKey(dir);
-    success &= runSecdiscard(dir);
-    success &= recursiveDeleteKey(dir);
+    for (const auto& dir : dirs) {
+        success &= deleteKey(dir);
+    }
+    runSecdiscard(dirs);
+    success &= recursiveDeleteKeys(dirs);
     return success;
 }
 
@@ -20,6 +20,7 @@
 #include "KeyBuffer.h"
 
 #include <string>
+#include <vector>
 
 namespace android {
 namespace vold {
@@ -63,7 +64,18 @@ bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, KeyBuffe
 // Securely destroy the key stored in the named directory and delete the directory.
 bool destroyKey(const std::string& dir);
 
+// As destroyKey, for several directories at once; their files are discarded
+// together, which is much quicker than one at a time.
+bool destroyKeys(const std::vector<std::string>& dirs);
+
 bool runSecdiscardSingle(const std::string& file);
+
+// AES-256-GCM under a key hashed from "preKey", as storeKey uses when no
+// Keymaster is involved; exposed for benchmarking.
+bool encryptWithoutKeymaster(const std::string& preKey,
+                             const KeyBuffer& plaintext, std::string* ciphertext);
+bool decryptWithoutKeymaster(const std::string& preKey,
+                             const std::string& ciphertext, KeyBuffer* plaintext);
 }  // namespace vold
 }  // namespace android
 
@@ -17,8 +17,11 @@
 #include "KeyUtil.h"
 
 #include <iomanip>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <openssl/sha.h>
 
@@ -57,7 +60,7 @@ bool randomKey(KeyBuffer* key) {
 }
 
 // Get raw keyref - used to make keyname and to pass to ioctl
-static std::string generateKeyRef(const char* key, int length) {
+std::string generateKeyRef(const char* key, int length) {
     SHA512_CTX c;
 
     SHA512_Init(&c);
@@ -104,13 +107,23 @@ static std::string keyname(const std::string& prefix, const std::string& raw_ref
     return o.str();
 }
 
+// Installing keys happens on several threads while DE keys load
+static std::mutex sKeyringLock;
+// Found once; the session keyring doesn't change under us
+static key_serial_t sDeviceKeyring = -1;
+// Serials of the keys we installed, one per name prefix, by raw key reference
+static std::map<std::string, std::vector<key_serial_t>> sInstalledKeys;
+
 // Get the keyring we store all keys in
-static bool e4cryptKeyring(key_serial_t* device_keyring) {
-    *device_keyring = keyctl_search(KEY_SPEC_SESSION_KEYRING, "keyring", "e4crypt", 0);
-    if (*device_keyring == -1) {
-        PLOG(ERROR) << "Unable to find device keyring";
-        return false;
+static bool e4cryptKeyringLocked(key_serial_t* device_keyring) {
+    if (sDeviceKeyring == -1) {
+        sDeviceKeyring = keyctl_search(KEY_SPEC_SESSION_KEYRING, "keyring", "e4crypt", 0);
+        if (sDeviceKeyring == -1) {
+            PLOG(ERROR) << "Unable to find device keyring";
+            return false;
+        }
     }
+    *device_keyring = sDeviceKeyring;
     return true;
 }
 
@@ -123,8 +136,16 @@ bool installKey(const KeyBuffer& key, std::string* raw_ref) {
 
     if (!fillKey(key, &ext4_key)) return false;
     *raw_ref = generateKeyRef(ext4_key.raw, ext4_key.size);
+
+    std::lock_guard<std::mutex> lock(sKeyringLock);
+    // The same key installed again, e.g. for another volume, is already there
+    if (sInstalledKeys.count(*raw_ref) != 0) {
+        LOG(DEBUG) << "Key " << keyname(NAME_PREFIXES[0], *raw_ref) << " already installed";
+        return true;
+    }
     key_serial_t device_keyring;
-    if (!e4cryptKeyring(&device_keyring)) return false;
+    if (!e4cryptKeyringLocked(&device_keyring)) return false;
+    std::vector<key_serial_t> serials;
     for (char const* const* name_prefix = NAME_PREFIXES; *name_prefix != nullptr; name_prefix++) {
         auto ref = keyname(*name_prefix, *raw_ref);
         key_serial_t key_id =
@@ -135,17 +156,32 @@ bool installKey(const KeyBuffer& key, std::string* raw_ref) {
         }
         LOG(DEBUG) << "Added key " << key_id << " (" << ref << ") to keyring " << device_keyring
                    << " in process " << getpid();
+        serials.push_back(key_id);
     }
+    sInstalledKeys[*raw_ref] = serials;
     return true;
 }
 
 bool evictKey(const std::string& raw_ref) {
+    std::lock_guard<std::mutex> lock(sKeyringLock);
     key_serial_t device_keyring;
-    if (!e4cryptKeyring(&device_keyring)) return false;
+    if (!e4cryptKeyringLocked(&device_keyring)) return false;
+
+    // Keys we installed ourselves need no searching for
+    std::vector<key_serial_t> serials;
+    auto it = sInstalledKeys.find(raw_ref);
+    if (it != sInstalledKeys.end()) {
+        serials = std::move(it->second);
+        sInstalledKeys.erase(it);
+    }
+
     bool success = true;
-    for (char const* const* name_prefix = NAME_PREFIXES; *name_prefix != nullptr; name_prefix++) {
+    size_t i = 0;
+    for (char const* const* name_prefix = NAME_PREFIXES; *name_prefix != nullptr;
+            name_prefix++, i++) {
         auto ref = keyname(*name_prefix, raw_ref);
-        auto key_serial = keyctl_search(device_keyring, "logon", ref.c_str(), 0);
+        auto key_serial = i < serials.size() ? serials[i]
+                : keyctl_search(device_keyring, "logon", ref.c_str(), 0);
 
         // Unlink the key from the keyring.  Prefer unlinking to revoking or
         // invalidating, since unlinking is actually no less secure currently, and
@@ -26,6 +26,8 @@ namespace android {
 namespace vold {
 
 bool randomKey(KeyBuffer* key);
+// Raw key reference, as passed to the kernel: the start of a double SHA512
+std::string generateKeyRef(const char* key, int length);
 bool installKey(const KeyBuffer& key, std::string* raw_ref);
 bool evictKey(const std::string& raw_ref);
 bool retrieveAndInstallKey(bool create_if_absent, const std::string& key_path,
@@ -16,11 +16,15 @@
 
 #include "Keymaster.h"
 
+#include "Timings.h"
+
 #include <android-base/logging.h>
 #include <keystore/keymaster_tags.h>
 #include <keystore/authorization_set.h>
 #include <keystore/keystore_hidl_support.h>
 
+#include <mutex>
+
 using namespace ::keystore;
 using android::hardware::hidl_string;
 
@@ -33,6 +37,7 @@ KeymasterOperation::~KeymasterOperation() {
 
 bool KeymasterOperation::updateCompletely(const char* input, size_t inputLen,
         const std::function<void(const char*, size_t)> consumer) {
+    Timing timing("keymaster update", true);
     uint32_t inputConsumed = 0;
 
     ErrorCode km_error;
@@ -69,15 +74,26 @@ bool KeymasterOperation::updateCompletely(const char* input, size_t inputLen,
 }
 
 bool KeymasterOperation::finish(std::string* output) {
+    return finish(nullptr, 0, [&](const char* b, size_t n) {
+        if (output) output->assign(b, n);
+    });
+}
+
+bool KeymasterOperation::finish(const char* input, size_t inputLen,
+        const std::function<void(const char*, size_t)>& consumer) {
+    Timing timing("keymaster finish", true);
     ErrorCode km_error;
     auto hidlCb = [&] (ErrorCode ret, const hidl_vec<KeyParameter>& /*ignored*/,
             const hidl_vec<uint8_t>& _output) {
         km_error = ret;
         if (km_error != ErrorCode::OK) return;
-        if (output)
-            output->assign(reinterpret_cast<const char*>(&_output[0]), _output.size());
+        consumer(reinterpret_cast<const char*>(&_output[0]), _output.size());
     };
-    auto error = mDevice->finish(mOpHandle, hidl_vec<KeyParameter>(), hidl_vec<uint8_t>(),
+    hidl_vec<uint8_t> inputBlob;
+    if (inputLen) {
+        inputBlob = blob2hidlVec(reinterpret_cast<const uint8_t*>(input), inputLen);
+    }
+    auto error = mDevice->finish(mOpHandle, hidl_vec<KeyParameter>(), inputBlob,
             hidl_vec<uint8_t>(), hidlCb);
     mDevice = nullptr;
     if (!error.isOk()) {
@@ -91,11 +107,54 @@ bool KeymasterOperation::finish(std::string* output) {
     return true;
 }
 
+namespace {
+
+std::mutex sDeviceLock;
+sp<IKeymasterDevice> sDevice;
+
+// Forgets the shared connection if the HAL dies, so the next Keymaster
+// looks the service up again.
+class DeviceDeathRecipient : public hardware::hidl_death_recipient {
+  public:
+    void serviceDied(uint64_t /*cookie*/,
+                     const wp<hidl::base::V1_0::IBase>& /*who*/) override {
+        LOG(WARNING) << "Keymaster HAL died; reconnecting on next use";
+        std::lock_guard<std::mutex> lock(sDeviceLock);
+        sDevice = nullptr;
+    }
+};
+
+sp<DeviceDeathRecipient> sDeathRecipient;
+
+}  // namespace
+
+// Every KeyStorage and cryptfs operation makes a Keymaster, so the service
+// lookup is done once per HAL lifetime rather than once per call.
+static sp<IKeymasterDevice> getDevice() {
+    std::lock_guard<std::mutex> lock(sDeviceLock);
+    if (sDevice.get()) return sDevice;
+
+    Timing timing("keymaster getService");
+    sDevice = IKeymasterDevice::getService();
+    if (!sDevice.get()) return nullptr;
+    if (!sDeathRecipient.get()) sDeathRecipient = new DeviceDeathRecipient();
+    auto linked = sDevice->linkToDeath(sDeathRecipient, 0);
+    if (!linked.isOk() || !linked) {
+        // Still usable, just not worth keeping without a way to hear of its death
+        LOG(WARNING) << "Failed to watch keymaster HAL for death";
+        sp<IKeymasterDevice> device = sDevice;
+        sDevice = nullptr;
+        return device;
+    }
+    return sDevice;
+}
+
 Keymaster::Keymaster() {
-    mDevice = ::android::hardware::keymaster::V3_0::IKeymasterDevice::getService();
+    mDevice = getDevice();
 }
 
 bool Keymaster::generateKey(const AuthorizationSet& inParams, std::string* key) {
+    Timing timing("keymaster generateKey", true);
     ErrorCode km_error;
     auto hidlCb = [&] (ErrorCode ret, const hidl_vec<uint8_t>& keyBlob,
             const KeyCharacteristics& /*ignored*/) {
@@ -118,6 +177,7 @@ bool Keymaster::generateKey(const AuthorizationSet& inParams, std::string* key)
 }
 
 bool Keymaster::deleteKey(const std::string& key) {
+    Timing timing("keymaster deleteKey", true);
     auto keyBlob = blob2hidlVec(key);
     auto error = mDevice->deleteKey(keyBlob);
     if (!error.isOk()) {
@@ -133,6 +193,7 @@ bool Keymaster::deleteKey(const std::string& key) {
 
 bool Keymaster::upgradeKey(const std::string& oldKey, const AuthorizationSet& inParams,
                            std::string* newKey) {
+    Timing timing("keymaster upgradeKey", true);
     auto oldKeyBlob = blob2hidlVec(oldKey);
     ErrorCode km_error;
     auto hidlCb = [&] (ErrorCode ret, const hidl_vec<uint8_t>& upgradedKeyBlob) {
@@ -157,6 +218,7 @@ bool Keymaster::upgradeKey(const std::string& oldKey, const AuthorizationSet& in
 KeymasterOperation Keymaster::begin(KeyPurpose purpose, const std::string& key,
                                     const AuthorizationSet& inParams,
                                     AuthorizationSet* outParams) {
+    Timing timing("keymaster begin", true);
     auto keyBlob = blob2hidlVec(key);
     uint64_t mOpHandle;
     ErrorCode km_error;
@@ -314,13 +376,7 @@ int keymaster_sign_object_for_cryptfs_scrypt(const uint8_t* key_blob,
         return -1;
     }
 
-    if (!op.updateCompletely(input, &output)) {
-        LOG(ERROR) << "Error sending data to keymaster signature transaction: "
-                   << uint32_t(op.errorCode());
-        return -1;
-    }
-
-    if (!op.finish(&output)) {
+    if (!op.updateAndFinish(input, &output)) {
         LOG(ERROR) << "Error finalizing keymaster signature transaction: " << int32_t(op.errorCode());
         return -1;
     }
@@ -63,6 +63,15 @@ class KeymasterOperation {
 
     // Finish and write the output to this string, unless pointer is null.
     bool finish(std::string* output);
+    // Pass all of the input to "finish", replacing the output. Saves the
+    // update round trips for inputs as small as a key blob.
+    template <class TI, class TO>
+    bool updateAndFinish(TI& input, TO* output) {
+        if (output) output->clear();
+        return finish(input.data(), input.size(), [&](const char* b, size_t n) {
+            if (output) std::copy(b, b+n, std::back_inserter(*output));
+        });
+    }
     // Move constructor
     KeymasterOperation(KeymasterOperation&& rhs) {
         mDevice = std::move(rhs.mDevice);
@@ -92,6 +101,8 @@ class KeymasterOperation {
 
     bool updateCompletely(const char* input, size_t inputLen,
                           const std::function<void(const char*, size_t)> consumer);
+    bool finish(const char* input, size_t inputLen,
+                const std::function<void(const char*, size_t)>& consumer);
 
     sp<IKeymasterDevice> mDevice;
     uint64_t mOpHandle;
@@ -104,6 +115,7 @@ class KeymasterOperation {
 // part of one.
 class Keymaster {
   public:
+    // Shares one connection to the HAL with every other instance.
     Keymaster();
     // false if we failed to open the keymaster device.
     explicit operator bool() { return mDevice.get() != nullptr; }
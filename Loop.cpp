@@ -21,17 +21,26 @@
 #include <errno.h>
 #include <string.h>
 
+#include <dirent.h>
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
 
 #include <linux/kdev_t.h>
 
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
 #define LOG_TAG "Vold"
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
@@ -45,121 +54,155 @@
 using android::base::StringPrintf;
 using android::base::unique_fd;
 
-int Loop::dumpState(SocketClient *c) {
-    int i;
-    int fd;
-    char filename[256];
+/* Older kernel headers predate these; kernels without them return EINVAL */
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+#ifndef LOOP_SET_BLOCK_SIZE
+#define LOOP_SET_BLOCK_SIZE 0x4C09
+#endif
 
-    for (i = 0; i < LOOP_MAX; i++) {
-        struct loop_info64 li;
-        int rc;
+/* Kernels stop handing out free loops long before this many races */
+static const int kMaxAllocAttempts = 8;
 
-        snprintf(filename, sizeof(filename), "/dev/block/loop%d", i);
+/*
+ * What vold knows about each bound loop, so allocation and lookups don't
+ * have to probe every possible loop node. Loaded with one full scan on
+ * first use, to pick up loops left behind by an earlier vold, and kept
+ * current by create() and destroyByDevice().
+ */
+struct LoopInfo {
+    std::string id;
+    std::string file;
+};
+
+static std::mutex sLoopsLock;
+static bool sLoopsLoaded = false;
+static std::map<int, LoopInfo> sLoops;
+static std::unordered_map<std::string, int> sLoopsById;
+
+static std::string loopPath(int i) {
+    return StringPrintf("/dev/block/loop%d", i);
+}
 
-        if ((fd = open(filename, O_RDWR | O_CLOEXEC)) < 0) {
-            if (errno != ENOENT) {
-                SLOGE("Unable to open %s (%s)", filename, strerror(errno));
-            } else {
-                continue;
-            }
-            return -1;
-        }
+/* Loop ids are stored truncated, so compare them the same way */
+static std::string loopId(const char *id) {
+    return std::string(id, strnlen(id, LO_NAME_SIZE - 1));
+}
 
-        rc = ioctl(fd, LOOP_GET_STATUS64, &li);
-        close(fd);
-        if (rc < 0 && errno == ENXIO) {
-            continue;
-        }
+static int loopIndex(const char *loopDevice) {
+    int i;
+    char extra;
+    if (sscanf(loopDevice, "/dev/block/loop%d%c", &i, &extra) != 1) {
+        return -1;
+    }
+    return i;
+}
 
-        if (rc < 0) {
-            SLOGE("Unable to get loop status for %s (%s)", filename,
-                 strerror(errno));
-            return -1;
+/*
+ * Returns 1 with |li| filled in if loop |i| is bound, 0 if it isn't or
+ * its node doesn't exist, or -1 with errno set.
+ */
+static int getLoopStatus(int i, struct loop_info64 *li) {
+    std::string filename(loopPath(i));
+    int fd = open(filename.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
         }
-        char *tmp = NULL;
-        asprintf(&tmp, "%s %d %lld:%lld %llu %lld:%lld %lld 0x%x {%s} {%s}", filename, li.lo_number,
-                MAJOR(li.lo_device), MINOR(li.lo_device), li.lo_inode, MAJOR(li.lo_rdevice),
-                        MINOR(li.lo_rdevice), li.lo_offset, li.lo_flags, li.lo_crypt_name,
-                        li.lo_file_name);
-        c->sendMsg(0, tmp, false);
-        free(tmp);
+        SLOGE("Unable to open %s (%s)", filename.c_str(), strerror(errno));
+        return -1;
     }
-    return 0;
+
+    int rc = ioctl(fd, LOOP_GET_STATUS64, li);
+    int sverrno = errno;
+    close(fd);
+    if (rc < 0 && sverrno == ENXIO) {
+        return 0;
+    }
+    if (rc < 0) {
+        SLOGE("Unable to get loop status for %s (%s)", filename.c_str(), strerror(sverrno));
+        errno = sverrno;
+        return -1;
+    }
+    return 1;
 }
 
-int Loop::lookupActive(const char *id, char *buffer, size_t len) {
-    int i;
-    int fd;
-    char filename[256];
+static void rememberLoopLocked(int i, const std::string& id, const std::string& file) {
+    sLoops[i] = LoopInfo{id, file};
+    if (!id.empty()) {
+        sLoopsById[id] = i;
+    }
+}
 
-    memset(buffer, 0, len);
+static void forgetLoopLocked(int i) {
+    auto it = sLoops.find(i);
+    if (it == sLoops.end()) {
+        return;
+    }
+    auto byId = sLoopsById.find(it->second.id);
+    if (byId != sLoopsById.end() && byId->second == i) {
+        sLoopsById.erase(byId);
+    }
+    sLoops.erase(it);
+}
 
-    for (i = 0; i < LOOP_MAX; i++) {
+static int loadLoopsLocked() {
+    if (sLoopsLoaded) {
+        return 0;
+    }
+    for (int i = 0; i < Loop::LOOP_MAX; i++) {
         struct loop_info64 li;
-        int rc;
-
-        snprintf(filename, sizeof(filename), "/dev/block/loop%d", i);
-
-        if ((fd = open(filename, O_RDWR | O_CLOEXEC)) < 0) {
-            if (errno != ENOENT) {
-                SLOGE("Unable to open %s (%s)", filename, strerror(errno));
-            } else {
-                continue;
-            }
-            return -1;
-        }
-
-        rc = ioctl(fd, LOOP_GET_STATUS64, &li);
-        if (rc < 0 && errno == ENXIO) {
-            close(fd);
-            continue;
-        }
-        close(fd);
-
+        int rc = getLoopStatus(i, &li);
         if (rc < 0) {
-            SLOGE("Unable to get loop status for %s (%s)", filename,
-                 strerror(errno));
+            sLoops.clear();
+            sLoopsById.clear();
             return -1;
         }
-        if (!strncmp((const char*) li.lo_crypt_name, id, LO_NAME_SIZE)) {
-            break;
+        if (rc > 0) {
+            rememberLoopLocked(i, loopId((const char*) li.lo_crypt_name),
+                    loopId((const char*) li.lo_file_name));
         }
     }
-
-    if (i == LOOP_MAX) {
-        errno = ENOENT;
-        return -1;
-    }
-    strlcpy(buffer, filename, len);
+    sLoopsLoaded = true;
     return 0;
 }
 
-int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len) {
-    int i;
-    int fd;
-    char filename[256];
+/*
+ * Allocates a free loop, creating its node if needed, and binds |file_fd|
+ * to it. Another process can grab the same free loop before we bind it,
+ * in which case LOOP_SET_FD fails with EBUSY and we ask again.
+ */
+static int bindFreeLoop(int file_fd, int *index) {
+    unique_fd ctl_fd(open("/dev/loop-control", O_RDWR | O_CLOEXEC));
+    if (ctl_fd.get() == -1) {
+        SLOGE("Unable to open loop-control (%s)", strerror(errno));
+        return -1;
+    }
 
-    for (i = 0; i < LOOP_MAX; i++) {
-        struct loop_info64 li;
-        int rc;
+    for (int attempt = 0; attempt < kMaxAllocAttempts; attempt++) {
+        int i = ioctl(ctl_fd.get(), LOOP_CTL_GET_FREE);
+        if (i < 0) {
+            SLOGE("Exhausted all loop devices (%s)", strerror(errno));
+            errno = ENOSPC;
+            return -1;
+        }
+        std::string filename(loopPath(i));
         char *secontext = NULL;
 
-        snprintf(filename, sizeof(filename), "/dev/block/loop%d", i);
-
         /*
-         * The kernel starts us off with 8 loop nodes, but more
-         * are created on-demand if needed.
+         * The kernel creates loops on demand, but the node may not have
+         * shown up in /dev/block yet.
          */
         mode_t mode = 0660 | S_IFBLK;
         unsigned int dev = (0xff & i) | ((i << 12) & 0xfff00000) | (7 << 8);
 
         if (sehandle) {
-            rc = selabel_lookup(sehandle, &secontext, filename, S_IFBLK);
-            if (rc == 0)
+            if (selabel_lookup(sehandle, &secontext, filename.c_str(), S_IFBLK) == 0)
                 setfscreatecon(secontext);
         }
 
-        if (mknod(filename, mode, dev) < 0) {
+        if (mknod(filename.c_str(), mode, dev) < 0) {
             if (errno != EEXIST) {
                 int sverrno = errno;
                 SLOGE("Error creating loop device node (%s)", strerror(errno));
@@ -176,44 +219,184 @@ int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, s
             setfscreatecon(NULL);
         }
 
-        if ((fd = open(filename, O_RDWR | O_CLOEXEC)) < 0) {
-            SLOGE("Unable to open %s (%s)", filename, strerror(errno));
+        int fd = open(filename.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            SLOGE("Unable to open %s (%s)", filename.c_str(), strerror(errno));
+            return -1;
+        }
+        if (ioctl(fd, LOOP_SET_FD, file_fd) < 0) {
+            int sverrno = errno;
+            close(fd);
+            if (sverrno == EBUSY) {
+                continue;
+            }
+            SLOGE("Error setting up loopback interface (%s)", strerror(sverrno));
+            errno = sverrno;
             return -1;
         }
+        *index = i;
+        return fd;
+    }
 
-        rc = ioctl(fd, LOOP_GET_STATUS64, &li);
-        if (rc < 0 && errno == ENXIO)
-            break;
+    SLOGE("Lost too many races for a free loop device");
+    errno = EBUSY;
+    return -1;
+}
 
-        close(fd);
+/* Logical block size of the device holding |file_fd|, or 512 if unknown */
+static unsigned long backingBlockSize(int file_fd) {
+    struct stat st;
+    if (fstat(file_fd, &st) == 0) {
+        // Partitions keep their queue limits in the parent disk
+        for (const char* queue : { "queue", "../queue" }) {
+            std::string path = StringPrintf("/sys/dev/block/%u:%u/%s/logical_block_size",
+                    major(st.st_dev), minor(st.st_dev), queue);
+            std::string value;
+            if (android::base::ReadFileToString(path, &value)) {
+                unsigned long size = strtoul(value.c_str(), nullptr, 10);
+                if (size >= 512) return size;
+            }
+        }
+    }
+    return 512;
+}
 
-        if (rc < 0) {
-            SLOGE("Unable to get loop status for %s (%s)", filename,
-                 strerror(errno));
-            return -1;
+/*
+ * Switches a freshly bound loop to direct I/O on its backing file, so its
+ * pages are cached once by the loop device instead of also in the file's
+ * page cache. The kernel only allows that when the loop's logical block
+ * size is at least the backing device's. Raising it would change the
+ * sector size OBB, ASEC and virtual disk images were laid out with, so on
+ * devices with larger blocks we pin 512 and stay buffered. Needs kernel
+ * 4.10 for direct I/O; older kernels reject the ioctl.
+ */
+static void enableDirectIo(int device_fd, int file_fd) {
+    if (!property_get_bool("vold.loop_direct_io", true)) {
+        return;
+    }
+
+    unsigned long blockSize = backingBlockSize(file_fd);
+    if (blockSize > 512) {
+        SLOGD("Leaving loop buffered; backing device uses %lu byte blocks", blockSize);
+        return;
+    }
+    // Make the 512 byte blocks our images assume explicit; needs 4.14
+    ioctl(device_fd, LOOP_SET_BLOCK_SIZE, 512UL);
+    if (ioctl(device_fd, LOOP_SET_DIRECT_IO, 1UL) < 0) {
+        SLOGD("Loop direct I/O not supported (%s)", strerror(errno));
+    }
+}
+
+/*
+ * Lists every bound loop the kernel knows of, including ones set up by
+ * other processes or leaked past LOOP_MAX, tagging those vold tracks with
+ * an id as "vold" and the rest as "foreign".
+ */
+int Loop::dumpState(SocketClient *c) {
+    std::lock_guard<std::mutex> lock(sLoopsLock);
+    if (loadLoopsLocked()) {
+        return -1;
+    }
+
+    std::unique_ptr<DIR, int (*)(DIR*)> dirp(opendir("/sys/block"), closedir);
+    if (!dirp) {
+        SLOGE("Unable to read /sys/block (%s)", strerror(errno));
+        return -1;
+    }
+    std::map<int, std::string> bound;
+    struct dirent* ent;
+    while ((ent = readdir(dirp.get()))) {
+        int i;
+        char extra;
+        if (sscanf(ent->d_name, "loop%d%c", &i, &extra) != 1) {
+            continue;
+        }
+        // Only present while something is bound
+        std::string file;
+        if (!android::base::ReadFileToString(
+                StringPrintf("/sys/block/%s/loop/backing_file", ent->d_name), &file)) {
+            continue;
+        }
+        while (!file.empty() && file.back() == '\n') {
+            file.pop_back();
+        }
+        bound[i] = file;
+    }
+
+    for (const auto& entry : bound) {
+        auto known = sLoops.find(entry.first);
+        const char* owner = (known != sLoops.end() && !known->second.id.empty())
+                ? "vold" : "foreign";
+        std::string filename(loopPath(entry.first));
+        char *tmp = NULL;
+        struct loop_info64 li;
+        if (getLoopStatus(entry.first, &li) > 0) {
+            asprintf(&tmp, "%s %s %d %lld:%lld %llu %lld:%lld %lld 0x%x {%s} {%s}",
+                    filename.c_str(), owner, li.lo_number, MAJOR(li.lo_device),
+                    MINOR(li.lo_device), li.lo_inode, MAJOR(li.lo_rdevice),
+                    MINOR(li.lo_rdevice), li.lo_offset, li.lo_flags, li.lo_crypt_name,
+                    entry.second.c_str());
+        } else {
+            // No node of ours to ask, so sysfs is all there is
+            asprintf(&tmp, "%s %s {} {%s}", filename.c_str(), owner, entry.second.c_str());
         }
+        c->sendMsg(0, tmp, false);
+        free(tmp);
+    }
+    return 0;
+}
+
+int Loop::lookupActive(const char *id, char *buffer, size_t len) {
+    memset(buffer, 0, len);
+
+    std::lock_guard<std::mutex> lock(sLoopsLock);
+    if (loadLoopsLocked()) {
+        return -1;
     }
 
-    if (i == LOOP_MAX) {
-        SLOGE("Exhausted all loop devices");
-        errno = ENOSPC;
+    std::string key(loopId(id));
+    auto it = sLoopsById.find(key);
+    if (it == sLoopsById.end()) {
+        errno = ENOENT;
         return -1;
     }
 
-    strlcpy(loopDeviceBuffer, filename, len);
+    // Double-check with the kernel in case someone else released it
+    int i = it->second;
+    struct loop_info64 li;
+    int rc = getLoopStatus(i, &li);
+    if (rc < 0) {
+        return -1;
+    }
+    if (rc == 0 || loopId((const char*) li.lo_crypt_name) != key) {
+        forgetLoopLocked(i);
+        errno = ENOENT;
+        return -1;
+    }
+
+    strlcpy(buffer, loopPath(i).c_str(), len);
+    return 0;
+}
+
+int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len) {
+    std::lock_guard<std::mutex> lock(sLoopsLock);
+    if (loadLoopsLocked()) {
+        return -1;
+    }
 
     int file_fd;
 
     if ((file_fd = open(loopFile, O_RDWR | O_CLOEXEC)) < 0) {
         SLOGE("Unable to open %s (%s)", loopFile, strerror(errno));
-        close(fd);
         return -1;
     }
 
-    if (ioctl(fd, LOOP_SET_FD, file_fd) < 0) {
-        SLOGE("Error setting up loopback interface (%s)", strerror(errno));
+    int i;
+    int fd = bindFreeLoop(file_fd, &i);
+    if (fd < 0) {
+        int sverrno = errno;
         close(file_fd);
-        close(fd);
+        errno = sverrno;
         return -1;
     }
 
@@ -225,48 +408,44 @@ int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, s
 
     if (ioctl(fd, LOOP_SET_STATUS64, &li) < 0) {
         SLOGE("Error setting loopback status (%s)", strerror(errno));
+        ioctl(fd, LOOP_CLR_FD, 0);
         close(file_fd);
         close(fd);
         return -1;
     }
 
+    enableDirectIo(fd, file_fd);
+
     close(fd);
     close(file_fd);
 
+    rememberLoopLocked(i, loopId(id), loopId(loopFile));
+    strlcpy(loopDeviceBuffer, loopPath(i).c_str(), len);
     return 0;
 }
 
 int Loop::create(const std::string& target, std::string& out_device) {
-    unique_fd ctl_fd(open("/dev/loop-control", O_RDWR | O_CLOEXEC));
-    if (ctl_fd.get() == -1) {
-        PLOG(ERROR) << "Failed to open loop-control";
-        return -errno;
-    }
-
-    int num = ioctl(ctl_fd.get(), LOOP_CTL_GET_FREE);
-    if (num == -1) {
-        PLOG(ERROR) << "Failed LOOP_CTL_GET_FREE";
-        return -errno;
-    }
-
-    out_device = StringPrintf("/dev/block/loop%d", num);
+    std::lock_guard<std::mutex> lock(sLoopsLock);
 
     unique_fd target_fd(open(target.c_str(), O_RDWR | O_CLOEXEC));
     if (target_fd.get() == -1) {
         PLOG(ERROR) << "Failed to open " << target;
         return -errno;
     }
-    unique_fd device_fd(open(out_device.c_str(), O_RDWR | O_CLOEXEC));
+
+    int num;
+    unique_fd device_fd(bindFreeLoop(target_fd.get(), &num));
     if (device_fd.get() == -1) {
-        PLOG(ERROR) << "Failed to open " << out_device;
+        PLOG(ERROR) << "Failed to bind a loop device to " << target;
         return -errno;
     }
 
-    if (ioctl(device_fd.get(), LOOP_SET_FD, target_fd.get()) == -1) {
-        PLOG(ERROR) << "Failed to LOOP_SET_FD";
-        return -errno;
-    }
+    enableDirectIo(device_fd.get(), target_fd.get());
 
+    out_device = loopPath(num);
+    if (sLoopsLoaded) {
+        rememberLoopLocked(num, "", loopId(target.c_str()));
+    }
     return 0;
 }
 
@@ -286,6 +465,12 @@ int Loop::destroyByDevice(const char *loopDevice) {
     }
 
     close(device_fd);
+
+    int i = loopIndex(loopDevice);
+    if (i >= 0) {
+        std::lock_guard<std::mutex> lock(sLoopsLock);
+        forgetLoopLocked(i);
+    }
     return 0;
 }
 
@@ -338,6 +523,19 @@ int Loop::resizeImageFile(const char *file, unsigned long numSectors) {
     return 0;
 }
 
+int Loop::setCapacity(const char *loopDevice) {
+    unique_fd fd(open(loopDevice, O_RDONLY | O_CLOEXEC));
+    if (fd.get() == -1) {
+        PLOG(ERROR) << "Failed to open " << loopDevice;
+        return -1;
+    }
+    if (ioctl(fd.get(), LOOP_SET_CAPACITY, 0) == -1) {
+        PLOG(ERROR) << "Failed to update capacity of " << loopDevice;
+        return -1;
+    }
+    return 0;
+}
+
 int Loop::lookupInfo(const char *loopDevice, struct asec_superblock *sb, unsigned long *nr_sec) {
     int fd;
     struct asec_superblock buffer;
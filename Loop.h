@@ -35,6 +35,8 @@ public:
     static int destroyByFile(const char *loopFile);
     static int createImageFile(const char *file, unsigned long numSectors);
     static int resizeImageFile(const char *file, unsigned long numSectors);
+    /* Has |loopDevice| pick up the current size of its backing file */
+    static int setCapacity(const char *loopDevice);
 
     static int dumpState(SocketClient *c);
 };
@@ -21,35 +21,40 @@
 #include <thread>
 #include <vector>
 #include <algorithm>
+#include <chrono>
 
+#include <endian.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
+#include <string.h>
+#include <sys/mount.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include <linux/dm-ioctl.h>
-
 #include <android-base/logging.h>
+#include <android-base/properties.h>
 #include <android-base/unique_fd.h>
 #include <cutils/properties.h>
 #include <fs_mgr.h>
 
+#include "DeviceMapper.h"
 #include "EncryptInplace.h"
 #include "KeyStorage.h"
 #include "KeyUtil.h"
 #include "secontext.h"
+#include "Timings.h"
 #include "Utils.h"
 #include "VoldUtil.h"
 
 extern struct fstab *fstab;
-#define DM_CRYPT_BUF_SIZE 4096
-#define TABLE_LOAD_RETRIES 10
 #define DEFAULT_KEY_TARGET_TYPE "default-key"
 
+using android::vold::DeviceMapper;
+using android::vold::ConcatKeyBuffer;
 using android::vold::KeyBuffer;
 
 static const std::string kDmNameUserdata = "userdata";
+static const std::chrono::milliseconds kDmNodeTimeout = std::chrono::seconds(5);
 
 static bool mount_via_fs_mgr(const char* mount_point, const char* blk_device) {
     // fs_mgr_do_mount runs fsck. Use setexeccon to run trusted
@@ -72,6 +77,38 @@ static bool mount_via_fs_mgr(const char* mount_point, const char* blk_device) {
     return true;
 }
 
+// Whether the ext4 superblock on |blk_device| says the last unmount was
+// clean: valid, no recorded errors and no journal left to replay.
+static bool ext4_cleanly_unmounted(const char* blk_device) {
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(blk_device, O_RDONLY | O_CLOEXEC)));
+    if (fd == -1) {
+        PLOG(WARNING) << "Unable to open " << blk_device << " to read superblock";
+        return false;
+    }
+    uint8_t sb[1024];
+    if (TEMP_FAILURE_RETRY(pread(fd, sb, sizeof(sb), 1024)) != sizeof(sb)) {
+        PLOG(WARNING) << "Unable to read superblock of " << blk_device;
+        return false;
+    }
+    auto le16 = [&](size_t off) { uint16_t v; memcpy(&v, sb + off, sizeof(v)); return le16toh(v); };
+    auto le32 = [&](size_t off) { uint32_t v; memcpy(&v, sb + off, sizeof(v)); return le32toh(v); };
+    if (le16(0x38) != 0xEF53) return false;
+    uint16_t state = le16(0x3A);
+    uint32_t incompat = le32(0x60);
+    // EXT4_VALID_FS, EXT4_ERROR_FS and EXT4_FEATURE_INCOMPAT_RECOVER
+    return (state & 0x1) && !(state & 0x2) && !(incompat & 0x4);
+}
+
+// Mounts |blk_device| directly with the fstab options, without fsck
+static bool mount_clean(const struct fstab_rec* rec, const char* blk_device) {
+    if (mount(blk_device, rec->mount_point, rec->fs_type, rec->flags, rec->fs_options) != 0) {
+        PLOG(WARNING) << "Direct mount of " << blk_device << " failed";
+        return false;
+    }
+    LOG(DEBUG) << "Mounted " << rec->mount_point << " without fsck";
+    return true;
+}
+
 static bool read_key(bool create_if_absent, KeyBuffer* key) {
     auto data_rec = fs_mgr_get_crypt_entry(fstab);
     if (!data_rec) {
@@ -103,7 +140,7 @@ static KeyBuffer default_key_params(const std::string& real_blkdev, const KeyBuf
         LOG(ERROR) << "Failed to turn key to hex";
         return KeyBuffer();
     }
-    auto res = KeyBuffer() + "AES-256-XTS " + hex_key + " " + real_blkdev.c_str() + " 0";
+    auto res = ConcatKeyBuffer({ "AES-256-XTS ", hex_key, " ", real_blkdev.c_str(), " 0" });
     LOG(DEBUG) << "crypt_params: " << std::string(res.data(), res.size());
     return res;
 }
@@ -126,87 +163,28 @@ static bool get_number_of_sectors(const std::string& real_blkdev, uint64_t *nr_s
     return true;
 }
 
-static struct dm_ioctl* dm_ioctl_init(char *buffer, size_t buffer_size,
-                                      const std::string& dm_name) {
-    if (buffer_size < sizeof(dm_ioctl)) {
-        LOG(ERROR) << "dm_ioctl buffer too small";
-        return nullptr;
-    }
-
-    memset(buffer, 0, buffer_size);
-    struct dm_ioctl* io = (struct dm_ioctl*) buffer;
-    io->data_size = buffer_size;
-    io->data_start = sizeof(struct dm_ioctl);
-    io->version[0] = 4;
-    io->version[1] = 0;
-    io->version[2] = 0;
-    io->flags = 0;
-    dm_name.copy(io->name, sizeof(io->name));
-    return io;
-}
-
 static bool create_crypto_blk_dev(const std::string& dm_name, uint64_t nr_sec,
                                   const std::string& target_type, const KeyBuffer& crypt_params,
                                   std::string* crypto_blkdev) {
-    android::base::unique_fd dm_fd(TEMP_FAILURE_RETRY(open(
-        "/dev/device-mapper", O_RDWR | O_CLOEXEC, 0)));
-    if (dm_fd == -1) {
-        PLOG(ERROR) << "Cannot open device-mapper";
-        return false;
-    }
-    alignas(struct dm_ioctl) char buffer[DM_CRYPT_BUF_SIZE];
-    auto io = dm_ioctl_init(buffer, sizeof(buffer), dm_name);
-    if (!io || ioctl(dm_fd.get(), DM_DEV_CREATE, io) != 0) {
-        PLOG(ERROR) << "Cannot create dm-crypt device " << dm_name;
-        return false;
-    }
-
-    // Get the device status, in particular, the name of its device file
-    io = dm_ioctl_init(buffer, sizeof(buffer), dm_name);
-    if (ioctl(dm_fd.get(), DM_DEV_STATUS, io) != 0) {
-        PLOG(ERROR) << "Cannot retrieve dm-crypt device status " << dm_name;
-        return false;
-    }
-    *crypto_blkdev = std::string() + "/dev/block/dm-" + std::to_string(
-        (io->dev & 0xff) | ((io->dev >> 12) & 0xfff00));
-
-    io = dm_ioctl_init(buffer, sizeof(buffer), dm_name);
-    size_t paramix = io->data_start + sizeof(struct dm_target_spec);
-    size_t nullix = paramix + crypt_params.size();
-    size_t endix = (nullix + 1 + 7) & 8; // Add room for \0 and align to 8 byte boundary
-
-    if (endix > sizeof(buffer)) {
-        LOG(ERROR) << "crypt_params too big for DM_CRYPT_BUF_SIZE";
+    std::vector<DeviceMapper::Target> table(1);
+    table[0].start = 0;
+    table[0].length = nr_sec;
+    table[0].type = target_type;
+    table[0].params = KeyBuffer() + crypt_params;
+
+    DeviceMapper dm;
+    if (dm.createDevice(dm_name, table, crypto_blkdev) != android::OK) {
+        LOG(ERROR) << "Cannot create dm-crypt device " << dm_name;
         return false;
     }
 
-    io->target_count = 1;
-    auto tgt = (struct dm_target_spec *) (buffer + io->data_start);
-    tgt->status = 0;
-    tgt->sector_start = 0;
-    tgt->length = nr_sec;
-    target_type.copy(tgt->target_type, sizeof(tgt->target_type));
-    memcpy(buffer + paramix, crypt_params.data(),
-            std::min(crypt_params.size(), sizeof(buffer) - paramix));
-    buffer[nullix] = '\0';
-    tgt->next = endix;
-
-    for (int i = 0; ; i++) {
-        if (ioctl(dm_fd.get(), DM_TABLE_LOAD, io) == 0) {
-            break;
+    // Mounting follows immediately, so wait for ueventd to create the node
+    if (!android::vold::WaitForFile(*crypto_blkdev, kDmNodeTimeout)) {
+        LOG(ERROR) << "Timed out waiting for " << *crypto_blkdev;
+        // Don't leave it behind to block the next attempt at the same name
+        if (dm.deleteDevice(dm_name) != android::OK) {
+            LOG(WARNING) << "Failed to remove dm-crypt device " << dm_name;
         }
-        if (i+1 >= TABLE_LOAD_RETRIES) {
-            PLOG(ERROR) << "DM_TABLE_LOAD ioctl failed";
-            return false;
-        }
-        PLOG(INFO) << "DM_TABLE_LOAD ioctl failed, retrying";
-        usleep(500000);
-    }
-
-    // Resume this device to activate it
-    io = dm_ioctl_init(buffer, sizeof(buffer), dm_name);
-    if (ioctl(dm_fd.get(), DM_DEV_SUSPEND, io)) {
-        PLOG(ERROR) << "Cannot resume dm-crypt device " << dm_name;
         return false;
     }
     return true;
@@ -251,22 +229,52 @@ static void async_kick_off() {
 
 bool e4crypt_mount_metadata_encrypted() {
     LOG(DEBUG) << "e4crypt_mount_default_encrypted";
-    KeyBuffer key;
-    if (!read_key(false, &key)) return false;
+    android::vold::Timing timing("e4crypt_mount_metadata_encrypted");
     auto data_rec = fs_mgr_get_crypt_entry(fstab);
     if (!data_rec) {
         LOG(ERROR) << "Failed to get data_rec";
         return false;
     }
-    uint64_t nr_sec;
-    if (!get_number_of_sectors(data_rec->blk_device, &nr_sec)) return false;
+
+    // Probe the size while keymaster unwraps the key, so the dm device can
+    // be created the moment the key arrives
+    uint64_t nr_sec = 0;
+    bool have_size = false;
+    std::thread size_probe([&]() {
+        android::vold::Timing timing("metadata size probe");
+        have_size = get_number_of_sectors(data_rec->blk_device, &nr_sec);
+    });
+    KeyBuffer key;
+    bool have_key;
+    {
+        android::vold::Timing timing("metadata read_key");
+        have_key = read_key(false, &key);
+    }
+    size_probe.join();
+    if (!have_key || !have_size) return false;
+
     std::string crypto_blkdev;
-    if (!create_crypto_blk_dev(kDmNameUserdata, nr_sec, DEFAULT_KEY_TARGET_TYPE,
-        default_key_params(data_rec->blk_device, key), &crypto_blkdev)) return false;
+    {
+        android::vold::Timing timing("metadata dm setup");
+        if (!create_crypto_blk_dev(kDmNameUserdata, nr_sec, DEFAULT_KEY_TARGET_TYPE,
+            default_key_params(data_rec->blk_device, key), &crypto_blkdev)) return false;
+    }
     // FIXME handle the corrupt case
 
     LOG(DEBUG) << "Restarting filesystem for metadata encryption";
-    mount_via_fs_mgr(data_rec->mount_point, crypto_blkdev.c_str());
+    {
+        android::vold::Timing timing("metadata mount");
+        // A clean ext4 needs no fsck; anything else goes through fs_mgr
+        bool mounted = false;
+        if (android::base::GetBoolProperty("vold.metadata_skip_clean_fsck", false)
+                && !strcmp(data_rec->fs_type, "ext4")
+                && ext4_cleanly_unmounted(crypto_blkdev.c_str())) {
+            mounted = mount_clean(data_rec, crypto_blkdev.c_str());
+        }
+        if (!mounted) {
+            mount_via_fs_mgr(data_rec->mount_point, crypto_blkdev.c_str());
+        }
+    }
     std::thread(&async_kick_off).detach();
     return true;
 }
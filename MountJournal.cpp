@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MountJournal.h"
+#include "MountTable.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <cutils/properties.h>
+#include <private/android_filesystem_config.h>
+
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+/* On tmpfs, so a reboot always starts without one */
+static const char* kJournalDir = "/mnt/vold";
+static const char* kJournalPath = "/mnt/vold/mounts";
+
+struct Entry {
+    std::string source;
+    std::string target;
+    /* Left by a previous vold and not adopted yet */
+    bool live;
+};
+
+/* Volumes mount in parallel, so serialize updates to the journal */
+static std::mutex sJournalLock;
+static std::map<std::string, Entry> sEntries;
+
+static void saveLocked() {
+    std::string content;
+    for (const auto& it : sEntries) {
+        content += StringPrintf("%s %s %s\n", it.first.c_str(), it.second.source.c_str(),
+                it.second.target.c_str());
+    }
+
+    if (mkdir(kJournalDir, 0700) != 0 && errno != EEXIST) {
+        PLOG(WARNING) << "Failed to create " << kJournalDir;
+        return;
+    }
+    std::string tmpPath = StringPrintf("%s.tmp", kJournalPath);
+    if (!android::base::WriteStringToFile(content, tmpPath, 0600, AID_ROOT, AID_ROOT)) {
+        PLOG(WARNING) << "Failed to write " << tmpPath;
+        return;
+    }
+    if (rename(tmpPath.c_str(), kJournalPath)) {
+        PLOG(WARNING) << "Failed to rename " << tmpPath;
+        unlink(tmpPath.c_str());
+    }
+}
+
+void JournalMount(const std::string& id, const std::string& source, const std::string& target) {
+    std::lock_guard<std::mutex> lock(sJournalLock);
+    sEntries[id] = Entry{ source, target, false };
+    saveLocked();
+}
+
+void ForgetMount(const std::string& id) {
+    std::lock_guard<std::mutex> lock(sJournalLock);
+    if (sEntries.erase(id)) {
+        saveLocked();
+    }
+}
+
+std::set<std::string> LoadLiveMounts(MountTable& table) {
+    std::lock_guard<std::mutex> lock(sJournalLock);
+    std::set<std::string> targets;
+    sEntries.clear();
+
+    std::string content;
+    if (property_get_bool("vold.warm_restart", true)
+            && android::base::ReadFileToString(kJournalPath, &content)) {
+        std::istringstream in(content);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::string id;
+            Entry entry;
+            std::istringstream fields(line);
+            if (!(fields >> id >> entry.source >> entry.target)) continue;
+
+            // Only a writable mount is worth keeping; one left read-only by
+            // an unfinished background check gets checked again
+            bool live = false;
+            for (const auto& mount : table.findBySource(entry.source)) {
+                if (mount.target == entry.target && mount.options.compare(0, 2, "rw") == 0) {
+                    live = true;
+                    break;
+                }
+            }
+            if (!live) continue;
+
+            LOG(INFO) << "Keeping " << entry.target << " of " << id << " for adoption";
+            entry.live = true;
+            targets.insert(entry.target);
+            sEntries[id] = entry;
+        }
+    }
+    saveLocked();
+    return targets;
+}
+
+bool HasLiveMount(const std::string& id) {
+    std::lock_guard<std::mutex> lock(sJournalLock);
+    auto it = sEntries.find(id);
+    return it != sEntries.end() && it->second.live;
+}
+
+bool AdoptLiveMount(const std::string& id, const std::string& source,
+        const std::string& target) {
+    {
+        std::lock_guard<std::mutex> lock(sJournalLock);
+        auto it = sEntries.find(id);
+        if (it == sEntries.end() || !it->second.live) {
+            return false;
+        }
+        if (it->second.source == source && it->second.target == target) {
+            it->second.live = false;
+            LOG(INFO) << id << " adopted " << target << " from a previous vold";
+            return true;
+        }
+        LOG(INFO) << id << " left " << it->second.target << " mounted from "
+                << it->second.source << ", not " << source;
+    }
+    ReleaseLiveMount(id);
+    return false;
+}
+
+void ReleaseLiveMount(const std::string& id) {
+    std::string target;
+    {
+        std::lock_guard<std::mutex> lock(sJournalLock);
+        auto it = sEntries.find(id);
+        if (it == sEntries.end() || !it->second.live) {
+            return;
+        }
+        target = it->second.target;
+        sEntries.erase(it);
+        saveLocked();
+    }
+    LOG(INFO) << "Tearing down " << target << " left by " << id;
+    ForceUnmount(target);
+}
+
+void ReleaseLiveMounts(const std::function<bool(const std::string&)>& exists) {
+    std::vector<std::string> ids;
+    {
+        std::lock_guard<std::mutex> lock(sJournalLock);
+        for (const auto& it : sEntries) {
+            if (it.second.live && !exists(it.first)) {
+                ids.push_back(it.first);
+            }
+        }
+    }
+    for (const auto& id : ids) {
+        ReleaseLiveMount(id);
+    }
+}
+
+}  // namespace vold
+}  // namespace android
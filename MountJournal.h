@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_MOUNT_JOURNAL_H
+#define ANDROID_VOLD_MOUNT_JOURNAL_H
+
+#include "Utils.h"
+
+#include <functional>
+#include <set>
+#include <string>
+
+namespace android {
+namespace vold {
+
+class MountTable;
+
+/*
+ * Lets the filesystem mounts of volumes outlive vold itself.
+ *
+ * Each volume journals the device it mounted and where, in a file on
+ * tmpfs so that it never outlives the boot. When vold restarts, journaled
+ * mounts that are still live and writable are spared from the stale mount
+ * teardown, and the volume adopts them when it's created and mounted
+ * again, skipping its check and mount. Mounts that aren't adopted within
+ * vold.warm_reset_timeout_ms are released. FUSE daemons die along with
+ * vold, so the layers above are always started afresh. vold.warm_restart
+ * set to false ignores the journal.
+ */
+
+/* Records that volume |id| has |source| mounted at |target| */
+void JournalMount(const std::string& id, const std::string& source, const std::string& target);
+/* Drops the record of |id|, once it's unmounted */
+void ForgetMount(const std::string& id);
+
+/*
+ * Loads the journal a previous vold left, keeping only the mounts still
+ * live in |table|, and returns their targets.
+ */
+std::set<std::string> LoadLiveMounts(MountTable& table);
+
+/* Whether |id| left a live mount that's waiting to be adopted */
+bool HasLiveMount(const std::string& id);
+/* Takes over the live mount of |source| at |target| left by |id|, if any */
+bool AdoptLiveMount(const std::string& id, const std::string& source,
+        const std::string& target);
+/* Unmounts what |id| left behind, unless it was adopted */
+void ReleaseLiveMount(const std::string& id);
+/* As above, for every volume that |exists| doesn't know of */
+void ReleaseLiveMounts(const std::function<bool(const std::string&)>& exists);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MountTable.h"
+
+#include <android-base/logging.h>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <mntent.h>
+#include <poll.h>
+#include <stdio.h>
+
+using android::base::unique_fd;
+
+static const char* kMounts = "/proc/self/mounts";
+
+namespace android {
+namespace vold {
+
+MountTable::MountTable() : mValid(false), mGeneration(0) {
+}
+
+void MountTable::refreshLocked() {
+    if (mPollFd == -1) {
+        mPollFd.reset(TEMP_FAILURE_RETRY(open(kMounts, O_RDONLY | O_CLOEXEC)));
+        if (mPollFd == -1) {
+            PLOG(WARNING) << "Failed to open " << kMounts << "; reading it every time";
+        }
+        mValid = false;
+    }
+
+    // Poll before reading, so that changes made while we read are still
+    // flagged next time
+    if (mPollFd != -1) {
+        struct pollfd pfd = { mPollFd.get(), POLLPRI, 0 };
+        if (TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) != 0) {
+            mValid = false;
+        }
+        if (mValid) return;
+    }
+
+    mEntries.clear();
+    mByTarget.clear();
+    mBySource.clear();
+
+    FILE* fp = setmntent(kMounts, "re");
+    if (fp == nullptr) {
+        PLOG(ERROR) << "Failed to open " << kMounts;
+        return;
+    }
+    mntent* mentry;
+    while ((mentry = getmntent(fp)) != nullptr) {
+        size_t i = mEntries.size();
+        mEntries.push_back(Entry{ mentry->mnt_fsname, mentry->mnt_dir, mentry->mnt_type,
+                mentry->mnt_opts });
+        mByTarget.emplace(mEntries[i].target, i);
+        mBySource.emplace(mEntries[i].source, i);
+    }
+    endmntent(fp);
+    mValid = true;
+    mGeneration++;
+}
+
+bool MountTable::isMounted(const std::string& target) {
+    std::lock_guard<std::mutex> lock(mLock);
+    refreshLocked();
+    return mByTarget.find(target) != mByTarget.end();
+}
+
+std::vector<MountTable::Entry> MountTable::findByPrefix(const std::string& prefix) {
+    std::lock_guard<std::mutex> lock(mLock);
+    refreshLocked();
+    std::vector<size_t> found;
+    for (auto it = mByTarget.lower_bound(prefix);
+            it != mByTarget.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+        found.push_back(it->second);
+    }
+    std::sort(found.rbegin(), found.rend());
+
+    std::vector<Entry> entries;
+    for (size_t i : found) {
+        entries.push_back(mEntries[i]);
+    }
+    return entries;
+}
+
+std::vector<MountTable::Entry> MountTable::findBySource(const std::string& source) {
+    std::lock_guard<std::mutex> lock(mLock);
+    refreshLocked();
+    std::vector<size_t> found;
+    auto range = mBySource.equal_range(source);
+    for (auto it = range.first; it != range.second; ++it) {
+        found.push_back(it->second);
+    }
+    std::sort(found.rbegin(), found.rend());
+
+    std::vector<Entry> entries;
+    for (size_t i : found) {
+        entries.push_back(mEntries[i]);
+    }
+    return entries;
+}
+
+uint64_t MountTable::generation() {
+    std::lock_guard<std::mutex> lock(mLock);
+    refreshLocked();
+    return mGeneration;
+}
+
+}  // namespace vold
+}  // namespace android
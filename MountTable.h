@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_MOUNT_TABLE_H
+#define ANDROID_VOLD_MOUNT_TABLE_H
+
+#include "Utils.h"
+
+#include <android-base/unique_fd.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * Cached copy of the calling process's mount table, indexed by mount
+ * point and by source.
+ *
+ * The kernel flags /proc/self/mounts with POLLPRI whenever the table
+ * changes, so each lookup only polls it without blocking and re-reads the
+ * table if something was mounted or unmounted since the last one. The
+ * cache belongs to the namespace it was first used in; children that
+ * switch namespaces need a table of their own.
+ */
+class MountTable {
+public:
+    struct Entry {
+        std::string source;
+        std::string target;
+        std::string type;
+        std::string options;
+    };
+
+    MountTable();
+    virtual ~MountTable() {}
+
+    /* Whether anything is mounted at |target| */
+    bool isMounted(const std::string& target);
+    /* Mounts with a target starting with |prefix|, most recent first */
+    std::vector<Entry> findByPrefix(const std::string& prefix);
+    /* Mounts of |source|, most recent first */
+    std::vector<Entry> findBySource(const std::string& source);
+    /* Bumped on every re-read, so callers can tell when mounts changed */
+    uint64_t generation();
+
+private:
+    std::mutex mLock;
+    /* Only polled; the table itself is read through a fresh stream */
+    android::base::unique_fd mPollFd;
+    bool mValid;
+    uint64_t mGeneration;
+
+    /* In mount order */
+    std::vector<Entry> mEntries;
+    std::multimap<std::string, size_t> mByTarget;
+    std::unordered_multimap<std::string, size_t> mBySource;
+
+    void refreshLocked();
+
+    DISALLOW_COPY_AND_ASSIGN(MountTable);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -15,22 +15,33 @@
  */
 
 #include "MoveTask.h"
+#include "TreeCopier.h"
+#include "TreeRemover.h"
 #include "Utils.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
 
+#include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <cutils/properties.h>
 #include <private/android_filesystem_config.h>
 #include <hardware_legacy/power.h>
 
 #include <dirent.h>
-#include <sys/wait.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
 
 #define CONSTRAIN(amount, low, high) ((amount) < (low) ? (low) : ((amount) > (high) ? (high) : (amount)))
 
-#define EXEC_BLOCKING 0
-
 using android::base::StringPrintf;
 
 namespace android {
@@ -40,10 +51,10 @@ namespace vold {
 static const int kMoveSucceeded = -100;
 static const int kMoveFailedInternalError = -6;
 
-static const char* kCpPath = "/system/bin/cp";
-static const char* kRmPath = "/system/bin/rm";
 
 static const char* kWakeLock = "MoveTask";
+// Left in the target while entries are renamed over, naming the source
+static const char* kRenameMarkerName = ".vold_move_rename";
 
 MoveTask::MoveTask(const std::shared_ptr<VolumeBase>& from,
         const std::shared_ptr<VolumeBase>& to) :
@@ -54,7 +65,8 @@ MoveTask::~MoveTask() {
 }
 
 void MoveTask::start() {
-    mThread = std::thread(&MoveTask::run, this);
+    StartBackgroundJob(BackgroundJob::Kind::kMove, mFrom->getId() + ":" + mTo->getId(),
+            IoSchedClass_NONE, [this](BackgroundJob& job) { run(job); });
 }
 
 static void notifyProgress(int progress) {
@@ -62,76 +74,63 @@ static void notifyProgress(int progress) {
             StringPrintf("%d", progress).c_str(), false);
 }
 
-static status_t pushBackContents(const std::string& path, std::vector<std::string>& cmd,
-        bool addWildcard) {
-    DIR* dir = opendir(path.c_str());
-    if (dir == NULL) {
-        return -1;
-    }
-    bool found = false;
-    struct dirent* ent;
-    while ((ent = readdir(dir)) != NULL) {
-        if ((!strcmp(ent->d_name, ".")) || (!strcmp(ent->d_name, ".."))) {
-            continue;
-        }
-        if (addWildcard) {
-            cmd.push_back(StringPrintf("%s/%s/*", path.c_str(), ent->d_name));
-        } else {
-            cmd.push_back(StringPrintf("%s/%s", path.c_str(), ent->d_name));
-        }
-        found = true;
-    }
-    closedir(dir);
-    return found ? OK : -1;
-}
+// Sizing the tree only drives the progress bar, so don't spend long on it
+static constexpr std::chrono::seconds kRmEstimateTimeout = std::chrono::seconds(2);
 
-static status_t execRm(const std::string& path, int startProgress, int stepProgress) {
+static status_t execRm(const std::string& path, int startProgress, int stepProgress,
+        uint64_t expectedBytes = 0) {
     notifyProgress(startProgress);
 
-    uint64_t expectedBytes = GetTreeBytes(path);
-    uint64_t startFreeBytes = GetFreeBytes(path);
-
-    std::vector<std::string> cmd;
-    cmd.push_back(kRmPath);
-    cmd.push_back("-f"); /* force: remove without confirmation, no error if it doesn't exist */
-    cmd.push_back("-R"); /* recursive: remove directory contents */
-    if (pushBackContents(path, cmd, true) != OK) {
-        LOG(WARNING) << "No contents in " << path;
-        return OK;
+    if (expectedBytes == 0) {
+        TreeSize size;
+        GetTreeSize(path, size, false, std::chrono::steady_clock::now() + kRmEstimateTimeout);
+        expectedBytes = size.bytes;
     }
 
-#if EXEC_BLOCKING
-    return ForkExecvp(cmd);
-#else
-    pid_t pid = ForkExecvpAsync(cmd);
-    if (pid == -1) return -1;
-
-    int status;
-    while (true) {
-        if (waitpid(pid, &status, WNOHANG) == pid) {
-            if (WIFEXITED(status)) {
-                LOG(DEBUG) << "Finished rm with status " << WEXITSTATUS(status);
-                return (WEXITSTATUS(status) == 0) ? OK : -1;
-            } else {
-                break;
-            }
-        }
-
-        sleep(1);
-        uint64_t deltaFreeBytes = GetFreeBytes(path) - startFreeBytes;
+    // Keep the top-level entries themselves, only removing their contents
+    TreeRemover remover(path, 2);
+    status_t res = remover.run([&](uint64_t removedFiles, uint64_t removedBytes) {
+        if (expectedBytes == 0) return;
         notifyProgress(startProgress + CONSTRAIN((int)
-                ((deltaFreeBytes * stepProgress) / expectedBytes), 0, stepProgress));
-    }
-    return -1;
-#endif
+                ((removedBytes * stepProgress) / expectedBytes), 0, stepProgress));
+    });
+    LOG(DEBUG) << "Finished rm of " << remover.getRemovedFiles() << " entries with status "
+            << res;
+    return res;
 }
 
-static status_t execCp(const std::string& fromPath, const std::string& toPath,
-        int startProgress, int stepProgress) {
+static std::string journalPath(const std::string& toPath) {
+    return toPath + "/" + TreeCopier::kJournalName;
+}
+
+static status_t execCp(BackgroundJob& job, const std::string& fromPath,
+        const std::string& toPath, int startProgress, int stepProgress, bool journal,
+        bool resume, uint64_t* copiedBytes) {
     notifyProgress(startProgress);
 
-    uint64_t expectedBytes = GetTreeBytes(fromPath);
+    TreeCopier copier(fromPath, toPath);
+    copier.setCheckpoint([&]() { return job.checkpoint(); });
+    if (copier.scan() != OK) {
+        LOG(ERROR) << "Failed to scan " << fromPath;
+        return -1;
+    }
+    if (journal && copier.openJournal(journalPath(toPath), resume) != OK) {
+        return -1;
+    }
+    // Drop whatever the earlier attempt copied that has since left the
+    // source, keeping the top-level entries the way execRm does
+    if (resume && copier.prune(2) != OK) {
+        LOG(ERROR) << "Failed to prune " << toPath;
+        return -1;
+    }
+
+    uint64_t expectedBytes = copier.getAllocatedBytes();
+    *copiedBytes = expectedBytes;
     uint64_t startFreeBytes = GetFreeBytes(toPath);
+    if (resume) {
+        // Space already taken by an earlier attempt is mostly reused
+        startFreeBytes += GetTreeBytes(toPath);
+    }
 
     if (expectedBytes > startFreeBytes) {
         LOG(ERROR) << "Data size " << expectedBytes << " is too large to fit in free space "
@@ -139,42 +138,114 @@ static status_t execCp(const std::string& fromPath, const std::string& toPath,
         return -1;
     }
 
-    std::vector<std::string> cmd;
-    cmd.push_back(kCpPath);
-    cmd.push_back("-p"); /* preserve timestamps, ownership, and permissions */
-    cmd.push_back("-R"); /* recurse into subdirectories (DEST must be a directory) */
-    cmd.push_back("-P"); /* Do not follow symlinks [default] */
-    cmd.push_back("-d"); /* don't dereference symlinks */
-    if (pushBackContents(fromPath, cmd, false) != OK) {
-        LOG(WARNING) << "No contents in " << fromPath;
-        return OK;
+    status_t res = copier.copy([&](uint64_t copiedBytes, uint64_t totalBytes) {
+        job.setProgress(copiedBytes, totalBytes);
+        if (totalBytes == 0) return;
+        notifyProgress(startProgress + CONSTRAIN((int)
+                ((copiedBytes * stepProgress) / totalBytes), 0, stepProgress));
+    });
+    LOG(DEBUG) << "Finished copy of " << copier.getCopiedBytes() << " bytes with status " << res;
+    return res;
+}
+
+static std::string renameMarkerPath(const std::string& toPath) {
+    return toPath + "/" + kRenameMarkerName;
+}
+
+static bool skipEntry(const char* name) {
+    return !strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, kRenameMarkerName)
+            || !strcmp(name, TreeCopier::kJournalName);
+}
+
+static std::vector<std::string> listDir(int fd) {
+    std::vector<std::string> names;
+    int dupFd = dup(fd);
+    DIR* dir = dupFd == -1 ? nullptr : fdopendir(dupFd);
+    if (dir == nullptr) {
+        if (dupFd != -1) close(dupFd);
+        return names;
+    }
+    dirent* de;
+    while ((de = readdir(dir)) != nullptr) {
+        if (!skipEntry(de->d_name)) names.push_back(de->d_name);
+    }
+    closedir(dir);
+    return names;
+}
+
+static int renameNoReplace(int fromFd, const std::string& name, int toFd) {
+    return syscall(__NR_renameat2, fromFd, name.c_str(), toFd, name.c_str(), RENAME_NOREPLACE);
+}
+
+/*
+ * Moves everything under |fromPath| into |toPath| by renaming, leaving the
+ * top-level directories themselves in place, the way execRm empties them.
+ * Each rename is atomic, so an interrupted move picks up where it left off.
+ * Returns -EXDEV when nothing could be renamed, so the caller can copy.
+ * Without a |job| it runs to the end, which rolling back has to.
+ */
+static status_t execRename(BackgroundJob* job, const std::string& fromPath,
+        const std::string& toPath, int startProgress, int stepProgress) {
+    notifyProgress(startProgress);
+
+    android::base::unique_fd fromFd(TEMP_FAILURE_RETRY(open(fromPath.c_str(),
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+    android::base::unique_fd toFd(TEMP_FAILURE_RETRY(open(toPath.c_str(),
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+    if (fromFd == -1 || toFd == -1) {
+        PLOG(ERROR) << "Failed to open " << fromPath << " or " << toPath;
+        return -errno;
     }
-    cmd.push_back(toPath.c_str());
-
-#if EXEC_BLOCKING
-    return ForkExecvp(cmd);
-#else
-    pid_t pid = ForkExecvpAsync(cmd);
-    if (pid == -1) return -1;
-
-    int status;
-    while (true) {
-        if (waitpid(pid, &status, WNOHANG) == pid) {
-            if (WIFEXITED(status)) {
-                LOG(DEBUG) << "Finished cp with status " << WEXITSTATUS(status);
-                return (WEXITSTATUS(status) == 0) ? OK : -1;
-            } else {
-                break;
+
+    uint64_t renamed = 0;
+    auto names = listDir(fromFd);
+    for (size_t i = 0; i < names.size(); i++) {
+        if (job && !job->checkpoint()) return -ECANCELED;
+        const auto& name = names[i];
+        struct stat sb;
+        if (fstatat(fromFd, name.c_str(), &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+            PLOG(ERROR) << "Failed to stat " << fromPath << "/" << name;
+            return -errno;
+        }
+
+        if (!S_ISDIR(sb.st_mode)) {
+            if (renameNoReplace(fromFd, name, toFd) != 0) {
+                if (errno == EXDEV && renamed == 0) return -EXDEV;
+                PLOG(ERROR) << "Failed to rename " << fromPath << "/" << name;
+                return -errno;
             }
+            renamed++;
+            continue;
         }
 
-        sleep(1);
-        uint64_t deltaFreeBytes = startFreeBytes - GetFreeBytes(toPath);
-        notifyProgress(startProgress + CONSTRAIN((int)
-                ((deltaFreeBytes * stepProgress) / expectedBytes), 0, stepProgress));
+        if (mkdirat(toFd, name.c_str(), sb.st_mode & 07777) == 0) {
+            if (fchownat(toFd, name.c_str(), sb.st_uid, sb.st_gid, AT_SYMLINK_NOFOLLOW) != 0) {
+                PLOG(WARNING) << "Failed to chown " << toPath << "/" << name;
+            }
+        } else if (errno != EEXIST) {
+            PLOG(ERROR) << "Failed to create " << toPath << "/" << name;
+            return -errno;
+        }
+        android::base::unique_fd fromChild(TEMP_FAILURE_RETRY(openat(fromFd, name.c_str(),
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)));
+        android::base::unique_fd toChild(TEMP_FAILURE_RETRY(openat(toFd, name.c_str(),
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)));
+        if (fromChild == -1 || toChild == -1) {
+            PLOG(ERROR) << "Failed to open " << name << " under " << fromPath << " or " << toPath;
+            return -errno;
+        }
+        for (const auto& child : listDir(fromChild)) {
+            if (renameNoReplace(fromChild, child, toChild) != 0) {
+                if (errno == EXDEV && renamed == 0) return -EXDEV;
+                PLOG(ERROR) << "Failed to rename " << fromPath << "/" << name << "/" << child;
+                return -errno;
+            }
+            renamed++;
+        }
+        notifyProgress(startProgress + (int) (((i + 1) * stepProgress) / names.size()));
     }
-    return -1;
-#endif
+    LOG(DEBUG) << "Finished rename of " << renamed << " entries";
+    return OK;
 }
 
 static void bringOffline(const std::shared_ptr<VolumeBase>& vol) {
@@ -191,11 +262,18 @@ static void bringOnline(const std::shared_ptr<VolumeBase>& vol) {
     vol->create();
 }
 
-void MoveTask::run() {
+void MoveTask::run(BackgroundJob& job) {
     acquire_wake_lock(PARTIAL_WAKE_LOCK, kWakeLock);
+    job.setWakeLock(kWakeLock);
 
     std::string fromPath;
     std::string toPath;
+    uint64_t copiedBytes = 0;
+    bool journal = property_get_bool("vold.move_journal", true);
+    bool resume = false;
+    bool sameDevice = false;
+    bool renamed = false;
+    status_t res;
 
     // TODO: add support for public volumes
     if (mFrom->getType() != VolumeBase::Type::kEmulated) goto fail;
@@ -212,14 +290,63 @@ void MoveTask::run() {
     fromPath = mFrom->getInternalPath();
     toPath = mTo->getInternalPath();
 
-    // Step 2: clean up any stale data
-    if (execRm(toPath, 10, 10) != OK) {
-        goto fail;
+    // Both views of one filesystem, so data can be renamed across
+    // instead of copied and removed
+    sameDevice = property_get_bool("vold.move_rename", true)
+            && GetDevice(fromPath) != 0 && GetDevice(fromPath) == GetDevice(toPath);
+
+    // Step 2: clean up any stale data, unless it's an interrupted copy
+    // or rename of this same source that we can pick up again
+    resume = journal && TreeCopier::isJournalFor(journalPath(toPath), fromPath);
+    if (resume) {
+        LOG(INFO) << "Resuming interrupted move from " << fromPath;
+        notifyProgress(20);
+    } else {
+        std::string marker;
+        if (sameDevice && android::base::ReadFileToString(renameMarkerPath(toPath), &marker)
+                && marker == fromPath) {
+            LOG(INFO) << "Resuming interrupted rename from " << fromPath;
+            notifyProgress(20);
+        } else if (execRm(toPath, 10, 10) != OK) {
+            goto fail;
+        }
     }
-
-    // Step 3: perform actual copy
-    if (execCp(fromPath, toPath, 20, 60) != OK) {
-        goto copy_fail;
+    if (!job.checkpoint()) goto fail;
+
+    // Step 3: rename within the filesystem when we can, otherwise perform
+    // actual copy
+    if (sameDevice && !resume) {
+        if (!android::base::WriteStringToFile(fromPath, renameMarkerPath(toPath))) {
+            PLOG(ERROR) << "Failed to write rename marker";
+            goto fail;
+        }
+        res = execRename(&job, fromPath, toPath, 20, 60);
+        if (res != OK && res != -EXDEV) {
+            // Part of the data is already in the target, and the source is
+            // about to come back online as its home, so put it all back
+            LOG(WARNING) << "Rename failed; moving entries back to " << fromPath;
+            if (execRename(nullptr, toPath, fromPath, 80, 1) != OK) {
+                // Keep the marker, so a retry carries on renaming
+                LOG(ERROR) << "Failed to move entries back to " << fromPath;
+                goto fail;
+            }
+        }
+        unlink(renameMarkerPath(toPath).c_str());
+        if (res == OK) {
+            renamed = true;
+        } else if (res == -EXDEV) {
+            LOG(INFO) << "Can't rename across " << fromPath << " and " << toPath << "; copying";
+        } else {
+            goto fail;
+        }
+    }
+    if (!renamed) {
+        if (execCp(job, fromPath, toPath, 20, 60, journal, resume, &copiedBytes) != OK) {
+            goto copy_fail;
+        }
+        if (journal && unlink(journalPath(toPath).c_str()) != 0) {
+            PLOG(WARNING) << "Failed to remove move journal";
+        }
     }
 
     // NOTE: MountService watches for this magic value to know
@@ -231,8 +358,9 @@ void MoveTask::run() {
         bringOnline(mTo);
     }
 
-    // Step 4: clean up old data
-    if (execRm(fromPath, 85, 15) != OK) {
+    // Step 4: clean up old data; the copy already measured it, and a
+    // rename left nothing behind
+    if (!renamed && execRm(fromPath, 85, 15, copiedBytes) != OK) {
         goto fail;
     }
 
@@ -243,8 +371,10 @@ void MoveTask::run() {
 copy_fail:
     // if we failed to copy the data we should not leave it laying around
     // in target location. Do not check return value, we can not do any
-    // useful anyway.
-    execRm(toPath, 80, 1);
+    // useful anyway. With a journal, keep it so a retry can resume.
+    if (!journal) {
+        execRm(toPath, 80, 1);
+    }
 fail:
     {
         std::lock_guard<std::mutex> lock(VolumeManager::Instance()->getLock());
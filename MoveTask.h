@@ -17,11 +17,10 @@
 #ifndef ANDROID_VOLD_MOVE_TASK_H
 #define ANDROID_VOLD_MOVE_TASK_H
 
+#include "JobScheduler.h"
 #include "Utils.h"
 #include "VolumeBase.h"
 
-#include <thread>
-
 namespace android {
 namespace vold {
 
@@ -30,14 +29,14 @@ public:
     MoveTask(const std::shared_ptr<VolumeBase>& from, const std::shared_ptr<VolumeBase>& to);
     virtual ~MoveTask();
 
+    /* Queues the move on the background job pool */
     void start();
 
 private:
     std::shared_ptr<VolumeBase> mFrom;
     std::shared_ptr<VolumeBase> mTo;
-    std::thread mThread;
 
-    void run();
+    void run(BackgroundJob& job);
 
     DISALLOW_COPY_AND_ASSIGN(MoveTask);
 };
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "NamespaceIndex.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using android::base::StringPrintf;
+using android::base::unique_fd;
+
+namespace android {
+namespace vold {
+
+NamespaceIndex::NamespaceIndex() : mStale(true), mListening(false), mRootNs(0) {
+}
+
+NamespaceIndex::~NamespaceIndex() {
+    if (mThread.joinable()) {
+        uint64_t one = 1;
+        TEMP_FAILURE_RETRY(write(mWakeFd, &one, sizeof(one)));
+        mThread.join();
+    }
+}
+
+status_t NamespaceIndex::start() {
+    mEventFd.reset(socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR));
+    if (mEventFd == -1) {
+        PLOG(WARNING) << "Process events unavailable; namespaces will be rescanned";
+        return -1;
+    }
+
+    struct sockaddr_nl addr = {};
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+    addr.nl_pid = 0;
+    if (bind(mEventFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+        PLOG(WARNING) << "Failed to bind process events connector";
+        mEventFd.reset();
+        return -1;
+    }
+
+    char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))] = {};
+    struct nlmsghdr* nl = reinterpret_cast<struct nlmsghdr*>(buf);
+    struct cn_msg* cn = static_cast<struct cn_msg*>(NLMSG_DATA(nl));
+    nl->nlmsg_len = NLMSG_LENGTH(sizeof(*cn) + sizeof(enum proc_cn_mcast_op));
+    nl->nlmsg_type = NLMSG_DONE;
+    nl->nlmsg_pid = getpid();
+    cn->id.idx = CN_IDX_PROC;
+    cn->id.val = CN_VAL_PROC;
+    cn->len = sizeof(enum proc_cn_mcast_op);
+    *reinterpret_cast<enum proc_cn_mcast_op*>(cn->data) = PROC_CN_MCAST_LISTEN;
+    if (TEMP_FAILURE_RETRY(send(mEventFd, buf, nl->nlmsg_len, 0)) == -1) {
+        PLOG(WARNING) << "Failed to subscribe to process events";
+        mEventFd.reset();
+        return -1;
+    }
+
+    mWakeFd.reset(eventfd(0, EFD_CLOEXEC));
+    if (mWakeFd == -1) {
+        PLOG(WARNING) << "Failed to create eventfd";
+        mEventFd.reset();
+        return -1;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mListening = true;
+        mStale = true;
+    }
+    mThread = std::thread(&NamespaceIndex::listen, this);
+    return OK;
+}
+
+void NamespaceIndex::listen() {
+    char buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct pollfd fds[] = {
+        { .fd = mEventFd, .events = POLLIN },
+        { .fd = mWakeFd, .events = POLLIN },
+    };
+    while (true) {
+        if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) == -1 || (fds[1].revents & POLLIN)) {
+            std::lock_guard<std::mutex> lock(mLock);
+            mListening = false;
+            return;
+        }
+        ssize_t len = TEMP_FAILURE_RETRY(recv(mEventFd, buf, sizeof(buf), 0));
+        if (len == -1 && errno == ENOBUFS) {
+            // We fell behind and lost events; start over from /proc
+            std::lock_guard<std::mutex> lock(mLock);
+            mStale = true;
+            continue;
+        }
+        if (len <= 0) {
+            if (len == -1) PLOG(WARNING) << "Lost process events connector";
+            std::lock_guard<std::mutex> lock(mLock);
+            mListening = false;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mLock);
+        int remaining = len;
+        for (struct nlmsghdr* nl = reinterpret_cast<struct nlmsghdr*>(buf);
+                NLMSG_OK(nl, remaining); nl = NLMSG_NEXT(nl, remaining)) {
+            if (nl->nlmsg_type != NLMSG_DONE) continue;
+            struct cn_msg* cn = static_cast<struct cn_msg*>(NLMSG_DATA(nl));
+            if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC) continue;
+            struct proc_event* ev = reinterpret_cast<struct proc_event*>(cn->data);
+
+            // Only whole processes matter; ignore thread creation and exit
+            switch (ev->what) {
+            case proc_event::PROC_EVENT_FORK:
+                if (ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid) {
+                    mDirty.insert(ev->event_data.fork.child_tgid);
+                }
+                break;
+            case proc_event::PROC_EVENT_EXEC:
+                mDirty.insert(ev->event_data.exec.process_tgid);
+                break;
+            case proc_event::PROC_EVENT_UID:
+                mDirty.insert(ev->event_data.id.process_tgid);
+                break;
+            case proc_event::PROC_EVENT_EXIT:
+                if (ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid) {
+                    mDirty.insert(ev->event_data.exit.process_tgid);
+                }
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+static bool readProcess(int procFd, const char* name, uid_t* uid, ino_t* ns) {
+    unique_fd pidFd(openat(procFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (pidFd == -1) return false;
+    struct stat sb;
+    if (fstat(pidFd, &sb) != 0) return false;
+    *uid = sb.st_uid;
+    if (fstatat(pidFd, "ns/mnt", &sb, 0) != 0) return false;
+    *ns = sb.st_ino;
+    return true;
+}
+
+// Start time in clock ticks since boot, which tells a reused pid apart
+static bool readStartTime(pid_t pid, uint64_t* start) {
+    std::string stat;
+    if (!android::base::ReadFileToString(StringPrintf("/proc/%d/stat", pid), &stat)) {
+        return false;
+    }
+    // The name may hold anything, so count fields from its closing paren;
+    // starttime is the 20th after it
+    size_t pos = stat.rfind(')');
+    if (pos == std::string::npos) return false;
+    return sscanf(stat.c_str() + pos + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+            " %*d %*d %*d %*d %*d %*d %" SCNu64, start) == 1;
+}
+
+void NamespaceIndex::removePidLocked(pid_t pid) {
+    auto it = mProcesses.find(pid);
+    if (it == mProcesses.end()) return;
+    auto ns = mNamespaces.find(it->second.ns);
+    if (ns != mNamespaces.end()) {
+        ns->second.pids.erase(pid);
+        if (ns->second.pids.empty()) mNamespaces.erase(ns);
+    }
+    mProcesses.erase(it);
+}
+
+void NamespaceIndex::updatePidLocked(pid_t pid) {
+    removePidLocked(pid);
+
+    unique_fd procFd(open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    Process proc;
+    if (procFd == -1 || !readProcess(procFd, StringPrintf("%d", pid).c_str(),
+            &proc.uid, &proc.ns)) {
+        return;
+    }
+    mProcesses[pid] = proc;
+    mNamespaces[proc.ns].pids.insert(pid);
+}
+
+void NamespaceIndex::rescanLocked() {
+    DIR* dir = opendir("/proc");
+    if (!dir) {
+        PLOG(ERROR) << "Failed to opendir /proc";
+        return;
+    }
+
+    // Modes carry over by inode; getMode() checks they still apply
+    std::unordered_map<ino_t, Namespace> old;
+    old.swap(mNamespaces);
+    mProcesses.clear();
+    mDirty.clear();
+
+    struct stat sb;
+    if (fstatat(dirfd(dir), "1/ns/mnt", &sb, 0) == 0) {
+        mRootNs = sb.st_ino;
+    }
+
+    struct dirent* de;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] < '0' || de->d_name[0] > '9') continue;
+        Process proc;
+        if (!readProcess(dirfd(dir), de->d_name, &proc.uid, &proc.ns)) continue;
+        pid_t pid = atoi(de->d_name);
+        mProcesses[pid] = proc;
+        mNamespaces[proc.ns].pids.insert(pid);
+    }
+    closedir(dir);
+
+    for (auto& ns : mNamespaces) {
+        auto it = old.find(ns.first);
+        if (it != old.end()) {
+            ns.second.mode = it->second.mode;
+            ns.second.owners = it->second.owners;
+        }
+    }
+    mStale = false;
+}
+
+void NamespaceIndex::refreshLocked() {
+    if (!mListening || mStale) {
+        rescanLocked();
+        return;
+    }
+    for (pid_t pid : mDirty) {
+        updatePidLocked(pid);
+    }
+    mDirty.clear();
+}
+
+std::vector<std::pair<ino_t, uid_t>> NamespaceIndex::findByUids(const std::set<uid_t>& uids) {
+    std::lock_guard<std::mutex> lock(mLock);
+    refreshLocked();
+
+    std::vector<std::pair<ino_t, uid_t>> res;
+    for (const auto& ns : mNamespaces) {
+        if (ns.first == mRootNs) continue;
+        for (pid_t pid : ns.second.pids) {
+            uid_t uid = mProcesses[pid].uid;
+            if (uids.find(uid) != uids.end()) {
+                res.emplace_back(ns.first, uid);
+                break;
+            }
+        }
+    }
+    return res;
+}
+
+ino_t NamespaceIndex::findByPid(pid_t pid) {
+    std::lock_guard<std::mutex> lock(mLock);
+    refreshLocked();
+    auto it = mProcesses.find(pid);
+    return it == mProcesses.end() ? 0 : it->second.ns;
+}
+
+ino_t NamespaceIndex::getRootNamespace() {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mRootNs == 0) refreshLocked();
+    return mRootNs;
+}
+
+bool NamespaceIndex::hasMembers(ino_t ino, pid_t except) {
+    std::lock_guard<std::mutex> lock(mLock);
+    refreshLocked();
+    auto it = mNamespaces.find(ino);
+    if (it == mNamespaces.end()) return false;
+    for (pid_t pid : it->second.pids) {
+        if (pid != except) return true;
+    }
+    return false;
+}
+
+unique_fd NamespaceIndex::openNamespace(ino_t ino) {
+    std::vector<pid_t> pids;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = mNamespaces.find(ino);
+        if (it == mNamespaces.end()) return unique_fd();
+        pids.assign(it->second.pids.begin(), it->second.pids.end());
+    }
+
+    // A pid may have exited or been reused since we last looked
+    for (pid_t pid : pids) {
+        // Callers purposefully leave the namespace open across a fork
+        unique_fd fd(open(StringPrintf("/proc/%d/ns/mnt", pid).c_str(), O_RDONLY));
+        struct stat sb;
+        if (fd != -1 && fstat(fd, &sb) == 0 && sb.st_ino == ino) {
+            return fd;
+        }
+    }
+    return unique_fd();
+}
+
+std::string NamespaceIndex::getMode(ino_t ino) {
+    std::lock_guard<std::mutex> lock(mLock);
+    refreshLocked();
+    auto it = mNamespaces.find(ino);
+    if (it == mNamespaces.end()) return "";
+    auto& ns = it->second;
+    for (const auto& owner : ns.owners) {
+        auto proc = mProcesses.find(owner.first);
+        uint64_t start;
+        if (proc != mProcesses.end() && proc->second.ns == ino
+                && readStartTime(owner.first, &start) && start == owner.second) {
+            return ns.mode;
+        }
+    }
+    ns.mode.clear();
+    ns.owners.clear();
+    return "";
+}
+
+void NamespaceIndex::setMode(ino_t ino, const std::string& mode) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mNamespaces.find(ino);
+    if (it == mNamespaces.end()) return;
+    auto& ns = it->second;
+    ns.mode = mode;
+    ns.owners.clear();
+    for (pid_t pid : ns.pids) {
+        uint64_t start;
+        if (readStartTime(pid, &start)) ns.owners.emplace_back(pid, start);
+    }
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_NAMESPACE_INDEX_H
+#define ANDROID_VOLD_NAMESPACE_INDEX_H
+
+#include "Utils.h"
+
+#include <android-base/unique_fd.h>
+
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace android {
+namespace vold {
+
+/*
+ * Long-lived map of mount namespace inode to member processes, along with
+ * the storage mode last applied to each namespace.
+ *
+ * The index is built from one /proc walk and then kept current from the
+ * kernel's process events connector: fork, exec, uid change and exit
+ * events only mark the affected pid for a re-stat at the next lookup. If
+ * the connector isn't available, or drops events, lookups fall back to a
+ * full /proc walk.
+ */
+class NamespaceIndex {
+public:
+    NamespaceIndex();
+    virtual ~NamespaceIndex();
+
+    /* Starts listening for process events */
+    status_t start();
+
+    /* Namespaces holding processes of any of |uids|, with one such uid each */
+    std::vector<std::pair<ino_t, uid_t>> findByUids(const std::set<uid_t>& uids);
+    /* Namespace of |pid|, or 0 if unknown */
+    ino_t findByPid(pid_t pid);
+    ino_t getRootNamespace();
+    /* Whether any process but |except| is still in |ino| */
+    bool hasMembers(ino_t ino, pid_t except);
+
+    /* Opens |ino| through one of its members, verifying it is still that namespace */
+    android::base::unique_fd openNamespace(ino_t ino);
+
+    /*
+     * Mode last applied to |ino|, for as long as one of the processes it
+     * was applied to is still there. The kernel reuses namespace inodes,
+     * so once they're all gone the mode may belong to a namespace that
+     * has since died, and is forgotten.
+     */
+    std::string getMode(ino_t ino);
+    void setMode(ino_t ino, const std::string& mode);
+
+private:
+    struct Process {
+        uid_t uid;
+        ino_t ns;
+    };
+    struct Namespace {
+        std::unordered_set<pid_t> pids;
+        std::string mode;
+        /* Members when the mode was applied, with their start times */
+        std::vector<std::pair<pid_t, uint64_t>> owners;
+    };
+
+    std::mutex mLock;
+    std::unordered_map<pid_t, Process> mProcesses;
+    std::unordered_map<ino_t, Namespace> mNamespaces;
+    std::unordered_set<pid_t> mDirty;
+    /* Set when events may have been missed and only a full walk will do */
+    bool mStale;
+    bool mListening;
+    ino_t mRootNs;
+
+    android::base::unique_fd mEventFd;
+    /* Written on destruction to stop the listener */
+    android::base::unique_fd mWakeFd;
+    std::thread mThread;
+
+    void listen();
+    void refreshLocked();
+    void rescanLocked();
+    void updatePidLocked(pid_t pid);
+    void removePidLocked(pid_t pid);
+
+    DISALLOW_COPY_AND_ASSIGN(NamespaceIndex);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
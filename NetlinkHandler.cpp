@@ -22,8 +22,10 @@
 #define LOG_TAG "Vold"
 
 #include <cutils/log.h>
+#include <cutils/uevent.h>
 
 #include <sysutils/NetlinkEvent.h>
+#include <sysutils/SocketClient.h>
 #include "NetlinkHandler.h"
 #include "VolumeManager.h"
 
@@ -42,16 +44,60 @@ int NetlinkHandler::stop() {
     return this->stopListener();
 }
 
+bool NetlinkHandler::onDataAvailable(SocketClient *cli) {
+    // Leave room to terminate the last field ourselves
+    uid_t uid = -1;
+    ssize_t count = TEMP_FAILURE_RETRY(uevent_kernel_recv(cli->getSocket(),
+            mBuffer, sizeof(mBuffer) - 1, true, &uid));
+    if (count < 0) {
+        if (errno == ENOBUFS) {
+            // The kernel dropped uevents for want of socket buffer; the
+            // disks they were about have to be found again
+            SLOGW("Uevent socket overflowed; re-syncing disks");
+            VolumeManager::Instance()->handleUeventOverflow();
+            return true;
+        }
+        SLOGE("recvmsg failed (%s)", strerror(errno));
+        return false;
+    }
+    if (count == 0) return true;
+    if (mBuffer[count - 1] != '\0') {
+        mBuffer[count++] = '\0';
+    }
+
+    android::vold::Uevent evt;
+    if (android::vold::ParseUevent(mBuffer, count, &evt)) {
+        onUevent(evt);
+    }
+    return true;
+}
+
 void NetlinkHandler::onEvent(NetlinkEvent *evt) {
-    VolumeManager *vm = VolumeManager::Instance();
-    const char *subsys = evt->getSubsystem();
+    // Only reached if something decodes events the old way
+    const char *major = evt->findParam("MAJOR");
+    const char *minor = evt->findParam("MINOR");
+    android::vold::Uevent uevent = {
+        "", evt->findParam("DEVPATH"), evt->getSubsystem(), evt->findParam("DEVTYPE"),
+        major ? atoi(major) : -1, minor ? atoi(minor) : -1,
+    };
+    switch (evt->getAction()) {
+    case NetlinkEvent::Action::kAdd: uevent.action = "add"; break;
+    case NetlinkEvent::Action::kRemove: uevent.action = "remove"; break;
+    case NetlinkEvent::Action::kChange: uevent.action = "change"; break;
+    default: break;
+    }
+    if (uevent.devPath) {
+        onUevent(uevent);
+    }
+}
 
-    if (!subsys) {
+void NetlinkHandler::onUevent(const android::vold::Uevent& evt) {
+    if (!evt.subsystem) {
         SLOGW("No subsystem found in netlink event");
         return;
     }
 
-    if (!strcmp(subsys, "block")) {
-        vm->handleBlockEvent(evt);
+    if (!strcmp(evt.subsystem, "block")) {
+        VolumeManager::Instance()->handleBlockEvent(evt);
     }
 }
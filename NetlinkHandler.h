@@ -19,6 +19,8 @@
 
 #include <sysutils/NetlinkListener.h>
 
+#include "Uevent.h"
+
 class NetlinkHandler: public NetlinkListener {
 
 public:
@@ -29,6 +31,13 @@ public:
     int stop(void);
 
 protected:
+    /* Parses uevents in place rather than through a NetlinkEvent */
+    virtual bool onDataAvailable(SocketClient *cli);
     virtual void onEvent(NetlinkEvent *evt);
+
+private:
+    char mBuffer[64 * 1024] __attribute__((aligned(4)));
+
+    void onUevent(const android::vold::Uevent& evt);
 };
 #endif
@@ -26,12 +26,18 @@
 
 #include <linux/netlink.h>
 
+#include <algorithm>
+
 #define LOG_TAG "Vold"
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include "NetlinkManager.h"
 #include "NetlinkHandler.h"
+#include "Uevent.h"
+
+static const int kDefaultRcvbufKb = 2 * 1024;
 
 NetlinkManager *NetlinkManager::sInstance = NULL;
 
@@ -50,7 +56,9 @@ NetlinkManager::~NetlinkManager() {
 
 int NetlinkManager::start() {
     struct sockaddr_nl nladdr;
-    int sz = 64 * 1024;
+    int sz = std::max(64, property_get_int32("vold.uevent_rcvbuf_kb", kDefaultRcvbufKb)) * 1024;
+    int actual = 0;
+    socklen_t len = sizeof(actual);
     int on = 1;
 
     memset(&nladdr, 0, sizeof(nladdr));
@@ -64,19 +72,35 @@ int NetlinkManager::start() {
         return -1;
     }
 
-    // When running in a net/user namespace, SO_RCVBUFFORCE is not available.
-    // Try using SO_RCVBUF first.
-    if ((setsockopt(mSock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz)) < 0) &&
-        (setsockopt(mSock, SOL_SOCKET, SO_RCVBUFFORCE, &sz, sizeof(sz)) < 0)) {
+    // Coldboot and hubs full of partitions send bursts big enough to
+    // overflow a small buffer. SO_RCVBUF is capped at rmem_max, so force
+    // it, but when running in a net/user namespace SO_RCVBUFFORCE is not
+    // available and SO_RCVBUF is the best we can do.
+    if ((setsockopt(mSock, SOL_SOCKET, SO_RCVBUFFORCE, &sz, sizeof(sz)) < 0) &&
+        (setsockopt(mSock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz)) < 0)) {
         SLOGE("Unable to set uevent socket SO_RCVBUF/SO_RCVBUFFORCE option: %s", strerror(errno));
         goto out;
     }
+    // The kernel reports double what it was asked for, to allow for overhead
+    if (getsockopt(mSock, SOL_SOCKET, SO_RCVBUF, &actual, &len) == 0 && actual / 2 < sz) {
+        SLOGW("Uevent socket buffer is %d bytes, not the %d requested", actual / 2, sz);
+    }
 
     if (setsockopt(mSock, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) {
         SLOGE("Unable to set uevent socket SO_PASSCRED option: %s", strerror(errno));
         goto out;
     }
 
+    // Only block uevents wake us up; the handler still checks every field,
+    // so carry on unfiltered if the kernel won't take the program
+    if (property_get_bool("vold.uevent_filter", true)) {
+        auto prog = android::vold::BlockUeventFilter();
+        struct sock_fprog fprog = { static_cast<unsigned short>(prog.size()), prog.data() };
+        if (setsockopt(mSock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+            SLOGW("Unable to attach uevent socket filter: %s", strerror(errno));
+        }
+    }
+
     if (bind(mSock, (struct sockaddr *) &nladdr, sizeof(nladdr)) < 0) {
         SLOGE("Unable to bind uevent socket: %s", strerror(errno));
         goto out;
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PartitionTable.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const uint16_t kMbrSignature = 0xAA55;
+static const uint8_t kMbrTypeProtective = 0xEE;
+static const int kMbrPrimaryParts = 4;
+/* Matches sgdisk's MAX_MBR_PARTS */
+static const int kMbrMaxParts = 128;
+
+static const char kGptSignature[] = "EFI PART";
+static const uint32_t kGptMinHeaderSize = 92;
+static const uint32_t kGptMinEntrySize = 128;
+/* Far more than any real table; keeps a corrupt header from asking for gigabytes */
+static const uint32_t kGptMaxEntries = 1024;
+
+struct MbrEntry {
+    uint8_t status;
+    uint8_t chsFirst[3];
+    uint8_t type;
+    uint8_t chsLast[3];
+    uint32_t firstLba;
+    uint32_t sectors;
+} __attribute__((packed));
+
+struct GptHeader {
+    char signature[8];
+    uint32_t revision;
+    uint32_t headerSize;
+    uint32_t headerCrc;
+    uint32_t reserved;
+    uint64_t currentLba;
+    uint64_t backupLba;
+    uint64_t firstUsableLba;
+    uint64_t lastUsableLba;
+    uint8_t diskGuid[16];
+    uint64_t entriesLba;
+    uint32_t numEntries;
+    uint32_t entrySize;
+    uint32_t entriesCrc;
+} __attribute__((packed));
+
+struct GptEntry {
+    uint8_t typeGuid[16];
+    uint8_t partGuid[16];
+    uint64_t firstLba;
+    uint64_t lastLba;
+    uint64_t attributes;
+    uint16_t name[36];
+} __attribute__((packed));
+
+static uint32_t crc32(const uint8_t* buf, size_t len) {
+    static uint32_t table[256];
+    static bool init = [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void) init;
+
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+/* Formats an on-disk GUID the way sgdisk prints it */
+static std::string guidToString(const uint8_t* g) {
+    return StringPrintf("%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+            g[3], g[2], g[1], g[0], g[5], g[4], g[7], g[6],
+            g[8], g[9], g[10], g[11], g[12], g[13], g[14], g[15]);
+}
+
+static bool isZero(const uint8_t* buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i]) return false;
+    }
+    return true;
+}
+
+static bool isExtended(uint8_t type) {
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+static status_t readFully(int fd, uint8_t* buf, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(pread(fd, buf, len, offset));
+        if (n < 0) return -errno;
+        if (n == 0) return -EIO;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return OK;
+}
+
+/*
+ * Validates the GPT header in |hdrBuf| found at |lba| and, if it's sound,
+ * reads its entry array with a single read.
+ */
+static bool readGpt(int fd, uint32_t sectorSize, uint64_t sectors, const uint8_t* hdrBuf,
+        uint64_t lba, PartitionTable& table) {
+    GptHeader hdr;
+    memcpy(&hdr, hdrBuf, sizeof(hdr));
+    if (memcmp(hdr.signature, kGptSignature, sizeof(hdr.signature))
+            || hdr.headerSize < kGptMinHeaderSize || hdr.headerSize > sectorSize
+            || hdr.currentLba != lba) {
+        return false;
+    }
+
+    std::unique_ptr<uint8_t[]> copy(new uint8_t[hdr.headerSize]);
+    memcpy(copy.get(), hdrBuf, hdr.headerSize);
+    memset(copy.get() + offsetof(GptHeader, headerCrc), 0, sizeof(hdr.headerCrc));
+    if (crc32(copy.get(), hdr.headerSize) != hdr.headerCrc) {
+        LOG(WARNING) << "GPT header at LBA " << lba << " has bad CRC";
+        return false;
+    }
+
+    if (hdr.numEntries == 0 || hdr.numEntries > kGptMaxEntries
+            || hdr.entrySize < kGptMinEntrySize || hdr.entrySize % 8
+            || hdr.entriesLba >= sectors) {
+        return false;
+    }
+    size_t len = (size_t) hdr.numEntries * hdr.entrySize;
+    std::unique_ptr<uint8_t[]> entries(new uint8_t[len]);
+    if (readFully(fd, entries.get(), len, hdr.entriesLba * sectorSize) != OK) {
+        return false;
+    }
+    if (crc32(entries.get(), len) != hdr.entriesCrc) {
+        LOG(WARNING) << "GPT entries for header at LBA " << lba << " have bad CRC";
+        return false;
+    }
+
+    table.type = PartitionTable::Type::kGpt;
+    table.diskId = guidToString(hdr.diskGuid);
+    table.partitions.clear();
+    for (uint32_t i = 0; i < hdr.numEntries; i++) {
+        const GptEntry* entry = reinterpret_cast<const GptEntry*>(
+                entries.get() + (size_t) i * hdr.entrySize);
+        if (isZero(entry->typeGuid, sizeof(entry->typeGuid))) continue;
+        PartitionTable::Partition part;
+        part.index = i + 1;
+        part.mbrType = 0;
+        part.typeGuid = guidToString(entry->typeGuid);
+        part.partGuid = guidToString(entry->partGuid);
+        part.firstLba = entry->firstLba;
+        part.sectors = entry->lastLba >= entry->firstLba
+                ? entry->lastLba - entry->firstLba + 1 : 0;
+        table.partitions.push_back(part);
+    }
+    return true;
+}
+
+/* Follows the chain of extended boot records starting at |extStart| */
+static void readLogical(int fd, uint32_t sectorSize, uint64_t sectors, uint32_t extStart,
+        PartitionTable& table) {
+    std::unique_ptr<uint8_t[]> ebr(new uint8_t[sectorSize]);
+    uint64_t lba = extStart;
+    int index = kMbrPrimaryParts + 1;
+    while (index <= kMbrMaxParts && lba > 0 && lba < sectors) {
+        if (readFully(fd, ebr.get(), sectorSize, lba * sectorSize) != OK) return;
+        uint16_t sig;
+        memcpy(&sig, ebr.get() + 510, sizeof(sig));
+        if (sig != kMbrSignature) return;
+
+        MbrEntry entries[2];
+        memcpy(entries, ebr.get() + 446, sizeof(entries));
+        if (entries[0].sectors > 0 && entries[0].type != 0) {
+            PartitionTable::Partition part;
+            part.index = index++;
+            part.mbrType = entries[0].type;
+            part.firstLba = lba + entries[0].firstLba;
+            part.sectors = entries[0].sectors;
+            table.partitions.push_back(part);
+        }
+        if (entries[1].sectors == 0 || !isExtended(entries[1].type)) return;
+        uint64_t next = (uint64_t) extStart + entries[1].firstLba;
+        // Each link must move forward, or a corrupt chain would loop forever
+        if (next <= lba) return;
+        lba = next;
+    }
+}
+
+status_t ReadPartitionTable(int fd, uint32_t sectorSize, uint64_t size, PartitionTable& table) {
+    table = PartitionTable();
+    if (sectorSize < 512 || size < 2 * sectorSize) {
+        return OK;
+    }
+    uint64_t sectors = size / sectorSize;
+
+    // LBA 0 and 1 hold the MBR and the primary GPT header
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[2 * sectorSize]);
+    status_t res = readFully(fd, buf.get(), 2 * sectorSize, 0);
+    if (res != OK) {
+        return res;
+    }
+
+    uint16_t sig;
+    memcpy(&sig, buf.get() + 510, sizeof(sig));
+    MbrEntry mbr[kMbrPrimaryParts];
+    memcpy(mbr, buf.get() + 446, sizeof(mbr));
+    bool haveMbr = (sig == kMbrSignature);
+    bool protective = false;
+    for (int i = 0; i < kMbrPrimaryParts; i++) {
+        if (mbr[i].type == kMbrTypeProtective) protective = true;
+    }
+
+    // Like sgdisk, a plain MBR wins over any stale GPT behind it
+    if (haveMbr && !protective) {
+        table.type = PartitionTable::Type::kMbr;
+        uint32_t diskSig;
+        memcpy(&diskSig, buf.get() + 440, sizeof(diskSig));
+        table.diskId = StringPrintf("%08X", diskSig);
+        for (int i = 0; i < kMbrPrimaryParts; i++) {
+            if (mbr[i].sectors == 0 || mbr[i].type == 0) continue;
+            PartitionTable::Partition part;
+            part.index = i + 1;
+            part.mbrType = mbr[i].type;
+            part.firstLba = mbr[i].firstLba;
+            part.sectors = mbr[i].sectors;
+            table.partitions.push_back(part);
+        }
+        for (int i = 0; i < kMbrPrimaryParts; i++) {
+            if (mbr[i].sectors > 0 && isExtended(mbr[i].type)) {
+                readLogical(fd, sectorSize, sectors, mbr[i].firstLba, table);
+                break;
+            }
+        }
+        return OK;
+    }
+
+    if (readGpt(fd, sectorSize, sectors, buf.get() + sectorSize, 1, table)) {
+        return OK;
+    }
+
+    // Primary is damaged; try the backup header in the last sector
+    std::unique_ptr<uint8_t[]> backup(new uint8_t[sectorSize]);
+    if (readFully(fd, backup.get(), sectorSize, (sectors - 1) * sectorSize) == OK
+            && readGpt(fd, sectorSize, sectors, backup.get(), sectors - 1, table)) {
+        LOG(WARNING) << "Using backup GPT";
+        return OK;
+    }
+
+    table = PartitionTable();
+    return OK;
+}
+
+status_t ReadPartitionTable(const std::string& devPath, PartitionTable& table) {
+    android::base::unique_fd fd(open(devPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        PLOG(WARNING) << "Failed to open " << devPath;
+        return -errno;
+    }
+
+    int sectorSize = 512;
+    uint64_t size = 0;
+    if (ioctl(fd, BLKSSZGET, &sectorSize) != 0 || ioctl(fd, BLKGETSIZE64, &size) != 0) {
+        // Regular files, such as test images, still work with 512 byte sectors
+        struct stat sb;
+        if (fstat(fd, &sb) != 0) {
+            return -errno;
+        }
+        sectorSize = 512;
+        size = sb.st_size;
+    }
+    return ReadPartitionTable(fd, sectorSize, size, table);
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_PARTITION_TABLE_H
+#define ANDROID_VOLD_PARTITION_TABLE_H
+
+#include <utils/Errors.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * Partition table as reported by "sgdisk --android-dump": the table type
+ * from the DISK line and one entry per PART line.
+ */
+struct PartitionTable {
+    enum class Type {
+        kUnknown,
+        kMbr,
+        kGpt,
+    };
+
+    struct Partition {
+        /* 1-based; MBR logical partitions start at 5 */
+        int index;
+        /* MBR partition type */
+        uint8_t mbrType;
+        /* Upper-case GUIDs, for GPT only */
+        std::string typeGuid;
+        std::string partGuid;
+        /* Extent in sectors; zero when read through sgdisk */
+        uint64_t firstLba = 0;
+        uint64_t sectors = 0;
+    };
+
+    Type type = Type::kUnknown;
+    /* MBR disk signature or GPT disk GUID, upper-case; empty through sgdisk */
+    std::string diskId;
+    std::vector<Partition> partitions;
+};
+
+/*
+ * Reads the MBR or GPT of |fd| in-process. A GPT is only trusted if its
+ * header and entry array CRCs check out; the backup GPT is used if the
+ * primary is damaged. Returns OK with an unknown type if no table is
+ * found, or -errno if the device couldn't be read.
+ */
+status_t ReadPartitionTable(int fd, uint32_t sectorSize, uint64_t size, PartitionTable& table);
+status_t ReadPartitionTable(const std::string& devPath, PartitionTable& table);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PatternMatcher.h"
+
+#include <fnmatch.h>
+
+#include <algorithm>
+
+namespace android {
+namespace vold {
+
+// Anything that makes fnmatch() more than a string compare; a backslash
+// escape is left to fnmatch() too, since it's rare enough not to matter
+static const char* kWildcards = "*?[\\";
+
+PatternMatcher::PatternMatcher() : mNodes(1) {
+}
+
+void PatternMatcher::add(const std::string& pattern) {
+    size_t index = mPatterns.size();
+    size_t prefix = std::min(pattern.find_first_of(kWildcards), pattern.size());
+    mPatterns.push_back(pattern);
+    mPrefixLengths.push_back(prefix);
+
+    size_t node = 0;
+    for (size_t i = 0; i < prefix; i++) {
+        auto it = mNodes[node].children.find(pattern[i]);
+        if (it == mNodes[node].children.end()) {
+            mNodes.emplace_back();
+            it = mNodes[node].children.emplace(pattern[i], mNodes.size() - 1).first;
+        }
+        node = it->second;
+    }
+    if (prefix == pattern.size()) {
+        mNodes[node].literals.push_back(index);
+    } else {
+        mNodes[node].globs.push_back(index);
+    }
+}
+
+void PatternMatcher::clear() {
+    mPatterns.clear();
+    mPrefixLengths.clear();
+    mNodes.assign(1, Node());
+}
+
+int PatternMatcher::match(const std::string& path) const {
+    size_t best = mPatterns.size();
+    size_t node = 0;
+    for (size_t i = 0; ; i++) {
+        for (size_t p : mNodes[node].globs) {
+            // Without flags fnmatch() is a left to right scan, so the prefix
+            // already walked needn't be matched again
+            if (p < best && !fnmatch(mPatterns[p].c_str() + mPrefixLengths[p],
+                    path.c_str() + i, 0)) {
+                best = p;
+            }
+        }
+        if (i == path.size()) {
+            for (size_t p : mNodes[node].literals) {
+                best = std::min(best, p);
+            }
+            break;
+        }
+        auto it = mNodes[node].children.find(path[i]);
+        if (it == mNodes[node].children.end()) break;
+        node = it->second;
+    }
+    return best == mPatterns.size() ? -1 : static_cast<int>(best);
+}
+
+}  // namespace vold
+}  // namespace android
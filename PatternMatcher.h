@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_PATTERN_MATCHER_H
+#define ANDROID_VOLD_PATTERN_MATCHER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * A set of fnmatch(3) patterns, matched all at once.
+ *
+ * Patterns are filed in a trie under their literal prefix, the part before
+ * the first wildcard, so a lookup walks the path once and only tries the
+ * patterns whose prefix it passes through. Patterns without wildcards are
+ * compared whole and never reach fnmatch. Matching is the same as
+ * fnmatch() with no flags.
+ */
+class PatternMatcher {
+public:
+    PatternMatcher();
+
+    /* Patterns are numbered from 0 in the order they're added */
+    void add(const std::string& pattern);
+    void clear();
+    size_t size() const { return mPatterns.size(); }
+
+    /* Lowest numbered pattern matching |path|, or -1 */
+    int match(const std::string& path) const;
+
+private:
+    struct Node {
+        std::map<char, size_t> children;
+        /* Patterns that are exactly the path to this node */
+        std::vector<size_t> literals;
+        /* Patterns with this literal prefix, then a wildcard */
+        std::vector<size_t> globs;
+    };
+
+    std::vector<std::string> mPatterns;
+    std::vector<size_t> mPrefixLengths;
+    std::vector<Node> mNodes;
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
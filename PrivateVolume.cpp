@@ -16,20 +16,28 @@
 
 #include "fs/Ext4.h"
 #include "fs/F2fs.h"
+#include "BenchmarkProbe.h"
+#include "DeviceMapper.h"
+#include "FsckCache.h"
+#include "MountJournal.h"
 #include "PrivateVolume.h"
 #include "EmulatedVolume.h"
 #include "Utils.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
+#include "VoldUtil.h"
 #include "cryptfs.h"
 
+#include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/logging.h>
 #include <cutils/fs.h>
+#include <cutils/properties.h>
 #include <private/android_filesystem_config.h>
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -45,6 +53,12 @@ namespace android {
 namespace vold {
 
 static const unsigned int kMajorBlockMmc = 179;
+static const uint64_t kExt4BlockSize = 4096;
+static const uint64_t kF2fsSegmentSize = 2 * 1024 * 1024;
+static const uint64_t kProfileProbeSize = 16 * 1024 * 1024;
+// 4K random writes per second at queue depth 1 that set the profile apart
+static const double kFastRandWriteIops = 1500;
+static const double kSlowRandWriteIops = 300;
 
 PrivateVolume::PrivateVolume(dev_t device, const std::string& keyRaw) :
         VolumeBase(Type::kPrivate), mRawDevice(device), mKeyRaw(keyRaw) {
@@ -68,11 +82,25 @@ status_t PrivateVolume::doCreate() {
         return -EIO;
     }
 
+    // A previous vold may have left the mapping in use by a live mount
+    if (HasLiveMount(getId())) {
+        DeviceMapper dm;
+        if (dm.getDevicePath(getId(), &mDmDevPath) == OK) {
+            LOG(INFO) << getId() << " keeping mapping " << mDmDevPath << " from previous vold";
+            return OK;
+        }
+        ReleaseLiveMount(getId());
+    }
+
     // Recover from stale vold by tearing down any old mappings
     cryptfs_revert_ext_volume(getId().c_str());
 
     // TODO: figure out better SELinux labels for private volumes
 
+    if (mKeyRaw.size() == kInlineKeySize) {
+        return setupInlineCrypto();
+    }
+
     unsigned char* key = (unsigned char*) mKeyRaw.data();
     char crypto_blkdev[MAXPATHLEN];
     int res = cryptfs_setup_ext_volume(getId().c_str(), mRawDevPath.c_str(),
@@ -86,6 +114,56 @@ status_t PrivateVolume::doCreate() {
     return OK;
 }
 
+size_t PrivateVolume::getNewKeySize() {
+    if (!property_get_bool("ro.crypto.private_volume_inline", false)) {
+        return kCryptKeySize;
+    }
+    DeviceMapper dm;
+    uint32_t version[3];
+    if (dm.getTargetVersion("default-key", version) != OK) {
+        LOG(WARNING) << "Inline encryption requested but default-key target missing";
+        return kCryptKeySize;
+    }
+    return kInlineKeySize;
+}
+
+status_t PrivateVolume::setupInlineCrypto() {
+    int fd = TEMP_FAILURE_RETRY(open(mRawDevPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        PLOG(ERROR) << getId() << " failed to open " << mRawDevPath;
+        return -EIO;
+    }
+    unsigned long nrSec = 0;
+    get_blkdev_size(fd, &nrSec);
+    close(fd);
+    if (nrSec == 0) {
+        LOG(ERROR) << getId() << " failed to get size of " << mRawDevPath;
+        return -EIO;
+    }
+
+    KeyBuffer hexKey;
+    if (StrToHex(KeyBuffer(mKeyRaw.begin(), mKeyRaw.end()), hexKey) != OK) {
+        return -EIO;
+    }
+    std::vector<DeviceMapper::Target> table(1);
+    table[0].start = 0;
+    table[0].length = nrSec;
+    table[0].type = "default-key";
+    table[0].params = ConcatKeyBuffer({ "AES-256-XTS ", hexKey, " ", mRawDevPath.c_str(), " 0" });
+
+    DeviceMapper dm;
+    if (dm.createDevice(getId(), table, &mDmDevPath) != OK) {
+        LOG(ERROR) << getId() << " failed to set up inline encryption";
+        return -EIO;
+    }
+    if (!WaitForFile(mDmDevPath, std::chrono::seconds(5))) {
+        LOG(ERROR) << getId() << " timed out waiting for " << mDmDevPath;
+        dm.deleteDevice(getId());
+        return -ETIMEDOUT;
+    }
+    return OK;
+}
+
 status_t PrivateVolume::doDestroy() {
     if (cryptfs_revert_ext_volume(getId().c_str())) {
         LOG(ERROR) << getId() << " failed to revert cryptfs";
@@ -112,8 +190,19 @@ status_t PrivateVolume::doMount() {
         return -EIO;
     }
 
-    if (mFsType == "ext4") {
-        int res = ext4::Check(mDmDevPath, mPath, true);
+    // A previous vold checked and mounted it, and the mount is still good
+    bool adopted = AdoptLiveMount(getId(), mDmDevPath, mPath);
+
+    // Nothing touched the filesystem since we last unmounted it cleanly
+    bool clean = !adopted && ConsumeCleanUnmount(mFsType, mFsUuid, mDmDevPath);
+    if (clean) {
+        LOG(INFO) << getId() << " unchanged since last clean unmount, skipping check";
+    }
+
+    if (adopted) {
+        LOG(INFO) << getId() << " still mounted from before vold restarted";
+    } else if (mFsType == "ext4") {
+        int res = clean ? 0 : ext4::Check(mDmDevPath, mPath, true);
         if (res == 0 || res == 1) {
             LOG(DEBUG) << getId() << " passed filesystem check";
         } else {
@@ -127,7 +216,7 @@ status_t PrivateVolume::doMount() {
         }
 
     } else if (mFsType == "f2fs") {
-        int res = f2fs::Check(mDmDevPath, true);
+        int res = clean ? 0 : f2fs::Check(mDmDevPath, true);
         if (res == 0) {
             LOG(DEBUG) << getId() << " passed filesystem check";
         } else {
@@ -135,15 +224,33 @@ status_t PrivateVolume::doMount() {
             return -EIO;
         }
 
-        if (f2fs::Mount(mDmDevPath, mPath, "", true)) {
-            PLOG(ERROR) << getId() << " failed to mount";
-            return -EIO;
+        std::string opts;
+        bool probe = false;
+        f2fs::Profile profile = f2fs::Profile::kDefault;
+        if (property_get_bool("vold.f2fs_profiles", false)) {
+            profile = loadF2fsProfile(&probe);
+            opts = f2fs::ProfileOptions(profile);
+            LOG(INFO) << getId() << " mounting with f2fs profile " << f2fs::ProfileName(profile);
+        }
+
+        if (f2fs::Mount(mDmDevPath, mPath, opts, true)) {
+            // Older kernels reject some of the tuned options outright
+            if (opts.empty() || errno != EINVAL || f2fs::Mount(mDmDevPath, mPath, "", true)) {
+                PLOG(ERROR) << getId() << " failed to mount";
+                return -EIO;
+            }
+            LOG(WARNING) << getId() << " kernel rejected f2fs options " << opts
+                    << "; mounted with defaults";
+        }
+        if (probe) {
+            probeF2fsProfile(profile);
         }
 
     } else {
         LOG(ERROR) << getId() << " unsupported filesystem " << mFsType;
         return -EIO;
     }
+    JournalMount(getId(), mDmDevPath, mPath);
 
     RestoreconRecursive(mPath);
 
@@ -170,8 +277,84 @@ status_t PrivateVolume::doMount() {
     return OK;
 }
 
+// Named by the normalized GUID, like the volume's key, so that forgetting
+// the partition finds it
+static std::string profilePath(const std::string& partGuid) {
+    std::string normalizedGuid;
+    if (partGuid.empty() || NormalizeHex(partGuid, normalizedGuid)) {
+        return "";
+    }
+    return BuildProfilePath(normalizedGuid);
+}
+
+f2fs::Profile PrivateVolume::loadF2fsProfile(bool* probe) {
+    *probe = false;
+    f2fs::Profile profile;
+    std::string path(profilePath(getPartGuid()));
+    std::string name;
+    if (!path.empty() && android::base::ReadFileToString(path, &name)
+            && f2fs::ParseProfile(name, &profile)) {
+        return profile;
+    }
+
+    // Without a measurement, go by the bus: SD cards sit on the MMC major
+    // and UFS is fast, but rotational flags aren't worth trusting
+    profile = f2fs::Profile::kDefault;
+    char* real = realpath(StringPrintf("/sys/dev/block/%u:%u", major(mRawDevice),
+            minor(mRawDevice)).c_str(), nullptr);
+    if (major(mRawDevice) == kMajorBlockMmc) {
+        profile = f2fs::Profile::kSdCard;
+    } else if (real != nullptr && strstr(real, "/ufs") != nullptr) {
+        profile = f2fs::Profile::kFast;
+    }
+    free(real);
+
+    if (path.empty()) {
+        return profile;
+    }
+    if (property_get_bool("vold.f2fs_profile_probe", true)) {
+        *probe = true;
+    } else if (!android::base::WriteStringToFile(f2fs::ProfileName(profile), path)) {
+        PLOG(WARNING) << getId() << " failed to persist f2fs profile";
+    }
+    return profile;
+}
+
+void PrivateVolume::probeF2fsProfile(f2fs::Profile guess) {
+    std::vector<ProbeResult> results;
+    nsecs_t budget = ms2ns(property_get_int32("vold.f2fs_profile_probe_ms", 250));
+    f2fs::Profile profile = guess;
+    if (RunThroughputProbe(mPath, kProfileProbeSize, budget, results) == OK) {
+        for (const auto& result : results) {
+            if (result.name != "rand_write" || result.queueDepth != 1
+                    || result.duration <= 0) continue;
+            double iops = result.ops * 1e9 / result.duration;
+            if (iops >= kFastRandWriteIops) {
+                profile = f2fs::Profile::kFast;
+            } else if (iops < kSlowRandWriteIops) {
+                profile = f2fs::Profile::kSdCard;
+            }
+            LOG(INFO) << getId() << " measured " << iops << " random write IOPS";
+        }
+    } else {
+        LOG(WARNING) << getId() << " throughput probe failed; keeping f2fs profile "
+                << f2fs::ProfileName(guess);
+    }
+
+    // Log counts are fixed at mount time, so this applies from the next one
+    std::string path(profilePath(getPartGuid()));
+    if (android::base::WriteStringToFile(f2fs::ProfileName(profile), path)) {
+        LOG(INFO) << getId() << " chose f2fs profile " << f2fs::ProfileName(profile);
+    } else {
+        PLOG(WARNING) << getId() << " failed to persist f2fs profile";
+    }
+}
+
 status_t PrivateVolume::doUnmount() {
-    ForceUnmount(mPath);
+    if (ForceUnmount(mPath) == OK) {
+        RecordCleanUnmount(mFsType, mFsUuid, mDmDevPath);
+    }
+    ForgetMount(getId());
 
     if (TEMP_FAILURE_RETRY(rmdir(mPath.c_str()))) {
         PLOG(ERROR) << getId() << " failed to rmdir mount point " << mPath;
@@ -180,7 +363,7 @@ status_t PrivateVolume::doUnmount() {
     return OK;
 }
 
-status_t PrivateVolume::doFormat(const std::string& fsType) {
+status_t PrivateVolume::doFormat(const std::string& fsType, bool quick) {
     std::string resolvedFsType = fsType;
     if (fsType == "auto") {
         // For now, assume that all MMC devices are flash-based SD cards, and
@@ -198,14 +381,26 @@ status_t PrivateVolume::doFormat(const std::string& fsType) {
         return -EIO;
     }
 
+    // dm-crypt passes I/O straight through, so the partition's geometry
+    // is the one that counts; without any, leave mkfs to its defaults
+    auto geometry = GetBlockGeometry(mRawDevice);
+    unsigned int stripeBlocks = 0;
+    unsigned int segmentsPerSection = 0;
+    if (geometry.eraseSize || geometry.optimalIo) {
+        stripeBlocks = geometry.alignment / kExt4BlockSize;
+        segmentsPerSection = geometry.alignment / kF2fsSegmentSize;
+        LOG(INFO) << getId() << " aligning " << resolvedFsType << " to "
+                << geometry.alignment << " bytes";
+    }
+
     if (resolvedFsType == "ext4") {
         // TODO: change reported mountpoint once we have better selinux support
-        if (ext4::Format(mDmDevPath, 0, "/data")) {
+        if (ext4::Format(mDmDevPath, 0, "/data", 0, stripeBlocks)) {
             PLOG(ERROR) << getId() << " failed to format";
             return -EIO;
         }
     } else if (resolvedFsType == "f2fs") {
-        if (f2fs::Format(mDmDevPath)) {
+        if (f2fs::Format(mDmDevPath, segmentsPerSection)) {
             PLOG(ERROR) << getId() << " failed to format";
             return -EIO;
         }
@@ -18,6 +18,7 @@
 #define ANDROID_VOLD_PRIVATE_VOLUME_H
 
 #include "VolumeBase.h"
+#include "fs/F2fs.h"
 
 #include <cutils/multiuser.h>
 
@@ -30,6 +31,12 @@ namespace vold {
  * Given a raw block device, it knows how to wrap it in dm-crypt and
  * format as ext4/f2fs.  EmulatedVolume can be stacked above it.
  *
+ * On devices with inline encryption hardware, new volumes are instead
+ * mapped through the default-key target, which hands the key to the
+ * storage controller rather than encrypting on the CPU. The two formats
+ * aren't compatible, so the size of the stored key records which one a
+ * volume was created with.
+ *
  * This volume is designed to behave much like the internal /data
  * partition, both in layout and function.  For example, apps and
  * private app data can be safely stored on this volume because the
@@ -40,14 +47,28 @@ public:
     PrivateVolume(dev_t device, const std::string& keyRaw);
     virtual ~PrivateVolume();
 
+    /* dm-crypt aes-cbc-essiv:sha256 */
+    static const size_t kCryptKeySize = 16;
+    /* default-key AES-256-XTS with inline hardware encryption */
+    static const size_t kInlineKeySize = 64;
+
+    /* Key size to generate for a newly adopted volume */
+    static size_t getNewKeySize();
+
 protected:
     status_t doCreate() override;
     status_t doDestroy() override;
     status_t doMount() override;
     status_t doUnmount() override;
-    status_t doFormat(const std::string& fsType) override;
+    status_t doFormat(const std::string& fsType, bool quick) override;
 
     status_t readMetadata();
+    status_t setupInlineCrypto();
+
+    /* Persisted profile, or a guess from the device; sets |probe| when the
+     * guess should be refined by measuring the mounted volume */
+    f2fs::Profile loadF2fsProfile(bool* probe);
+    void probeF2fsProfile(f2fs::Profile guess);
 
 private:
     /* Kernel device of raw, encrypted partition */
@@ -39,6 +39,9 @@
 using android::base::ReadFileToString;
 using android::base::StringPrintf;
 
+/* How often waitForExit() looks at the processes it's waiting for */
+static const useconds_t kExitPollUs = 20 * 1000;
+
 int Process::readSymLink(const char *path, char *link, size_t max) {
     struct stat s;
     int length;
@@ -178,6 +181,120 @@ extern "C" void vold_killProcessesWithOpenFiles(const char *path, int signal) {
  * Hunt down processes that have files open at the given mount point.
  */
 int Process::killProcessesWithOpenFiles(const char *path, int signal) {
+    ProcessScanner scanner;
+    scanner.addMountPoint(path);
+    return scanner.scan(signal);
+}
+
+ProcessScanner::ProcessScanner() {
+}
+
+void ProcessScanner::addMountPoint(const std::string& mountPoint) {
+    Node* node = &mRoot;
+    size_t pos = 0;
+    while (pos < mountPoint.size()) {
+        size_t end = mountPoint.find('/', pos);
+        if (end == std::string::npos) end = mountPoint.size();
+        if (end > pos) {
+            auto& child = node->children[mountPoint.substr(pos, end - pos)];
+            if (!child) child.reset(new Node());
+            node = child.get();
+        }
+        pos = end + 1;
+    }
+    // Like pathMatchesMountPoint(), never treat "/" itself as a match
+    if (node != &mRoot) node->terminal = true;
+}
+
+/*
+ * Returns the mount point prefix of |path| that matched, as a pointer to the
+ * end of it within |path|, or nullptr.
+ */
+const char* ProcessScanner::match(const char* path) {
+    if (path[0] != '/') return nullptr;
+    const Node* node = &mRoot;
+    const char* p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        const char* end = strchrnul(p, '/');
+        if (end == p) break;
+        mComponent.assign(p, end - p);
+        auto it = node->children.find(mComponent);
+        if (it == node->children.end()) return nullptr;
+        node = it->second.get();
+        if (node->terminal) return end;
+        p = end;
+    }
+    return nullptr;
+}
+
+bool ProcessScanner::checkPid(int pid, std::string& why) {
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR* dir = opendir(path);
+    if (dir) {
+        // readlinkat() fails cleanly on anything that isn't a link, so skip the lstat()
+        struct dirent* de;
+        while ((de = readdir(dir))) {
+            if (de->d_name[0] == '.') continue;
+            ssize_t len = readlinkat(dirfd(dir), de->d_name, link, sizeof(link) - 1);
+            if (len <= 0) continue;
+            link[len] = 0;
+            if (match(link)) {
+                why = StringPrintf("has open file %s", link);
+                closedir(dir);
+                return true;
+            }
+        }
+        closedir(dir);
+    }
+
+    std::string maps;
+    if (ReadFileToString(StringPrintf("/proc/%d/maps", pid), &maps)) {
+        // Consecutive mappings usually come from the same file; only match each once
+        const char* last = nullptr;
+        size_t lastLen = 0;
+        size_t pos = 0;
+        while (pos < maps.size()) {
+            size_t eol = maps.find('\n', pos);
+            if (eol == std::string::npos) eol = maps.size();
+            maps[eol] = 0;
+            const char* file = strchr(&maps[pos], '/');
+            if (file) {
+                size_t fileLen = &maps[eol] - file;
+                if (!last || fileLen != lastLen || memcmp(file, last, fileLen)) {
+                    if (match(file)) {
+                        why = StringPrintf("has open filemap for %s", file);
+                        return true;
+                    }
+                    last = file;
+                    lastLen = fileLen;
+                }
+            }
+            pos = eol + 1;
+        }
+    }
+
+    static const char* kLinks[] = { "cwd", "root", "exe" };
+    static const char* kReasons[] = { "has cwd within", "has chroot within",
+            "has executable path within" };
+    for (size_t i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "/proc/%d/%s", pid, kLinks[i]);
+        ssize_t len = readlink(path, link, sizeof(link) - 1);
+        if (len <= 0) continue;
+        link[len] = 0;
+        const char* end = match(link);
+        if (end) {
+            why = StringPrintf("%s %s", kReasons[i], std::string(link, end - link).c_str());
+            return true;
+        }
+    }
+    return false;
+}
+
+int ProcessScanner::scan(int signal) {
     int count = 0;
     DIR* dir;
     struct dirent* de;
@@ -187,29 +304,22 @@ int Process::killProcessesWithOpenFiles(const char *path, int signal) {
         return count;
     }
 
+    std::set<int> hits;
     while ((de = readdir(dir))) {
-        int pid = getPid(de->d_name);
+        int pid = Process::getPid(de->d_name);
         if (pid == -1)
             continue;
 
-        std::string name;
-        getProcessName(pid, name);
-
-        char openfile[PATH_MAX];
-
-        if (checkFileDescriptorSymLinks(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open file %s", name.c_str(), pid, openfile);
-        } else if (checkFileMaps(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open filemap for %s", name.c_str(), pid, openfile);
-        } else if (checkSymLink(pid, path, "cwd")) {
-            SLOGE("Process %s (%d) has cwd within %s", name.c_str(), pid, path);
-        } else if (checkSymLink(pid, path, "root")) {
-            SLOGE("Process %s (%d) has chroot within %s", name.c_str(), pid, path);
-        } else if (checkSymLink(pid, path, "exe")) {
-            SLOGE("Process %s (%d) has executable path within %s", name.c_str(), pid, path);
-        } else {
+        // Every round looks at every pid again, since one that matched
+        // nothing last time may have opened something under the path since
+        std::string why;
+        if (!checkPid(pid, why))
             continue;
-        }
+        hits.insert(pid);
+
+        std::string name;
+        Process::getProcessName(pid, name);
+        SLOGE("Process %s (%d) %s", name.c_str(), pid, why.c_str());
 
         if (signal != 0) {
             SLOGW("Sending %s to process %d", strsignal(signal), pid);
@@ -218,5 +328,30 @@ int Process::killProcessesWithOpenFiles(const char *path, int signal) {
         }
     }
     closedir(dir);
+
+    mHits.swap(hits);
     return count;
 }
+
+static bool isGone(int pid) {
+    std::string stat;
+    if (!ReadFileToString(StringPrintf("/proc/%d/stat", pid), &stat)) return true;
+    // The state follows the parenthesised name, which may itself hold spaces
+    size_t close = stat.rfind(')');
+    if (close == std::string::npos || close + 2 >= stat.size()) return true;
+    char state = stat[close + 2];
+    return state == 'Z' || state == 'X';
+}
+
+bool ProcessScanner::waitForExit(std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::set<int> waiting(mHits);
+    while (true) {
+        for (auto it = waiting.begin(); it != waiting.end();) {
+            it = isGone(*it) ? waiting.erase(it) : std::next(it);
+        }
+        if (waiting.empty()) return true;
+        if (std::chrono::steady_clock::now() >= deadline) return false;
+        usleep(kExitPollUs);
+    }
+}
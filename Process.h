@@ -19,6 +19,52 @@
 
 #ifdef __cplusplus
 
+#include <chrono>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Finds processes holding files under any of a set of mount points, reading
+ * each pid's fds, maps and cwd/root/exe links once and matching every path
+ * in a single walk of a trie of the mount points.
+ *
+ * A scanner is meant to be reused across signal escalation rounds, so the
+ * trie is built once; each scan() still checks every live pid, since any of
+ * them may have opened something under a mount point since the last one.
+ */
+class ProcessScanner {
+public:
+    ProcessScanner();
+
+    void addMountPoint(const std::string& mountPoint);
+
+    /* Sends |signal| (if non-zero) to matching processes; returns how many matched */
+    int scan(int signal);
+
+    /*
+     * Waits up to |timeout| for every process the last scan() matched to
+     * exit, checking every few milliseconds; returns whether they all did.
+     * Zombies count as gone, since they no longer hold anything open.
+     */
+    bool waitForExit(std::chrono::milliseconds timeout);
+
+private:
+    struct Node {
+        bool terminal = false;
+        std::map<std::string, std::unique_ptr<Node>> children;
+    };
+
+    Node mRoot;
+    std::set<int> mHits;
+    std::string mComponent;
+
+    const char* match(const char* path);
+    bool checkPid(int pid, std::string& why);
+};
+
 class Process {
 public:
     static int killProcessesWithOpenFiles(const char *path, int signal);
@@ -20,19 +20,27 @@
 #include "fs/Ext4.h"
 #include "fs/F2fs.h"
 #include "fs/Ntfs.h"
+#include "fs/Sdcardfs.h"
 #include "fs/Vfat.h"
+#include "FsckCache.h"
+#include "MountJournal.h"
 #include "PublicVolume.h"
 #include "Utils.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
 
+#include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/logging.h>
+#include <android-base/unique_fd.h>
 #include <cutils/fs.h>
+#include <cutils/properties.h>
 #include <private/android_filesystem_config.h>
 
 #include <fcntl.h>
+#include <linux/fs.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -45,18 +53,27 @@ namespace android {
 namespace vold {
 
 static const char* kFusePath = "/system/bin/sdcard";
+static constexpr std::chrono::seconds kFuseTimeout = std::chrono::seconds(20);
 
 static const char* kAsecPath = "/mnt/secure/asec";
 
+static const int kQuickWipeThreads = 4;
+static const unsigned int kMinFatCluster = 4 * 1024;
+static const unsigned int kMaxFatCluster = 32 * 1024;
+static const unsigned int kMinExfatCluster = 32 * 1024;
+static const unsigned int kMaxExfatCluster = 128 * 1024;
+static const uint64_t kMinFat32Clusters = 65525;
+
 PublicVolume::PublicVolume(dev_t device, const std::string& fstype /* = "" */,
                 const std::string& mntopts /* = "" */) :
         VolumeBase(Type::kPublic), mDevice(device), mFusePid(0),
-        mFsType(fstype), mMntOpts(mntopts) {
+        mFsType(fstype), mMntOpts(mntopts), mForceCheck(false), mFsClean(false) {
     setId(StringPrintf("public:%u_%u", major(device), minor(device)));
     mDevPath = StringPrintf("/dev/block/vold/%s", getId().c_str());
 }
 
 PublicVolume::~PublicVolume() {
+    stopCheck();
 }
 
 status_t PublicVolume::readMetadata() {
@@ -91,6 +108,63 @@ status_t PublicVolume::initAsecStage() {
     return OK;
 }
 
+bool PublicVolume::canCheckInBackground() {
+    if (mForceCheck || !property_get_bool("vold.fsck_background", false)) {
+        return false;
+    }
+#ifdef CONFIG_EXFAT_DRIVER
+    if (mFsType == "exfat") return true;
+#endif
+    return mFsType == "vfat";
+}
+
+void PublicVolume::checkInBackground() {
+    int ret;
+#ifdef CONFIG_EXFAT_DRIVER
+    if (mFsType == "exfat") {
+        ret = exfat::Check(mDevPath, &mCheckControl);
+    } else
+#endif
+    ret = vfat::Check(mDevPath, &mCheckControl);
+
+    if (mCheckControl.cancel) {
+        LOG(INFO) << getId() << " background filesystem check cancelled";
+        return;
+    }
+    if (ret) {
+        // Leave it read-only, and repair before the next mount
+        LOG(ERROR) << getId() << " failed background filesystem check";
+        mForceCheck = true;
+        notifyEvent(ResponseCode::VolumeCheckProgress, "-1");
+        return;
+    }
+
+#ifdef CONFIG_EXFAT_DRIVER
+    if (mFsType == "exfat") {
+        ret = exfat::Mount(mDevPath, mRawPath, false, true, false,
+                AID_MEDIA_RW, AID_MEDIA_RW, 0007);
+    } else
+#endif
+    ret = vfat::Mount(mDevPath, mRawPath, false, true, false,
+            AID_MEDIA_RW, AID_MEDIA_RW, 0007, true);
+    if (ret) {
+        PLOG(ERROR) << getId() << " failed to remount read-write";
+        notifyEvent(ResponseCode::VolumeCheckProgress, "-1");
+        return;
+    }
+
+    LOG(INFO) << getId() << " passed background filesystem check";
+    mFsClean = true;
+    notifyEvent(ResponseCode::VolumeCheckProgress, "100");
+}
+
+void PublicVolume::stopCheck() {
+    if (mCheckThread.joinable()) {
+        mCheckControl.cancel = true;
+        mCheckThread.join();
+    }
+}
+
 status_t PublicVolume::doCreate() {
     return CreateDeviceNode(mDevPath, mDevice);
 }
@@ -101,6 +175,7 @@ status_t PublicVolume::doDestroy() {
 
 status_t PublicVolume::doMount() {
     // TODO: expand to support mounting other filesystems
+    stopCheck();
     readMetadata();
 
     if (!IsFilesystemSupported(mFsType)) {
@@ -132,31 +207,55 @@ status_t PublicVolume::doMount() {
         return -errno;
     }
 
+    // A previous vold checked and mounted it, and the mount is still good
+    bool adopted = AdoptLiveMount(getId(), mDevPath, mRawPath);
+
+    // Skip the check entirely when nothing touched the filesystem since we
+    // last unmounted it cleanly
+    mFsClean = adopted || ConsumeCleanUnmount(mFsType, mFsUuid, mDevPath);
+
+    // A large dirty card can take minutes to check, so optionally make it
+    // available read-only right away and check it in the background
+    bool background = !mFsClean && canCheckInBackground();
+
     int ret = 0;
+    if (adopted) {
+        LOG(INFO) << getId() << " still mounted from before vold restarted";
+    } else if (mFsClean) {
+        LOG(INFO) << getId() << " unchanged since last clean unmount, skipping check";
+    } else if (background) {
+        LOG(INFO) << getId() << " mounting read-only until background check completes";
+    } else {
 #ifdef CONFIG_EXFAT_DRIVER
-    if (mFsType == "exfat") {
-        ret = exfat::Check(mDevPath);
-    } else
+        if (mFsType == "exfat") {
+            ret = exfat::Check(mDevPath);
+        } else
 #endif
-    if (mFsType == "ext4") {
-        ret = ext4::Check(mDevPath, mRawPath, false);
-    } else if (mFsType == "f2fs") {
-        ret = f2fs::Check(mDevPath, false);
-    } else if (mFsType == "ntfs") {
-        ret = ntfs::Check(mDevPath);
-    } else if (mFsType == "vfat") {
-        ret = vfat::Check(mDevPath);
-    } else {
-        LOG(WARNING) << getId() << " unsupported filesystem check, skipping";
-    }
-    if (ret) {
-        LOG(ERROR) << getId() << " failed filesystem check";
-        return -EIO;
+        if (mFsType == "ext4") {
+            ret = ext4::Check(mDevPath, mRawPath, false);
+        } else if (mFsType == "f2fs") {
+            ret = f2fs::Check(mDevPath, false);
+        } else if (mFsType == "ntfs") {
+            ret = ntfs::Check(mDevPath);
+        } else if (mFsType == "vfat") {
+            ret = vfat::Check(mDevPath);
+        } else {
+            LOG(WARNING) << getId() << " unsupported filesystem check, skipping";
+        }
+        if (ret) {
+            LOG(ERROR) << getId() << " failed filesystem check";
+            return -EIO;
+        }
+        mForceCheck = false;
+        mFsClean = true;
     }
 
+    if (adopted) {
+        // Nothing to mount
+    } else
 #ifdef CONFIG_EXFAT_DRIVER
     if (mFsType == "exfat") {
-        ret = exfat::Mount(mDevPath, mRawPath, false, false, false,
+        ret = exfat::Mount(mDevPath, mRawPath, background, false, false,
                 AID_MEDIA_RW, AID_MEDIA_RW, 0007);
     } else
 #endif
@@ -169,8 +268,8 @@ status_t PublicVolume::doMount() {
         ret = ntfs::Mount(mDevPath, mRawPath, false, false, false,
                 AID_MEDIA_RW, AID_MEDIA_RW, 0007, true);
     } else if (mFsType == "vfat") {
-        ret = vfat::Mount(mDevPath, mRawPath, false, false, false,
-                AID_MEDIA_RW, AID_MEDIA_RW, 0007, true);
+        ret = vfat::Mount(mDevPath, mRawPath, background, false, false,
+                AID_MEDIA_RW, AID_MEDIA_RW, 0007, !background);
     } else {
         ret = ::mount(mDevPath.c_str(), mRawPath.c_str(), mFsType.c_str(), 0, NULL);
     }
@@ -178,6 +277,17 @@ status_t PublicVolume::doMount() {
         PLOG(ERROR) << getId() << " failed to mount " << mDevPath;
         return -EIO;
     }
+    JournalMount(getId(), mDevPath, mRawPath);
+
+    if (background) {
+        mCheckControl.cancel = false;
+        mCheckControl.readOnly = true;
+        mCheckControl.progress = [this](int progress) {
+            notifyEvent(ResponseCode::VolumeCheckProgress, StringPrintf("%d", progress));
+        };
+        notifyEvent(ResponseCode::VolumeCheckProgress, "0");
+        mCheckThread = std::thread(&PublicVolume::checkInBackground, this);
+    }
 
     if (getMountFlags() & MountFlags::kPrimary) {
         initAsecStage();
@@ -195,6 +305,12 @@ status_t PublicVolume::doMount() {
         return -errno;
     }
 
+    if (sdcardfs::IsSupported()) {
+        // Same views the daemon would mount, without waiting for it to start
+        return sdcardfs::MountViews(mRawPath, stableName, AID_MEDIA_RW, AID_MEDIA_RW,
+                getMountUserId(), false, getMountFlags() & MountFlags::kPrimary, false);
+    }
+
     dev_t before = GetDevice(mFuseWrite);
 
     if (!(mFusePid = fork())) {
@@ -230,12 +346,23 @@ status_t PublicVolume::doMount() {
         return -errno;
     }
 
-    while (before == GetDevice(mFuseWrite)) {
-        LOG(VERBOSE) << "Waiting for FUSE to spin up...";
-        usleep(50000); // 50ms
+    // The write view is mounted last; sdcardfs exits once it is, FUSE keeps running
+    bool exited;
+    status_t res = WaitForMount(mFuseWrite, before, mFusePid, &exited, kFuseTimeout);
+    if (!exited) {
+        TEMP_FAILURE_RETRY(waitpid(mFusePid, nullptr, WNOHANG));
+    } else {
+        mFusePid = 0;
+    }
+    if (res != OK) {
+        LOG(ERROR) << getId() << " failed to spin up FUSE";
+        if (mFusePid > 0) {
+            kill(mFusePid, SIGTERM);
+            TEMP_FAILURE_RETRY(waitpid(mFusePid, nullptr, 0));
+            mFusePid = 0;
+        }
+        return res;
     }
-    /* sdcardfs will have exited already. FUSE will still be running */
-    TEMP_FAILURE_RETRY(waitpid(mFusePid, nullptr, WNOHANG));
 
     return OK;
 }
@@ -245,6 +372,7 @@ status_t PublicVolume::doUnmount() {
     // the FUSE process first, most file system operations will return
     // ENOTCONN until the unmount completes. This is an exotic and unusual
     // error code and might cause broken behaviour in applications.
+    stopCheck();
     KillProcessesUsingPath(getPath());
 
     ForceUnmount(kAsecPath);
@@ -252,7 +380,11 @@ status_t PublicVolume::doUnmount() {
     ForceUnmount(mFuseDefault);
     ForceUnmount(mFuseRead);
     ForceUnmount(mFuseWrite);
-    ForceUnmount(mRawPath);
+    if (ForceUnmount(mRawPath) == OK && mFsClean) {
+        RecordCleanUnmount(mFsType, mFsUuid, mDevPath);
+    }
+    ForgetMount(getId());
+    mFsClean = false;
 
     if (mFusePid > 0) {
         kill(mFusePid, SIGTERM);
@@ -273,7 +405,47 @@ status_t PublicVolume::doUnmount() {
     return OK;
 }
 
-status_t PublicVolume::doFormat(const std::string& fsType) {
+/* Where a partition starts on its disk, in bytes; 0 for a whole disk */
+static uint64_t partitionStartBytes(dev_t device) {
+    std::string tmp;
+    auto path = StringPrintf("/sys/dev/block/%u:%u/start", major(device), minor(device));
+    if (!android::base::ReadFileToString(path, &tmp)) return 0;
+    return strtoull(tmp.c_str(), nullptr, 10) * 512;
+}
+
+static unsigned int floorPowerOfTwo(uint64_t n) {
+    unsigned int p = 1;
+    while (p <= n / 2) p *= 2;
+    return p;
+}
+
+unsigned int PublicVolume::quickClusterBytes(const std::string& fsType) {
+    uint64_t erase = GetBlockGeometry(mDevice).eraseSize;
+    uint64_t size = 0;
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(mDevPath.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (erase == 0 || fd == -1 || ioctl(fd, BLKGETSIZE64, &size) != 0) {
+        return 0;
+    }
+
+    // Clusters as large as the erase block allows, within what the SD
+    // specification suggests for each filesystem; FAT32 also needs enough
+    // clusters to still be FAT32
+    unsigned int cluster;
+    if (fsType == "exfat") {
+        cluster = std::max(kMinExfatCluster, std::min(kMaxExfatCluster, floorPowerOfTwo(erase)));
+    } else {
+        cluster = std::max(kMinFatCluster, std::min(kMaxFatCluster, floorPowerOfTwo(erase)));
+        while (cluster > kMinFatCluster && size / cluster < kMinFat32Clusters) {
+            cluster /= 2;
+        }
+        if (size / cluster < kMinFat32Clusters) return 0;
+    }
+    LOG(INFO) << getId() << " has " << erase << " byte erase blocks; using "
+            << cluster << " byte clusters";
+    return cluster;
+}
+
+status_t PublicVolume::doFormat(const std::string& fsType, bool quick) {
     // "auto" is used for newly partitioned disks (see Disk::partition*)
     // and thus is restricted to external/removable storage.
     if (!(IsFilesystemSupported(fsType) || fsType == "auto")) {
@@ -281,25 +453,44 @@ status_t PublicVolume::doFormat(const std::string& fsType) {
         return -EINVAL;
     }
 
-    if (WipeBlockDevice(mDevPath) != OK) {
+    // Quick formats discard on every thread allowed and size clusters to
+    // the card; discarding is most of the work, so it's most of the progress
+    int threads = quick ? kQuickWipeThreads : 0;
+    unsigned int clusterBytes = quick ? quickClusterBytes(fsType) : 0;
+    notifyEvent(ResponseCode::VolumeFormatProgress, "0");
+    bool zeroed = false;
+    bool wiped = WipeBlockDevice(mDevPath, &zeroed, threads, [this](int pct) {
+        notifyEvent(ResponseCode::VolumeFormatProgress, StringPrintf("%d", pct * 9 / 10));
+    }) == OK;
+    if (!wiped) {
         LOG(WARNING) << getId() << " failed to wipe";
     }
 
     int ret = 0;
+    // Quick FAT formats also start the data area on an erase block boundary
+    uint64_t alignBytes = 0, offsetBytes = 0;
+    if (clusterBytes) {
+        alignBytes = GetBlockGeometry(mDevice).eraseSize;
+        offsetBytes = partitionStartBytes(mDevice);
+    }
     if (fsType == "auto") {
-        ret = vfat::Format(mDevPath, 0);
+        ret = vfat::Format(mDevPath, 0, clusterBytes, alignBytes, offsetBytes);
 #ifdef CONFIG_EXFAT_DRIVER
     } else if (fsType == "exfat") {
-        ret = exfat::Format(mDevPath);
+        ret = exfat::Format(mDevPath, clusterBytes);
 #endif
     } else if (fsType == "ext4") {
-        ret = ext4::Format(mDevPath, 0, mRawPath);
+        // Don't discard twice, or zero what already reads as zeros
+        int flags = 0;
+        if (wiped) flags |= ext4::kNoDiscard;
+        if (zeroed) flags |= ext4::kLazyInodeTables | ext4::kLazyJournal;
+        ret = ext4::Format(mDevPath, 0, mRawPath, flags);
     } else if (fsType == "f2fs") {
         ret = f2fs::Format(mDevPath);
     } else if (fsType == "ntfs") {
         ret = ntfs::Format(mDevPath, 0);
     } else if (fsType == "vfat") {
-        ret = vfat::Format(mDevPath, 0);
+        ret = vfat::Format(mDevPath, 0, clusterBytes, alignBytes, offsetBytes);
     } else {
         LOG(ERROR) << getId() << " unrecognized filesystem " << fsType;
         ret = -1;
@@ -308,9 +499,11 @@ status_t PublicVolume::doFormat(const std::string& fsType) {
 
     if (ret) {
         LOG(ERROR) << getId() << " failed to format";
+        notifyEvent(ResponseCode::VolumeFormatProgress, "-1");
         return -errno;
     }
 
+    notifyEvent(ResponseCode::VolumeFormatProgress, "100");
     return OK;
 }
 
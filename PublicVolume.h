@@ -21,6 +21,8 @@
 
 #include <cutils/multiuser.h>
 
+#include <thread>
+
 namespace android {
 namespace vold {
 
@@ -48,11 +50,18 @@ protected:
     status_t doDestroy() override;
     status_t doMount() override;
     status_t doUnmount() override;
-    status_t doFormat(const std::string& fsType) override;
+    status_t doFormat(const std::string& fsType, bool quick) override;
 
     status_t readMetadata();
+    /* Cluster size matched to the card's erase blocks, or 0 for the default */
+    unsigned int quickClusterBytes(const std::string& fsType);
     status_t initAsecStage();
 
+    /* Whether to mount read-only first and check in the background */
+    bool canCheckInBackground();
+    void checkInBackground();
+    void stopCheck();
+
 private:
     /* Kernel device representing partition */
     dev_t mDevice;
@@ -77,6 +86,14 @@ private:
     /* Mount options */
     std::string mMntOpts;
 
+    /* Background filesystem check, while mounted read-only */
+    std::thread mCheckThread;
+    CheckControl mCheckControl;
+    /* Last background check found problems, so repair before mounting */
+    bool mForceCheck;
+    /* Filesystem was checked or known clean, so a clean unmount is cached */
+    bool mFsClean;
+
     DISALLOW_COPY_AND_ASSIGN(PublicVolume);
 };
 
@@ -27,6 +27,8 @@ public:
     static const int AsecListResult           = 111;
     static const int StorageUsersListResult   = 112;
     static const int CryptfsGetfieldResult    = 113;
+    static const int IoStatsListResult        = 114;
+    static const int TaskListResult           = 115;
 
     // 200 series - Requested action has been successfully completed
     static const int CommandOkay              = 200;
@@ -71,6 +73,7 @@ public:
     static const int DiskLabelChanged = 642;
     static const int DiskScanned = 643;
     static const int DiskSysPathChanged = 644;
+    static const int DiskSnapshot = 645;
     static const int DiskDestroyed = 649;
 
     static const int VolumeCreated = 650;
@@ -80,11 +83,18 @@ public:
     static const int VolumeFsLabelChanged = 654;
     static const int VolumePathChanged = 655;
     static const int VolumeInternalPathChanged = 656;
+    static const int VolumeCheckProgress = 657;
+    static const int VolumeSnapshot = 658;
     static const int VolumeDestroyed = 659;
 
     static const int MoveStatus = 660;
     static const int BenchmarkResult = 661;
     static const int TrimResult = 662;
+    static const int TrimSliceResult = 663;
+    static const int BenchmarkLatency = 664;
+    static const int BenchmarkVmStats = 665;
+    static const int BenchmarkThroughput = 666;
+    static const int VolumeFormatProgress = 667;
 
     static int convertFromErrno();
 };
@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SecureDiscard.h"
+#include "FileDeviceUtils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace vold {
+
+namespace {
+
+constexpr uint32_t max_extents = 32;
+constexpr size_t max_workers = 4;
+// Zero overwrites go out in chunks this large, aligned for O_DIRECT
+constexpr size_t zero_bufsize = 1024 * 1024;
+constexpr size_t zero_align = 4096;
+
+struct Device {
+    std::string path;
+    android::base::unique_fd fd;
+};
+
+struct Range {
+    int fd;
+    const std::string* device;
+    uint64_t start;
+    uint64_t length;
+    // Indices into the targets this range covers part of
+    std::vector<size_t> targets;
+};
+
+}  // namespace
+
+// Ensure that the FIEMAP covers the file and is OK to discard
+static bool check_fiemap(const struct fiemap &fiemap, const std::string &path) {
+    auto mapped = fiemap.fm_mapped_extents;
+    if (!(fiemap.fm_extents[mapped - 1].fe_flags & FIEMAP_EXTENT_LAST)) {
+        LOG(ERROR) << "Extent " << mapped -1 << " was not the last in " << path;
+        return false;
+    }
+    for (uint32_t i = 0; i < mapped; i++) {
+        auto flags = fiemap.fm_extents[i].fe_flags;
+        if (flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_NOT_ALIGNED)) {
+            LOG(ERROR) << "Extent " << i << " has unexpected flags " << flags << ": " << path;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether |length| bytes at |start| read back as zeros
+static bool verify_zeros(int fd, off64_t start, off64_t length) {
+    std::unique_ptr<char[]> buf(new char[zero_bufsize]);
+    while (length > 0) {
+        size_t rlen = static_cast<size_t>(std::min(static_cast<off64_t>(zero_bufsize), length));
+        auto got = TEMP_FAILURE_RETRY(pread64(fd, buf.get(), rlen, start));
+        if (got < 1) {
+            PLOG(ERROR) << "Read back after discard failed";
+            return false;
+        }
+        for (ssize_t i = 0; i < got; i++) {
+            if (buf[i] != 0) return false;
+        }
+        start += got;
+        length -= got;
+    }
+    return true;
+}
+
+// Large writes straight to the device, bypassing the page cache where the
+// range is aligned for it. Positioned, since workers share the device fd.
+static bool overwrite_with_zeros(int fd, off64_t start, off64_t length, bool* direct) {
+    *direct = false;
+    android::base::unique_fd direct_fd;
+    if (start % zero_align == 0 && length % zero_align == 0) {
+        // Reopen rather than set O_DIRECT on the shared file description
+        auto self = "/proc/self/fd/" + std::to_string(fd);
+        direct_fd.reset(TEMP_FAILURE_RETRY(open(self.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC)));
+        *direct = direct_fd != -1;
+    }
+    int wfd = *direct ? direct_fd.get() : fd;
+
+    void* mem;
+    if (posix_memalign(&mem, zero_align, zero_bufsize)) {
+        LOG(ERROR) << "Failed to allocate zero buffer";
+        return false;
+    }
+    std::unique_ptr<void, decltype(&free)> buf(mem, free);
+    memset(buf.get(), 0, zero_bufsize);
+    while (length > 0) {
+        size_t wlen = static_cast<size_t>(std::min(static_cast<off64_t>(zero_bufsize), length));
+        auto written = TEMP_FAILURE_RETRY(pwrite64(wfd, buf.get(), wlen, start));
+        if (written < 1) {
+            PLOG(ERROR) << "Write of zeroes failed";
+            return false;
+        }
+        start += written;
+        length -= written;
+    }
+    if (!*direct && fdatasync(fd) != 0) {
+        PLOG(ERROR) << "Failed to sync zeroes";
+        return false;
+    }
+    return true;
+}
+
+// Tries each way of getting rid of the range in turn, from most to least
+// preferred, and returns the one that worked, or nullptr if none did.
+static const char* discard_range(const Range& range) {
+    uint64_t args[2] = { range.start, range.length };
+    if (ioctl(range.fd, BLKSECDISCARD, args) == 0) {
+        return "BLKSECDISCARD";
+    }
+    PLOG(DEBUG) << "Unable to BLKSECDISCARD " << range.length << " bytes at " << range.start
+            << " on " << *range.device;
+
+    // Have the device write zeros itself
+    if (ioctl(range.fd, BLKZEROOUT, args) == 0) {
+        return "BLKZEROOUT";
+    }
+    PLOG(DEBUG) << "Unable to BLKZEROOUT";
+    if (fallocate(range.fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+            range.start, range.length) == 0) {
+        return "FALLOC_FL_ZERO_RANGE";
+    }
+    PLOG(DEBUG) << "Unable to FALLOC_FL_ZERO_RANGE";
+
+    // Only trusted once the range reads back as zeros
+    unsigned int zeroes = 0;
+    if (ioctl(range.fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes) {
+        if (ioctl(range.fd, BLKDISCARD, args) == 0
+                && verify_zeros(range.fd, range.start, range.length)) {
+            return "BLKDISCARD";
+        }
+        LOG(DEBUG) << "BLKDISCARD didn't zero the range";
+    }
+
+    bool direct;
+    if (overwrite_with_zeros(range.fd, range.start, range.length, &direct)) {
+        return direct ? "O_DIRECT zero overwrite" : "zero overwrite";
+    }
+    return nullptr;
+}
+
+bool SecdiscardPaths(const std::vector<std::string>& paths, bool unlink) {
+    std::vector<bool> ok(paths.size(), true);
+    // Keyed by st_dev, so each device is resolved and opened once
+    std::map<dev_t, Device> devices;
+    std::map<dev_t, std::vector<Range>> extents;
+
+    for (size_t i = 0; i < paths.size(); i++) {
+        const auto& path = paths[i];
+        LOG(DEBUG) << "Securely discarding '" << path << "' unlink=" << unlink;
+        struct stat sb;
+        if (stat(path.c_str(), &sb) != 0) {
+            PLOG(ERROR) << "Unable to stat " << path;
+            ok[i] = false;
+            continue;
+        }
+        auto fiemap = PathFiemap(path, max_extents);
+        if (!fiemap || !check_fiemap(*fiemap, path)) {
+            ok[i] = false;
+            continue;
+        }
+        auto it = devices.find(sb.st_dev);
+        if (it == devices.end()) {
+            Device device;
+            device.path = BlockDeviceForPath(path);
+            if (!device.path.empty()) {
+                device.fd.reset(TEMP_FAILURE_RETRY(open(
+                    device.path.c_str(), O_RDWR | O_LARGEFILE | O_CLOEXEC, 0)));
+                if (device.fd == -1) {
+                    PLOG(ERROR) << "Failed to open device " << device.path;
+                }
+            }
+            // Remember failures too, so the device isn't retried per file
+            it = devices.emplace(sb.st_dev, std::move(device)).first;
+        }
+        if (it->second.fd == -1) {
+            ok[i] = false;
+            continue;
+        }
+        for (uint32_t e = 0; e < fiemap->fm_mapped_extents; e++) {
+            extents[sb.st_dev].push_back(Range{ it->second.fd.get(), &it->second.path,
+                    fiemap->fm_extents[e].fe_physical, fiemap->fm_extents[e].fe_length, { i } });
+        }
+    }
+
+    // Sort each device's extents and merge the ones that touch or overlap
+    std::vector<Range> ranges;
+    for (auto& device : extents) {
+        auto& list = device.second;
+        std::sort(list.begin(), list.end(), [](const Range& a, const Range& b) {
+            return a.start < b.start;
+        });
+        for (auto& extent : list) {
+            if (!ranges.empty() && ranges.back().fd == extent.fd
+                    && extent.start <= ranges.back().start + ranges.back().length) {
+                auto& last = ranges.back();
+                last.length = std::max(last.start + last.length,
+                        extent.start + extent.length) - last.start;
+                last.targets.push_back(extent.targets[0]);
+            } else {
+                ranges.push_back(std::move(extent));
+            }
+        }
+    }
+
+    // Not vector<bool>, since workers write neighbouring entries
+    std::vector<char> range_ok(ranges.size(), true);
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t r = next++; r < ranges.size(); r = next++) {
+            const auto& range = ranges[r];
+            const char* how = discard_range(range);
+            if (how) {
+                LOG(INFO) << "Discarded " << range.length << " bytes at " << range.start
+                        << " on " << *range.device << " with " << how;
+            } else {
+                LOG(ERROR) << "Unable to discard " << range.length << " bytes at "
+                        << range.start << " on " << *range.device;
+            }
+            range_ok[r] = how != nullptr;
+        }
+    };
+    size_t workers = std::min(max_workers, ranges.size());
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; w++) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    for (size_t r = 0; r < ranges.size(); r++) {
+        if (range_ok[r]) continue;
+        for (size_t i : ranges[r].targets) {
+            ok[i] = false;
+        }
+    }
+
+    bool success = true;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (!ok[i]) {
+            LOG(ERROR) << "Secure discard failed for: " << paths[i];
+            success = false;
+        }
+        if (unlink) {
+            if (::unlink(paths[i].c_str()) != 0 && errno != ENOENT) {
+                PLOG(ERROR) << "Unable to unlink: " << paths[i];
+            }
+        }
+        LOG(DEBUG) << "Discarded: " << paths[i];
+    }
+    return success;
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_SECURE_DISCARD_H
+#define ANDROID_VOLD_SECURE_DISCARD_H
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+// BLKSECDISCARD the content of every file in "paths", falling back to
+// overwriting with zeros, and unlink each afterwards if "unlink" is set.
+// Each block device is resolved and opened once; extents from all files
+// are sorted and merged per device, then discarded on a few threads.
+// Returns true if every file was discarded.
+bool SecdiscardPaths(const std::vector<std::string>& paths, bool unlink);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
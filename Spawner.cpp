@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Spawner.h"
+#include "Timings.h"
+
+#include <android-base/logging.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace android {
+namespace vold {
+
+/* Far more than any command line vold builds */
+static const size_t kMaxRequestSize = 64 * 1024;
+
+/*
+ * Exec requests pass their reply socket and the child's output pipe;
+ * namespace requests pass their reply socket, the namespace and the
+ * socket the helper serves.
+ */
+static const int kExecFds = 2;
+static const int kNamespaceFds = 3;
+static const int kMaxRequestFds = 3;
+
+/* First byte of a namespace request; exec requests start with '0' or '1' */
+static const char kNamespaceRequest = 'n';
+
+enum : int32_t {
+    kReplySpawned = 1,
+    kReplyExited = 2,
+    kReplyFailed = 3,
+};
+
+struct Reply {
+    int32_t type;
+    int32_t value;
+};
+
+static int sControlFd = -1;
+static std::mutex sControlLock;
+static std::atomic<bool> sSpawnerDead(false);
+
+static void sendReply(int fd, int32_t type, int32_t value) {
+    Reply reply = { type, value };
+    TEMP_FAILURE_RETRY(send(fd, &reply, sizeof(reply), MSG_NOSIGNAL));
+}
+
+/*
+ * Requests are a flags byte, the exec context and then argv, each string
+ * NUL-terminated. Runs in the spawner; |replyFd| is kept until the child
+ * has been reaped.
+ */
+static void spawnRequest(char* buf, size_t len, int replyFd, int outFd, int nullFd,
+        std::map<pid_t, int>& children) {
+    std::vector<char*> argv;
+    char* context = nullptr;
+    bool mergeStderr = false;
+    if (len > 1 && buf[len - 1] == '\0') {
+        mergeStderr = (buf[0] == '1');
+        context = buf + 1;
+        for (char* p = context + strlen(context) + 1; p < buf + len; p += strlen(p) + 1) {
+            argv.push_back(p);
+        }
+    }
+    if (argv.empty()) {
+        sendReply(replyFd, kReplyFailed, EINVAL);
+        close(replyFd);
+        close(outFd);
+        return;
+    }
+    argv.push_back(nullptr);
+
+    if (setexeccon(*context ? context : nullptr)) {
+        sendReply(replyFd, kReplyFailed, errno);
+        close(replyFd);
+        close(outFd);
+        return;
+    }
+
+    // Nothing but async-signal-safe calls until exec, since we share memory
+    pid_t pid = vfork();
+    if (pid == 0) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, nullptr);
+
+        dup2(nullFd, STDIN_FILENO);
+        dup2(outFd, STDOUT_FILENO);
+        dup2(mergeStderr ? outFd : nullFd, STDERR_FILENO);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    int spawnErrno = errno;
+    if (setexeccon(nullptr)) {
+        // Every later child would run in the wrong domain
+        _exit(1);
+    }
+    close(outFd);
+
+    if (pid == -1) {
+        sendReply(replyFd, kReplyFailed, spawnErrno);
+        close(replyFd);
+        return;
+    }
+    sendReply(replyFd, kReplySpawned, pid);
+    children[pid] = replyFd;
+}
+
+/*
+ * Namespace requests are the type byte and the address of the function to
+ * serve with, which is valid here since we're a fork of vold.
+ */
+static void namespaceRequest(char* buf, size_t len, int fds[kNamespaceFds], int controlFd,
+        const std::map<pid_t, int>& children) {
+    int replyFd = fds[0];
+    NamespaceServer serve;
+    if (len != 1 + sizeof(serve)) {
+        sendReply(replyFd, kReplyFailed, EINVAL);
+        close(replyFd);
+        close(fds[1]);
+        close(fds[2]);
+        return;
+    }
+    memcpy(&serve, buf + 1, sizeof(serve));
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Only the namespace and our own socket are wanted from here on
+        close(controlFd);
+        for (const auto& child : children) close(child.second);
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, nullptr);
+        if (setns(fds[1], CLONE_NEWNS) != 0) {
+            sendReply(replyFd, kReplyFailed, errno);
+            _exit(1);
+        }
+        close(fds[1]);
+        sendReply(replyFd, kReplySpawned, getpid());
+        close(replyFd);
+        _exit(serve(fds[2]));
+    }
+    int spawnErrno = errno;
+    close(fds[1]);
+    close(fds[2]);
+    if (pid == -1) {
+        sendReply(replyFd, kReplyFailed, spawnErrno);
+    }
+    // Otherwise the child replies once it's in the namespace
+    close(replyFd);
+}
+
+static void reapChildren(std::map<pid_t, int>& children) {
+    int status;
+    pid_t pid;
+    while ((pid = TEMP_FAILURE_RETRY(waitpid(-1, &status, WNOHANG))) > 0) {
+        auto it = children.find(pid);
+        if (it == children.end()) continue;
+        sendReply(it->second, kReplyExited, status);
+        close(it->second);
+        children.erase(it);
+    }
+}
+
+static void runSpawner(int controlFd) {
+    // Never outlive vold, and never leave it waiting on us
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() == 1) _exit(0);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    int sigFd = signalfd(-1, &mask, SFD_CLOEXEC);
+    int nullFd = TEMP_FAILURE_RETRY(open("/dev/null", O_RDWR | O_CLOEXEC));
+    if (sigFd == -1 || nullFd == -1) {
+        PLOG(ERROR) << "Failed to set up spawner";
+        _exit(1);
+    }
+
+    std::map<pid_t, int> children;
+    std::vector<char> buf(kMaxRequestSize);
+    while (true) {
+        struct pollfd fds[2] = {
+            { controlFd, POLLIN, 0 },
+            { sigFd, POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            _exit(1);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            TEMP_FAILURE_RETRY(read(sigFd, &info, sizeof(info)));
+            reapChildren(children);
+        }
+
+        if (fds[0].revents) {
+            struct iovec iov = { buf.data(), buf.size() };
+            char cbuf[CMSG_SPACE(sizeof(int) * kMaxRequestFds)];
+            struct msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = cbuf;
+            msg.msg_controllen = sizeof(cbuf);
+
+            ssize_t len = TEMP_FAILURE_RETRY(recvmsg(controlFd, &msg, MSG_CMSG_CLOEXEC));
+            if (len <= 0) {
+                // vold went away
+                _exit(0);
+            }
+
+            int reqFds[kMaxRequestFds];
+            int count = 0;
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+                    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+                int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                int* cfds = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+                for (int i = 0; i < n; i++) {
+                    if (count < kMaxRequestFds) {
+                        reqFds[count++] = cfds[i];
+                    } else {
+                        close(cfds[i]);
+                    }
+                }
+            }
+            bool ns = (buf[0] == kNamespaceRequest);
+            if (count != (ns ? kNamespaceFds : kExecFds) || (msg.msg_flags & MSG_TRUNC)) {
+                for (int i = 0; i < count; i++) close(reqFds[i]);
+                continue;
+            }
+            if (ns) {
+                namespaceRequest(buf.data(), len, reqFds, controlFd, children);
+            } else {
+                spawnRequest(buf.data(), len, reqFds[0], reqFds[1], nullFd, children);
+            }
+        }
+    }
+}
+
+status_t StartSpawner() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+        PLOG(ERROR) << "Failed to create spawner socket";
+        return -errno;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        runSpawner(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+    if (pid == -1) {
+        PLOG(ERROR) << "Failed to fork spawner";
+        close(fds[0]);
+        return -errno;
+    }
+
+    LOG(VERBOSE) << "Started spawner " << pid;
+    sControlFd = fds[0];
+    return OK;
+}
+
+static bool sendRequest(const std::string& request, const std::vector<int>& reqFds) {
+    struct iovec iov = { const_cast<char*>(request.data()), request.size() };
+    char cbuf[CMSG_SPACE(sizeof(int) * kMaxRequestFds)];
+    memset(cbuf, 0, sizeof(cbuf));
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * reqFds.size());
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * reqFds.size());
+    memcpy(CMSG_DATA(cmsg), reqFds.data(), sizeof(int) * reqFds.size());
+
+    std::lock_guard<std::mutex> lock(sControlLock);
+    return TEMP_FAILURE_RETRY(sendmsg(sControlFd, &msg, MSG_NOSIGNAL))
+            == (ssize_t) request.size();
+}
+
+static bool recvReply(int fd, Reply& reply) {
+    return TEMP_FAILURE_RETRY(recv(fd, &reply, sizeof(reply), 0)) == sizeof(reply);
+}
+
+status_t SpawnAndWait(const std::vector<std::string>& args, security_context_t context,
+        bool mergeStderr, const std::function<bool(const std::string&)>& onLine,
+        int* status, bool* stopped) {
+    if (sControlFd == -1 || sSpawnerDead || args.empty()) {
+        return -ENOTCONN;
+    }
+
+    std::string request(mergeStderr ? "1" : "0");
+    request += context ? context : "";
+    request += '\0';
+    for (const auto& arg : args) {
+        request += arg;
+        request += '\0';
+    }
+    if (request.size() > kMaxRequestSize) {
+        return -ENOTCONN;
+    }
+
+    int out[2];
+    int reply[2];
+    if (pipe2(out, O_CLOEXEC)) {
+        PLOG(ERROR) << "Failed to create pipe";
+        return -errno;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, reply)) {
+        PLOG(ERROR) << "Failed to create reply socket";
+        close(out[0]);
+        close(out[1]);
+        return -errno;
+    }
+
+    Reply r;
+    {
+        Timing timing("spawn " + args[0].substr(args[0].rfind('/') + 1));
+        bool sent = sendRequest(request, { reply[1], out[1] });
+        close(reply[1]);
+        close(out[1]);
+        if (!sent) {
+            PLOG(WARNING) << "Spawner unavailable; forking directly";
+            sSpawnerDead = true;
+            close(out[0]);
+            close(reply[0]);
+            return -ENOTCONN;
+        }
+        if (!recvReply(reply[0], r)) {
+            r = Reply{ kReplyFailed, EPIPE };
+        }
+    }
+    if (r.type != kReplySpawned) {
+        errno = r.value;
+        PLOG(ERROR) << "Failed to spawn " << args[0];
+        close(out[0]);
+        close(reply[0]);
+        return -r.value;
+    }
+
+    // Lines are split out of |pending| into |line|, both reused throughout
+    std::string pending;
+    std::string line;
+    bool more = true;
+    char buf[1024];
+    ssize_t n;
+    while (more && (n = TEMP_FAILURE_RETRY(read(out[0], buf, sizeof(buf)))) > 0) {
+        pending.append(buf, n);
+        size_t start = 0;
+        size_t end;
+        while (more && (end = pending.find('\n', start)) != std::string::npos) {
+            line.assign(pending, start, end - start);
+            more = onLine(line);
+            start = end + 1;
+        }
+        pending.erase(0, start);
+    }
+    if (more && !pending.empty()) {
+        onLine(pending);
+    }
+    // Stopping early leaves the child to die of SIGPIPE if it keeps writing
+    close(out[0]);
+    if (stopped) *stopped = !more;
+
+    bool exited = recvReply(reply[0], r) && r.type == kReplyExited;
+    close(reply[0]);
+    if (!exited) {
+        LOG(ERROR) << "Lost track of " << args[0];
+        return -ECHILD;
+    }
+    *status = r.value;
+    return OK;
+}
+
+status_t SpawnInNamespace(int nsFd, int serveFd, NamespaceServer serve, pid_t* pid) {
+    if (sControlFd == -1 || sSpawnerDead) {
+        return -ENOTCONN;
+    }
+
+    std::string request(1, kNamespaceRequest);
+    request.append(reinterpret_cast<const char*>(&serve), sizeof(serve));
+
+    int reply[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, reply)) {
+        PLOG(ERROR) << "Failed to create reply socket";
+        return -errno;
+    }
+    bool sent = sendRequest(request, { reply[1], nsFd, serveFd });
+    close(reply[1]);
+    if (!sent) {
+        PLOG(WARNING) << "Spawner unavailable";
+        sSpawnerDead = true;
+        close(reply[0]);
+        return -ENOTCONN;
+    }
+    Reply r;
+    if (!recvReply(reply[0], r)) {
+        r = Reply{ kReplyFailed, EPIPE };
+    }
+    close(reply[0]);
+    if (r.type != kReplySpawned) {
+        errno = r.value;
+        PLOG(ERROR) << "Failed to start namespace helper";
+        return -r.value;
+    }
+    *pid = r.value;
+    return OK;
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_SPAWNER_H
+#define ANDROID_VOLD_SPAWNER_H
+
+#include <selinux/selinux.h>
+#include <utils/Errors.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace android {
+namespace vold {
+
+/*
+ * Small helper process that launches external tools on vold's behalf.
+ *
+ * Once vold is up its address space is large, and every fork() copies
+ * its page tables. The spawner is forked before any of that exists, so
+ * its own vfork()/exec is cheap. Requests carry argv and the SELinux exec
+ * context over a socket, together with the pipe the child should write
+ * its output to; the exit status comes back on a per-request socket.
+ *
+ * Must be started from main() while vold is still single-threaded.
+ */
+status_t StartSpawner();
+
+/*
+ * Runs |args| through the spawner, handing each line of its stdout (and
+ * stderr with |mergeStderr|) to |onLine|, and stores the wait() status.
+ * Once |onLine| returns false the rest of the output is dropped and
+ * |stopped| is set. Returns -ENOTCONN when the spawner isn't running, in
+ * which case callers should fork the tool themselves.
+ */
+status_t SpawnAndWait(const std::vector<std::string>& args, security_context_t context,
+        bool mergeStderr, const std::function<bool(const std::string&)>& onLine,
+        int* status, bool* stopped = nullptr);
+
+/* Serves requests on its socket from inside a namespace, returning the exit status */
+typedef int (*NamespaceServer)(int fd);
+
+/*
+ * Starts a long-lived child of the spawner that joins the mount namespace
+ * |nsFd| and runs |serve| on |serveFd| until it returns. The child dies
+ * with the spawner, and so with vold. Returns -ENOTCONN like
+ * SpawnAndWait() when the spawner isn't running.
+ */
+status_t SpawnInNamespace(int nsFd, int serveFd, NamespaceServer serve, pid_t* pid);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
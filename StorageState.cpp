@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "StorageState.h"
+
+#include <android-base/stringprintf.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include <inttypes.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+/* Only writers take this; readers just load sState */
+static std::mutex sWriteLock;
+static std::shared_ptr<const StorageState> sState = std::make_shared<StorageState>();
+
+std::shared_ptr<const StorageState> GetStorageState() {
+    return std::atomic_load(&sState);
+}
+
+template <class T>
+static typename std::vector<T>::iterator find(std::vector<T>& items, const std::string& id) {
+    return std::find_if(items.begin(), items.end(), [&](const T& t) { return t.id == id; });
+}
+
+/* Must be called with sWriteLock held */
+static void publish(const std::function<void(StorageState&)>& change) {
+    auto next = std::make_shared<StorageState>(*sState);
+    next->generation++;
+    change(*next);
+    std::atomic_store(&sState, std::shared_ptr<const StorageState>(std::move(next)));
+}
+
+void UpdateDiskState(const std::string& id, const std::function<void(DiskState&)>& update) {
+    std::lock_guard<std::mutex> lock(sWriteLock);
+    publish([&](StorageState& state) {
+        auto it = find(state.disks, id);
+        if (it == state.disks.end()) {
+            state.disks.push_back(DiskState{ id, 0, 0, "", "" });
+            it = state.disks.end() - 1;
+        }
+        update(*it);
+    });
+}
+
+void UpdateVolumeState(const std::string& id, const std::function<void(VolumeState&)>& update) {
+    std::lock_guard<std::mutex> lock(sWriteLock);
+    publish([&](StorageState& state) {
+        auto it = find(state.volumes, id);
+        if (it == state.volumes.end()) {
+            state.volumes.push_back(VolumeState{ id, 0, "", "", 0, "", "", "", "", "", 0, 0 });
+            it = state.volumes.end() - 1;
+        }
+        update(*it);
+    });
+}
+
+void RemoveDiskState(const std::string& id) {
+    std::lock_guard<std::mutex> lock(sWriteLock);
+    publish([&](StorageState& state) {
+        auto it = find(state.disks, id);
+        if (it != state.disks.end()) state.disks.erase(it);
+    });
+}
+
+void RemoveVolumeState(const std::string& id) {
+    std::lock_guard<std::mutex> lock(sWriteLock);
+    publish([&](StorageState& state) {
+        auto it = find(state.volumes, id);
+        if (it != state.volumes.end()) state.volumes.erase(it);
+    });
+}
+
+void DumpStorageState(std::vector<std::string>& lines) {
+    auto state = GetStorageState();
+    lines.push_back(StringPrintf("generation %" PRIu64, state->generation));
+    for (const auto& d : state->disks) {
+        lines.push_back(StringPrintf("disk %s %d %" PRIu64 " \"%s\" \"%s\"", d.id.c_str(),
+                d.flags, d.size, d.label.c_str(), d.sysPath.c_str()));
+    }
+    for (const auto& v : state->volumes) {
+        lines.push_back(StringPrintf("volume %s %d \"%s\" \"%s\" %d \"%s\" \"%s\" \"%s\" \"%s\""
+                " \"%s\" %d %d", v.id.c_str(), v.type, v.diskId.c_str(), v.partGuid.c_str(),
+                v.state, v.fsType.c_str(), v.fsUuid.c_str(), v.fsLabel.c_str(), v.path.c_str(),
+                v.internalPath.c_str(), v.mountFlags, v.mountUserId));
+    }
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_STORAGE_STATE_H
+#define ANDROID_VOLD_STORAGE_STATE_H
+
+#include <cutils/multiuser.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+struct DiskState {
+    std::string id;
+    int flags;
+    uint64_t size;
+    std::string label;
+    std::string sysPath;
+};
+
+struct VolumeState {
+    std::string id;
+    int type;
+    std::string diskId;
+    std::string partGuid;
+    int state;
+    std::string fsType;
+    std::string fsUuid;
+    std::string fsLabel;
+    std::string path;
+    std::string internalPath;
+    int mountFlags;
+    userid_t mountUserId;
+};
+
+/*
+ * The disks and volumes as last announced to the framework. Every
+ * announcement publishes a new copy, so a snapshot never changes once
+ * taken and can be read without holding any of vold's locks.
+ */
+struct StorageState {
+    /* Bumped with every snapshot */
+    uint64_t generation;
+    std::vector<DiskState> disks;
+    std::vector<VolumeState> volumes;
+};
+
+std::shared_ptr<const StorageState> GetStorageState();
+
+/* Publishes a snapshot with |id| changed by |update|, adding it if new */
+void UpdateDiskState(const std::string& id, const std::function<void(DiskState&)>& update);
+void UpdateVolumeState(const std::string& id, const std::function<void(VolumeState&)>& update);
+void RemoveDiskState(const std::string& id);
+void RemoveVolumeState(const std::string& id);
+
+/* One line per disk and volume in the current snapshot */
+void DumpStorageState(std::vector<std::string>& lines);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
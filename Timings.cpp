@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
+
+#include "Timings.h"
+
+#include <android-base/stringprintf.h>
+#include <cutils/trace.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+
+#include <inttypes.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+namespace {
+
+/* Bucket i counts runs shorter than 2^i ms; the last takes the rest */
+constexpr size_t kHistogramBuckets = 12;
+
+struct Phase {
+    /* When this phase first started, relative to vold starting */
+    nsecs_t firstStart;
+    uint64_t count;
+    nsecs_t total;
+    nsecs_t max;
+    /* Empty unless the phase is timed with a histogram */
+    std::vector<uint64_t> histogram;
+};
+
+std::mutex sLock;
+std::map<std::string, Phase> sPhases;
+std::atomic<bool> sAllHistograms(false);
+/* Close enough to process start; statics are set up before main() */
+const nsecs_t sVoldStart = systemTime(SYSTEM_TIME_MONOTONIC);
+
+}  // namespace
+
+Timing::Timing(const std::string& name, bool withHistogram) : mName(name),
+        mStart(systemTime(SYSTEM_TIME_MONOTONIC)), mHistogram(withHistogram) {
+    atrace_begin(ATRACE_TAG, mName.c_str());
+}
+
+static size_t bucketFor(nsecs_t duration) {
+    size_t bucket = 0;
+    nsecs_t limit = ms2ns(1);
+    while (bucket < kHistogramBuckets - 1 && duration >= limit) {
+        bucket++;
+        limit *= 2;
+    }
+    return bucket;
+}
+
+Timing::~Timing() {
+    nsecs_t duration = systemTime(SYSTEM_TIME_MONOTONIC) - mStart;
+    atrace_end(ATRACE_TAG);
+
+    std::lock_guard<std::mutex> lock(sLock);
+    auto it = sPhases.find(mName);
+    if (it == sPhases.end()) {
+        it = sPhases.emplace(mName, Phase{ mStart - sVoldStart, 0, 0, 0, {} }).first;
+    }
+    Phase& phase = it->second;
+    phase.count++;
+    phase.total += duration;
+    phase.max = std::max(phase.max, duration);
+    if (mHistogram || sAllHistograms) {
+        phase.histogram.resize(kHistogramBuckets);
+        phase.histogram[bucketFor(duration)]++;
+    }
+}
+
+void EnableTimingHistograms() {
+    sAllHistograms = true;
+}
+
+void DumpTimings(std::vector<std::string>& lines) {
+    std::vector<std::pair<std::string, Phase>> phases;
+    {
+        std::lock_guard<std::mutex> lock(sLock);
+        phases.assign(sPhases.begin(), sPhases.end());
+    }
+    std::sort(phases.begin(), phases.end(), [](const std::pair<std::string, Phase>& a,
+            const std::pair<std::string, Phase>& b) {
+        return a.second.firstStart < b.second.firstStart;
+    });
+
+    for (const auto& p : phases) {
+        lines.push_back(StringPrintf("%s: first at %" PRId64 "ms, %" PRIu64 " runs, total %"
+                PRId64 "ms, max %" PRId64 "ms", p.first.c_str(), ns2ms(p.second.firstStart),
+                p.second.count, ns2ms(p.second.total), ns2ms(p.second.max)));
+        if (p.second.histogram.empty()) continue;
+
+        std::string histogram = "  ";
+        for (size_t i = 0; i < kHistogramBuckets; i++) {
+            if (!p.second.histogram[i]) continue;
+            if (i == kHistogramBuckets - 1) {
+                histogram += StringPrintf(" >=%dms:", 1 << (i - 1));
+            } else {
+                histogram += StringPrintf(" <%dms:", 1 << i);
+            }
+            histogram += std::to_string(p.second.histogram[i]);
+        }
+        lines.push_back(histogram);
+    }
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_TIMINGS_H
+#define ANDROID_VOLD_TIMINGS_H
+
+#include "Utils.h"
+
+#include <utils/Timers.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * Times the enclosing scope as phase |name|, both as an atrace section and
+ * in the totals reported by "dump timings". Phases timed |withHistogram|
+ * also report how the individual runs were distributed, which is worth it
+ * for short, frequent calls such as those into the keymaster HAL.
+ */
+class Timing {
+public:
+    explicit Timing(const std::string& name, bool withHistogram = false);
+    ~Timing();
+
+private:
+    std::string mName;
+    nsecs_t mStart;
+    bool mHistogram;
+
+    DISALLOW_COPY_AND_ASSIGN(Timing);
+};
+
+/* Gives every phase a histogram from now on, as when benchmarking */
+void EnableTimingHistograms();
+
+/* One line per phase, in the order phases first started */
+void DumpTimings(std::vector<std::string>& lines);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
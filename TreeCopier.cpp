@@ -0,0 +1,600 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TreeCopier.h"
+#include "TreeRemover.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <cutils/properties.h>
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+using android::base::unique_fd;
+
+namespace android {
+namespace vold {
+
+static const int kDefaultThreads = 4;
+static const int kMaxThreads = 16;
+
+/* Largest chunk handed to a single copy_file_range()/sendfile() call */
+static const size_t kCopyChunk = 8 * 1024 * 1024;
+static const size_t kBufferSize = 128 * 1024;
+
+/* How often copied files are synced and recorded in the journal */
+static const std::chrono::seconds kJournalCommitInterval(5);
+static const char kJournalMagic[] = "VOLDMOVE1\n";
+
+const char* TreeCopier::kJournalName = ".vold_move_journal";
+
+TreeCopier::TreeCopier(const std::string& fromPath, const std::string& toPath) :
+        mFromPath(fromPath), mToPath(toPath), mAllocatedBytes(0), mTotalBytes(0),
+        mCopiedBytes(0), mFailed(false), mSkippedFiles(0), mJournalFd(-1) {
+    mThreads = std::max(1, std::min(kMaxThreads,
+            property_get_int32("vold.move_threads", kDefaultThreads)));
+}
+
+TreeCopier::~TreeCopier() {
+    if (mJournalFd != -1) {
+        close(mJournalFd);
+    }
+}
+
+static std::string journalHeader(const std::string& fromPath) {
+    return std::string(kJournalMagic) + fromPath + "\n";
+}
+
+bool TreeCopier::isJournalFor(const std::string& journalPath, const std::string& fromPath) {
+    std::string header = journalHeader(fromPath);
+    unique_fd fd(TEMP_FAILURE_RETRY(open(journalPath.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
+    if (fd == -1) return false;
+    std::string actual(header.size(), '\0');
+    return android::base::ReadFully(fd, &actual[0], actual.size()) && actual == header;
+}
+
+status_t TreeCopier::openJournal(const std::string& journalPath, bool resume) {
+    mJournaled.clear();
+    if (resume) {
+        std::string contents;
+        if (!android::base::ReadFileToString(journalPath, &contents)) {
+            PLOG(ERROR) << "Failed to read " << journalPath;
+            return -1;
+        }
+        std::string header = journalHeader(mFromPath);
+        if (contents.compare(0, header.size(), header) != 0) {
+            LOG(ERROR) << "Journal " << journalPath << " is not for " << mFromPath;
+            return -1;
+        }
+        // Records are appended whole after a sync, but a torn tail is simply ignored
+        size_t pos = header.size();
+        while (pos + sizeof(JournalRecord) + sizeof(uint32_t) <= contents.size()) {
+            JournalRecord record;
+            uint32_t len;
+            memcpy(&record, &contents[pos], sizeof(record));
+            memcpy(&len, &contents[pos + sizeof(record)], sizeof(len));
+            pos += sizeof(record) + sizeof(len);
+            if (pos + len > contents.size()) break;
+            mJournaled[contents.substr(pos, len)] = record;
+            pos += len;
+        }
+        LOG(INFO) << "Resuming copy with " << mJournaled.size() << " files already copied";
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_APPEND | O_NOFOLLOW | O_CLOEXEC | (resume ? 0 : O_TRUNC);
+    mJournalFd = TEMP_FAILURE_RETRY(open(journalPath.c_str(), flags, 0600));
+    if (mJournalFd == -1) {
+        PLOG(ERROR) << "Failed to open " << journalPath;
+        return -1;
+    }
+    if (!resume) {
+        std::string header = journalHeader(mFromPath);
+        if (!android::base::WriteFully(mJournalFd, header.data(), header.size())
+                || fdatasync(mJournalFd) != 0) {
+            PLOG(ERROR) << "Failed to write " << journalPath;
+            return -1;
+        }
+    }
+    return OK;
+}
+
+status_t TreeCopier::commitJournal() {
+    std::vector<std::pair<std::string, JournalRecord>> records;
+    {
+        std::lock_guard<std::mutex> lock(mJournalLock);
+        records.swap(mPendingRecords);
+    }
+    if (mJournalFd == -1 || records.empty()) return OK;
+
+    // Only record files once their data is known to be on disk
+    unique_fd rootFd(open(mToPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (rootFd == -1 || syncfs(rootFd) != 0) {
+        PLOG(ERROR) << "Failed to sync " << mToPath;
+        return -1;
+    }
+
+    std::string buf;
+    for (const auto& record : records) {
+        uint32_t len = record.first.size();
+        buf.append(reinterpret_cast<const char*>(&record.second), sizeof(record.second));
+        buf.append(reinterpret_cast<const char*>(&len), sizeof(len));
+        buf.append(record.first);
+    }
+    if (!android::base::WriteFully(mJournalFd, buf.data(), buf.size())
+            || fdatasync(mJournalFd) != 0) {
+        PLOG(ERROR) << "Failed to update move journal";
+        return -1;
+    }
+    return OK;
+}
+
+static uint64_t allocatedSize(const struct stat& st) {
+    // Same accounting as GetTreeBytes(): blocks in use, rounded up to blksize
+    uint64_t size = (uint64_t) st.st_blocks * 512;
+    uint64_t blksize = st.st_blksize;
+    if (blksize) {
+        size = (size + blksize - 1) & ~(blksize - 1);
+    }
+    return size;
+}
+
+static std::string join(const std::string& root, const std::string& rel) {
+    return rel.empty() ? root : root + "/" + rel;
+}
+
+void TreeCopier::scanWorker(std::mutex& lock, std::vector<std::string>& queue, int& busy,
+        std::condition_variable& cond) {
+    std::vector<Entry> dirs, files, others;
+    uint64_t allocated = 0, total = 0;
+
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        cond.wait(guard, [&] { return !queue.empty() || busy == 0 || mFailed; });
+        if (queue.empty() || mFailed) break;
+
+        std::string rel = queue.back();
+        queue.pop_back();
+        busy++;
+        guard.unlock();
+
+        std::vector<std::string> subdirs;
+        std::string path = join(mFromPath, rel);
+        DIR* dir = opendir(path.c_str());
+        if (dir == nullptr) {
+            PLOG(ERROR) << "Failed to open " << path;
+            mFailed = true;
+        } else {
+            struct dirent* ent;
+            while ((ent = readdir(dir)) != nullptr) {
+                if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+                if (rel.empty() && !strcmp(ent->d_name, kJournalName)) continue;
+
+                Entry entry;
+                entry.path = rel.empty() ? ent->d_name : rel + "/" + ent->d_name;
+                if (fstatat(dirfd(dir), ent->d_name, &entry.st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    PLOG(ERROR) << "Failed to stat " << join(mFromPath, entry.path);
+                    mFailed = true;
+                    continue;
+                }
+                allocated += allocatedSize(entry.st);
+                if (S_ISDIR(entry.st.st_mode)) {
+                    subdirs.push_back(entry.path);
+                    dirs.push_back(std::move(entry));
+                } else if (S_ISREG(entry.st.st_mode)) {
+                    total += entry.st.st_size;
+                    files.push_back(std::move(entry));
+                } else {
+                    others.push_back(std::move(entry));
+                }
+            }
+            closedir(dir);
+        }
+
+        guard.lock();
+        busy--;
+        queue.insert(queue.end(), subdirs.begin(), subdirs.end());
+        cond.notify_all();
+    }
+
+    // Still holding the lock; merge what this worker found
+    std::move(dirs.begin(), dirs.end(), std::back_inserter(mDirs));
+    std::move(files.begin(), files.end(), std::back_inserter(mFiles));
+    std::move(others.begin(), others.end(), std::back_inserter(mOthers));
+    mAllocatedBytes += allocated;
+    mTotalBytes += total;
+    cond.notify_all();
+}
+
+status_t TreeCopier::scan() {
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<std::string> queue;
+    int busy = 0;
+
+    mDirs.clear();
+    mFiles.clear();
+    mOthers.clear();
+    mAllocatedBytes = 0;
+    mTotalBytes = 0;
+    mFailed = false;
+
+    queue.push_back("");
+    std::vector<std::thread> threads;
+    for (int i = 0; i < mThreads; i++) {
+        threads.emplace_back(&TreeCopier::scanWorker, this, std::ref(lock), std::ref(queue),
+                std::ref(busy), std::ref(cond));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    // Parents sort before their children, so directories can be created in order
+    std::sort(mDirs.begin(), mDirs.end(),
+            [](const Entry& a, const Entry& b) { return a.path < b.path; });
+    // Copy the largest files first so the tail of the copy stays parallel
+    std::sort(mFiles.begin(), mFiles.end(),
+            [](const Entry& a, const Entry& b) { return a.st.st_size > b.st.st_size; });
+
+    LOG(DEBUG) << "Scanned " << mFromPath << ": " << mDirs.size() << " dirs, " << mFiles.size()
+            << " files, " << mTotalBytes << " bytes";
+    return mFailed ? -1 : OK;
+}
+
+status_t TreeCopier::pruneDir(const std::unordered_map<std::string, mode_t>& types,
+        const std::string& rel, int depth, int keepDepth) {
+    std::string path = join(mToPath, rel);
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        PLOG(ERROR) << "Failed to open " << path;
+        return -1;
+    }
+    std::vector<std::string> subdirs;
+    std::vector<std::pair<std::string, bool>> stale;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != nullptr) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        if (rel.empty() && !strcmp(ent->d_name, kJournalName)) continue;
+
+        std::string child = rel.empty() ? ent->d_name : rel + "/" + ent->d_name;
+        struct stat st;
+        if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            PLOG(ERROR) << "Failed to stat " << join(mToPath, child);
+            closedir(dir);
+            return -1;
+        }
+        auto it = types.find(child);
+        if (it == types.end()) {
+            // Gone from the source; shallow entries are only emptied
+            stale.emplace_back(child, depth < keepDepth);
+        } else if (it->second != (st.st_mode & S_IFMT)) {
+            stale.emplace_back(child, false);
+        } else if (S_ISDIR(st.st_mode)) {
+            subdirs.push_back(child);
+        }
+    }
+    closedir(dir);
+
+    status_t res = OK;
+    for (const auto& entry : stale) {
+        LOG(DEBUG) << "Pruning " << entry.first << " from " << mToPath;
+        TreeRemover remover(join(mToPath, entry.first), entry.second ? 1 : 0);
+        if (remover.run(nullptr) != OK) res = -1;
+    }
+    for (const auto& subdir : subdirs) {
+        if (pruneDir(types, subdir, depth + 1, keepDepth) != OK) res = -1;
+    }
+    return res;
+}
+
+status_t TreeCopier::prune(int keepDepth) {
+    std::unordered_map<std::string, mode_t> types;
+    for (const auto* entries : { &mDirs, &mFiles, &mOthers }) {
+        for (const auto& entry : *entries) {
+            types[entry.path] = entry.st.st_mode & S_IFMT;
+        }
+    }
+    return pruneDir(types, "", 1, keepDepth);
+}
+
+static void copyXattrs(int srcFd, int dstFd, const std::string& path) {
+    ssize_t len = flistxattr(srcFd, nullptr, 0);
+    if (len <= 0) return;
+    std::vector<char> names(len);
+    len = flistxattr(srcFd, names.data(), names.size());
+    if (len <= 0) return;
+
+    std::vector<char> value;
+    for (const char* name = names.data(); name < names.data() + len;
+            name += strlen(name) + 1) {
+        ssize_t size = fgetxattr(srcFd, name, nullptr, 0);
+        if (size < 0) continue;
+        value.resize(size);
+        size = fgetxattr(srcFd, name, value.data(), value.size());
+        if (size < 0) continue;
+        if (fsetxattr(dstFd, name, value.data(), size, 0) != 0 && errno != ENOTSUP) {
+            PLOG(VERBOSE) << "Failed to copy xattr " << name << " to " << path;
+        }
+    }
+}
+
+/* Copies ownership, permissions, timestamps and xattrs from |st| onto |dstFd| */
+static status_t copyMetadata(int srcFd, int dstFd, const struct stat& st,
+        const std::string& path) {
+    copyXattrs(srcFd, dstFd, path);
+    if (fchown(dstFd, st.st_uid, st.st_gid) != 0) {
+        PLOG(ERROR) << "Failed to chown " << path;
+        return -1;
+    }
+    if (fchmod(dstFd, st.st_mode & 07777) != 0) {
+        PLOG(ERROR) << "Failed to chmod " << path;
+        return -1;
+    }
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    if (futimens(dstFd, times) != 0) {
+        PLOG(ERROR) << "Failed to set times on " << path;
+        return -1;
+    }
+    return OK;
+}
+
+status_t TreeCopier::copyData(int srcFd, int dstFd, off64_t size) {
+    off64_t done = 0;
+
+#if defined(__NR_copy_file_range)
+    bool tryCopyFileRange = true;
+#else
+    bool tryCopyFileRange = false;
+#endif
+    bool trySendfile = true;
+    std::unique_ptr<char[]> buf;
+
+    while (done < size) {
+        size_t want = std::min((off64_t) kCopyChunk, size - done);
+        ssize_t n = -1;
+#if defined(__NR_copy_file_range)
+        if (tryCopyFileRange) {
+            n = syscall(__NR_copy_file_range, srcFd, nullptr, dstFd, nullptr, want, 0);
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                    || errno == EOPNOTSUPP)) {
+                tryCopyFileRange = false;
+                continue;
+            }
+        } else
+#endif
+        if (trySendfile) {
+            n = sendfile(dstFd, srcFd, nullptr, want);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                trySendfile = false;
+                continue;
+            }
+        } else {
+            if (!buf) buf.reset(new char[kBufferSize]);
+            n = TEMP_FAILURE_RETRY(read(srcFd, buf.get(), std::min(want, kBufferSize)));
+            if (n > 0 && !android::base::WriteFully(dstFd, buf.get(), n)) {
+                n = -1;
+            }
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            // File shrank underneath us; copy what's there
+            break;
+        }
+        done += n;
+        mCopiedBytes += n;
+    }
+    return OK;
+}
+
+static int64_t mtimeNs(const struct stat& st) {
+    return (int64_t) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+status_t TreeCopier::copyFile(const Entry& entry) {
+    std::string from = join(mFromPath, entry.path);
+    std::string to = join(mToPath, entry.path);
+
+    auto it = mJournaled.find(entry.path);
+    if (it != mJournaled.end()) {
+        const JournalRecord& record = it->second;
+        struct stat st;
+        if (record.ino == (uint64_t) entry.st.st_ino
+                && record.size == (uint64_t) entry.st.st_size
+                && record.mtimeNs == mtimeNs(entry.st)
+                && lstat(to.c_str(), &st) == 0 && S_ISREG(st.st_mode)
+                && st.st_size == entry.st.st_size) {
+            mCopiedBytes += entry.st.st_size;
+            mSkippedFiles++;
+            return OK;
+        }
+    }
+
+    unique_fd srcFd(TEMP_FAILURE_RETRY(open(from.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
+    if (srcFd == -1) {
+        PLOG(ERROR) << "Failed to open " << from;
+        return -1;
+    }
+    unique_fd dstFd(TEMP_FAILURE_RETRY(open(to.c_str(),
+            O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600)));
+    if (dstFd == -1) {
+        PLOG(ERROR) << "Failed to create " << to;
+        return -1;
+    }
+
+    if (copyData(srcFd, dstFd, entry.st.st_size) != OK) {
+        PLOG(ERROR) << "Failed to copy " << from << " to " << to;
+        return -1;
+    }
+    if (copyMetadata(srcFd, dstFd, entry.st, to) != OK) {
+        return -1;
+    }
+
+    if (mJournalFd != -1) {
+        JournalRecord record = { (uint64_t) entry.st.st_ino, (uint64_t) entry.st.st_size,
+                mtimeNs(entry.st) };
+        std::lock_guard<std::mutex> lock(mJournalLock);
+        mPendingRecords.emplace_back(entry.path, record);
+    }
+    return OK;
+}
+
+status_t TreeCopier::copyOther(const Entry& entry) {
+    std::string from = join(mFromPath, entry.path);
+    std::string to = join(mToPath, entry.path);
+
+    if (S_ISLNK(entry.st.st_mode)) {
+        std::string target;
+        if (!android::base::Readlink(from, &target)) {
+            PLOG(ERROR) << "Failed to read link " << from;
+            return -1;
+        }
+        // May be left over from an interrupted attempt
+        if (unlink(to.c_str()) != 0 && errno != ENOENT) {
+            PLOG(ERROR) << "Failed to replace " << to;
+            return -1;
+        }
+        if (symlink(target.c_str(), to.c_str()) != 0) {
+            PLOG(ERROR) << "Failed to create link " << to;
+            return -1;
+        }
+    } else if (S_ISFIFO(entry.st.st_mode)) {
+        if (mkfifo(to.c_str(), entry.st.st_mode & 07777) != 0 && errno != EEXIST) {
+            PLOG(ERROR) << "Failed to create fifo " << to;
+            return -1;
+        }
+    } else {
+        LOG(WARNING) << "Skipping special file " << from;
+        return OK;
+    }
+
+    if (lchown(to.c_str(), entry.st.st_uid, entry.st.st_gid) != 0) {
+        PLOG(ERROR) << "Failed to chown " << to;
+        return -1;
+    }
+    struct timespec times[2] = { entry.st.st_atim, entry.st.st_mtim };
+    if (utimensat(AT_FDCWD, to.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0) {
+        PLOG(WARNING) << "Failed to set times on " << to;
+    }
+    return OK;
+}
+
+void TreeCopier::copyWorker(std::atomic<size_t>& next, std::mutex& lock, int& running,
+        std::condition_variable& cond) {
+    while (!mFailed) {
+        size_t i = next++;
+        if (i >= mFiles.size()) break;
+        if (mCheckpoint && !mCheckpoint()) {
+            LOG(INFO) << "Copy to " << mToPath << " cancelled";
+            mFailed = true;
+            break;
+        }
+        if (copyFile(mFiles[i]) != OK) {
+            mFailed = true;
+        }
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    running--;
+    cond.notify_all();
+}
+
+status_t TreeCopier::copy(const ProgressCallback& progress) {
+    mCopiedBytes = 0;
+    mFailed = false;
+
+    for (const auto& dir : mDirs) {
+        std::string to = join(mToPath, dir.path);
+        if (mkdir(to.c_str(), 0700) != 0 && errno != EEXIST) {
+            PLOG(ERROR) << "Failed to create " << to;
+            return -1;
+        }
+    }
+
+    // Files recorded in the journal are skipped; count only what we do
+    mSkippedFiles = 0;
+
+    std::atomic<size_t> next(0);
+    std::mutex lock;
+    std::condition_variable cond;
+    int running = mThreads;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < mThreads; i++) {
+        threads.emplace_back(&TreeCopier::copyWorker, this, std::ref(next), std::ref(lock),
+                std::ref(running), std::ref(cond));
+    }
+
+    // Report progress and commit the journal from here while the workers run
+    {
+        auto lastCommit = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> guard(lock);
+        while (running > 0) {
+            cond.wait_for(guard, std::chrono::seconds(1));
+            guard.unlock();
+            if (progress) progress(mCopiedBytes, mTotalBytes);
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastCommit >= kJournalCommitInterval) {
+                if (commitJournal() != OK) mFailed = true;
+                lastCommit = now;
+            }
+            guard.lock();
+        }
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    // Whatever made it across is still worth remembering for a retry
+    if (commitJournal() != OK) mFailed = true;
+    if (mFailed) return -1;
+    if (mSkippedFiles > 0) {
+        LOG(INFO) << "Skipped " << mSkippedFiles << " already copied files";
+    }
+
+    for (const auto& other : mOthers) {
+        if (copyOther(other) != OK) return -1;
+    }
+
+    // Directory metadata last and deepest first, so writing children
+    // doesn't disturb the timestamps we restore
+    for (auto it = mDirs.rbegin(); it != mDirs.rend(); ++it) {
+        std::string from = join(mFromPath, it->path);
+        std::string to = join(mToPath, it->path);
+        unique_fd srcFd(open(from.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        unique_fd dstFd(open(to.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if (srcFd == -1 || dstFd == -1) {
+            PLOG(ERROR) << "Failed to open " << from << " or " << to;
+            return -1;
+        }
+        if (copyMetadata(srcFd, dstFd, it->st, to) != OK) return -1;
+    }
+
+    if (progress) progress(mCopiedBytes, mTotalBytes);
+    return OK;
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_TREE_COPIER_H
+#define ANDROID_VOLD_TREE_COPIER_H
+
+#include "Utils.h"
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * In-process replacement for "cp -p -R -P -d" that copies the contents of
+ * one directory into another.
+ *
+ * scan() walks the source tree once on a small pool of threads, recording
+ * every entry and the total size. copy() then recreates directories,
+ * copies regular files in parallel using copy_file_range() (falling back
+ * to sendfile() and read()/write()), recreates symlinks and FIFOs, and
+ * preserves ownership, mode, timestamps and xattrs. Symlinks are never
+ * followed.
+ *
+ * With a journal, the relative path and source identity (inode, size,
+ * mtime) of every copied file is appended to a manifest once its data has
+ * been synced, so a later attempt can skip files whose source hasn't
+ * changed since.
+ */
+class TreeCopier {
+public:
+    typedef std::function<void(uint64_t copiedBytes, uint64_t totalBytes)> ProgressCallback;
+
+    /* Name of the journal in the target root; never copied from a source */
+    static const char* kJournalName;
+
+    TreeCopier(const std::string& fromPath, const std::string& toPath);
+    virtual ~TreeCopier();
+
+    /* True if |journalPath| is a journal of an earlier copy from |fromPath| */
+    static bool isJournalFor(const std::string& journalPath, const std::string& fromPath);
+
+    /* Records progress in |journalPath|, first loading it if |resume| */
+    status_t openJournal(const std::string& journalPath, bool resume);
+
+    /* Walks the source tree; must be called before copy() */
+    status_t scan();
+    /*
+     * Removes everything in the target that scan() didn't find in the
+     * source, or found as another type, so a resumed copy doesn't keep
+     * files deleted since the earlier attempt. Entries shallower than
+     * |keepDepth| are only emptied, as TreeRemover does.
+     */
+    status_t prune(int keepDepth);
+    /* Copies everything found by scan(), calling |progress| about once a second */
+    status_t copy(const ProgressCallback& progress);
+    /*
+     * Called by each copying thread before every file, so the copy can be
+     * held; the copy fails once it returns false
+     */
+    void setCheckpoint(const std::function<bool()>& checkpoint) { mCheckpoint = checkpoint; }
+
+    /* Bytes of storage the source tree occupies, as GetTreeBytes() reports */
+    uint64_t getAllocatedBytes() const { return mAllocatedBytes; }
+    /* Sum of the sizes of all regular files */
+    uint64_t getTotalBytes() const { return mTotalBytes; }
+    uint64_t getCopiedBytes() const { return mCopiedBytes; }
+    /* Files skipped because the journal showed them already copied */
+    uint64_t getSkippedFiles() const { return mSkippedFiles; }
+
+private:
+    struct Entry {
+        std::string path;  // relative to both roots
+        struct stat st;
+    };
+
+    /* Source identity of a copied file, as stored in the journal */
+    struct JournalRecord {
+        uint64_t ino;
+        uint64_t size;
+        int64_t mtimeNs;
+    };
+
+    std::string mFromPath;
+    std::string mToPath;
+    int mThreads;
+    std::function<bool()> mCheckpoint;
+
+    std::vector<Entry> mDirs;
+    std::vector<Entry> mFiles;
+    std::vector<Entry> mOthers;
+    uint64_t mAllocatedBytes;
+    uint64_t mTotalBytes;
+    std::atomic<uint64_t> mCopiedBytes;
+    std::atomic<bool> mFailed;
+    std::atomic<uint64_t> mSkippedFiles;
+
+    int mJournalFd;
+    std::unordered_map<std::string, JournalRecord> mJournaled;
+    std::mutex mJournalLock;
+    std::vector<std::pair<std::string, JournalRecord>> mPendingRecords;
+
+    status_t commitJournal();
+    status_t pruneDir(const std::unordered_map<std::string, mode_t>& types,
+            const std::string& rel, int depth, int keepDepth);
+
+    void scanWorker(std::mutex& lock, std::vector<std::string>& queue, int& busy,
+            std::condition_variable& cond);
+    void copyWorker(std::atomic<size_t>& next, std::mutex& lock, int& running,
+            std::condition_variable& cond);
+
+    status_t copyFile(const Entry& entry);
+    status_t copyOther(const Entry& entry);
+    status_t copyData(int srcFd, int dstFd, off64_t size);
+
+    DISALLOW_COPY_AND_ASSIGN(TreeCopier);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TreeRemover.h"
+
+#include <android-base/logging.h>
+#include <cutils/properties.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace android {
+namespace vold {
+
+static const int kDefaultThreads = 4;
+static const int kMaxThreads = 16;
+
+TreeRemover::TreeRemover(const std::string& path, int keepDepth) :
+        mPath(path), mKeepDepth(keepDepth), mQueued(0), mDone(false), mCancelled(false),
+        mFailed(false), mRemovedFiles(0), mRemovedBytes(0) {
+    mThreads = std::max(1, std::min(kMaxThreads,
+            property_get_int32("vold.move_threads", kDefaultThreads)));
+}
+
+TreeRemover::~TreeRemover() {
+}
+
+void TreeRemover::push(int worker, Dir* dir) {
+    {
+        std::lock_guard<std::mutex> lock(mQueues[worker]->lock);
+        mQueues[worker]->dirs.push_back(dir);
+    }
+    std::lock_guard<std::mutex> lock(mLock);
+    mQueued++;
+    mCond.notify_all();
+}
+
+TreeRemover::Dir* TreeRemover::pop(int worker) {
+    // Depth-first from our own queue, then steal breadth-first from others
+    for (int i = 0; i < mThreads; i++) {
+        int victim = (worker + i) % mThreads;
+        Queue& queue = *mQueues[victim];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if (queue.dirs.empty()) continue;
+
+        Dir* dir;
+        if (i == 0) {
+            dir = queue.dirs.back();
+            queue.dirs.pop_back();
+        } else {
+            dir = queue.dirs.front();
+            queue.dirs.pop_front();
+        }
+        std::lock_guard<std::mutex> guard(mLock);
+        mQueued--;
+        return dir;
+    }
+    return nullptr;
+}
+
+void TreeRemover::release(Dir* dir) {
+    while (dir != nullptr && --dir->pending == 0) {
+        if (!mCancelled && dir->depth >= mKeepDepth) {
+            if (rmdir(dir->path.c_str()) != 0 && errno != ENOENT) {
+                PLOG(WARNING) << "Failed to remove " << dir->path;
+                mFailed = true;
+            } else {
+                mRemovedFiles++;
+            }
+        }
+        Dir* parent = dir->parent;
+        delete dir;
+        if (parent == nullptr) {
+            std::lock_guard<std::mutex> lock(mLock);
+            mDone = true;
+            mCond.notify_all();
+        }
+        dir = parent;
+    }
+}
+
+void TreeRemover::processDir(int worker, Dir* dir) {
+    if (mCancelled) {
+        release(dir);
+        return;
+    }
+
+    DIR* d = opendir(dir->path.c_str());
+    if (d == nullptr) {
+        if (errno != ENOENT) {
+            PLOG(WARNING) << "Failed to open " << dir->path;
+            mFailed = true;
+        }
+        release(dir);
+        return;
+    }
+
+    int dfd = dirfd(d);
+    struct dirent* ent;
+    while (!mCancelled && (ent = readdir(d)) != nullptr) {
+        const char* name = ent->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+
+        struct stat st;
+        bool haveStat = fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+        bool isDir = haveStat ? S_ISDIR(st.st_mode) : ent->d_type == DT_DIR;
+
+        if (isDir) {
+            Dir* child = new Dir;
+            child->path = dir->path + "/" + name;
+            child->depth = dir->depth + 1;
+            child->parent = dir;
+            child->pending = 1;
+            dir->pending++;
+            push(worker, child);
+            continue;
+        }
+
+        if (dir->depth + 1 < mKeepDepth) continue;
+        if (unlinkat(dfd, name, 0) != 0) {
+            if (errno != ENOENT) {
+                PLOG(WARNING) << "Failed to remove " << dir->path << "/" << name;
+                mFailed = true;
+            }
+            continue;
+        }
+        mRemovedFiles++;
+        if (haveStat) {
+            mRemovedBytes += (uint64_t) st.st_blocks * 512;
+        }
+    }
+    closedir(d);
+    release(dir);
+}
+
+void TreeRemover::worker(int id) {
+    while (true) {
+        Dir* dir = pop(id);
+        if (dir != nullptr) {
+            processDir(id, dir);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mLock);
+        mCond.wait(lock, [&] { return mDone || mQueued > 0; });
+        if (mDone) return;
+    }
+}
+
+status_t TreeRemover::run(const ProgressCallback& progress) {
+    struct stat st;
+    if (lstat(mPath.c_str(), &st) != 0) {
+        return (errno == ENOENT) ? OK : -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (mKeepDepth > 0) return OK;
+        return (unlink(mPath.c_str()) == 0 || errno == ENOENT) ? OK : -1;
+    }
+
+    mQueues.clear();
+    for (int i = 0; i < mThreads; i++) {
+        mQueues.emplace_back(new Queue);
+    }
+    mQueued = 0;
+    mDone = false;
+
+    Dir* root = new Dir;
+    root->path = mPath;
+    root->depth = 0;
+    root->parent = nullptr;
+    root->pending = 1;
+    push(0, root);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < mThreads; i++) {
+        threads.emplace_back(&TreeRemover::worker, this, i);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        while (!mDone) {
+            mCond.wait_for(lock, std::chrono::seconds(1));
+            if (progress && !mDone) {
+                lock.unlock();
+                progress(mRemovedFiles, mRemovedBytes);
+                lock.lock();
+            }
+        }
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    if (progress) progress(mRemovedFiles, mRemovedBytes);
+
+    LOG(DEBUG) << "Removed " << mRemovedFiles << " entries (" << mRemovedBytes
+            << " bytes) under " << mPath;
+    if (mCancelled) return -ECANCELED;
+    return mFailed ? -1 : OK;
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_TREE_REMOVER_H
+#define ANDROID_VOLD_TREE_REMOVER_H
+
+#include "Utils.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * In-process, multi-threaded replacement for "rm -f -R".
+ *
+ * Directories are fanned out over per-thread work queues; idle threads
+ * steal from the others. Every file is removed with unlinkat() relative to
+ * its parent directory, and each directory is removed as soon as its last
+ * child is gone. Like "rm -f", failures are logged and the walk carries on,
+ * but run() reports them.
+ *
+ * Entries shallower than |keepDepth| are emptied but kept: with 0 the root
+ * itself is removed, with 1 only its contents, with 2 the root's immediate
+ * children survive too, matching what MoveTask used to pass to "rm -R".
+ */
+class TreeRemover {
+public:
+    typedef std::function<void(uint64_t removedFiles, uint64_t removedBytes)> ProgressCallback;
+
+    TreeRemover(const std::string& path, int keepDepth);
+    virtual ~TreeRemover();
+
+    /* Removes the tree, calling |progress| about once a second */
+    status_t run(const ProgressCallback& progress);
+    /* Asks a running run() to stop as soon as possible; safe from any thread */
+    void cancel() { mCancelled = true; }
+
+    uint64_t getRemovedFiles() const { return mRemovedFiles; }
+    uint64_t getRemovedBytes() const { return mRemovedBytes; }
+
+private:
+    struct Dir {
+        std::string path;
+        int depth;
+        Dir* parent;
+        /* Unfinished children, plus one while this dir is being scanned */
+        std::atomic<int> pending;
+    };
+
+    struct Queue {
+        std::mutex lock;
+        std::deque<Dir*> dirs;
+    };
+
+    std::string mPath;
+    int mKeepDepth;
+    int mThreads;
+
+    std::vector<std::unique_ptr<Queue>> mQueues;
+    std::mutex mLock;
+    std::condition_variable mCond;
+    size_t mQueued;
+    bool mDone;
+
+    std::atomic<bool> mCancelled;
+    std::atomic<bool> mFailed;
+    std::atomic<uint64_t> mRemovedFiles;
+    std::atomic<uint64_t> mRemovedBytes;
+
+    void push(int worker, Dir* dir);
+    Dir* pop(int worker);
+    void worker(int id);
+    void processDir(int worker, Dir* dir);
+    void release(Dir* dir);
+
+    DISALLOW_COPY_AND_ASSIGN(TreeRemover);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -16,10 +16,12 @@
 
 #include "TrimTask.h"
 #include "Benchmark.h"
+#include "BenchHistory.h"
 #include "Utils.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
 
+#include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/logging.h>
 #include <cutils/properties.h>
@@ -27,12 +29,22 @@
 #include <private/android_filesystem_config.h>
 #include <hardware_legacy/power.h>
 
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <vector>
+
 #include <dirent.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 
 /* From a would-be kernel header */
 #define FIDTRIM         _IOWR('f', 128, struct fstrim_range)    /* Deep discard trim */
@@ -46,7 +58,18 @@ namespace vold {
 
 static const char* kWakeLock = "TrimTask";
 
-TrimTask::TrimTask(int flags) : mFlags(flags) {
+static const char* kCursorPath = "/data/misc/vold/trim_cursor";
+
+/* Slices per filesystem when trimming against a budget */
+static const uint64_t kBudgetSlices = 16;
+/* How long the disk has to be quiet before the next slice */
+static const nsecs_t kQuietInterval = ms2ns(100);
+/* Hold off no longer than this per slice, or a busy disk never gets trimmed */
+static const nsecs_t kMaxYield = s2ns(10);
+
+TrimTask::TrimTask(int flags, IoSchedClass ioClass, nsecs_t budget) :
+        mFlags(flags), mIoClass(ioClass), mBudget(budget), mDeadline(0),
+        mTrimmedPaths(0) {
     // Collect both fstab and vold volumes
     addFromFstab();
 
@@ -99,7 +122,8 @@ void TrimTask::addFromFstab() {
 }
 
 void TrimTask::start() {
-    mThread = std::thread(&TrimTask::run, this);
+    StartBackgroundJob(BackgroundJob::Kind::kTrim, "fstrim", mIoClass,
+            [this](BackgroundJob& job) { run(job); });
 }
 
 static void notifyResult(const std::string& path, int64_t bytes, int64_t delta) {
@@ -110,35 +134,244 @@ static void notifyResult(const std::string& path, int64_t bytes, int64_t delta)
             ResponseCode::TrimResult, res.c_str(), false);
 }
 
-void TrimTask::run() {
-    acquire_wake_lock(PARTIAL_WAKE_LOCK, kWakeLock);
-
-    for (const auto& path : mPaths) {
-        LOG(DEBUG) << "Starting trim of " << path;
+/*
+ * Names the whole disk under |path|, looking through partitions and
+ * device-mapper stacks, or returns the filesystem's own device when sysfs
+ * has nothing better. Only used to decide what can run concurrently.
+ */
+static std::string getDiskForPath(const std::string& path) {
+    struct stat sb;
+    if (stat(path.c_str(), &sb)) {
+        return path;
+    }
+    std::string sysPath = StringPrintf("/sys/dev/block/%u:%u", major(sb.st_dev), minor(sb.st_dev));
+    for (int depth = 0; depth < 8; depth++) {
+        char* real = realpath(sysPath.c_str(), nullptr);
+        if (!real) break;
+        sysPath = real;
+        free(real);
 
-        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
-        if (fd < 0) {
-            PLOG(WARNING) << "Failed to open " << path;
+        // Follow the first device a dm or loop device sits on
+        std::string slaves = sysPath + "/slaves";
+        std::unique_ptr<DIR, int (*)(DIR*)> dirp(opendir(slaves.c_str()), closedir);
+        struct dirent* ent = nullptr;
+        while (dirp && (ent = readdir(dirp.get())) && ent->d_name[0] == '.') {}
+        if (ent) {
+            sysPath = slaves + "/" + ent->d_name;
             continue;
         }
+        if (access((sysPath + "/partition").c_str(), F_OK) == 0) {
+            sysPath = sysPath.substr(0, sysPath.rfind('/'));
+        }
+        return sysPath;
+    }
+    return StringPrintf("%u:%u", major(sb.st_dev), minor(sb.st_dev));
+}
+
+/* Completed reads and writes plus in-flight requests, from the disk's stat */
+static bool readDiskActivity(const std::string& disk, uint64_t* activity) {
+    std::string stat;
+    if (!android::base::ReadFileToString(disk + "/stat", &stat)) {
+        return false;
+    }
+    std::istringstream in(stat);
+    uint64_t fields[9];
+    for (auto& field : fields) {
+        if (!(in >> field)) return false;
+    }
+    // reads, writes and in_flight
+    *activity = fields[0] + fields[4] + fields[8];
+    return true;
+}
+
+/*
+ * Waits until nothing has touched |disk| for kQuietInterval. Our own
+ * discards may still be draining after the ioctl returns, which is just as
+ * well worth waiting for.
+ */
+static void yieldToForeground(const std::string& disk, nsecs_t deadline) {
+    nsecs_t giveUp = systemTime(SYSTEM_TIME_BOOTTIME) + kMaxYield;
+    if (deadline > 0) giveUp = std::min(giveUp, deadline);
+
+    uint64_t before;
+    if (!readDiskActivity(disk, &before)) return;
+    while (true) {
+        usleep(ns2us(kQuietInterval));
+        uint64_t after;
+        if (!readDiskActivity(disk, &after) || after == before) return;
+        if (systemTime(SYSTEM_TIME_BOOTTIME) >= giveUp) {
+            LOG(DEBUG) << disk << " still busy; trimming anyway";
+            return;
+        }
+        before = after;
+    }
+}
+
+static void notifySlice(const std::string& path, uint64_t offset, uint64_t bytes,
+        nsecs_t delta) {
+    std::string res(path
+            + " " + std::to_string(offset)
+            + " " + std::to_string(bytes)
+            + " " + std::to_string(delta));
+    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(
+            ResponseCode::TrimSliceResult, res.c_str(), false);
+}
+
+void TrimTask::trimPath(BackgroundJob& job, const std::string& disk, const std::string& path) {
+    LOG(DEBUG) << "Starting trim of " << path;
+
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        PLOG(WARNING) << "Failed to open " << path;
+        return;
+    }
+
+    // Unless slicing, the whole filesystem goes in one call
+    uint64_t size = ULLONG_MAX;
+    uint64_t slice = ULLONG_MAX;
+    uint64_t sliceMb = property_get_int32("vold.trim_slice_mb", 0);
+    struct statvfs sv;
+    if ((mBudget > 0 || sliceMb > 0) && !fstatvfs(fd, &sv)) {
+        size = (uint64_t) sv.f_blocks * sv.f_frsize;
+        slice = sliceMb > 0 ? sliceMb << 20 : size / kBudgetSlices;
+        slice = std::max<uint64_t>(slice, sv.f_frsize);
+    }
+    bool sliced = (slice != ULLONG_MAX);
 
+    // Filled in before the threads start; look up only, never insert
+    uint64_t& cursor = mCursors.at(path);
+    if (!sliced || cursor >= size) {
+        cursor = 0;
+    } else if (cursor > 0) {
+        LOG(DEBUG) << "Resuming trim of " << path << " at " << cursor;
+    }
+
+    nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
+    uint64_t trimmed = 0;
+    bool failed = false;
+    bool outOfTime = false;
+    while (cursor < size) {
+        if (mBudget > 0 && systemTime(SYSTEM_TIME_BOOTTIME) >= mDeadline) {
+            outOfTime = true;
+            break;
+        }
         struct fstrim_range range;
         memset(&range, 0, sizeof(range));
-        range.len = ULLONG_MAX;
-
-        nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
+        range.start = cursor;
+        range.len = slice;
+        nsecs_t sliceStart = systemTime(SYSTEM_TIME_BOOTTIME);
         if (ioctl(fd, (mFlags & Flags::kDeepTrim) ? FIDTRIM : FITRIM, &range)) {
             PLOG(WARNING) << "Trim failed on " << path;
-            notifyResult(path, -1, -1);
+            failed = true;
+            break;
+        }
+        trimmed += range.len;
+        if (!sliced) break;
+
+        notifySlice(path, cursor, range.len, systemTime(SYSTEM_TIME_BOOTTIME) - sliceStart);
+        cursor = std::min(size, cursor + slice);
+        if (cursor < size) {
+            yieldToForeground(disk, mBudget > 0 ? mDeadline : 0);
+            if (!job.checkpoint()) {
+                // Like running out of time, so the next run carries on from here
+                outOfTime = true;
+                break;
+            }
+        }
+    }
+    close(fd);
+    if (!outOfTime) {
+        // Done, or failed and worth starting over
+        cursor = 0;
+    }
+
+    if (failed) {
+        notifyResult(path, -1, -1);
+        return;
+    }
+    nsecs_t delta = systemTime(SYSTEM_TIME_BOOTTIME) - start;
+    LOG(INFO) << "Trimmed " << trimmed << " bytes on " << path
+            << " in " << nanoseconds_to_milliseconds(delta) << "ms"
+            << (outOfTime ? " before running out of time" : "");
+    notifyResult(path, trimmed, delta);
+    RecordTrim(path, trimmed, delta);
+}
+
+void TrimTask::trimPaths(BackgroundJob& job, const std::string& disk,
+        const std::list<std::string>& paths) {
+    for (const auto& path : paths) {
+        if (!job.checkpoint()) break;
+        trimPath(job, disk, path);
+        job.setProgress(++mTrimmedPaths, mPaths.size());
+    }
+}
+
+static void loadCursors(std::map<std::string, uint64_t>& cursors) {
+    std::string content;
+    if (!android::base::ReadFileToString(kCursorPath, &content)) {
+        return;
+    }
+    std::istringstream in(content);
+    std::string path;
+    uint64_t offset;
+    while (in >> path >> offset) {
+        auto it = cursors.find(path);
+        if (it != cursors.end()) it->second = offset;
+    }
+}
+
+static void saveCursors(const std::map<std::string, uint64_t>& cursors) {
+    std::string content;
+    for (const auto& cursor : cursors) {
+        if (cursor.second > 0) {
+            content += StringPrintf("%s %" PRIu64 "\n", cursor.first.c_str(), cursor.second);
+        }
+    }
+
+    std::string tmpPath = StringPrintf("%s.tmp", kCursorPath);
+    if (!android::base::WriteStringToFile(content, tmpPath, 0600, AID_ROOT, AID_ROOT)) {
+        PLOG(WARNING) << "Failed to write " << tmpPath;
+        return;
+    }
+    if (rename(tmpPath.c_str(), kCursorPath)) {
+        PLOG(WARNING) << "Failed to rename " << tmpPath;
+        unlink(tmpPath.c_str());
+    }
+}
+
+void TrimTask::run(BackgroundJob& job) {
+    acquire_wake_lock(PARTIAL_WAKE_LOCK, kWakeLock);
+    job.setWakeLock(kWakeLock);
+    mDeadline = systemTime(SYSTEM_TIME_BOOTTIME) + mBudget;
+
+    // Keep each disk's filesystems in their original order
+    std::map<std::string, std::list<std::string>> disks;
+    for (const auto& path : mPaths) {
+        disks[getDiskForPath(path)].push_back(path);
+        // Threads only update their own entries from here on
+        mCursors[path] = 0;
+    }
+    loadCursors(mCursors);
+
+    std::vector<std::thread> threads;
+    for (const auto& disk : disks) {
+        LOG(DEBUG) << "Trimming " << disk.second.size() << " filesystems on " << disk.first;
+        if (&disk == &*disks.rbegin()) {
+            // This thread takes the last disk itself
+            trimPaths(job, disk.first, disk.second);
         } else {
-            nsecs_t delta = systemTime(SYSTEM_TIME_BOOTTIME) - start;
-            LOG(INFO) << "Trimmed " << range.len << " bytes on " << path
-                    << " in " << nanoseconds_to_milliseconds(delta) << "ms";
-            notifyResult(path, range.len, delta);
+            threads.emplace_back(&TrimTask::trimPaths, this, std::ref(job),
+                    std::cref(disk.first), std::cref(disk.second));
         }
-        close(fd);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    saveCursors(mCursors);
 
-        if (mFlags & Flags::kBenchmarkAfter) {
+    // Benchmarks run once every trim is done, so they don't measure each other
+    if ((mFlags & Flags::kBenchmarkAfter) && !job.isCancelled()) {
+        for (const auto& path : mPaths) {
 #if BENCHMARK_ENABLED
             BenchmarkPrivate(path);
 #else
@@ -17,17 +17,35 @@
 #ifndef ANDROID_VOLD_TRIM_TASK_H
 #define ANDROID_VOLD_TRIM_TASK_H
 
+#include "JobScheduler.h"
 #include "Utils.h"
 
-#include <thread>
+#include <cutils/iosched_policy.h>
+#include <utils/Timers.h>
+
+#include <atomic>
 #include <list>
+#include <map>
 
 namespace android {
 namespace vold {
 
+/*
+ * Trims every writable fstab filesystem and mounted private volume.
+ *
+ * Filesystems on different disks are trimmed concurrently, one thread per
+ * disk, while those sharing a disk take turns since they'd only compete
+ * for it. Each disk's trims are a background job of their own, running in
+ * |ioClass| unless it's IoSchedClass_NONE, when the job policy decides.
+ *
+ * With a |budget| or vold.trim_slice_mb set, each filesystem is trimmed in
+ * slices rather than one long ioctl, pausing between slices while anything
+ * else is using the disk. Where a filesystem was left off is saved, so the
+ * next run carries on from there, as it does when the job is cancelled.
+ */
 class TrimTask {
 public:
-    explicit TrimTask(int flags);
+    explicit TrimTask(int flags, IoSchedClass ioClass = IoSchedClass_NONE, nsecs_t budget = 0);
     virtual ~TrimTask();
 
     enum Flags {
@@ -35,15 +53,24 @@ public:
         kBenchmarkAfter = 1 << 1,
     };
 
+    /* Queues the trim on the background job pool */
     void start();
 
 private:
     int mFlags;
+    IoSchedClass mIoClass;
+    nsecs_t mBudget;
+    nsecs_t mDeadline;
     std::list<std::string> mPaths;
-    std::thread mThread;
+    /* Offset to resume each path from; filled in before trimming starts */
+    std::map<std::string, uint64_t> mCursors;
+    std::atomic<size_t> mTrimmedPaths;
 
     void addFromFstab();
-    void run();
+    void run(BackgroundJob& job);
+    void trimPaths(BackgroundJob& job, const std::string& disk,
+            const std::list<std::string>& paths);
+    void trimPath(BackgroundJob& job, const std::string& disk, const std::string& path);
 
     DISALLOW_COPY_AND_ASSIGN(TrimTask);
 };
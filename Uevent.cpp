@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Uevent.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace android {
+namespace vold {
+
+// Longest "action@devpath" header the filter looks for the end of
+static constexpr uint32_t kMaxFilteredHeader = 512;
+static constexpr char kBlockSubsystem[] = "SUBSYSTEM=block";
+
+// Value of |str| if it starts with |key|, which includes the '='
+template <size_t N>
+static const char* value(const char* str, const char (&key)[N]) {
+    return strncmp(str, key, N - 1) == 0 ? str + N - 1 : nullptr;
+}
+
+static int number(const char* str) {
+    char* end;
+    long n = strtol(str, &end, 10);
+    return (end == str || *end != '\0' || n < 0 || n > INT32_MAX) ? -1 : static_cast<int>(n);
+}
+
+bool ParseUevent(const char* buf, size_t len, Uevent* out) {
+    *out = Uevent{ nullptr, nullptr, nullptr, nullptr, -1, -1 };
+    if (len == 0 || buf[len - 1] != '\0') return false;
+
+    // The header is "action@devpath"; anything else, such as a libudev
+    // message, isn't from the kernel
+    const char* end = buf + len;
+    size_t headerLen = strlen(buf);
+    if (memchr(buf, '@', headerLen) == nullptr) return false;
+
+    for (const char* field = buf + headerLen + 1; field < end; field += strlen(field) + 1) {
+        const char* val;
+        if ((val = value(field, "ACTION="))) {
+            out->action = val;
+        } else if ((val = value(field, "DEVPATH="))) {
+            out->devPath = val;
+        } else if ((val = value(field, "SUBSYSTEM="))) {
+            out->subsystem = val;
+        } else if ((val = value(field, "DEVTYPE="))) {
+            out->devType = val;
+        } else if ((val = value(field, "MAJOR="))) {
+            out->major = number(val);
+        } else if ((val = value(field, "MINOR="))) {
+            out->minor = number(val);
+        }
+    }
+    return out->action != nullptr && out->devPath != nullptr;
+}
+
+// Four bytes of |str| as an absolute or indexed BPF word load sees them
+static uint32_t word(const char* str) {
+    return (static_cast<uint32_t>(static_cast<uint8_t>(str[0])) << 24)
+            | (static_cast<uint32_t>(static_cast<uint8_t>(str[1])) << 16)
+            | (static_cast<uint32_t>(static_cast<uint8_t>(str[2])) << 8)
+            | static_cast<uint32_t>(static_cast<uint8_t>(str[3]));
+}
+
+static sock_filter stmt(uint16_t code, uint32_t k) {
+    return sock_filter BPF_STMT(code, k);
+}
+
+static sock_filter jump(uint16_t code, uint32_t k, uint8_t jt, uint8_t jf) {
+    return sock_filter BPF_JUMP(code, k, jt, jf);
+}
+
+std::vector<sock_filter> BlockUeventFilter() {
+    // With the header "action@devpath" ending in the NUL at n, the message
+    // continues "ACTION=action\0DEVPATH=devpath\0SUBSYSTEM=", putting the
+    // subsystem at 2n + 17. Classic BPF can't loop, so the search for the
+    // NUL is unrolled, four instructions per byte.
+    std::vector<sock_filter> prog;
+    const uint32_t match = kMaxFilteredHeader * 4 + 1;
+    for (uint32_t n = 0; n < kMaxFilteredHeader; n++) {
+        prog.push_back(stmt(BPF_LD | BPF_B | BPF_ABS, n));
+        prog.push_back(jump(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2));
+        prog.push_back(stmt(BPF_LDX | BPF_W | BPF_IMM, 2 * n + 17));
+        prog.push_back(stmt(BPF_JMP | BPF_JA, match - static_cast<uint32_t>(prog.size()) - 1));
+    }
+    prog.push_back(stmt(BPF_RET | BPF_K, 0xffffffff));
+
+    // "SUBSYSTEM=block\0" is four words; loads past the end drop the event
+    static_assert(sizeof(kBlockSubsystem) == 16, "subsystem match is four words");
+    for (uint32_t w = 0; w < 4; w++) {
+        prog.push_back(stmt(BPF_LD | BPF_W | BPF_IND, w * 4));
+        prog.push_back(jump(BPF_JMP | BPF_JEQ | BPF_K, word(kBlockSubsystem + w * 4),
+                0, static_cast<uint8_t>(7 - w * 2)));
+    }
+    prog.push_back(stmt(BPF_RET | BPF_K, 0xffffffff));
+    prog.push_back(stmt(BPF_RET | BPF_K, 0));
+    return prog;
+}
+
+}  // namespace vold
+}  // namespace android
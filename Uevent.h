@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_UEVENT_H
+#define ANDROID_VOLD_UEVENT_H
+
+#include <linux/filter.h>
+#include <stddef.h>
+
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * The fields of one kernel uevent that vold acts on, pointing into the
+ * buffer it was received in. Values are the NUL-terminated strings the
+ * kernel already separates the message into, so nothing is copied; the
+ * event is only valid for as long as that buffer is. Missing fields are
+ * nullptr, and missing numbers -1.
+ */
+struct Uevent {
+    const char* action;
+    const char* devPath;
+    const char* subsystem;
+    const char* devType;
+    int major;
+    int minor;
+};
+
+/*
+ * Fills |out| from the |len| bytes of |buf|, which must be NUL-terminated
+ * at |buf[len - 1]|. False if it isn't a kernel uevent.
+ */
+bool ParseUevent(const char* buf, size_t len, Uevent* out);
+
+/*
+ * Classic BPF program for a NETLINK_KOBJECT_UEVENT socket that only admits
+ * uevents with SUBSYSTEM=block. It relies on the kernel writing ACTION,
+ * DEVPATH and SUBSYSTEM first, repeating the "action@devpath" header, so
+ * the subsystem sits at a fixed distance from the end of the header.
+ * Anything with a header too long to find is admitted, and left to
+ * ParseUevent().
+ */
+std::vector<sock_filter> BlockUeventFilter();
+
+}  // namespace vold
+}  // namespace android
+
+#endif
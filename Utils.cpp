@@ -16,29 +16,39 @@
 
 #include "sehandle.h"
 #include "Utils.h"
+#include "FsProbe.h"
 #include "Process.h"
+#include "Spawner.h"
+#include "Timings.h"
 #include "VolumeManager.h"
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
 
 #include <cutils/fs.h>
+#include <cutils/properties.h>
 #include <logwrap/logwrap.h>
 #include <private/android_filesystem_config.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
 #include <dirent.h>
 #include <fcntl.h>
 #include <linux/fs.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <sys/inotify.h>
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
 #include <sys/statvfs.h>
+#include <sys/syscall.h>
 #include <thread>
 
 #ifndef UMOUNT_NOFOLLOW
@@ -124,56 +134,65 @@ status_t PrepareDir(const std::string& path, mode_t mode, uid_t uid, gid_t gid)
     }
 }
 
+/* Processes get this long to handle each signal before the next one is sent */
+static std::chrono::milliseconds getKillStageTimeout() {
+    if (VolumeManager::shutting_down) return 500ms;
+    return std::chrono::milliseconds(std::max(0,
+            android::base::GetIntProperty("vold.kill_stage_ms", 5000)));
+}
+
+static bool tryUnmount(const char* path) {
+    return !umount2(path, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT;
+}
+
+/* How often an unmount is retried while apps are closing their files */
+static constexpr std::chrono::milliseconds kUnmountRetryInterval = 50ms;
+
 status_t ForceUnmount(const std::string& path) {
     const char* cpath = path.c_str();
-    if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
+    if (tryUnmount(cpath)) {
         return OK;
     }
-    // Apps might still be handling eject request, so wait before
-    // we start sending signals
-    if (!VolumeManager::shutting_down) sleep(5);
-
-    Process::killProcessesWithOpenFiles(cpath, SIGINT);
-    if (!VolumeManager::shutting_down) sleep(5);
-    if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
-        return OK;
-    }
-
-    Process::killProcessesWithOpenFiles(cpath, SIGTERM);
-    if (!VolumeManager::shutting_down) sleep(5);
-    if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
-        return OK;
+    // Apps might still be handling eject request, so give them a while
+    // before we start sending signals, retrying as they let go
+    auto stage = getKillStageTimeout();
+    if (!VolumeManager::shutting_down) {
+        auto deadline = std::chrono::steady_clock::now() + stage;
+        while (std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(kUnmountRetryInterval);
+            if (tryUnmount(cpath)) return OK;
+        }
     }
 
-    Process::killProcessesWithOpenFiles(cpath, SIGKILL);
-    if (!VolumeManager::shutting_down) sleep(5);
-    if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
-        return OK;
+    // Later rounds only need to revisit the processes found by the first
+    ProcessScanner scanner;
+    scanner.addMountPoint(path);
+    for (int signal : { SIGINT, SIGTERM, SIGKILL }) {
+        // Next round as soon as everyone signalled is gone
+        if (scanner.scan(signal) > 0) {
+            scanner.waitForExit(stage);
+        }
+        if (tryUnmount(cpath)) {
+            return OK;
+        }
     }
-
     return -errno;
 }
 
 status_t KillProcessesUsingPath(const std::string& path) {
-    const char* cpath = path.c_str();
-    if (Process::killProcessesWithOpenFiles(cpath, SIGINT) == 0) {
-        return OK;
-    }
-    if (!VolumeManager::shutting_down) sleep(5);
-
-    if (Process::killProcessesWithOpenFiles(cpath, SIGTERM) == 0) {
-        return OK;
-    }
-    if (!VolumeManager::shutting_down) sleep(5);
-
-    if (Process::killProcessesWithOpenFiles(cpath, SIGKILL) == 0) {
-        return OK;
+    auto stage = getKillStageTimeout();
+    ProcessScanner scanner;
+    scanner.addMountPoint(path);
+    for (int signal : { SIGINT, SIGTERM, SIGKILL }) {
+        if (scanner.scan(signal) == 0) {
+            return OK;
+        }
+        scanner.waitForExit(stage);
     }
-    if (!VolumeManager::shutting_down) sleep(5);
 
     // Send SIGKILL a second time to determine if we've
     // actually killed everyone with open files
-    if (Process::killProcessesWithOpenFiles(cpath, SIGKILL) == 0) {
+    if (scanner.scan(SIGKILL) == 0) {
         return OK;
     }
     PLOG(ERROR) << "Failed to kill processes using " << path;
@@ -194,6 +213,12 @@ static status_t readMetadata(const std::string& path, std::string& fsType,
     fsUuid.clear();
     fsLabel.clear();
 
+    // Reading a few sectors ourselves is far cheaper than exec'ing blkid
+    if (property_get_bool("vold.native_probe", true)
+            && ProbeFilesystem(path, fsType, fsUuid, fsLabel, untrusted) == OK) {
+        return OK;
+    }
+
     std::vector<std::string> cmd;
     cmd.push_back(kBlkidPath);
     cmd.push_back("-c");
@@ -206,15 +231,8 @@ static status_t readMetadata(const std::string& path, std::string& fsType,
     cmd.push_back("LABEL");
     cmd.push_back(path);
 
-    std::vector<std::string> output;
-    status_t res = ForkExecvp(cmd, output, untrusted ? sBlkidUntrustedContext : sBlkidContext);
-    if (res != OK) {
-        LOG(WARNING) << "blkid failed to identify " << path;
-        return res;
-    }
-
     char value[128];
-    for (const auto& line : output) {
+    status_t res = ForkExecvpStream(cmd, [&](const std::string& line) {
         // Extract values from blkid output, if defined
         const char* cline = line.c_str();
         const char* start = strstr(cline, "TYPE=\"");
@@ -231,6 +249,11 @@ static status_t readMetadata(const std::string& path, std::string& fsType,
         if (start != nullptr && sscanf(start + 6, "\"%127[^\"]\"", value) == 1) {
             fsLabel = value;
         }
+        return true;
+    }, untrusted ? sBlkidUntrustedContext : sBlkidContext);
+    if (res != OK) {
+        LOG(WARNING) << "blkid failed to identify " << path;
+        return res;
     }
 
     return OK;
@@ -250,7 +273,14 @@ status_t ForkExecvp(const std::vector<std::string>& args) {
     return ForkExecvp(args, nullptr);
 }
 
+/* Timing phase for running |args|, tagged with the binary's name */
+static std::string execPhase(const std::vector<std::string>& args) {
+    if (args.empty()) return "exec";
+    return "exec " + args[0].substr(args[0].rfind('/') + 1);
+}
+
 status_t ForkExecvp(const std::vector<std::string>& args, security_context_t context) {
+    Timing timing(execPhase(args));
     size_t argc = args.size();
     char** argv = (char**) calloc(argc, sizeof(char*));
     for (size_t i = 0; i < argc; i++) {
@@ -262,11 +292,22 @@ status_t ForkExecvp(const std::vector<std::string>& args, security_context_t con
         }
     }
 
+    int status;
+    status_t res = SpawnAndWait(args, context, true, [](const std::string& line) {
+        LOG(INFO) << line;
+        return true;
+    }, &status);
+    if (res != -ENOTCONN) {
+        free(argv);
+        if (res != OK) return res;
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -ECHILD;
+    }
+
     if (setexeccon(context)) {
         LOG(ERROR) << "Failed to setexeccon";
         abort();
     }
-    status_t res = android_fork_execvp(argc, argv, NULL, false, true);
+    res = android_fork_execvp(argc, argv, NULL, false, true);
     if (setexeccon(nullptr)) {
         LOG(ERROR) << "Failed to setexeccon";
         abort();
@@ -283,6 +324,16 @@ status_t ForkExecvp(const std::vector<std::string>& args,
 
 status_t ForkExecvp(const std::vector<std::string>& args,
         std::vector<std::string>& output, security_context_t context) {
+    output.clear();
+    return ForkExecvpStream(args, [&](const std::string& line) {
+        output.push_back(line + "\n");
+        return true;
+    }, context);
+}
+
+status_t ForkExecvpStream(const std::vector<std::string>& args,
+        const std::function<bool(const std::string&)>& onLine, security_context_t context) {
+    Timing timing(execPhase(args));
     std::string cmd;
     for (size_t i = 0; i < args.size(); i++) {
         cmd += args[i] + " ";
@@ -292,7 +343,23 @@ status_t ForkExecvp(const std::vector<std::string>& args,
             LOG(VERBOSE) << "    " << args[i];
         }
     }
-    output.clear();
+
+    auto logLine = [&](const std::string& line) {
+        LOG(VERBOSE) << line;
+        return onLine(line);
+    };
+
+    int status;
+    bool stopped = false;
+    status_t res = SpawnAndWait(args, context, false, logLine, &status, &stopped);
+    if (res != -ENOTCONN) {
+        if (res != OK || stopped) return res;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            LOG(ERROR) << args[0] << " failed with status " << status;
+            return -ECHILD;
+        }
+        return OK;
+    }
 
     if (setexeccon(context)) {
         LOG(ERROR) << "Failed to setexeccon";
@@ -308,12 +375,14 @@ status_t ForkExecvp(const std::vector<std::string>& args,
         PLOG(ERROR) << "Failed to popen " << cmd;
         return -errno;
     }
-    char line[1024];
-    while (fgets(line, sizeof(line), fp) != nullptr) {
-        LOG(VERBOSE) << line;
-        output.push_back(std::string(line));
+    char buf[1024];
+    std::string line;
+    while (!stopped && fgets(buf, sizeof(buf), fp) != nullptr) {
+        line.assign(buf);
+        if (!line.empty() && line.back() == '\n') line.pop_back();
+        stopped = !logLine(line);
     }
-    if (pclose(fp) != 0) {
+    if (pclose(fp) != 0 && !stopped) {
         PLOG(ERROR) << "Failed to pclose " << cmd;
         return -errno;
     }
@@ -321,6 +390,122 @@ status_t ForkExecvp(const std::vector<std::string>& args,
     return OK;
 }
 
+/* How often a cancellable child checks whether it should be killed */
+static const int kCancelPollMs = 100;
+
+status_t ForkExecvpCancellable(const std::vector<std::string>& args,
+        security_context_t context, const std::atomic<bool>& cancel,
+        const std::function<void(const std::string&)>& onLine) {
+    Timing timing(execPhase(args));
+    size_t argc = args.size();
+    char** argv = (char**) calloc(argc + 1, sizeof(char*));
+    for (size_t i = 0; i < argc; i++) {
+        argv[i] = (char*) args[i].c_str();
+        if (i == 0) {
+            LOG(VERBOSE) << args[i];
+        } else {
+            LOG(VERBOSE) << "    " << args[i];
+        }
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC)) {
+        PLOG(ERROR) << "Failed to create pipe";
+        free(argv);
+        return -errno;
+    }
+
+    if (setexeccon(context)) {
+        LOG(ERROR) << "Failed to setexeccon";
+        abort();
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+
+        if (execvp(argv[0], argv)) {
+            PLOG(ERROR) << "Failed to exec";
+        }
+
+        _exit(1);
+    }
+    int forkErrno = errno;
+    if (setexeccon(nullptr)) {
+        LOG(ERROR) << "Failed to setexeccon";
+        abort();
+    }
+    close(fds[1]);
+    free(argv);
+
+    if (pid == -1) {
+        errno = forkErrno;
+        PLOG(ERROR) << "Failed to fork";
+        close(fds[0]);
+        return -forkErrno;
+    }
+
+    bool cancelled = false;
+    bool eof = false;
+    std::string pending;
+    char buf[1024];
+    struct pollfd pfd = { fds[0], POLLIN, 0 };
+    while (!eof) {
+        if (cancel && !cancelled) {
+            LOG(INFO) << "Cancelling " << args[0];
+            kill(pid, SIGKILL);
+            cancelled = true;
+        }
+
+        int res = poll(&pfd, 1, kCancelPollMs);
+        if (res == 0 || (res == -1 && errno == EINTR)) continue;
+        if (res == -1) {
+            PLOG(ERROR) << "Failed to poll " << args[0];
+            break;
+        }
+
+        ssize_t n = TEMP_FAILURE_RETRY(read(fds[0], buf, sizeof(buf)));
+        if (n <= 0) {
+            eof = (n == 0);
+            if (n == -1) PLOG(ERROR) << "Failed to read " << args[0];
+            break;
+        }
+        pending.append(buf, n);
+
+        size_t end;
+        while ((end = pending.find('\n')) != std::string::npos) {
+            std::string line(pending, 0, end);
+            pending.erase(0, end + 1);
+            LOG(INFO) << line;
+            if (onLine) onLine(line);
+        }
+    }
+    if (!pending.empty()) {
+        LOG(INFO) << pending;
+        if (onLine) onLine(pending);
+    }
+    close(fds[0]);
+
+    if (!eof && !cancelled) {
+        // Don't wait forever on a child we can no longer hear from
+        kill(pid, SIGKILL);
+    }
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) == -1) {
+        PLOG(ERROR) << "Failed to wait for " << args[0];
+        return -errno;
+    }
+    if (cancelled) {
+        return -ECANCELED;
+    }
+    if (!WIFEXITED(status)) {
+        LOG(ERROR) << args[0] << " terminated abnormally";
+        return -ECHILD;
+    }
+    return WEXITSTATUS(status);
+}
+
 pid_t ForkExecvpAsync(const std::vector<std::string>& args) {
     size_t argc = args.size();
     char** argv = (char**) calloc(argc + 1, sizeof(char*));
@@ -390,62 +575,72 @@ status_t GenerateRandomUuid(std::string& out) {
     return res;
 }
 
+void EncodeHex(const unsigned char* in, size_t len, char* out, bool upper) {
+    // Digits above 9 are lifted past the punctuation between '9' and 'a'/'A'
+    const int letter = upper ? 'A' - '0' - 10 : 'a' - '0' - 10;
+    for (size_t i = 0; i < len; i++) {
+        int hi = in[i] >> 4;
+        int lo = in[i] & 0x0F;
+        out[2 * i] = '0' + hi + (((9 - hi) >> 8) & letter);
+        out[2 * i + 1] = '0' + lo + (((9 - lo) >> 8) & letter);
+    }
+}
+
+int DecodeHexDigit(unsigned char c) {
+    // Each mask is all ones when |c| is in its range, else zero
+    int folded = c | 0x20;
+    int isDigit = ((('0' - 1) - c) & (c - ('9' + 1))) >> 8;
+    int isLetter = ((('a' - 1) - folded) & (folded - ('f' + 1))) >> 8;
+    return ((c - '0') & isDigit) | ((folded - 'a' + 10) & isLetter) | ~(isDigit | isLetter);
+}
+
+static bool isHexSeparator(char c) {
+    return c == ' ' || c == '-' || c == ':';
+}
+
 status_t HexToStr(const std::string& hex, std::string& str) {
+    // Only separators are branched on; secrets come as plain digits
+    size_t digits = 0;
+    for (char c : hex) {
+        if (!isHexSeparator(c)) digits++;
+    }
     str.clear();
-    bool even = true;
-    char cur = 0;
-    for (size_t i = 0; i < hex.size(); i++) {
-        int val = 0;
-        switch (hex[i]) {
-        case ' ': case '-': case ':': continue;
-        case 'f': case 'F': val = 15; break;
-        case 'e': case 'E': val = 14; break;
-        case 'd': case 'D': val = 13; break;
-        case 'c': case 'C': val = 12; break;
-        case 'b': case 'B': val = 11; break;
-        case 'a': case 'A': val = 10; break;
-        case '9': val = 9; break;
-        case '8': val = 8; break;
-        case '7': val = 7; break;
-        case '6': val = 6; break;
-        case '5': val = 5; break;
-        case '4': val = 4; break;
-        case '3': val = 3; break;
-        case '2': val = 2; break;
-        case '1': val = 1; break;
-        case '0': val = 0; break;
-        default: return -EINVAL;
-        }
-
-        if (even) {
-            cur = val << 4;
+    if (digits % 2 != 0) {
+        return -EINVAL;
+    }
+    str.resize(digits / 2);
+
+    int invalid = 0;
+    int hi = 0;
+    size_t n = 0;
+    for (char c : hex) {
+        if (isHexSeparator(c)) continue;
+        int val = DecodeHexDigit(c);
+        invalid |= val;
+        if (n % 2 == 0) {
+            hi = val;
         } else {
-            cur += val;
-            str.push_back(cur);
-            cur = 0;
+            str[n / 2] = ((hi & 0x0F) << 4) | (val & 0x0F);
         }
-        even = !even;
+        n++;
+    }
+    if (invalid < 0) {
+        str.clear();
+        return -EINVAL;
     }
-    return even ? OK : -EINVAL;
+    return OK;
 }
 
-static const char* kLookup = "0123456789abcdef";
-
 status_t StrToHex(const std::string& str, std::string& hex) {
-    hex.clear();
-    for (size_t i = 0; i < str.size(); i++) {
-        hex.push_back(kLookup[(str[i] & 0xF0) >> 4]);
-        hex.push_back(kLookup[str[i] & 0x0F]);
-    }
+    hex.resize(str.size() * 2);
+    EncodeHex(reinterpret_cast<const unsigned char*>(str.data()), str.size(), &hex[0]);
     return OK;
 }
 
 status_t StrToHex(const KeyBuffer& str, KeyBuffer& hex) {
     hex.clear();
-    for (size_t i = 0; i < str.size(); i++) {
-        hex.push_back(kLookup[(str.data()[i] & 0xF0) >> 4]);
-        hex.push_back(kLookup[str.data()[i] & 0x0F]);
-    }
+    hex.resize(str.size() * 2);
+    EncodeHex(reinterpret_cast<const unsigned char*>(str.data()), str.size(), hex.data());
     return OK;
 }
 
@@ -468,10 +663,9 @@ uint64_t GetFreeBytes(const std::string& path) {
 
 // TODO: borrowed from frameworks/native/libs/diskusage/ which should
 // eventually be migrated into system/
-static int64_t stat_size(struct stat *s) {
-    int64_t blksize = s->st_blksize;
+static int64_t stat_size(uint64_t blocks, uint64_t blksize) {
     // count actual blocks used instead of nominal file size
-    int64_t size = s->st_blocks * 512;
+    int64_t size = blocks * 512;
 
     if (blksize) {
         /* round up to filesystem block size */
@@ -481,56 +675,165 @@ static int64_t stat_size(struct stat *s) {
     return size;
 }
 
-// TODO: borrowed from frameworks/native/libs/diskusage/ which should
-// eventually be migrated into system/
-int64_t calculate_dir_size(int dfd) {
-    int64_t size = 0;
+static const int kTreeSizeDefaultThreads = 4;
+static const int kTreeSizeMaxThreads = 16;
+
+/* Minimal per-entry information GetTreeSize() needs */
+struct TreeEntryInfo {
+    bool isDir;
+    bool isReg;
+    uint64_t allocated;
+    uint64_t size;
+};
+
+static bool statEntry(int dfd, const char* name, bool wantSize, TreeEntryInfo* info) {
+#if defined(__NR_statx) && defined(STATX_BLOCKS)
+    static std::atomic<bool> sHaveStatx(true);
+    if (sHaveStatx) {
+        struct statx stx;
+        unsigned mask = STATX_TYPE | STATX_BLOCKS | (wantSize ? STATX_SIZE : 0);
+        if (syscall(__NR_statx, dfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask,
+                &stx) == 0) {
+            info->isDir = S_ISDIR(stx.stx_mode);
+            info->isReg = S_ISREG(stx.stx_mode);
+            info->allocated = stat_size(stx.stx_blocks, stx.stx_blksize);
+            info->size = stx.stx_size;
+            return true;
+        }
+        if (errno != ENOSYS) return false;
+        sHaveStatx = false;
+    }
+#endif
     struct stat s;
-    DIR *d;
-    struct dirent *de;
+    if (fstatat(dfd, name, &s, AT_SYMLINK_NOFOLLOW) != 0) return false;
+    info->isDir = S_ISDIR(s.st_mode);
+    info->isReg = S_ISREG(s.st_mode);
+    info->allocated = stat_size(s.st_blocks, s.st_blksize);
+    info->size = s.st_size;
+    return true;
+}
 
-    d = fdopendir(dfd);
-    if (d == NULL) {
-        close(dfd);
-        return 0;
+status_t GetTreeSize(const std::string& path, TreeSize& out, bool histogram,
+        std::chrono::steady_clock::time_point deadline) {
+    out = TreeSize();
+    if (histogram) {
+        out.fileCounts.resize(kTreeSizeBuckets);
+        out.fileBytes.resize(kTreeSizeBuckets);
     }
 
-    while ((de = readdir(d))) {
-        const char *name = de->d_name;
-        if (fstatat(dfd, name, &s, AT_SYMLINK_NOFOLLOW) == 0) {
-            size += stat_size(&s);
+    int rootfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootfd < 0) {
+        PLOG(WARNING) << "Failed to open " << path;
+        return -errno;
+    }
+    close(rootfd);
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<std::string> queue;
+    int busy = 0;
+    uint64_t dirsFound = 1, dirsScanned = 0;
+    bool expired = false;
+    queue.push_back(path);
+
+    auto worker = [&]() {
+        TreeSize local;
+        if (histogram) {
+            local.fileCounts.resize(kTreeSizeBuckets);
+            local.fileBytes.resize(kTreeSizeBuckets);
         }
-        if (de->d_type == DT_DIR) {
-            int subfd;
+        uint64_t scanned = 0;
+
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            cond.wait(guard, [&] { return !queue.empty() || busy == 0 || expired; });
+            if (queue.empty() || expired) break;
+            if (std::chrono::steady_clock::now() >= deadline) {
+                expired = true;
+                cond.notify_all();
+                break;
+            }
 
-            /* always skip "." and ".." */
-            if (name[0] == '.') {
-                if (name[1] == 0)
-                    continue;
-                if ((name[1] == '.') && (name[2] == 0))
-                    continue;
+            std::string dirPath = std::move(queue.back());
+            queue.pop_back();
+            busy++;
+            guard.unlock();
+
+            std::vector<std::string> subdirs;
+            DIR* d = opendir(dirPath.c_str());
+            if (d != nullptr) {
+                struct dirent* de;
+                while ((de = readdir(d))) {
+                    const char* name = de->d_name;
+                    TreeEntryInfo info;
+                    if (!statEntry(dirfd(d), name, histogram, &info)) continue;
+                    if (info.isDir && name[0] == '.'
+                            && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+                        /* "." is counted as part of its parent, ".." not at all */
+                        if (name[1] == 0) local.bytes += info.allocated;
+                        continue;
+                    }
+                    local.bytes += info.allocated;
+                    local.inodes++;
+                    if (info.isDir) {
+                        subdirs.push_back(dirPath + "/" + name);
+                    } else if (info.isReg && histogram) {
+                        int bucket = info.size ? 64 - __builtin_clzll(info.size) : 0;
+                        bucket = std::min(bucket, kTreeSizeBuckets - 1);
+                        local.fileCounts[bucket]++;
+                        local.fileBytes[bucket] += info.size;
+                    }
+                }
+                closedir(d);
             }
+            scanned++;
 
-            subfd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-            if (subfd >= 0) {
-                size += calculate_dir_size(subfd);
+            guard.lock();
+            busy--;
+            dirsFound += subdirs.size();
+            for (auto& subdir : subdirs) {
+                queue.push_back(std::move(subdir));
             }
+            cond.notify_all();
+        }
+
+        // Still holding the lock; merge what this worker found
+        out.bytes += local.bytes;
+        out.inodes += local.inodes;
+        for (size_t i = 0; i < local.fileCounts.size(); i++) {
+            out.fileCounts[i] += local.fileCounts[i];
+            out.fileBytes[i] += local.fileBytes[i];
         }
+        dirsScanned += scanned;
+    };
+
+    int threads = std::max(1, std::min(kTreeSizeMaxThreads,
+            android::base::GetIntProperty("vold.tree_size_threads", kTreeSizeDefaultThreads)));
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; i++) {
+        pool.emplace_back(worker);
     }
-    closedir(d);
-    return size;
+    for (auto& t : pool) {
+        t.join();
+    }
+
+    if (expired && dirsScanned > 0) {
+        // Assume unscanned directories look like the ones we did see
+        out.complete = false;
+        out.bytes = out.bytes * dirsFound / dirsScanned;
+        out.inodes = out.inodes * dirsFound / dirsScanned;
+        LOG(DEBUG) << "Estimated size of " << path << " from " << dirsScanned << " of "
+                << dirsFound << " directories";
+    }
+    return OK;
 }
 
 uint64_t GetTreeBytes(const std::string& path) {
-    int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-    if (dirfd < 0) {
-        PLOG(WARNING) << "Failed to open " << path;
+    TreeSize size;
+    if (GetTreeSize(path, size) != OK) {
         return -1;
-    } else {
-        uint64_t res = calculate_dir_size(dirfd);
-        close(dirfd);
-        return res;
     }
+    return size.bytes;
 }
 
 bool IsFilesystemSupported(const std::string& fsType) {
@@ -552,37 +855,144 @@ bool IsFilesystemSupported(const std::string& fsType) {
     return supported.find(fsType + "\n") != std::string::npos;
 }
 
-status_t WipeBlockDevice(const std::string& path) {
-    status_t res = -1;
-    const char* c_path = path.c_str();
-    unsigned long nr_sec = 0;
-    unsigned long long range[2];
+/* One ioctl per chunk at most this large, so progress shows and none runs for minutes */
+static const uint64_t kWipeMaxChunk = 256 * 1024 * 1024;
+static const int kWipeMaxThreads = 4;
+
+/* Reads a number from the queue attributes of the device at |dev| */
+static uint64_t readQueueAttr(dev_t dev, const char* attr) {
+    // Partitions have no queue of their own; use their disk's
+    std::string tmp;
+    for (const char* queue : { "queue", "../queue" }) {
+        auto path = StringPrintf("/sys/dev/block/%u:%u/%s/%s", major(dev), minor(dev), queue, attr);
+        if (ReadFileToString(path, &tmp)) {
+            return strtoull(tmp.c_str(), nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+// Partitions are aligned to at least what sgdisk would pick by itself
+static const uint64_t kMinAlignment = 1024 * 1024;
+static const uint64_t kMaxAlignment = 64 * 1024 * 1024;
 
-    int fd = TEMP_FAILURE_RETRY(open(c_path, O_RDWR | O_CLOEXEC));
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+BlockGeometry GetBlockGeometry(dev_t device) {
+    BlockGeometry geometry = {};
+    std::string tmp;
+    for (const char* attr : { "device/preferred_erase_size", "../device/preferred_erase_size" }) {
+        auto path = StringPrintf("/sys/dev/block/%u:%u/%s", major(device), minor(device), attr);
+        if (ReadFileToString(path, &tmp)) {
+            geometry.eraseSize = strtoull(tmp.c_str(), nullptr, 10);
+            break;
+        }
+    }
+    geometry.optimalIo = readQueueAttr(device, "optimal_io_size");
+    geometry.discardGranularity = readQueueAttr(device, "discard_granularity");
+
+    // A boundary of every unit at once, unless that grows absurd; cards
+    // with odd erase sizes can push the common multiple into gigabytes
+    geometry.alignment = kMinAlignment;
+    for (uint64_t unit : { geometry.eraseSize, geometry.optimalIo,
+            geometry.discardGranularity }) {
+        if (unit == 0) continue;
+        uint64_t lcm = geometry.alignment / gcd(geometry.alignment, unit) * unit;
+        if (lcm <= kMaxAlignment) {
+            geometry.alignment = lcm;
+        }
+    }
+    return geometry;
+}
+
+status_t WipeBlockDevice(const std::string& path, bool* zeroed, int threads,
+        const std::function<void(int)>& progress) {
+    if (zeroed) *zeroed = false;
+
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDWR | O_CLOEXEC)));
     if (fd == -1) {
         PLOG(ERROR) << "Failed to open " << path;
-        goto done;
+        return -errno;
     }
 
-    if ((ioctl(fd, BLKGETSIZE, &nr_sec)) == -1) {
+    struct stat sb;
+    uint64_t size = 0;
+    if (fstat(fd, &sb) == -1 || ioctl(fd, BLKGETSIZE64, &size) == -1) {
         PLOG(ERROR) << "Failed to determine size of " << path;
-        goto done;
+        return -errno;
     }
 
-    range[0] = 0;
-    range[1] = (unsigned long long) nr_sec * 512;
-
-    LOG(INFO) << "About to discard " << range[1] << " on " << path;
-    if (ioctl(fd, BLKDISCARD, &range) == 0) {
-        LOG(INFO) << "Discard success on " << path;
-        res = 0;
-    } else {
-        PLOG(ERROR) << "Discard failure on " << path;
+    uint64_t maxBytes = readQueueAttr(sb.st_rdev, "discard_max_bytes");
+    uint64_t granularity = std::max<uint64_t>(readQueueAttr(sb.st_rdev, "discard_granularity"), 512);
+    if (maxBytes == 0) {
+        // Unknown, or not supported; let a single discard tell which
+        maxBytes = kWipeMaxChunk;
+    }
+    uint64_t chunk = std::min(maxBytes, kWipeMaxChunk);
+    chunk = std::max(chunk - chunk % granularity, granularity);
+    if (threads <= 0) {
+        threads = android::base::GetIntProperty("vold.wipe_threads", 1);
+    }
+    threads = std::max(1, std::min(kWipeMaxThreads, threads));
+
+    LOG(INFO) << "About to discard " << size << " on " << path << " in chunks of " << chunk
+            << " on " << threads << " threads";
+    auto start = std::chrono::steady_clock::now();
+
+    std::atomic<uint64_t> next(0);
+    std::atomic<uint64_t> done(0);
+    std::atomic<bool> failed(false);
+    std::mutex progressLock;
+    int lastPct = 0;
+    auto worker = [&]() {
+        while (!failed) {
+            uint64_t offset = next.fetch_add(chunk);
+            if (offset >= size) break;
+            uint64_t range[2] = { offset, std::min(chunk, size - offset) };
+            if (ioctl(fd, BLKDISCARD, &range) != 0) {
+                PLOG(ERROR) << "Discard failure on " << path << " at " << offset;
+                failed = true;
+                break;
+            }
+            int pct = (done += range[1]) * 100 / size;
+            std::lock_guard<std::mutex> lock(progressLock);
+            if (pct > lastPct) {
+                if (pct / 10 > lastPct / 10) {
+                    LOG(INFO) << "Discarded " << pct << "% of " << path;
+                }
+                if (progress) progress(pct);
+                lastPct = pct;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : pool) {
+        t.join();
+    }
+    if (failed) {
+        return -EIO;
     }
 
-done:
-    close(fd);
-    return res;
+    unsigned int zeroes = 0;
+    if (zeroed && ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0) {
+        *zeroed = zeroes != 0;
+    }
+    LOG(INFO) << "Discard success on " << path << " in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count() << "ms"
+            << (zeroes ? ", reads back as zeros" : "");
+    return OK;
 }
 
 static bool isValidFilename(const std::string& name) {
@@ -598,6 +1008,10 @@ std::string BuildKeyPath(const std::string& partGuid) {
     return StringPrintf("%s/expand_%s.key", kKeyPath, partGuid.c_str());
 }
 
+std::string BuildProfilePath(const std::string& partGuid) {
+    return StringPrintf("%s/f2fs_%s.profile", kKeyPath, partGuid.c_str());
+}
+
 std::string BuildDataSystemLegacyPath(userid_t userId) {
     return StringPrintf("%s/system/users/%u", BuildDataPath(nullptr).c_str(), userId);
 }
@@ -703,16 +1117,92 @@ bool WaitForFile(const std::string& filename,
         const std::chrono::milliseconds relativeTimeout) {
     auto startTime = std::chrono::steady_clock::now();
 
+    // ueventd creates device nodes shortly after the kernel announces them,
+    // so watch the parent directory instead of polling for them
+    size_t slash = filename.rfind('/');
+    std::string dir = filename.substr(0, slash + 1);
+    std::string name = filename.substr(slash + 1);
+    android::base::unique_fd inotifyFd(inotify_init1(IN_CLOEXEC | IN_NONBLOCK));
+    bool watching = inotifyFd.get() != -1 && !dir.empty()
+            && inotify_add_watch(inotifyFd.get(), dir.c_str(), IN_CREATE | IN_MOVED_TO) != -1;
+
     while (true) {
         if (!access(filename.c_str(), F_OK) || errno != ENOENT) {
             return true;
         }
 
-        std::this_thread::sleep_for(50ms);
-
         auto now = std::chrono::steady_clock::now();
         auto timeElapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - startTime);
         if (timeElapsed > relativeTimeout) return false;
+
+        if (!watching) {
+            std::this_thread::sleep_for(50ms);
+            continue;
+        }
+
+        // Sleep until our node shows up, ignoring its neighbours
+        bool seen = false;
+        while (!seen) {
+            now = std::chrono::steady_clock::now();
+            timeElapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - startTime);
+            if (timeElapsed > relativeTimeout) break;
+
+            struct pollfd pfd = { inotifyFd.get(), POLLIN, 0 };
+            auto remaining = relativeTimeout - timeElapsed + 1ms;
+            if (poll(&pfd, 1, remaining.count()) <= 0) break;
+
+            alignas(struct inotify_event) char events[4096];
+            ssize_t len;
+            while ((len = read(inotifyFd.get(), events, sizeof(events))) > 0) {
+                for (char* p = events; p < events + len; ) {
+                    auto event = reinterpret_cast<struct inotify_event*>(p);
+                    if ((event->mask & IN_Q_OVERFLOW)
+                            || (event->len && name == event->name)) {
+                        seen = true;
+                    }
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        }
+    }
+}
+
+/* Mount changes wake us at once; only the daemon exiting needs checking for */
+static constexpr std::chrono::milliseconds kMountExitCheck = std::chrono::milliseconds(100);
+
+status_t WaitForMount(const std::string& path, dev_t before, pid_t pid, bool* exited,
+        const std::chrono::milliseconds relativeTimeout) {
+    auto deadline = std::chrono::steady_clock::now() + relativeTimeout;
+    *exited = false;
+    // Flagged with POLLPRI whenever anything in our namespace is mounted
+    android::base::unique_fd mountsFd(open("/proc/self/mounts", O_RDONLY | O_CLOEXEC));
+    while (true) {
+        if (GetDevice(path) != before) return OK;
+        if (pid > 0 && !*exited) {
+            int status;
+            if (TEMP_FAILURE_RETRY(waitpid(pid, &status, WNOHANG)) == pid) {
+                *exited = true;
+                // It may have mounted just before going
+                if (GetDevice(path) != before) return OK;
+                LOG(ERROR) << "Process " << pid << " exited with status " << status
+                        << " before mounting " << path;
+                return -ECHILD;
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            LOG(ERROR) << "Timed out waiting for " << path << " to be mounted";
+            return -ETIMEDOUT;
+        }
+        auto wait = std::min(kMountExitCheck,
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) + 1ms);
+        if (mountsFd != -1) {
+            struct pollfd pfd = { mountsFd.get(), POLLPRI, 0 };
+            TEMP_FAILURE_RETRY(poll(&pfd, 1, wait.count()));
+        } else {
+            std::this_thread::sleep_for(wait);
+        }
     }
 }
 
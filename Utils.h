@@ -23,7 +23,9 @@
 #include <cutils/multiuser.h>
 #include <selinux/selinux.h>
 
+#include <atomic>
 #include <chrono>
+#include <functional>
 #include <vector>
 #include <string>
 
@@ -78,12 +80,50 @@ status_t ForkExecvp(const std::vector<std::string>& args,
 status_t ForkExecvp(const std::vector<std::string>& args,
         std::vector<std::string>& output, security_context_t context);
 
+/*
+ * Hands each line of stdout to |onLine| as it arrives, without the trailing
+ * newline. Returning false stops early: the rest of the output is dropped
+ * and the result is OK whatever the child's exit status.
+ */
+status_t ForkExecvpStream(const std::vector<std::string>& args,
+        const std::function<bool(const std::string&)>& onLine,
+        security_context_t context = nullptr);
+
+/*
+ * Like ForkExecvp(), but hands each line of output to |onLine| and kills
+ * the child once |cancel| is set, in which case it returns -ECANCELED.
+ */
+status_t ForkExecvpCancellable(const std::vector<std::string>& args,
+        security_context_t context, const std::atomic<bool>& cancel,
+        const std::function<void(const std::string&)>& onLine);
+
+/*
+ * Lets a filesystem check run in the background: |cancel| stops it early
+ * and |progress| receives a rough 0-100 estimate. With |readOnly| the
+ * checker only reports problems, since the filesystem may be mounted.
+ */
+struct CheckControl {
+    std::atomic<bool> cancel;
+    bool readOnly;
+    std::function<void(int)> progress;
+
+    CheckControl() : cancel(false), readOnly(true) {}
+};
+
 pid_t ForkExecvpAsync(const std::vector<std::string>& args);
 
 status_t ReadRandomBytes(size_t bytes, std::string& out);
 status_t ReadRandomBytes(size_t bytes, char* buffer);
 status_t GenerateRandomUuid(std::string& out);
 
+/*
+ * Hex kernels for key material. Their timing and memory accesses depend
+ * only on the length of the input, never on its value.
+ */
+void EncodeHex(const unsigned char* in, size_t len, char* out, bool upper = false);
+/* Returns -1 when |c| isn't a hex digit */
+int DecodeHexDigit(unsigned char c);
+
 /* Converts hex string to raw bytes, ignoring [ :-] */
 status_t HexToStr(const std::string& hex, std::string& str);
 /* Converts raw bytes to hex string */
@@ -96,12 +136,51 @@ status_t NormalizeHex(const std::string& in, std::string& out);
 uint64_t GetFreeBytes(const std::string& path);
 uint64_t GetTreeBytes(const std::string& path);
 
+/* Number of power-of-two file size buckets in TreeSize histograms */
+static const int kTreeSizeBuckets = 48;
+
+/* Storage used by a directory tree, as measured by GetTreeSize() */
+struct TreeSize {
+    /* Allocated bytes, rounded up to the filesystem block size */
+    uint64_t bytes = 0;
+    uint64_t inodes = 0;
+    /* False when the deadline cut the walk short and the totals are estimates */
+    bool complete = true;
+    /* When requested, regular files bucketed by the bit length of their size */
+    std::vector<uint64_t> fileCounts;
+    std::vector<uint64_t> fileBytes;
+};
+
+/* Walks |path| on a small thread pool; once |deadline| passes the walk stops
+ * and the totals are extrapolated from the directories seen so far */
+status_t GetTreeSize(const std::string& path, TreeSize& out, bool histogram = false,
+        std::chrono::steady_clock::time_point deadline =
+                std::chrono::steady_clock::time_point::max());
+
 bool IsFilesystemSupported(const std::string& fsType);
 
-/* Wipes contents of block device at given path */
-status_t WipeBlockDevice(const std::string& path);
+/* I/O geometry the kernel reports for a block device, in bytes; 0 if unknown */
+struct BlockGeometry {
+    uint64_t eraseSize;
+    uint64_t optimalIo;
+    uint64_t discardGranularity;
+    /* What partitions and filesystem allocation units should line up with */
+    uint64_t alignment;
+};
+
+/* Partitions report the geometry of the disk holding them */
+BlockGeometry GetBlockGeometry(dev_t device);
+
+/* Wipes contents of block device at given path, discarding it in chunks
+ * sized from its queue limits; |zeroed| says whether it now reads as zeros.
+ * Runs on |threads| threads, or vold.wipe_threads when 0, and reports each
+ * whole percent done to |progress|. */
+status_t WipeBlockDevice(const std::string& path, bool* zeroed = nullptr, int threads = 0,
+        const std::function<void(int)>& progress = nullptr);
 
 std::string BuildKeyPath(const std::string& partGuid);
+/* Where the f2fs mount profile chosen for a private volume is kept */
+std::string BuildProfilePath(const std::string& partGuid);
 
 std::string BuildDataSystemLegacyPath(userid_t userid);
 std::string BuildDataSystemCePath(userid_t userid);
@@ -125,6 +204,14 @@ status_t SaneReadLinkAt(int dirfd, const char* path, char* buf, size_t bufsiz);
 bool WaitForFile(const std::string& filename,
         const std::chrono::milliseconds relativeTimeout);
 
+/*
+ * Waits for something to be mounted over |path|, which was on |before|,
+ * waking on mount table changes rather than polling. Gives up early if
+ * |pid| exits first, setting |exited| whenever it's reaped here.
+ */
+status_t WaitForMount(const std::string& path, dev_t before, pid_t pid, bool* exited,
+        const std::chrono::milliseconds relativeTimeout);
+
 /* Checks if Android is running in QEMU */
 bool IsRunningInEmulator();
 
@@ -14,6 +14,10 @@
  * limitations under the License.
  */
 
+#include "EventBatch.h"
+#include "MountJournal.h"
+#include "StorageState.h"
+#include "Timings.h"
 #include "Utils.h"
 #include "VolumeBase.h"
 #include "VolumeManager.h"
@@ -35,7 +39,7 @@ namespace vold {
 
 VolumeBase::VolumeBase(Type type) :
         mType(type), mMountFlags(0), mMountUserId(-1), mCreated(false), mState(
-                State::kUnmounted), mSilent(false) {
+                State::kUnmounted), mSilent(false), mWarm(false) {
 }
 
 VolumeBase::~VolumeBase() {
@@ -129,27 +133,52 @@ status_t VolumeBase::setInternalPath(const std::string& internalPath) {
     return OK;
 }
 
+void VolumeBase::publishState(int event, const std::string& value) {
+    if (event == ResponseCode::VolumeDestroyed) {
+        RemoveVolumeState(mId);
+        return;
+    }
+    UpdateVolumeState(mId, [&](VolumeState& s) {
+        s.type = static_cast<int>(mType);
+        s.diskId = mDiskId;
+        s.partGuid = mPartGuid;
+        s.state = static_cast<int>(mState);
+        s.path = mPath;
+        s.internalPath = mInternalPath;
+        s.mountFlags = mMountFlags;
+        s.mountUserId = mMountUserId;
+        // Filesystem details belong to subclasses and only arrive as events
+        if (event == ResponseCode::VolumeFsTypeChanged) s.fsType = value;
+        if (event == ResponseCode::VolumeFsUuidChanged) s.fsUuid = value;
+        if (event == ResponseCode::VolumeFsLabelChanged) s.fsLabel = value;
+    });
+}
+
 void VolumeBase::notifyEvent(int event) {
     if (mSilent) return;
-    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(event,
-            getId().c_str(), false);
+    // Published first, so that anyone acting on the event sees it
+    publishState(event, "");
+    SendEvent(ResponseCode::VolumeSnapshot, getId(), event);
 }
 
 void VolumeBase::notifyEvent(int event, const std::string& value) {
     if (mSilent) return;
-    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(event,
-            StringPrintf("%s %s", getId().c_str(), value.c_str()).c_str(), false);
+    publishState(event, value);
+    SendEvent(ResponseCode::VolumeSnapshot, getId(), event, value);
 }
 
 void VolumeBase::addVolume(const std::shared_ptr<VolumeBase>& volume) {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     mVolumes.push_back(volume);
 }
 
 void VolumeBase::removeVolume(const std::shared_ptr<VolumeBase>& volume) {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     mVolumes.remove(volume);
 }
 
 std::shared_ptr<VolumeBase> VolumeBase::findVolume(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     for (auto vol : mVolumes) {
         if (vol->getId() == id) {
             return vol;
@@ -159,6 +188,7 @@ std::shared_ptr<VolumeBase> VolumeBase::findVolume(const std::string& id) {
 }
 
 status_t VolumeBase::create() {
+    std::lock_guard<std::recursive_mutex> lock(mLock);
     if (mCreated) {
         return BAD_VALUE;
     }
@@ -176,9 +206,11 @@ status_t VolumeBase::doCreate() {
 }
 
 status_t VolumeBase::destroy() {
+    std::lock_guard<std::recursive_mutex> lock(mLock);
     if (!mCreated) {
         return NO_INIT;
     }
+    Timing timing("destroy " + getId());
 
     if (mState == State::kMounted) {
         unmount();
@@ -188,6 +220,8 @@ status_t VolumeBase::destroy() {
     }
 
     notifyEvent(ResponseCode::VolumeDestroyed);
+    // A mount left by a previous vold that this volume never took over
+    ReleaseLiveMount(getId());
     status_t res = doDestroy();
     mCreated = false;
     return res;
@@ -198,13 +232,18 @@ status_t VolumeBase::doDestroy() {
 }
 
 status_t VolumeBase::mount() {
+    std::lock_guard<std::recursive_mutex> lock(mLock);
     if ((mState != State::kUnmounted) && (mState != State::kUnmountable)) {
         LOG(WARNING) << getId() << " mount requires state unmounted or unmountable";
         return -EBUSY;
     }
 
     setState(State::kChecking);
-    status_t res = doMount();
+    status_t res;
+    {
+        Timing timing("mount " + getId());
+        res = doMount();
+    }
     if (res == OK) {
         setState(State::kMounted);
     } else {
@@ -215,29 +254,38 @@ status_t VolumeBase::mount() {
 }
 
 status_t VolumeBase::unmount() {
+    std::lock_guard<std::recursive_mutex> lock(mLock);
     if (mState != State::kMounted) {
         LOG(WARNING) << getId() << " unmount requires state mounted";
         return -EBUSY;
     }
+    mWarm = false;
 
     setState(State::kEjecting);
-    for (const auto& vol : mVolumes) {
+    std::list<std::shared_ptr<VolumeBase>> stacked;
+    {
+        std::lock_guard<std::mutex> volumesLock(mVolumesLock);
+        stacked.swap(mVolumes);
+    }
+    for (const auto& vol : stacked) {
         if (vol->destroy()) {
             LOG(WARNING) << getId() << " failed to destroy " << vol->getId()
                     << " stacked above";
         }
     }
-    mVolumes.clear();
 
     status_t res = doUnmount();
     setState(State::kUnmounted);
     return res;
 }
 
-status_t VolumeBase::format(const std::string& fsType) {
+status_t VolumeBase::format(const std::string& fsType, bool quick) {
+    std::lock_guard<std::recursive_mutex> lock(mLock);
     if (mState == State::kMounted) {
         unmount();
     }
+    // A previous vold may still have the device mounted, with us none the wiser
+    ReleaseLiveMount(getId());
 
     if ((mState != State::kUnmounted) && (mState != State::kUnmountable)) {
         LOG(WARNING) << getId() << " format requires state unmounted or unmountable";
@@ -245,14 +293,88 @@ status_t VolumeBase::format(const std::string& fsType) {
     }
 
     setState(State::kFormatting);
-    status_t res = doFormat(fsType);
+    status_t res = doFormat(fsType, quick);
     setState(State::kUnmounted);
     return res;
 }
 
-status_t VolumeBase::doFormat(const std::string& fsType) {
+status_t VolumeBase::doFormat(const std::string& fsType, bool quick) {
     return -ENOTSUP;
 }
 
+void VolumeBase::announce() {
+    std::lock_guard<std::recursive_mutex> lock(mLock);
+    if (!mCreated) {
+        return;
+    }
+
+    // Filesystem details belong to subclasses, but were published as sent
+    VolumeState published = {};
+    for (const auto& vol : GetStorageState()->volumes) {
+        if (vol.id == mId) published = vol;
+    }
+
+    mWarm = (mState == State::kMounted);
+    notifyEvent(ResponseCode::VolumeCreated,
+            StringPrintf("%d \"%s\" \"%s\"", mType, mDiskId.c_str(), mPartGuid.c_str()));
+    notifyEvent(ResponseCode::VolumeFsTypeChanged, published.fsType);
+    notifyEvent(ResponseCode::VolumeFsUuidChanged, published.fsUuid);
+    notifyEvent(ResponseCode::VolumeFsLabelChanged, published.fsLabel);
+    if (!mWarm && !mPath.empty()) {
+        notifyEvent(ResponseCode::VolumePathChanged, mPath);
+    }
+    if (!mWarm && !mInternalPath.empty()) {
+        notifyEvent(ResponseCode::VolumeInternalPathChanged, mInternalPath);
+    }
+    notifyEvent(ResponseCode::VolumeStateChanged,
+            StringPrintf("%d", mWarm ? State::kUnmounted : mState));
+
+    std::list<std::shared_ptr<VolumeBase>> stacked;
+    {
+        std::lock_guard<std::mutex> volumesLock(mVolumesLock);
+        stacked = mVolumes;
+    }
+    for (const auto& vol : stacked) {
+        vol->announce();
+    }
+}
+
+bool VolumeBase::adoptWarmMount(int mountFlags, userid_t mountUserId) {
+    std::lock_guard<std::recursive_mutex> lock(mLock);
+    if (!mWarm) {
+        return false;
+    }
+    mWarm = false;
+    if (mState == State::kMounted && mountFlags == mMountFlags
+            && mountUserId == mMountUserId) {
+        LOG(INFO) << getId() << " kept mounted across reset";
+        notifyEvent(ResponseCode::VolumePathChanged, mPath);
+        notifyEvent(ResponseCode::VolumeInternalPathChanged, mInternalPath);
+        setState(State::kMounted);
+        return true;
+    }
+    if (mState == State::kMounted) {
+        unmount();
+    }
+    return false;
+}
+
+void VolumeBase::releaseWarmMount() {
+    std::lock_guard<std::recursive_mutex> lock(mLock);
+    std::list<std::shared_ptr<VolumeBase>> stacked;
+    {
+        std::lock_guard<std::mutex> volumesLock(mVolumesLock);
+        stacked = mVolumes;
+    }
+    for (const auto& vol : stacked) {
+        vol->releaseWarmMount();
+    }
+    if (mWarm && mState == State::kMounted) {
+        LOG(INFO) << getId() << " not mounted again after reset; unmounting";
+        unmount();
+    }
+    mWarm = false;
+}
+
 }  // namespace vold
 }  // namespace android
@@ -24,6 +24,7 @@
 
 #include <sys/types.h>
 #include <list>
+#include <mutex>
 #include <string>
 
 namespace android {
@@ -84,6 +85,13 @@ public:
     const std::string& getPath() { return mPath; }
     const std::string& getInternalPath() { return mInternalPath; }
 
+    /*
+     * Held across create(), destroy(), mount(), unmount() and format(), so
+     * independent volumes can change state in parallel. Never acquire the
+     * VolumeManager lock while holding it.
+     */
+    std::recursive_mutex& getLock() { return mLock; }
+
     status_t setDiskId(const std::string& diskId);
     status_t setPartGuid(const std::string& partGuid);
     status_t setMountFlags(int mountFlags);
@@ -99,7 +107,24 @@ public:
     status_t destroy();
     status_t mount();
     status_t unmount();
-    status_t format(const std::string& fsType);
+    /* Quick formats trade some thoroughness for speed on large cards */
+    status_t format(const std::string& fsType, bool quick = false);
+
+    /*
+     * Re-sends what a newly connected framework needs to know about this
+     * volume and those stacked on it. Mounted volumes are announced as
+     * unmounted but stay mounted until the framework asks for them again,
+     * or until releaseWarmMount().
+     */
+    void announce();
+    /*
+     * Takes a mount request for a volume announce() left mounted: adopts
+     * the mount if it has the same |mountFlags| and |mountUserId|, returning
+     * true, or unmounts it so it can be mounted afresh.
+     */
+    bool adoptWarmMount(int mountFlags, userid_t mountUserId);
+    /* Unmounts this and stacked volumes the framework didn't ask for again */
+    void releaseWarmMount();
 
 protected:
     explicit VolumeBase(Type type);
@@ -108,7 +133,7 @@ protected:
     virtual status_t doDestroy();
     virtual status_t doMount() = 0;
     virtual status_t doUnmount() = 0;
-    virtual status_t doFormat(const std::string& fsType);
+    virtual status_t doFormat(const std::string& fsType, bool quick);
 
     status_t setId(const std::string& id);
     status_t setPath(const std::string& path);
@@ -118,6 +143,8 @@ protected:
     void notifyEvent(int msg, const std::string& value);
 
 private:
+    void publishState(int event, const std::string& value);
+
     /* ID that uniquely references volume while alive */
     std::string mId;
     /* ID that uniquely references parent disk while alive */
@@ -140,7 +167,14 @@ private:
     std::string mInternalPath;
     /* Flag indicating that volume should emit no events */
     bool mSilent;
+    /* Flag that volume is still mounted across a framework reset */
+    bool mWarm;
+
+    /* Serializes state changes of this volume */
+    std::recursive_mutex mLock;
 
+    /* Guards mVolumes, which is searched without holding mLock */
+    std::mutex mVolumesLock;
     /* Volumes stacked on top of this volume */
     std::list<std::shared_ptr<VolumeBase>> mVolumes;
 
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fts.h>
+#include <limits.h>
 #include <mntent.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,14 +33,29 @@
 
 #include <linux/kdev_t.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
 #define LOG_TAG "Vold"
 
 #include <openssl/md5.h>
+#include <openssl/sha.h>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
 #include <cutils/fs.h>
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include <selinux/android.h>
 
@@ -48,7 +64,10 @@
 #include <private/android_filesystem_config.h>
 
 #include "Benchmark.h"
+#include "BenchHistory.h"
 #include "EmulatedVolume.h"
+#include "EventBatch.h"
+#include "MountJournal.h"
 #include "VolumeManager.h"
 #include "NetlinkManager.h"
 #include "ResponseCode.h"
@@ -58,6 +77,7 @@
 #include "Utils.h"
 #include "Devmapper.h"
 #include "Process.h"
+#include "Timings.h"
 #include "Asec.h"
 #include "VoldUtil.h"
 #include "cryptfs.h"
@@ -67,6 +87,9 @@
 #define ROUND_UP_POWER_OF_2(number, po2) (((!!((number) & ((1U << (po2)) - 1))) << (po2))\
                                          + ((number) & (~((1U << (po2)) - 1))))
 
+#define UNMOUNT_RETRIES 5
+#define UNMOUNT_SLEEP_BETWEEN_RETRY_MS (1000 * 1000)
+
 using android::base::StringPrintf;
 
 /*
@@ -89,7 +112,7 @@ const char *VolumeManager::ASECDIR           = "/mnt/asec";
  */
 const char *VolumeManager::LOOPDIR           = "/mnt/obb";
 
-bool VolumeManager::shutting_down = false;
+std::atomic<bool> VolumeManager::shutting_down(false);
 
 static const char* kPathUserMount = "/mnt/user";
 static const char* kPathVirtualDisk = "/data/misc/vold/virtual_disk";
@@ -103,6 +126,9 @@ static const unsigned int kMajorBlockMmc = 179;
 static const unsigned int kMajorBlockExperimentalMin = 240;
 static const unsigned int kMajorBlockExperimentalMax = 254;
 
+/* How long to collect a burst of change events before rescanning */
+static const int kDefaultUeventDebounceMs = 100;
+
 /* writes superblock at end of file or device given by name */
 static int writeSuperBlock(const char* name, struct asec_superblock *sb, unsigned int numImgSectors) {
     int sbfd = open(name, O_RDWR | O_CLOEXEC);
@@ -191,19 +217,174 @@ static int setupDevMapperDevice(char* buffer, size_t len, const char* loopDevice
 
 static void waitForDevMapper(const char *dmDevice) {
     /*
-     * Wait for the device mapper node to be created. Sometimes it takes a
-     * while. Wait for up to 1 second. We could also inspect incoming uevents,
-     * but that would take more effort.
+     * Wait up to 1 second for ueventd to create the device mapper node.
+     * The kernel's uevent arrives before the node exists, so rather than
+     * that, watch for the node itself the same way other dm users do.
      */
-    int tries = 25;
-    while (tries--) {
-        if (!access(dmDevice, F_OK) || errno != ENOENT) {
-            break;
+    if (!android::vold::WaitForFile(dmDevice, std::chrono::seconds(1))) {
+        SLOGW("Timed out waiting for %s", dmDevice);
+    }
+}
+
+namespace {
+
+/* What an OBB's loop and dm devices were set up from */
+struct ObbIdentity {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    /* SHA-256 of the key, so the key itself isn't kept */
+    std::string keyDigest;
+
+    bool operator==(const ObbIdentity& o) const {
+        return dev == o.dev && ino == o.ino && mtime.tv_sec == o.mtime.tv_sec
+                && mtime.tv_nsec == o.mtime.tv_nsec && size == o.size
+                && keyDigest == o.keyDigest;
+    }
+};
+
+struct WarmObb {
+    ObbIdentity identity;
+    /* What gets mounted: the dm device, or the loop device for plain OBBs */
+    std::string device;
+    std::chrono::steady_clock::time_point expiry;
+};
+
+std::mutex sObbLock;
+/* Mounted OBBs by hash, remembered so they can be kept warm on unmount */
+std::map<std::string, WarmObb> sMountedObbs;
+/* Unmounted OBBs whose devices are kept until they expire */
+std::map<std::string, WarmObb> sWarmObbs;
+
+}  // namespace
+
+/* How long an unmounted OBB keeps its devices; 0 tears them down at once */
+static std::chrono::milliseconds getObbWarmTime() {
+    return std::chrono::milliseconds(std::max(0, property_get_int32("vold.obb_warm_ms", 0)));
+}
+
+static bool getObbIdentity(const char* img, const char* key, ObbIdentity* identity) {
+    struct stat sb;
+    if (stat(img, &sb)) {
+        return false;
+    }
+    identity->dev = sb.st_dev;
+    identity->ino = sb.st_ino;
+    identity->mtime = sb.st_mtim;
+    identity->size = sb.st_size;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(key), strlen(key), digest);
+    identity->keyDigest.assign(reinterpret_cast<const char*>(digest), sizeof(digest));
+    return true;
+}
+
+/* Retries the unmount every few ms for up to |timeout|, as users let go */
+static bool retryUnmount(const char* mountPoint, std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (std::chrono::steady_clock::now() < deadline) {
+        usleep(50 * 1000);
+        if (!umount(mountPoint) || errno == EINVAL || errno == ENOENT) return true;
+    }
+    return false;
+}
+
+static void destroyLoopImageDevices(const char* idHash, const char* fileName) {
+    for (int i = 1; i <= UNMOUNT_RETRIES; i++) {
+        if (Devmapper::destroy(idHash) && errno != ENXIO) {
+            SLOGE("Failed to destroy devmapper instance (%s)", strerror(errno));
+            usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
+            continue;
+        } else {
+          break;
         }
-        usleep(40 * 1000);
+    }
+
+    char loopDevice[255];
+    if (!Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
+        Loop::destroyByDevice(loopDevice);
+    } else {
+        SLOGW("Failed to find loop device for {%s} (%s)", fileName, strerror(errno));
     }
 }
 
+/* Tears down every warm OBB, or only those that have expired */
+static void pruneWarmObbs(bool all) {
+    std::lock_guard<std::mutex> lock(sObbLock);
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = sWarmObbs.begin(); it != sWarmObbs.end();) {
+        if (all || it->second.expiry <= now) {
+            SLOGD("Releasing warm OBB devices for %s", it->first.c_str());
+            destroyLoopImageDevices(it->first.c_str(), it->first.c_str());
+            it = sWarmObbs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/*
+ * Claims the warm devices kept for |idHash| if they were set up from
+ * |identity|; stale ones are torn down so they get set up afresh.
+ */
+static bool takeWarmObb(const std::string& idHash, const ObbIdentity* identity,
+        WarmObb* warm) {
+    std::lock_guard<std::mutex> lock(sObbLock);
+    auto it = sWarmObbs.find(idHash);
+    if (it == sWarmObbs.end()) {
+        return false;
+    }
+    bool usable = identity && it->second.identity == *identity
+            && it->second.expiry > std::chrono::steady_clock::now();
+    if (usable) {
+        *warm = it->second;
+    } else {
+        SLOGD("Warm OBB devices for %s are stale", idHash.c_str());
+        destroyLoopImageDevices(idHash.c_str(), idHash.c_str());
+    }
+    sWarmObbs.erase(it);
+    return usable;
+}
+
+/*
+ * Grows a mounted container whose image file has already been extended:
+ * the loop device picks up the new size, the dm table is reloaded with the
+ * new length and resize2fs grows the filesystem online. Whether there is a
+ * dm layer comes from the on-disk superblock, not the caller's key.
+ */
+static int growMountedAsec(const char* id, const char* idHash, const struct asec_superblock& sb,
+        unsigned long numImgSectors) {
+    char loopDevice[255];
+    if (Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
+        SLOGE("No loop device for mounted ASEC %s", id);
+        return -1;
+    }
+    if (Loop::setCapacity(loopDevice)) {
+        return -1;
+    }
+
+    char dmDevice[255];
+    if (sb.c_cipher != ASEC_SB_C_CIPHER_NONE) {
+        if (Devmapper::lookupActive(idHash, dmDevice, sizeof(dmDevice))) {
+            SLOGE("No devmapper instance for mounted ASEC %s", id);
+            return -1;
+        }
+        if (Devmapper::resize(idHash, numImgSectors)) {
+            SLOGE("Unable to grow devmapper instance for %s (%s)", id, strerror(errno));
+            return -1;
+        }
+    } else {
+        strlcpy(dmDevice, loopDevice, sizeof(dmDevice));
+    }
+
+    if (android::vold::ext4::Resize(dmDevice, numImgSectors)) {
+        SLOGE("Unable to resize %s online (%s)", id, strerror(errno));
+        return -1;
+    }
+    SLOGI("Grew mounted ASEC %s to %lu sectors", id, numImgSectors);
+    return 0;
+}
+
 VolumeManager *VolumeManager::sInstance = NULL;
 
 VolumeManager *VolumeManager::Instance() {
@@ -220,6 +401,12 @@ VolumeManager::VolumeManager() {
     mSavedDirtyRatio = -1;
     // set dirty ratio to 0 when UMS is active
     mUmsDirtyRatio = 0;
+    mMountWorkers = 0;
+    mResyncPending = false;
+    mSourceMatcherValid = false;
+    mAsecGeneration = 0;
+    mAsecIndexValid = false;
+    mWarmGeneration = 0;
 }
 
 VolumeManager::~VolumeManager() {
@@ -312,10 +499,15 @@ int VolumeManager::setDebug(bool enable) {
     return 0;
 }
 
+// How long volumes stay mounted after a reset or restart for the framework to ask again
+static const int kDefaultWarmResetTimeoutMs = 60000;
+
 int VolumeManager::start() {
     // Always start from a clean slate by unmounting everything in
-    // directories that we own, in case we crashed.
-    unmountAll();
+    // directories that we own, in case we crashed, except for volume
+    // mounts that are still healthy and can be adopted as they are.
+    unmountAll(android::vold::LoadLiveMounts(mMountTable));
+    scheduleWarmRelease();
 
     // Assume that we always have an emulated volume on internal
     // storage; the framework will decide if it should be mounted.
@@ -327,6 +519,13 @@ int VolumeManager::start() {
     // Consider creating a virtual disk
     updateVirtualDisk();
 
+    // Without process events the index just rescans /proc on every lookup
+    mNamespaceIndex.start();
+
+    if (!mEventThread.joinable()) {
+        mEventThread = std::thread(&VolumeManager::processBlockEvents, this);
+    }
+
     return 0;
 }
 
@@ -337,70 +536,243 @@ int VolumeManager::stop() {
     return 0;
 }
 
-void VolumeManager::handleBlockEvent(NetlinkEvent *evt) {
-    std::lock_guard<std::mutex> lock(mLock);
-
+void VolumeManager::handleBlockEvent(const android::vold::Uevent& evt) {
     if (mDebug) {
-        LOG(VERBOSE) << "----------------";
-        LOG(VERBOSE) << "handleBlockEvent with action " << (int) evt->getAction();
-        evt->dump();
+        LOG(VERBOSE) << "handleBlockEvent " << evt.action << " " << evt.devPath
+                << " type " << (evt.devType ? evt.devType : "") << " " << evt.major
+                << ":" << evt.minor;
     }
 
-    std::string eventPath(evt->findParam("DEVPATH")?evt->findParam("DEVPATH"):"");
-    std::string devType(evt->findParam("DEVTYPE")?evt->findParam("DEVTYPE"):"");
+    // Everything but whole disks is dropped before anything is copied
+    if (!evt.devType || strcmp(evt.devType, "disk") || evt.major < 0 || evt.minor < 0) return;
 
-    if (devType != "disk") return;
+    NetlinkEvent::Action action;
+    if (!strcmp(evt.action, "add")) {
+        action = NetlinkEvent::Action::kAdd;
+    } else if (!strcmp(evt.action, "remove")) {
+        action = NetlinkEvent::Action::kRemove;
+    } else if (!strcmp(evt.action, "change")) {
+        action = NetlinkEvent::Action::kChange;
+    } else {
+        return;
+    }
 
-    int major = atoi(evt->findParam("MAJOR"));
-    int minor = atoi(evt->findParam("MINOR"));
-    dev_t device = makedev(major, minor);
+    // Handled on our own thread, so the listener never waits on mLock
+    std::lock_guard<std::mutex> lock(mEventLock);
+    mEvents.push_back(BlockEvent{ action, evt.devPath, makedev(evt.major, evt.minor) });
+    mEventCond.notify_one();
+}
 
-    switch (evt->getAction()) {
-    case NetlinkEvent::Action::kAdd: {
-        for (const auto& source : mDiskSources) {
-            if (source->matches(eventPath)) {
-                // For now, assume that MMC, virtio-blk (the latter is
-                // emulator-specific; see Disk.cpp for details) and UFS card
-                // devices are SD, and that everything else is USB
-                int flags = source->getFlags();
-                if (major == kMajorBlockMmc
-                    || (eventPath.find("ufs") != std::string::npos)
-                    || (android::vold::IsRunningInEmulator()
-                    && major >= (int) kMajorBlockExperimentalMin
-                    && major <= (int) kMajorBlockExperimentalMax)) {
-                    flags |= android::vold::Disk::Flags::kSd;
-                } else {
-                    flags |= android::vold::Disk::Flags::kUsb;
+void VolumeManager::handleUeventOverflow() {
+    std::lock_guard<std::mutex> lock(mEventLock);
+    mResyncPending = true;
+    mEventCond.notify_one();
+}
+
+/*
+ * Drops change events made redundant by an earlier add or change of the
+ * same device in |events|, or by a later remove of it.
+ */
+static void coalesceBlockEvents(std::deque<VolumeManager::BlockEvent>& events) {
+    std::deque<VolumeManager::BlockEvent> out;
+    for (auto& evt : events) {
+        if (evt.action == NetlinkEvent::Action::kChange
+                || evt.action == NetlinkEvent::Action::kRemove) {
+            auto prev = std::find_if(out.rbegin(), out.rend(),
+                    [&](const VolumeManager::BlockEvent& e) { return e.device == evt.device; });
+            if (prev != out.rend() && prev->action != NetlinkEvent::Action::kRemove) {
+                if (evt.action == NetlinkEvent::Action::kChange) continue;
+                if (prev->action == NetlinkEvent::Action::kChange) {
+                    out.erase(std::next(prev).base());
                 }
+            }
+        }
+        out.push_back(std::move(evt));
+    }
+    events.swap(out);
+}
 
-                 android::vold::Disk* disk = (source->getPartNum() == -1) ?
-                        new android::vold::Disk(eventPath, device,
-                                source->getNickname(), flags) :
-                        new android::vold::DiskPartition(eventPath, device,
-                                source->getNickname(), flags,
-                                source->getPartNum(),
-                                source->getFsType(), source->getMntOpts());
-                disk->create();
-                mDisks.push_back(std::shared_ptr<android::vold::Disk>(disk));
-                break;
+void VolumeManager::processBlockEvents() {
+    const auto window = std::chrono::milliseconds(std::max(0,
+            property_get_int32("vold.uevent_debounce_ms", kDefaultUeventDebounceMs)));
+    while (true) {
+        std::deque<BlockEvent> events;
+        bool resync;
+        {
+            std::unique_lock<std::mutex> lock(mEventLock);
+            mEventCond.wait(lock, [this] { return !mEvents.empty() || mResyncPending; });
+
+            // Hubs and card readers send change events in bursts; let the
+            // rest of the burst arrive so the disk is rescanned only once
+            bool change = std::any_of(mEvents.begin(), mEvents.end(), [](const BlockEvent& e) {
+                return e.action == NetlinkEvent::Action::kChange;
+            });
+            if (change) {
+                lock.unlock();
+                std::this_thread::sleep_for(window);
+                lock.lock();
             }
+            events.swap(mEvents);
+            resync = mResyncPending;
+            mResyncPending = false;
+        }
+
+        size_t received = events.size();
+        coalesceBlockEvents(events);
+        if (events.size() != received) {
+            LOG(DEBUG) << "Coalesced " << received << " block events into " << events.size();
+        }
+
+        for (const auto& evt : events) {
+            if (evt.action == NetlinkEvent::Action::kChange) {
+                rescanDisk(evt.device);
+            } else {
+                std::lock_guard<std::mutex> lock(mLock);
+                handleBlockEventLocked(evt);
+            }
+        }
+        if (resync) {
+            resyncDisks();
         }
-        break;
     }
-    case NetlinkEvent::Action::kChange: {
-        LOG(DEBUG) << "Disk at " << major << ":" << minor << " changed";
+}
+
+/*
+ * Brings mDisks back in line with the kernel after the uevent socket
+ * overflowed. Only /sys/block entries some DiskSource matches are looked
+ * at: missing disks are added, vanished ones removed, and the rest
+ * rescanned in case a change event was among those lost.
+ */
+void VolumeManager::resyncDisks() {
+    android::vold::Timing timing("uevent resync");
+
+    std::map<dev_t, std::string> present;
+    std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir("/sys/block"), closedir);
+    if (!dir) {
+        PLOG(ERROR) << "Failed to open /sys/block";
+        return;
+    }
+    struct dirent* de;
+    while ((de = readdir(dir.get())) != nullptr) {
+        if (de->d_name[0] == '.') continue;
+        std::string base = std::string("/sys/block/") + de->d_name;
+        char real[PATH_MAX];
+        if (!realpath(base.c_str(), real) || strncmp(real, "/sys/", 5)) continue;
+        if (!matchesDiskSource(real + 4)) continue;
+
+        std::string dev;
+        unsigned int maj, min;
+        if (!android::base::ReadFileToString(base + "/dev", &dev)
+                || sscanf(dev.c_str(), "%u:%u", &maj, &min) != 2) continue;
+        present.emplace(makedev(maj, min), real + 4);
+    }
+
+    std::vector<BlockEvent> events;
+    std::vector<dev_t> known;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        std::set<dev_t> seen;
+        for (const auto& disk : mDisks) {
+            if (disk == mVirtualDisk || !seen.insert(disk->getDevice()).second) continue;
+            auto it = present.find(disk->getDevice());
+            if (it == present.end()) {
+                events.push_back(BlockEvent{ NetlinkEvent::Action::kRemove,
+                        disk->getEventPath(), disk->getDevice() });
+            } else {
+                known.push_back(disk->getDevice());
+                present.erase(it);
+            }
+        }
+        for (const auto& p : present) {
+            events.push_back(BlockEvent{ NetlinkEvent::Action::kAdd, p.second, p.first });
+        }
+        for (const auto& evt : events) {
+            handleBlockEventLocked(evt);
+        }
+    }
+    for (dev_t device : known) {
+        rescanDisk(device);
+    }
+    LOG(INFO) << "Re-synced disks after uevent overflow: " << events.size()
+            << " added or removed, " << known.size() << " rescanned";
+}
+
+void VolumeManager::rescanDisk(dev_t device) {
+    LOG(DEBUG) << "Disk at " << major(device) << ":" << minor(device) << " changed";
+
+    std::vector<std::shared_ptr<android::vold::Disk>> disks;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
         for (const auto& disk : mDisks) {
             if (disk->getDevice() == device) {
-                disk->readMetadata();
-                disk->readPartitions();
+                disks.push_back(disk);
             }
         }
+    }
+
+    for (const auto& disk : disks) {
+        // Reading the partition table forks sgdisk, so do it unlocked
+        android::vold::Disk::PartitionScan scan;
+        disk->scanPartitions(scan);
+
+        std::lock_guard<std::mutex> lock(mLock);
+        if (std::find(mDisks.begin(), mDisks.end(), disk) == mDisks.end()) {
+            // Removed while we were scanning
+            continue;
+        }
+        android::vold::EventBatch batch;
+        disk->readMetadata();
+        disk->applyPartitions(scan);
+    }
+}
+
+void VolumeManager::handleBlockEventLocked(const BlockEvent& evt) {
+    android::vold::EventBatch batch;
+    const std::string& eventPath = evt.path;
+    dev_t device = evt.device;
+    int major = major(device);
+
+    switch (evt.action) {
+    case NetlinkEvent::Action::kAdd: {
+        auto source = findDiskSourceLocked(eventPath);
+        if (source) {
+            // For now, assume that MMC, virtio-blk (the latter is
+            // emulator-specific; see Disk.cpp for details) and UFS card
+            // devices are SD, and that everything else is USB
+            int flags = source->getFlags();
+            if (major == kMajorBlockMmc
+                || (eventPath.find("ufs") != std::string::npos)
+                || (android::vold::IsRunningInEmulator()
+                && major >= (int) kMajorBlockExperimentalMin
+                && major <= (int) kMajorBlockExperimentalMax)) {
+                flags |= android::vold::Disk::Flags::kSd;
+            } else {
+                flags |= android::vold::Disk::Flags::kUsb;
+            }
+
+            android::vold::Disk* disk = (source->getPartNum() == -1) ?
+                    new android::vold::Disk(eventPath, device,
+                            source->getNickname(), flags) :
+                    new android::vold::DiskPartition(eventPath, device,
+                            source->getNickname(), flags,
+                            source->getPartNum(),
+                            source->getFsType(), source->getMntOpts());
+            disk->create();
+            mDisks.push_back(std::shared_ptr<android::vold::Disk>(disk));
+        }
+
+        std::lock_guard<std::mutex> lock(mColdbootLock);
+        if (mColdbootPending.erase(device) && mColdbootPending.empty()) {
+            mColdbootCond.notify_all();
+        }
         break;
     }
     case NetlinkEvent::Action::kRemove: {
         auto i = mDisks.begin();
         while (i != mDisks.end()) {
             if ((*i)->getDevice() == device) {
+                // Their loop devices would keep the disk's volumes busy
+                releaseWarmObbs();
                 (*i)->destroy();
                 i = mDisks.erase(i);
             } else {
@@ -410,7 +782,7 @@ void VolumeManager::handleBlockEvent(NetlinkEvent *evt) {
         break;
     }
     default: {
-        LOG(WARNING) << "Unexpected block event action " << (int) evt->getAction();
+        LOG(WARNING) << "Unexpected block event action " << (int) evt.action;
         break;
     }
     }
@@ -419,6 +791,36 @@ void VolumeManager::handleBlockEvent(NetlinkEvent *evt) {
 void VolumeManager::addDiskSource(const std::shared_ptr<DiskSource>& diskSource) {
     std::lock_guard<std::mutex> lock(mLock);
     mDiskSources.push_back(diskSource);
+    mSourceMatcherValid = false;
+}
+
+std::shared_ptr<VolumeManager::DiskSource> VolumeManager::findDiskSourceLocked(
+        const std::string& sysPath) {
+    // Built on first use, once process_config() has added every source
+    if (!mSourceMatcherValid) {
+        mSourceMatcher.clear();
+        for (const auto& source : mDiskSources) {
+            mSourceMatcher.add(source->getSysPattern());
+        }
+        mSourceMatcherValid = true;
+    }
+    int i = mSourceMatcher.match(sysPath);
+    return i < 0 ? nullptr : mDiskSources[i];
+}
+
+bool VolumeManager::matchesDiskSource(const std::string& sysPath) {
+    std::lock_guard<std::mutex> lock(mLock);
+    return findDiskSourceLocked(sysPath) != nullptr;
+}
+
+void VolumeManager::setColdbootPending(const std::set<dev_t>& devices) {
+    std::lock_guard<std::mutex> lock(mColdbootLock);
+    mColdbootPending = devices;
+}
+
+bool VolumeManager::waitForColdboot(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mColdbootLock);
+    return mColdbootCond.wait_for(lock, timeout, [this] { return mColdbootPending.empty(); });
 }
 
 std::shared_ptr<android::vold::Disk> VolumeManager::findDisk(const std::string& id) {
@@ -485,6 +887,11 @@ int VolumeManager::forgetPartition(const std::string& partGuid) {
         LOG(ERROR) << "Failed to unlink " << keyPath;
         return -1;
     }
+    android::vold::ForgetBenchHistory(normalizedGuid);
+    std::string profilePath = android::vold::BuildProfilePath(normalizedGuid);
+    if (unlink(profilePath.c_str()) != 0 && errno != ENOENT) {
+        PLOG(WARNING) << "Failed to unlink " << profilePath;
+    }
 
     return 0;
 }
@@ -548,189 +955,349 @@ int VolumeManager::setPrimary(const std::shared_ptr<android::vold::VolumeBase>&
     return 0;
 }
 
-static int unmount_tree(const char* path) {
-    size_t path_len = strlen(path);
+/* Enough for two card slots and an OTG drive; 0 mounts synchronously */
+static const int kDefaultMountWorkers = 3;
+static const int kMaxMountWorkers = 8;
 
-    FILE* fp = setmntent("/proc/mounts", "r");
-    if (fp == NULL) {
-        ALOGE("Error opening /proc/mounts: %s", strerror(errno));
-        return -errno;
+bool VolumeManager::mountAsync(const std::shared_ptr<android::vold::VolumeBase>& vol,
+        int mountFlags, userid_t mountUserId) {
+    int maxWorkers = std::min(property_get_int32("vold.mount_workers",
+            kDefaultMountWorkers), kMaxMountWorkers);
+    if (maxWorkers <= 0) {
+        return false;
     }
 
-    // Some volumes can be stacked on each other, so force unmount in
-    // reverse order to give us the best chance of success.
-    std::list<std::string> toUnmount;
-    mntent* mentry;
-    while ((mentry = getmntent(fp)) != NULL) {
-        if (strncmp(mentry->mnt_dir, path, path_len) == 0) {
-            toUnmount.push_front(std::string(mentry->mnt_dir));
+    std::lock_guard<std::mutex> lock(mMountLock);
+    mMountRequests.push_back(MountRequest{vol, mountFlags, mountUserId});
+    if (mMountWorkers < maxWorkers) {
+        mMountWorkers++;
+        std::thread(&VolumeManager::processMountRequests, this).detach();
+    }
+    return true;
+}
+
+void VolumeManager::processMountRequests() {
+    std::unique_lock<std::mutex> lock(mMountLock);
+    while (!mMountRequests.empty()) {
+        MountRequest req = mMountRequests.front();
+        mMountRequests.pop_front();
+        lock.unlock();
+
+        // Only this volume is locked while it checks and mounts; mLock is
+        // taken afterwards, since holders of mLock may wait on the volume
+        {
+            std::lock_guard<std::recursive_mutex> volLock(req.vol->getLock());
+            if (!req.vol->adoptWarmMount(req.mountFlags, req.mountUserId)) {
+                req.vol->setMountFlags(req.mountFlags);
+                req.vol->setMountUserId(req.mountUserId);
+                req.vol->mount();
+            }
         }
+        if (req.mountFlags & android::vold::VolumeBase::MountFlags::kPrimary) {
+            std::lock_guard<std::mutex> globalLock(mLock);
+            setPrimary(req.vol);
+        }
+
+        lock.lock();
     }
-    endmntent(fp);
+    mMountWorkers--;
+}
 
-    for (const auto& path : toUnmount) {
-        if (umount2(path.c_str(), MNT_DETACH)) {
-            ALOGW("Failed to unmount %s: %s", path.c_str(), strerror(errno));
+static int unmount_tree(const char* path) {
+    // We've switched namespaces and may have forked while another thread
+    // held the shared table, so read this namespace's table afresh.
+    // Entries come most recent first, so stacked volumes unmount in
+    // reverse order, giving us the best chance of success.
+    android::vold::MountTable table;
+    for (const auto& entry : table.findByPrefix(path)) {
+        if (umount2(entry.target.c_str(), MNT_DETACH)) {
+            ALOGW("Failed to unmount %s: %s", entry.target.c_str(), strerror(errno));
         }
     }
     return 0;
 }
 
-int VolumeManager::remountUid(uid_t uid, const std::string& mode) {
-    LOG(DEBUG) << "Remounting " << uid << " as mode " << mode;
+/*
+ * Runs in a forked child: switches to the namespace behind |nsFd| and
+ * replaces its /storage view. Returns the child's exit status.
+ */
+static int remount_namespace(int nsFd, uid_t uid, const std::string& mode) {
+    if (setns(nsFd, CLONE_NEWNS) != 0) {
+        PLOG(ERROR) << "Failed to setns for " << uid;
+        return 1;
+    }
 
-    DIR* dir;
-    struct dirent* de;
-    char rootName[PATH_MAX];
-    char pidName[PATH_MAX];
-    int pidFd;
-    int nsFd;
-    struct stat sb;
-    pid_t child;
+    unmount_tree("/storage");
 
-    if (!(dir = opendir("/proc"))) {
-        PLOG(ERROR) << "Failed to opendir";
-        return -1;
+    std::string storageSource;
+    if (mode == "default") {
+        storageSource = "/mnt/runtime/default";
+    } else if (mode == "read") {
+        storageSource = "/mnt/runtime/read";
+    } else if (mode == "write") {
+        storageSource = "/mnt/runtime/write";
+    } else {
+        // Sane default of no storage visible
+        return 0;
+    }
+    if (TEMP_FAILURE_RETRY(mount(storageSource.c_str(), "/storage",
+            NULL, MS_BIND | MS_REC, NULL)) == -1) {
+        PLOG(ERROR) << "Failed to mount " << storageSource << " for " << uid;
+        return 1;
+    }
+    if (TEMP_FAILURE_RETRY(mount(NULL, "/storage", NULL,
+            MS_REC | MS_SLAVE, NULL)) == -1) {
+        PLOG(ERROR) << "Failed to set MS_SLAVE to /storage for " << uid;
+        return 1;
     }
 
-    // Figure out root namespace to compare against below
-    if (android::vold::SaneReadLinkAt(dirfd(dir), "1/ns/mnt", rootName, PATH_MAX) == -1) {
-        PLOG(ERROR) << "Failed to readlink";
-        closedir(dir);
-        return -1;
+    // Mount user-specific symlink helper into place
+    userid_t user_id = multiuser_get_user_id(uid);
+    std::string userSource(StringPrintf("/mnt/user/%d", user_id));
+    if (TEMP_FAILURE_RETRY(mount(userSource.c_str(), "/storage/self",
+            NULL, MS_BIND, NULL)) == -1) {
+        PLOG(ERROR) << "Failed to mount " << userSource << " for " << uid;
+        return 1;
     }
+    return 0;
+}
 
-    // Poke through all running PIDs look for apps running as UID
-    while ((de = readdir(dir))) {
-        pidFd = -1;
-        nsFd = -1;
+static const int kDefaultRemountWorkers = 4;
+static const int kMaxRemountWorkers = 16;
 
-        pidFd = openat(dirfd(dir), de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-        if (pidFd < 0) {
-            goto next;
-        }
-        if (fstat(pidFd, &sb) != 0) {
-            PLOG(WARNING) << "Failed to stat " << de->d_name;
-            goto next;
-        }
-        if (sb.st_uid != uid) {
-            goto next;
-        }
+int VolumeManager::remountUid(uid_t uid, const std::string& mode) {
+    return remountUids(std::vector<uid_t>{ uid }, mode);
+}
+
+int VolumeManager::remountUids(const std::vector<uid_t>& uids, const std::string& mode) {
+    LOG(DEBUG) << "Remounting " << uids.size() << " uids as mode " << mode;
+
+    // Refuse to touch anything if we can't tell the root namespace apart
+    if (mNamespaceIndex.getRootNamespace() == 0) {
+        LOG(ERROR) << "Failed to find root namespace";
+        return -1;
+    }
 
-        // Matches so far, but refuse to touch if in root namespace
-        LOG(DEBUG) << "Found matching PID " << de->d_name;
-        if (android::vold::SaneReadLinkAt(pidFd, "ns/mnt", pidName, PATH_MAX) == -1) {
-            PLOG(WARNING) << "Failed to read namespace for " << de->d_name;
-            goto next;
+    // Most processes share a handful of namespaces, so work per namespace;
+    // those already in the requested mode need nothing at all
+    std::set<uid_t> wanted(uids.begin(), uids.end());
+    std::vector<std::pair<ino_t, uid_t>> namespaces;
+    for (const auto& ns : mNamespaceIndex.findByUids(wanted)) {
+        if (mNamespaceIndex.getMode(ns.first) == mode) {
+            LOG(DEBUG) << "Namespace " << ns.first << " already in mode " << mode;
+            continue;
         }
-        if (!strcmp(rootName, pidName)) {
-            LOG(WARNING) << "Skipping due to root namespace";
-            goto next;
+        namespaces.push_back(ns);
+    }
+
+    // Namespaces are independent, so remount a few at a time. Children use
+    // the heap (getmntent(), logging), so they need their own address space
+    // rather than vfork() or CLONE_VM.
+    int workers = std::max(1, std::min(kMaxRemountWorkers,
+            property_get_int32("vold.remount_workers", kDefaultRemountWorkers)));
+
+    // Only ever wait for our own children; other threads fork too.
+    std::deque<std::pair<pid_t, ino_t>> running;
+    auto reap = [&]() {
+        int status;
+        if (TEMP_FAILURE_RETRY(waitpid(running.front().first, &status, 0)) != -1
+                && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            mNamespaceIndex.setMode(running.front().second, mode);
+        }
+        running.pop_front();
+    };
+    for (const auto& ns : namespaces) {
+        if ((int) running.size() == workers) {
+            reap();
         }
 
         // We purposefully leave the namespace open across the fork
-        nsFd = openat(pidFd, "ns/mnt", O_RDONLY); // not O_CLOEXEC
+        android::base::unique_fd nsFd(mNamespaceIndex.openNamespace(ns.first));
         if (nsFd < 0) {
-            PLOG(WARNING) << "Failed to open namespace for " << de->d_name;
-            goto next;
+            LOG(WARNING) << "Failed to open namespace " << ns.first;
+            continue;
         }
 
-        if (!(child = fork())) {
-            if (setns(nsFd, CLONE_NEWNS) != 0) {
-                PLOG(ERROR) << "Failed to setns for " << de->d_name;
-                _exit(1);
-            }
+        pid_t child = fork();
+        if (child == 0) {
+            _exit(remount_namespace(nsFd, ns.second, mode));
+        } else if (child == -1) {
+            PLOG(ERROR) << "Failed to fork";
+        } else {
+            running.emplace_back(child, ns.first);
+        }
+    }
+    while (!running.empty()) {
+        reap();
+    }
+    LOG(DEBUG) << "Remounted " << namespaces.size() << " namespaces";
+    return 0;
+}
 
-            unmount_tree("/storage");
+namespace {
 
-            std::string storageSource;
-            if (mode == "default") {
-                storageSource = "/mnt/runtime/default";
-            } else if (mode == "read") {
-                storageSource = "/mnt/runtime/read";
-            } else if (mode == "write") {
-                storageSource = "/mnt/runtime/write";
-            } else {
-                // Sane default of no storage visible
-                _exit(0);
-            }
-            if (TEMP_FAILURE_RETRY(mount(storageSource.c_str(), "/storage",
-                    NULL, MS_BIND | MS_REC, NULL)) == -1) {
-                PLOG(ERROR) << "Failed to mount " << storageSource << " for "
-                        << de->d_name;
-                _exit(1);
-            }
-            if (TEMP_FAILURE_RETRY(mount(NULL, "/storage", NULL,
-                    MS_REC | MS_SLAVE, NULL)) == -1) {
-                PLOG(ERROR) << "Failed to set MS_SLAVE to /storage for "
-                        << de->d_name;
-                _exit(1);
-            }
+struct Teardown {
+    std::string name;
+    std::function<void()> run;
+};
 
-            // Mount user-specific symlink helper into place
-            userid_t user_id = multiuser_get_user_id(uid);
-            std::string userSource(StringPrintf("/mnt/user/%d", user_id));
-            if (TEMP_FAILURE_RETRY(mount(userSource.c_str(), "/storage/self",
-                    NULL, MS_BIND, NULL)) == -1) {
-                PLOG(ERROR) << "Failed to mount " << userSource << " for "
-                        << de->d_name;
-                _exit(1);
-            }
+}  // namespace
 
-            _exit(0);
+/*
+ * Runs every teardown at once, since volumes on different disks don't
+ * depend on each other, logging how long each took. Waits for them all
+ * unless |giveUp|, when those still running at vold.teardown_deadline_ms
+ * are left to finish on their own. |finished| runs once every teardown
+ * has, on whichever thread that happens.
+ */
+static void runTeardowns(const std::vector<Teardown>& teardowns, bool giveUp,
+        const std::function<void()>& finished = nullptr) {
+    auto timed = [](const Teardown& t) {
+        auto start = std::chrono::steady_clock::now();
+        {
+            // Events are batched per thread
+            android::vold::EventBatch batch;
+            t.run();
         }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        LOG(INFO) << "Tore down " << t.name << " in " << ms << "ms";
+    };
+    if (teardowns.size() < 2 || !property_get_bool("vold.parallel_teardown", true)) {
+        for (const auto& t : teardowns) timed(t);
+        if (finished) finished();
+        return;
+    }
+
+    // Shared with the threads, which may outlive this call
+    struct State {
+        std::mutex lock;
+        std::condition_variable cond;
+        std::set<std::string> running;
+        /* Set once this call has stopped waiting for them */
+        bool abandoned = false;
+        std::function<void()> finished;
+    };
+    auto state = std::make_shared<State>();
+    state->finished = finished;
+    for (const auto& t : teardowns) {
+        state->running.insert(t.name);
+    }
+    for (const auto& t : teardowns) {
+        std::thread([state, t, timed]() {
+            timed(t);
+            std::unique_lock<std::mutex> lock(state->lock);
+            state->running.erase(t.name);
+            state->cond.notify_all();
+            if (state->abandoned && state->running.empty() && state->finished) {
+                lock.unlock();
+                state->finished();
+            }
+        }).detach();
+    }
 
-        if (child == -1) {
-            PLOG(ERROR) << "Failed to fork";
-            goto next;
-        } else {
-            TEMP_FAILURE_RETRY(waitpid(child, nullptr, 0));
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(
+            std::max(0, property_get_int32("vold.teardown_deadline_ms", 30000)));
+    std::unique_lock<std::mutex> lock(state->lock);
+    if (!state->cond.wait_until(lock, deadline, [&]() { return state->running.empty(); })) {
+        for (const auto& name : state->running) {
+            LOG(WARNING) << "Still tearing down " << name << " at the deadline";
         }
-
-next:
-        close(nsFd);
-        close(pidFd);
+        if (giveUp) {
+            state->abandoned = true;
+            return;
+        }
+        state->cond.wait(lock, [&]() { return state->running.empty(); });
     }
-    closedir(dir);
-    return 0;
+    lock.unlock();
+    if (finished) finished();
 }
 
 int VolumeManager::reset() {
     // Tear down all existing disks/volumes and start from a blank slate so
-    // newly connected framework hears all events.
+    // newly connected framework hears all events. With warm resets, disks
+    // with mounted volumes are only announced again instead, so that apps
+    // keep their open files if the framework asks for the same mounts.
+    android::vold::EventBatch batch;
+    bool warm = property_get_bool("vold.warm_reset", true);
+    std::vector<Teardown> teardowns;
     if (mInternalEmulated != nullptr) {
-        mInternalEmulated->destroy();
-        mInternalEmulated->create();
+        auto vol = mInternalEmulated;
+        if (warm && vol->getState() == android::vold::VolumeBase::State::kMounted) {
+            vol->announce();
+        } else {
+            teardowns.push_back(Teardown{ vol->getId(), [vol]() {
+                vol->destroy();
+                vol->create();
+            } });
+        }
     }
     for (const auto& disk : mDisks) {
-        disk->destroy();
-        disk->create();
+        if (warm && disk->hasMountedVolumes()) {
+            disk->announce();
+            continue;
+        }
+        teardowns.push_back(Teardown{ disk->getId(), [disk]() {
+            disk->destroy();
+            disk->create();
+        } });
     }
+    runTeardowns(teardowns, false);
     updateVirtualDisk();
     mAddedUsers.clear();
     mStartedUsers.clear();
+
+    scheduleWarmRelease();
     return 0;
 }
 
+void VolumeManager::scheduleWarmRelease() {
+    // Block events are still being scanned when the framework connects, so
+    // mounts left by a previous vold get as long as warm mounts do
+    uint64_t generation = ++mWarmGeneration;
+    auto timeout = std::chrono::milliseconds(property_get_int32("vold.warm_reset_timeout_ms",
+            kDefaultWarmResetTimeoutMs));
+    std::thread([this, generation, timeout]() {
+        std::this_thread::sleep_for(timeout);
+        std::lock_guard<std::mutex> lock(mLock);
+        if (generation != mWarmGeneration) return;
+        if (mInternalEmulated != nullptr) {
+            mInternalEmulated->releaseWarmMount();
+        }
+        for (const auto& disk : mDisks) {
+            disk->releaseWarmMounts();
+        }
+        android::vold::ReleaseLiveMounts([](const std::string&) { return false; });
+    }).detach();
+}
+
 // Can be called twice (sequentially) during shutdown. should be safe for that.
 int VolumeManager::shutdown() {
     if (mInternalEmulated == nullptr) {
         return 0; // already shutdown
     }
     shutting_down = true;
-    mInternalEmulated->destroy();
-    mInternalEmulated = nullptr;
+    releaseWarmObbs();
+    std::vector<Teardown> teardowns;
+    auto vol = mInternalEmulated;
+    teardowns.push_back(Teardown{ vol->getId(), [vol]() { vol->destroy(); } });
     for (const auto& disk : mDisks) {
-        disk->destroy();
+        teardowns.push_back(Teardown{ disk->getId(), [disk]() { disk->destroy(); } });
     }
+    // Rebooting anyway, so don't hold it up for a stuck unmount, but keep
+    // the shutdown kill timings for it until it's done
+    runTeardowns(teardowns, true, []() { shutting_down = false; });
+    mInternalEmulated = nullptr;
     mDisks.clear();
-    shutting_down = false;
     return 0;
 }
 
-int VolumeManager::unmountAll() {
+int VolumeManager::unmountAll(const std::set<std::string>& keep) {
     std::lock_guard<std::mutex> lock(mLock);
 
+    // Warm OBBs keep files open on the volumes about to go away
+    releaseWarmObbs();
+
     // First, try gracefully unmounting all known devices
     if (mInternalEmulated != nullptr) {
         mInternalEmulated->unmount();
@@ -740,24 +1307,17 @@ int VolumeManager::unmountAll() {
     }
 
     // Worst case we might have some stale mounts lurking around, so
-    // force unmount those just to be safe.
-    FILE* fp = setmntent("/proc/mounts", "r");
-    if (fp == NULL) {
-        SLOGE("Error opening /proc/mounts: %s", strerror(errno));
-        return -errno;
-    }
-
-    // Some volumes can be stacked on each other, so force unmount in
-    // reverse order to give us the best chance of success.
+    // force unmount those just to be safe. Some volumes can be stacked on
+    // each other, so the table hands them back in reverse order to give us
+    // the best chance of success.
     std::list<std::string> toUnmount;
-    mntent* mentry;
-    while ((mentry = getmntent(fp)) != NULL) {
-        if (strncmp(mentry->mnt_dir, "/mnt/", 5) == 0
-                || strncmp(mentry->mnt_dir, "/storage/", 9) == 0) {
-            toUnmount.push_front(std::string(mentry->mnt_dir));
+    for (const auto& entry : mMountTable.findByPrefix("/")) {
+        if (keep.count(entry.target)) continue;
+        if (entry.target.compare(0, 5, "/mnt/") == 0
+                || entry.target.compare(0, 9, "/storage/") == 0) {
+            toUnmount.push_back(entry.target);
         }
     }
-    endmntent(fp);
 
     for (const auto& path : toUnmount) {
         SLOGW("Tearing down stale mount %s", path.c_str());
@@ -917,8 +1477,21 @@ int VolumeManager::createAsec(const char *id, unsigned long numSectors, const ch
         return -1;
     }
 
+    // XXX: Twofish is all we support for now
+    bool encrypted = strcmp(key, "none") != 0;
+    sb.c_cipher = encrypted ? ASEC_SB_C_CIPHER_TWOFISH : ASEC_SB_C_CIPHER_NONE;
+
+    /*
+     * Drop down the superblock at the end of the file, straight into the
+     * image rather than through the loop device
+     */
+    if (writeSuperBlock(asecFileName, &sb, numImgSectors)) {
+        unlink(asecFileName);
+        return -1;
+    }
+
     char idHash[33];
-    if (!asecHash(id, idHash, sizeof(idHash))) {
+    if (!getAsecHash(id, idHash, sizeof(idHash))) {
         SLOGE("Hash of '%s' failed (%s)", id, strerror(errno));
         unlink(asecFileName);
         return -1;
@@ -934,9 +1507,7 @@ int VolumeManager::createAsec(const char *id, unsigned long numSectors, const ch
     char dmDevice[255];
     bool cleanupDm = false;
 
-    if (strcmp(key, "none")) {
-        // XXX: This is all we support for now
-        sb.c_cipher = ASEC_SB_C_CIPHER_TWOFISH;
+    if (encrypted) {
         if (Devmapper::create(idHash, loopDevice, key, numImgSectors, dmDevice,
                              sizeof(dmDevice))) {
             SLOGE("ASEC device mapping failed (%s)", strerror(errno));
@@ -945,23 +1516,12 @@ int VolumeManager::createAsec(const char *id, unsigned long numSectors, const ch
             return -1;
         }
         cleanupDm = true;
+        // Formatted right away, so the node must be there first
+        waitForDevMapper(dmDevice);
     } else {
-        sb.c_cipher = ASEC_SB_C_CIPHER_NONE;
         strlcpy(dmDevice, loopDevice, sizeof(dmDevice));
     }
 
-    /*
-     * Drop down the superblock at the end of the file
-     */
-    if (writeSuperBlock(loopDevice, &sb, numImgSectors)) {
-        if (cleanupDm) {
-            Devmapper::destroy(idHash);
-        }
-        Loop::destroyByDevice(loopDevice);
-        unlink(asecFileName);
-        return -1;
-    }
-
     if (wantFilesystem) {
         int formatStatus;
         char mountPoint[255];
@@ -978,7 +1538,16 @@ int VolumeManager::createAsec(const char *id, unsigned long numSectors, const ch
         }
 
         if (usingExt4) {
-            formatStatus = android::vold::ext4::Format(dmDevice, numImgSectors, mountPoint);
+            // The image is fresh, so let the kernel zero inode tables
+            // after mounting, and keep mke2fs from discarding the
+            // preallocated space. Only a plain image is known to read back
+            // as zeros, so only then can the journal go unzeroed too.
+            int flags = android::vold::ext4::kLazyInodeTables | android::vold::ext4::kNoDiscard;
+            if (!encrypted) {
+                flags |= android::vold::ext4::kLazyJournal;
+            }
+            formatStatus = android::vold::ext4::Format(dmDevice, numImgSectors, mountPoint,
+                    flags);
         } else {
             formatStatus = android::vold::vfat::Format(dmDevice, numImgSectors);
         }
@@ -1038,6 +1607,10 @@ int VolumeManager::createAsec(const char *id, unsigned long numSectors, const ch
         SLOGI("Created raw secure container %s (no filesystem)", id);
     }
 
+    {
+        std::lock_guard<std::mutex> lock(mAsecLock);
+        mAsecIndex[id] = AsecEntry{ asecDir, idHash };
+    }
     mActiveContainers->push_back(new ContainerData(strdup(id), ASEC));
     return 0;
 }
@@ -1064,10 +1637,17 @@ int VolumeManager::resizeAsec(const char *id, unsigned long numSectors, const ch
        return -1;
     }
 
-    if (isMountpointMounted(mountPoint)) {
-       SLOGE("ASEC %s mounted. Unmount before resizing", id);
-       errno = EBUSY;
-       return -1;
+    // Mounted containers are grown in place, unless they're finalized and
+    // so mounted read-only, which resize2fs can't grow
+    bool online = false;
+    for (const auto& mount : mMountTable.findByPrefix(mountPoint)) {
+        if (mount.target != mountPoint) continue;
+        if (mount.options.compare(0, 2, "rw") != 0) {
+            SLOGE("ASEC %s is mounted read-only; unmount it to resize", id);
+            errno = EBUSY;
+            return -1;
+        }
+        online = true;
     }
 
     struct asec_superblock sb;
@@ -1147,11 +1727,17 @@ int VolumeManager::resizeAsec(const char *id, unsigned long numSectors, const ch
         goto fail;
 
     char idHash[33];
-    if (!asecHash(id, idHash, sizeof(idHash))) {
+    if (!getAsecHash(id, idHash, sizeof(idHash))) {
         SLOGE("Hash of '%s' failed (%s)", id, strerror(errno));
         goto fail;
     }
 
+    if (online) {
+        // Past this point the devices may already be larger, which is
+        // harmless, but the image can't shrink back under them
+        return growMountedAsec(id, idHash, sb, numImgSectors);
+    }
+
     char loopDevice[255];
     if (setupLoopDevice(loopDevice, sizeof(loopDevice), asecFileName, idHash, mDebug))
         goto fail;
@@ -1200,7 +1786,7 @@ int VolumeManager::finalizeAsec(const char *id) {
     }
 
     char idHash[33];
-    if (!asecHash(id, idHash, sizeof(idHash))) {
+    if (!getAsecHash(id, idHash, sizeof(idHash))) {
         SLOGE("Hash of '%s' failed (%s)", id, strerror(errno));
         return -1;
     }
@@ -1265,7 +1851,7 @@ int VolumeManager::fixupAsecPermissions(const char *id, gid_t gid, const char* f
     }
 
     char idHash[33];
-    if (!asecHash(id, idHash, sizeof(idHash))) {
+    if (!getAsecHash(id, idHash, sizeof(idHash))) {
         SLOGE("Hash of '%s' failed (%s)", id, strerror(errno));
         return -1;
     }
@@ -1432,6 +2018,17 @@ int VolumeManager::renameAsec(const char *id1, const char *id2) {
         goto out_err;
     }
 
+    {
+        std::lock_guard<std::mutex> lock(mAsecLock);
+        mAsecIndex.erase(id1);
+        char idHash[MD5_ASCII_LENGTH_PLUS_NULL];
+        if (asecHash(id2, idHash, sizeof(idHash))) {
+            mAsecIndex[id2] = AsecEntry{ dir, idHash };
+        } else {
+            mAsecIndexValid = false;
+        }
+    }
+
     free(asecFilename2);
     return 0;
 
@@ -1440,8 +2037,6 @@ out_err:
     return -1;
 }
 
-#define UNMOUNT_RETRIES 5
-#define UNMOUNT_SLEEP_BETWEEN_RETRY_MS (1000 * 1000)
 int VolumeManager::unmountAsec(const char *id, bool force) {
     char asecFileName[255];
     char mountPoint[255];
@@ -1464,7 +2059,7 @@ int VolumeManager::unmountAsec(const char *id, bool force) {
     }
 
     char idHash[33];
-    if (!asecHash(id, idHash, sizeof(idHash))) {
+    if (!getAsecHash(id, idHash, sizeof(idHash))) {
         SLOGE("Hash of '%s' failed (%s)", id, strerror(errno));
         return -1;
     }
@@ -1487,11 +2082,42 @@ int VolumeManager::unmountObb(const char *fileName, bool force) {
         return -1;
     }
 
-    return unmountLoopImage(fileName, idHash, fileName, mountPoint, force);
+    WarmObb warm;
+    bool keep = false;
+    auto warmTime = getObbWarmTime();
+    {
+        std::lock_guard<std::mutex> lock(sObbLock);
+        auto it = sMountedObbs.find(idHash);
+        if (it != sMountedObbs.end()) {
+            warm = it->second;
+            keep = warmTime.count() > 0;
+            sMountedObbs.erase(it);
+        }
+    }
+
+    if (unmountLoopImage(fileName, idHash, fileName, mountPoint, force, keep)) {
+        return -1;
+    }
+    if (keep) {
+        warm.expiry = std::chrono::steady_clock::now() + warmTime;
+        {
+            std::lock_guard<std::mutex> lock(sObbLock);
+            sWarmObbs[idHash] = warm;
+        }
+        std::thread([warmTime]() {
+            std::this_thread::sleep_for(warmTime);
+            pruneWarmObbs(false);
+        }).detach();
+    }
+    return 0;
+}
+
+void VolumeManager::releaseWarmObbs() {
+    pruneWarmObbs(true);
 }
 
 int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
-        const char *fileName, const char *mountPoint, bool force) {
+        const char *fileName, const char *mountPoint, bool force, bool keepDevices) {
     if (!isMountpointMounted(mountPoint)) {
         SLOGE("Unmount request for %s when not mounted", id);
         errno = ENOENT;
@@ -1499,6 +2125,8 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
     }
 
     int i, rc;
+    ProcessScanner scanner;
+    scanner.addMountPoint(mountPoint);
     for (i = 1; i <= UNMOUNT_RETRIES; i++) {
         rc = umount(mountPoint);
         if (!rc) {
@@ -1521,8 +2149,18 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
                 signal = SIGTERM;
         }
 
-        Process::killProcessesWithOpenFiles(mountPoint, signal);
-        usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
+        // Go again as soon as everyone signalled is gone, or just keep
+        // retrying while processes are only being asked nicely
+        auto wait = std::chrono::microseconds(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
+        scanner.scan(signal);
+        if (signal != 0) {
+            scanner.waitForExit(std::chrono::duration_cast<std::chrono::milliseconds>(wait));
+        } else if (retryUnmount(mountPoint,
+                std::chrono::duration_cast<std::chrono::milliseconds>(wait))) {
+            SLOGI("Container %s unmounted OK", id);
+            rc = 0;
+            break;
+        }
     }
 
     if (rc) {
@@ -1546,21 +2184,8 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
         SLOGE("Timed out trying to rmdir %s (%s)", mountPoint, strerror(errno));
     }
 
-    for (i=1; i <= UNMOUNT_RETRIES; i++) {
-        if (Devmapper::destroy(idHash) && errno != ENXIO) {
-            SLOGE("Failed to destroy devmapper instance (%s)", strerror(errno));
-            usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
-            continue;
-        } else {
-          break;
-        }
-    }
-
-    char loopDevice[255];
-    if (!Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
-        Loop::destroyByDevice(loopDevice);
-    } else {
-        SLOGW("Failed to find loop device for {%s} (%s)", fileName, strerror(errno));
+    if (!keepDevices) {
+        destroyLoopImageDevices(idHash, fileName);
     }
 
     AsecIdCollection::iterator it;
@@ -1614,6 +2239,11 @@ int VolumeManager::destroyAsec(const char *id, bool force) {
         return -1;
     }
 
+    {
+        std::lock_guard<std::mutex> lock(mAsecLock);
+        mAsecIndex.erase(id);
+    }
+
     if (mDebug) {
         SLOGD("ASEC %s destroyed", id);
     }
@@ -1652,45 +2282,87 @@ bool VolumeManager::isLegalAsecId(const char *id) const {
     return true;
 }
 
-bool VolumeManager::isAsecInDirectory(const char *dir, const char *asecName) const {
-    int dirfd = open(dir, O_DIRECTORY | O_CLOEXEC);
-    if (dirfd < 0) {
-        SLOGE("Couldn't open internal ASEC dir (%s)", strerror(errno));
-        return false;
+void VolumeManager::refreshAsecIndexLocked() {
+    uint64_t generation = mMountTable.generation();
+    if (mAsecIndexValid && generation == mAsecGeneration) {
+        return;
     }
 
-    struct stat sb;
-    bool ret = (fstatat(dirfd, asecName, &sb, AT_SYMLINK_NOFOLLOW) == 0)
-        && S_ISREG(sb.st_mode);
+    // Keep hashes we already have rather than computing them again
+    std::map<std::string, AsecEntry> previous;
+    previous.swap(mAsecIndex);
+    mUnreadableAsecDirs.clear();
+
+    // Internal containers shadow external ones with the same id
+    for (const char* dir : { VolumeManager::SEC_ASECDIR_EXT, VolumeManager::SEC_ASECDIR_INT }) {
+        DIR* d = opendir(dir);
+        if (!d) {
+            SLOGW("Couldn't open ASEC dir %s (%s)", dir, strerror(errno));
+            mUnreadableAsecDirs.insert(dir);
+            continue;
+        }
+        struct dirent* de;
+        while ((de = readdir(d)) != NULL) {
+            if (de->d_name[0] == '.' || de->d_type != DT_REG) {
+                continue;
+            }
+            std::string name(de->d_name);
+            if (name.size() <= 5 || name.compare(name.size() - 5, 5, ".asec")) {
+                continue;
+            }
+            std::string id(name.substr(0, name.size() - 5));
+            if (!isLegalAsecId(id.c_str())) {
+                continue;
+            }
 
-    close(dirfd);
+            auto it = previous.find(id);
+            if (it != previous.end()) {
+                mAsecIndex[id] = AsecEntry{ dir, it->second.hash };
+                continue;
+            }
+            char idHash[MD5_ASCII_LENGTH_PLUS_NULL];
+            if (asecHash(id.c_str(), idHash, sizeof(idHash))) {
+                mAsecIndex[id] = AsecEntry{ dir, idHash };
+            }
+        }
+        closedir(d);
+    }
 
-    return ret;
+    mAsecGeneration = generation;
+    mAsecIndexValid = true;
 }
 
-int VolumeManager::findAsec(const char *id, char *asecPath, size_t asecPathLen,
-        const char **directory) const {
-    char *asecName;
+char* VolumeManager::getAsecHash(const char *id, char *buffer, size_t len) {
+    {
+        std::lock_guard<std::mutex> lock(mAsecLock);
+        refreshAsecIndexLocked();
+        auto it = mAsecIndex.find(id);
+        if (it != mAsecIndex.end() && len > it->second.hash.size()) {
+            strlcpy(buffer, it->second.hash.c_str(), len);
+            return buffer;
+        }
+    }
+    return asecHash(id, buffer, len);
+}
 
+int VolumeManager::findAsec(const char *id, char *asecPath, size_t asecPathLen,
+        const char **directory) {
     if (!isLegalAsecId(id)) {
         SLOGE("findAsec: Invalid asec id \"%s\"", id);
         errno = EINVAL;
         return -1;
     }
 
-    if (asprintf(&asecName, "%s.asec", id) < 0) {
-        SLOGE("Couldn't allocate string to write ASEC name");
-        return -1;
-    }
-
     const char *dir;
-    if (isAsecInDirectory(VolumeManager::SEC_ASECDIR_INT, asecName)) {
-        dir = VolumeManager::SEC_ASECDIR_INT;
-    } else if (isAsecInDirectory(VolumeManager::SEC_ASECDIR_EXT, asecName)) {
-        dir = VolumeManager::SEC_ASECDIR_EXT;
-    } else {
-        free(asecName);
-        return -1;
+    {
+        std::lock_guard<std::mutex> lock(mAsecLock);
+        refreshAsecIndexLocked();
+        auto it = mAsecIndex.find(id);
+        if (it == mAsecIndex.end()) {
+            errno = ENOENT;
+            return -1;
+        }
+        dir = it->second.dir;
     }
 
     if (directory != NULL) {
@@ -1698,15 +2370,28 @@ int VolumeManager::findAsec(const char *id, char *asecPath, size_t asecPathLen,
     }
 
     if (asecPath != NULL) {
-        int written = snprintf(asecPath, asecPathLen, "%s/%s", dir, asecName);
+        int written = snprintf(asecPath, asecPathLen, "%s/%s.asec", dir, id);
         if ((written < 0) || (size_t(written) >= asecPathLen)) {
             SLOGE("findAsec failed for %s: couldn't construct ASEC path", id);
-            free(asecName);
             return -1;
         }
     }
 
-    free(asecName);
+    return 0;
+}
+
+int VolumeManager::listAsecs(const char *directory, std::vector<std::string>& ids) {
+    std::lock_guard<std::mutex> lock(mAsecLock);
+    refreshAsecIndexLocked();
+    if (mUnreadableAsecDirs.count(directory)) {
+        errno = ENOENT;
+        return -1;
+    }
+    for (const auto& entry : mAsecIndex) {
+        if (!strcmp(entry.second.dir, directory)) {
+            ids.push_back(entry.first);
+        }
+    }
     return 0;
 }
 
@@ -1738,7 +2423,7 @@ int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid, bool
     }
 
     char idHash[33];
-    if (!asecHash(id, idHash, sizeof(idHash))) {
+    if (!getAsecHash(id, idHash, sizeof(idHash))) {
         SLOGE("Hash of '%s' failed (%s)", id, strerror(errno));
         return -1;
     }
@@ -1838,6 +2523,29 @@ int VolumeManager::mountObb(const char *img, const char *key, int ownerGid) {
         return -1;
     }
 
+    // Games remount the same OBB on every launch; if it was unmounted
+    // moments ago its devices may still be around for a plain mount
+    ObbIdentity identity;
+    bool identified = getObbWarmTime().count() > 0 && getObbIdentity(img, key, &identity);
+    WarmObb warm;
+    if (takeWarmObb(idHash, identified ? &identity : nullptr, &warm)) {
+        if ((!mkdir(mountPoint, 0755) || errno == EEXIST)
+                && !android::vold::vfat::Mount(warm.device, mountPoint,
+                        true, false, true, 0, ownerGid, 0227, false)) {
+            {
+                std::lock_guard<std::mutex> lock(sObbLock);
+                sMountedObbs[idHash] = warm;
+            }
+            mActiveContainers->push_back(new ContainerData(strdup(img), OBB));
+            if (mDebug) {
+                SLOGD("Image %s mounted from warm %s", img, warm.device.c_str());
+            }
+            return 0;
+        }
+        SLOGW("Warm mount of %s failed (%s); setting it up again", img, strerror(errno));
+        destroyLoopImageDevices(idHash, img);
+    }
+
     char loopDevice[255];
     if (setupLoopDevice(loopDevice, sizeof(loopDevice), img, idHash, mDebug))
         return -1;
@@ -1894,6 +2602,10 @@ int VolumeManager::mountObb(const char *img, const char *key, int ownerGid) {
         return -1;
     }
 
+    if (identified) {
+        std::lock_guard<std::mutex> lock(sObbLock);
+        sMountedObbs[idHash] = WarmObb{ identity, dmDevice, {} };
+    }
     mActiveContainers->push_back(new ContainerData(strdup(img), OBB));
     if (mDebug) {
         SLOGD("Image %s mounted", img);
@@ -1902,34 +2614,19 @@ int VolumeManager::mountObb(const char *img, const char *key, int ownerGid) {
 }
 
 int VolumeManager::listMountedObbs(SocketClient* cli) {
-    FILE *fp = setmntent("/proc/mounts", "r");
-    if (fp == NULL) {
-        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
-        return -1;
-    }
-
-    // Create a string to compare against that has a trailing slash
-    int loopDirLen = strlen(VolumeManager::LOOPDIR);
-    char loopDir[loopDirLen + 2];
-    strlcpy(loopDir, VolumeManager::LOOPDIR, sizeof(loopDir));
-    loopDir[loopDirLen++] = '/';
-    loopDir[loopDirLen] = '\0';
-
-    mntent* mentry;
-    while ((mentry = getmntent(fp)) != NULL) {
-        if (!strncmp(mentry->mnt_dir, loopDir, loopDirLen)) {
-            int fd = open(mentry->mnt_fsname, O_RDONLY | O_CLOEXEC);
-            if (fd >= 0) {
-                struct loop_info64 li;
-                if (ioctl(fd, LOOP_GET_STATUS64, &li) >= 0) {
-                    cli->sendMsg(ResponseCode::AsecListResult,
-                            (const char*) li.lo_file_name, false);
-                }
-                close(fd);
+    // Compare against a trailing slash
+    std::string loopDir = std::string(VolumeManager::LOOPDIR) + "/";
+    for (const auto& entry : mMountTable.findByPrefix(loopDir)) {
+        int fd = open(entry.source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            struct loop_info64 li;
+            if (ioctl(fd, LOOP_GET_STATUS64, &li) >= 0) {
+                cli->sendMsg(ResponseCode::AsecListResult,
+                        (const char*) li.lo_file_name, false);
             }
+            close(fd);
         }
     }
-    endmntent(fp);
     return 0;
 }
 
@@ -1940,22 +2637,7 @@ extern "C" int vold_unmountAll(void) {
 
 bool VolumeManager::isMountpointMounted(const char *mp)
 {
-    FILE *fp = setmntent("/proc/mounts", "r");
-    if (fp == NULL) {
-        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
-        return false;
-    }
-
-    bool found_mp = false;
-    mntent* mentry;
-    while ((mentry = getmntent(fp)) != NULL) {
-        if (strcmp(mentry->mnt_dir, mp) == 0) {
-            found_mp = true;
-            break;
-        }
-    }
-    endmntent(fp);
-    return found_mp;
+    return mMountTable.isMounted(mp);
 }
 
 int VolumeManager::mkdirs(char* path) {
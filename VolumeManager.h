@@ -23,11 +23,19 @@
 
 #ifdef __cplusplus
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <list>
+#include <map>
 #include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <cutils/multiuser.h>
 #include <utils/List.h>
@@ -37,6 +45,10 @@
 
 #include "Disk.h"
 #include "DiskPartition.h"
+#include "MountTable.h"
+#include "NamespaceIndex.h"
+#include "PatternMatcher.h"
+#include "Uevent.h"
 #include "VolumeBase.h"
 
 /* The length of an MD5 hash when encoded into ASCII hex characters */
@@ -72,7 +84,8 @@ public:
     static const char *LOOPDIR;
 
     //TODO remove this with better solution, b/64143519
-    static bool shutting_down;
+    // Stays set until teardowns left running past the shutdown deadline end
+    static std::atomic<bool> shutting_down;
 
 private:
     static VolumeManager *sInstance;
@@ -96,7 +109,16 @@ public:
     int start();
     int stop();
 
-    void handleBlockEvent(NetlinkEvent *evt);
+    /* Block uevent fields we need, copied off the listener's event */
+    struct BlockEvent {
+        NetlinkEvent::Action action;
+        std::string path;
+        dev_t device;
+    };
+
+    void handleBlockEvent(const android::vold::Uevent& evt);
+    /* Uevents were dropped; re-syncs disks against /sys/block to catch up */
+    void handleUeventOverflow();
 
     class DiskSource {
     public:
@@ -112,6 +134,7 @@ public:
             return !fnmatch(mSysPattern.c_str(), sysPath.c_str(), 0);
         }
 
+        const std::string& getSysPattern() { return mSysPattern; }
         const std::string& getNickname() { return mNickname; }
         int getPartNum() { return mPartNum; }
         int getFlags() { return mFlags; }
@@ -128,6 +151,13 @@ public:
     };
 
     void addDiskSource(const std::shared_ptr<DiskSource>& diskSource);
+    /* True if a uevent for |sysPath| would be picked up by some DiskSource */
+    bool matchesDiskSource(const std::string& sysPath);
+
+    /* Records the devices coldboot is about to trigger "add" events for */
+    void setColdbootPending(const std::set<dev_t>& devices);
+    /* Waits until every pending coldboot device has been added */
+    bool waitForColdboot(std::chrono::milliseconds timeout);
 
     std::shared_ptr<android::vold::Disk> findDisk(const std::string& id);
     std::shared_ptr<android::vold::VolumeBase> findVolume(const std::string& id);
@@ -145,18 +175,30 @@ public:
 
     int setPrimary(const std::shared_ptr<android::vold::VolumeBase>& vol);
 
+    /*
+     * Queues |vol| to be mounted on a worker thread, so independent volumes
+     * come up in parallel; the outcome is reported through volume state
+     * events. Returns false when parallel mounting is disabled.
+     */
+    bool mountAsync(const std::shared_ptr<android::vold::VolumeBase>& vol,
+            int mountFlags, userid_t mountUserId);
+
     int remountUid(uid_t uid, const std::string& mode);
+    /* Remounts every process of |uids|, once per distinct mount namespace */
+    int remountUids(const std::vector<uid_t>& uids, const std::string& mode);
 
     /* Reset all internal state, typically during framework boot */
     int reset();
     /* Prepare for device shutdown, safely unmounting all devices */
     int shutdown();
-    /* Unmount all volumes, usually for encryption */
-    int unmountAll();
+    /* Unmount all volumes, usually for encryption, sparing mounts at |keep| */
+    int unmountAll(const std::set<std::string>& keep = std::set<std::string>());
 
     /* ASEC */
     int findAsec(const char *id, char *asecPath = NULL, size_t asecPathLen = 0,
-            const char **directory = NULL) const;
+            const char **directory = NULL);
+    /* Ids of the containers in |directory|; fails if it can't be read */
+    int listAsecs(const char *directory, std::vector<std::string>& ids);
     int createAsec(const char *id, unsigned long numSectors, const char *fstype,
                    const char *key, const int ownerUid, bool isExternal);
     int resizeAsec(const char *id, unsigned long numSectors, const char *key);
@@ -186,9 +228,21 @@ public:
     int unmountObb(const char *fileName, bool force);
     int getObbMountPath(const char *id, char *buffer, int maxlen);
 
+    /*
+     * Tears down the devices of recently unmounted OBBs that were kept
+     * around for a quick remount (see vold.obb_warm_ms)
+     */
+    void releaseWarmObbs();
+    /*
+     * Unmounts warm volumes and a previous vold's mounts that nobody asked
+     * for within vold.warm_reset_timeout_ms
+     */
+    void scheduleWarmRelease();
+
     /* Shared between ASEC and Loopback images */
     int unmountLoopImage(const char *containerId, const char *loopId,
-            const char *fileName, const char *mountPoint, bool force);
+            const char *fileName, const char *mountPoint, bool force,
+            bool keepDevices = false);
 
     int updateVirtualDisk();
     int setDebug(bool enable);
@@ -198,6 +252,9 @@ public:
 
     static VolumeManager *Instance();
 
+    android::vold::NamespaceIndex& getNamespaceIndex() { return mNamespaceIndex; }
+    android::vold::MountTable& getMountTable() { return mMountTable; }
+
     static char *asecHash(const char *id, char *buffer, size_t len);
 
     /*
@@ -213,16 +270,71 @@ private:
     VolumeManager();
     void readInitialState();
     bool isMountpointMounted(const char *mp);
-    bool isAsecInDirectory(const char *dir, const char *asec) const;
     bool isLegalAsecId(const char *id) const;
 
     int linkPrimary(userid_t userId);
 
+    /* Where an ASEC lives, so lookups don't have to probe for it */
+    struct AsecEntry {
+        const char* dir;
+        std::string hash;
+    };
+    void refreshAsecIndexLocked();
+    char* getAsecHash(const char *id, char *buffer, size_t len);
+
+    struct MountRequest {
+        std::shared_ptr<android::vold::VolumeBase> vol;
+        int mountFlags;
+        userid_t mountUserId;
+    };
+    void processMountRequests();
+
+    void processBlockEvents();
+    void handleBlockEventLocked(const BlockEvent& evt);
+    void rescanDisk(dev_t device);
+    /* First source whose pattern matches |sysPath|, if any */
+    std::shared_ptr<DiskSource> findDiskSourceLocked(const std::string& sysPath);
+    void resyncDisks();
+
     std::mutex mLock;
 
-    std::list<std::shared_ptr<DiskSource>> mDiskSources;
+    /* Block events waiting for processBlockEvents() */
+    std::mutex mEventLock;
+    std::condition_variable mEventCond;
+    std::deque<BlockEvent> mEvents;
+    bool mResyncPending;
+    std::thread mEventThread;
+
+    /* Volumes waiting for processMountRequests() */
+    std::mutex mMountLock;
+    std::deque<MountRequest> mMountRequests;
+    int mMountWorkers;
+
+    /* Coldboot devices whose add event hasn't been handled yet */
+    std::mutex mColdbootLock;
+    std::condition_variable mColdbootCond;
+    std::set<dev_t> mColdbootPending;
+
+    /*
+     * ASECs by id, read from the ASEC directories and kept up to date by
+     * create, rename and destroy. Re-read whenever the mount table changes,
+     * since the external directory comes and goes with its volume.
+     */
+    std::mutex mAsecLock;
+    std::map<std::string, AsecEntry> mAsecIndex;
+    std::set<std::string> mUnreadableAsecDirs;
+    uint64_t mAsecGeneration;
+    bool mAsecIndexValid;
+
+    std::vector<std::shared_ptr<DiskSource>> mDiskSources;
+    /* Every source's pattern in one place, rebuilt when sources are added */
+    android::vold::PatternMatcher mSourceMatcher;
+    bool mSourceMatcherValid;
     std::list<std::shared_ptr<android::vold::Disk>> mDisks;
 
+    /* Bumped by every start and reset, so only the latest releases warm mounts */
+    uint64_t mWarmGeneration;
+
     std::unordered_map<userid_t, int> mAddedUsers;
     std::unordered_set<userid_t> mStartedUsers;
 
@@ -230,6 +342,9 @@ private:
     std::shared_ptr<android::vold::Disk> mVirtualDisk;
     std::shared_ptr<android::vold::VolumeBase> mInternalEmulated;
     std::shared_ptr<android::vold::VolumeBase> mPrimary;
+
+    android::vold::NamespaceIndex mNamespaceIndex;
+    android::vold::MountTable mMountTable;
 };
 
 extern "C" {
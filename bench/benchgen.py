@@ -24,9 +24,18 @@ $ adb shell strace -p `pid zygote` -o /data/local/tmp/trace -f -ff -y -ttt -e tr
 $ adb pull /data/local/tmp/trace*
 $ python benchgen.py trace.*
 
+To capture a workload as a trace file replayed alongside the built-in one, instead of
+regenerating BenchmarkGen.h, name it and write it out; each captured thread replays on
+its own thread, and --shared-fds lets a descriptor opened by one be used by another:
+$ python benchgen.py --binary app_launch.vbt --name app_launch trace.*
+$ adb push app_launch.vbt /data/misc/vold/bench_traces/
+
+Workloads that are hard to capture reproducibly can be synthesized too:
+$ python benchgen.py --binary sqlite_wal.vbt --synth sqlite_wal
+
 """
 
-import re, sys, collections, traceback, argparse
+import re, sys, collections, traceback, argparse, struct
 
 from operator import itemgetter
 from collections import defaultdict
@@ -107,9 +116,218 @@ def parse_args(s):
 bufsize = 1048576
 interesting = ["mmap2","read","write","pread64","pwrite64","fsync","fdatasync","openat","close","lseek","_llseek"]
 
+# Must match BenchmarkTrace.h
+OP_OPEN, OP_CLOSE, OP_LSEEK, OP_READ, OP_WRITE, OP_PREAD, OP_PWRITE, OP_FSYNC, OP_FDATASYNC = range(1, 10)
+open_flags = {
+    "O_WRONLY": 1 << 0,
+    "O_RDWR": 1 << 1,
+    "O_CREAT": 1 << 2,
+    "O_TRUNC": 1 << 3,
+    "O_APPEND": 1 << 4,
+    "O_EXCL": 1 << 5,
+}
+whences = { "SEEK_SET": 0, "SEEK_CUR": 1, "SEEK_END": 2 }
+
+
+class Trace:
+    """Per-thread operations on numbered files, as written by --binary"""
+    def __init__(self, name):
+        self.name = name
+        self.sizes = []
+        self.handles = {}
+        self.threads = defaultdict(list)
+        # Microseconds into the trace of calls added next
+        self.now = 0
+
+    def file(self, size=0):
+        self.sizes.append(size)
+        return len(self.sizes) - 1
+
+    def grow(self, ident, size):
+        self.sizes[ident] = max(self.sizes[ident], size)
+
+    def add(self, thread, op, handle, arg=0, offset=0, count=0, flags=0, mode=0):
+        if handle not in self.handles:
+            self.handles[handle] = len(self.handles)
+        self.threads[thread].append((op, flags, self.handles[handle], arg, mode, offset, count,
+                self.now))
+
+    def write(self, fn):
+        with open(fn, 'wb') as out:
+            out.write(struct.pack("<4sIIII", "VBT2", len(self.sizes), len(self.handles),
+                    len(self.threads), len(self.name)))
+            out.write(self.name)
+            for size in self.sizes:
+                out.write(struct.pack("<Q", size))
+            for thread in sorted(self.threads):
+                ops = self.threads[thread]
+                out.write(struct.pack("<I", len(ops)))
+                for op, flags, handle, arg, mode, offset, count, now in ops:
+                    out.write(struct.pack("<BBHIIIqqq", op, flags, 0, handle, arg, mode,
+                            offset, count, now))
+
+
+def parse_flags(s):
+    flags = 0
+    for flag in s.split("|"):
+        flags |= open_flags.get(flag.strip(), 0)
+    return flags
+
+
+def capture_trace(events, name, shared_fds):
+    """Same translation as BenchmarkGen.h, but each thread keeps its own order and timing"""
+    trace = Trace(name)
+    idents = {}
+    def ident(f):
+        if f.name not in idents:
+            idents[f.name] = trace.file()
+        return idents[f.name]
+
+    def extract(e, arg):
+        fd, f, handle = extract_file(e, arg)
+        if f and shared_fds:
+            # Threads of one process share their descriptors
+            handle = "f%s<%s>" % (fd, f.name)
+        return (fd, f, handle)
+
+    events = sorted(events, key=lambda e: e.time)
+    first = events[0].time if events else 0
+    active = {}
+    for e in events:
+        trace.now = int((e.time - first) * 1000000)
+        if e.call == "openat":
+            fd, f, handle = extract(e, e.ret)
+            if f:
+                active[handle] = e.thread
+                mode = int(e.args[3], 8) if 'O_CREAT' in e.args[2] else 0
+                trace.add(e.thread, OP_OPEN, handle, ident(f), flags=parse_flags(e.args[2]),
+                        mode=mode)
+            continue
+
+        if e.call == "mmap2":
+            fd, f, handle = extract(e, e.args[4])
+        else:
+            fd, f, handle = extract(e, e.args[0])
+        if handle not in active: continue
+        active[handle] = e.thread
+
+        if e.call == "close":
+            del active[handle]
+            trace.add(e.thread, OP_CLOSE, handle)
+        elif e.call == "lseek":
+            trace.add(e.thread, OP_LSEEK, handle, whences[e.args[2]], offset=int(e.args[1]))
+        elif e.call == "_llseek":
+            trace.add(e.thread, OP_LSEEK, handle, whences[e.args[3]], offset=int(e.args[1]))
+        elif e.call in ("read", "write"):
+            count = min(int(e.args[2]), bufsize)
+            trace.grow(ident(f), trace.sizes[ident(f)] + count)
+            trace.add(e.thread, OP_READ if e.call == "read" else OP_WRITE, handle, count=count)
+        elif e.call in ("pread64", "pwrite64"):
+            trace.grow(ident(f), int(e.args[2]) + int(e.args[3]))
+            count = min(int(e.args[2]), bufsize)
+            trace.add(e.thread, OP_PREAD if e.call == "pread64" else OP_PWRITE, handle,
+                    offset=int(e.args[3]), count=count)
+        elif e.call == "fsync":
+            trace.add(e.thread, OP_FSYNC, handle)
+        elif e.call == "fdatasync":
+            trace.add(e.thread, OP_FDATASYNC, handle)
+        elif e.call == "mmap2":
+            count = min(int(e.args[1]), bufsize)
+            offset = int(e.args[5], 0)
+            trace.grow(ident(f), count + offset)
+            trace.add(e.thread, OP_PREAD, handle, offset=offset, count=count)
+
+    for handle, thread in active.iteritems():
+        trace.add(thread, OP_CLOSE, handle)
+    return trace
+
+
+def synth_sqlite_wal():
+    """Small transactions appended to a WAL, with periodic checkpoints into the database"""
+    trace = Trace("sqlite_wal")
+    page = 4096
+    db = trace.file(256 * page)
+    wal = trace.file()
+    rdwr = open_flags["O_RDWR"] | open_flags["O_CREAT"]
+    trace.add(0, OP_OPEN, "db", db, flags=rdwr, mode=0600)
+    trace.add(0, OP_OPEN, "wal", wal, flags=rdwr, mode=0600)
+    frames = 0
+    for txn in range(500):
+        for i in range(txn % 3 + 1):
+            trace.add(0, OP_PREAD, "db", offset=((txn * 7 + i) % 256) * page, count=page)
+        for i in range(txn % 4 + 1):
+            trace.add(0, OP_PWRITE, "wal", offset=32 + frames * (page + 24), count=page + 24)
+            frames += 1
+        trace.add(0, OP_FDATASYNC, "wal")
+        if frames >= 1000 or txn == 499:
+            for i in range(frames):
+                trace.add(0, OP_PREAD, "wal", offset=32 + i * (page + 24), count=page + 24)
+                trace.add(0, OP_PWRITE, "db", offset=(i % 256) * page, count=page)
+            trace.add(0, OP_FSYNC, "db")
+            frames = 0
+    trace.add(0, OP_CLOSE, "wal")
+    trace.add(0, OP_CLOSE, "db")
+    return trace
+
+
+def synth_camera_burst():
+    """Two capture threads each writing out a burst of large images"""
+    trace = Trace("camera_burst")
+    create = open_flags["O_WRONLY"] | open_flags["O_CREAT"] | open_flags["O_TRUNC"]
+    chunk = 256 * 1024
+    for thread in range(2):
+        for shot in range(10):
+            f = trace.file()
+            handle = "t%ds%d" % (thread, shot)
+            trace.add(thread, OP_OPEN, handle, f, flags=create, mode=0644)
+            for i in range(12):
+                trace.add(thread, OP_WRITE, handle, count=chunk)
+            trace.add(thread, OP_FSYNC, handle)
+            trace.add(thread, OP_CLOSE, handle)
+    return trace
+
+
+def synth_media_scan():
+    """Several threads reading the head and tail of many media files"""
+    trace = Trace("media_scan")
+    for thread in range(4):
+        for n in range(50):
+            size = (n % 8 + 1) * 128 * 1024
+            f = trace.file(size)
+            handle = "t%dn%d" % (thread, n)
+            trace.add(thread, OP_OPEN, handle, f)
+            trace.add(thread, OP_PREAD, handle, offset=0, count=65536)
+            trace.add(thread, OP_PREAD, handle, offset=size - 65536, count=65536)
+            trace.add(thread, OP_CLOSE, handle)
+    return trace
+
+
+synths = {
+    "sqlite_wal": synth_sqlite_wal,
+    "camera_burst": synth_camera_burst,
+    "media_scan": synth_media_scan,
+}
+
+parser = argparse.ArgumentParser(description="Generate storage benchmark from strace output")
+parser.add_argument("traces", nargs="*", help="strace output files, one per thread")
+parser.add_argument("--binary", help="write a trace file instead of BenchmarkGen.h")
+parser.add_argument("--name", help="workload name reported with --binary results")
+parser.add_argument("--synth", choices=sorted(synths), help="synthesize a workload for --binary")
+parser.add_argument("--shared-fds", action="store_true",
+        help="with --binary, treat the traces as threads of one process sharing descriptors")
+opts = parser.parse_args()
+
+if opts.synth:
+    if not opts.binary: parser.error("--synth needs --binary")
+    synths[opts.synth]().write(opts.binary)
+    sys.exit(0)
+
+if opts.binary and not opts.name:
+    parser.error("--binary needs --name")
+
 re_event = re.compile(r"^([\d\.]+) (.+?)\((.+?)\) = (.+?)$")
 re_arg = re.compile(r'''((?:[^,"']|"[^"]*"|'[^']*')+)''')
-for fn in sys.argv[1:]:
+for fn in opts.traces:
     with open(fn) as f:
         thread = int(fn.split(".")[-1])
         for line in f:
@@ -125,6 +343,13 @@ for fn in sys.argv[1:]:
             events.append(Event(thread, time, call, args, ret))
 
 
+if opts.binary:
+    trace = capture_trace(events, opts.name, opts.shared_fds)
+    trace.write(opts.binary)
+    print "Wrote", sum([ len(t) for t in trace.threads.values() ]), "calls from", \
+            len(trace.threads), "threads to", opts.binary
+    sys.exit(0)
+
 with open("BenchmarkGen.h", 'w') as bench:
     print >>bench, """/*
  * Copyright (C) 2015 The Android Open Source Project
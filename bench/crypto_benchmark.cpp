@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmarks for the crypto and key-handling primitives that unlock
+ * paths are built from. BM_scrypt_device runs with this device's
+ * ro.crypto.scrypt_params, so that BM_scrypt across N and r shows how far
+ * those could move within an unlock-latency budget.
+ */
+
+#include "KeyBuffer.h"
+#include "KeyStorage.h"
+#include "KeyUtil.h"
+#include "ScryptParameters.h"
+#include "Utils.h"
+
+#include <benchmark/benchmark.h>
+#include <cutils/properties.h>
+
+#include <string>
+
+#include "crypto_scrypt.h"
+
+namespace android {
+namespace vold {
+
+/* Same sizes as the inputs and output of stretchSecret() */
+static const size_t kSecretBytes = 32;
+static const size_t kSaltBytes = 16;
+static const size_t kStretchedBytes = 64;
+static const size_t kKeyBytes = 64;
+
+static void runScrypt(benchmark::State& state, int Nf, int rf, int pf) {
+    std::string secret(kSecretBytes, 's');
+    std::string salt(kSaltBytes, 'n');
+    uint8_t out[kStretchedBytes];
+    while (state.KeepRunning()) {
+        crypto_scrypt(reinterpret_cast<const uint8_t*>(secret.data()), secret.size(),
+                reinterpret_cast<const uint8_t*>(salt.data()), salt.size(),
+                1 << Nf, 1 << rf, 1 << pf, out, sizeof(out));
+    }
+}
+
+/* Arguments are log2 of N, r and p, as in ScryptParameters */
+static void BM_scrypt(benchmark::State& state) {
+    runScrypt(state, state.range(0), state.range(1), state.range(2));
+}
+BENCHMARK(BM_scrypt)
+        ->Args({ 11, 3, 1 })
+        ->Args({ 12, 3, 1 })
+        ->Args({ 13, 3, 1 })
+        ->Args({ 14, 3, 1 })
+        ->Args({ 15, 3, 1 })
+        ->Args({ 16, 3, 1 })
+        ->Args({ 14, 2, 1 })
+        ->Args({ 14, 4, 1 })
+        ->Args({ 15, 3, 0 })
+        ->Args({ 15, 3, 2 })
+        ->Unit(benchmark::kMillisecond);
+
+static void BM_scrypt_device(benchmark::State& state) {
+    char paramstr[PROPERTY_VALUE_MAX];
+    property_get(SCRYPT_PROP, paramstr, SCRYPT_DEFAULTS);
+    int Nf, rf, pf;
+    if (!parse_scrypt_parameters(paramstr, &Nf, &rf, &pf)) {
+        parse_scrypt_parameters(SCRYPT_DEFAULTS, &Nf, &rf, &pf);
+    }
+    state.SetLabel(paramstr);
+    runScrypt(state, Nf, rf, pf);
+}
+BENCHMARK(BM_scrypt_device)->Unit(benchmark::kMillisecond);
+
+static void BM_encryptWithoutKeymaster(benchmark::State& state) {
+    std::string preKey(kStretchedBytes, 'p');
+    KeyBuffer key(kKeyBytes, 'k');
+    std::string ciphertext;
+    while (state.KeepRunning()) {
+        encryptWithoutKeymaster(preKey, key, &ciphertext);
+    }
+}
+BENCHMARK(BM_encryptWithoutKeymaster);
+
+static void BM_decryptWithoutKeymaster(benchmark::State& state) {
+    std::string preKey(kStretchedBytes, 'p');
+    KeyBuffer key(kKeyBytes, 'k');
+    std::string ciphertext;
+    if (!encryptWithoutKeymaster(preKey, key, &ciphertext)) {
+        state.SkipWithError("encryptWithoutKeymaster failed");
+        return;
+    }
+    while (state.KeepRunning()) {
+        decryptWithoutKeymaster(preKey, ciphertext, &key);
+    }
+}
+BENCHMARK(BM_decryptWithoutKeymaster);
+
+static void BM_StrToHex(benchmark::State& state) {
+    std::string str(state.range(0), '\xa5');
+    std::string hex;
+    while (state.KeepRunning()) {
+        StrToHex(str, hex);
+    }
+    state.SetBytesProcessed(state.iterations() * str.size());
+}
+BENCHMARK(BM_StrToHex)->Arg(16)->Arg(64)->Arg(1024);
+
+static void BM_StrToHex_KeyBuffer(benchmark::State& state) {
+    KeyBuffer str(state.range(0), '\xa5');
+    KeyBuffer hex;
+    while (state.KeepRunning()) {
+        StrToHex(str, hex);
+    }
+    state.SetBytesProcessed(state.iterations() * str.size());
+}
+BENCHMARK(BM_StrToHex_KeyBuffer)->Arg(16)->Arg(64)->Arg(1024);
+
+static void BM_HexToStr(benchmark::State& state) {
+    std::string hex(state.range(0) * 2, 'a');
+    std::string str;
+    while (state.KeepRunning()) {
+        HexToStr(hex, str);
+    }
+    state.SetBytesProcessed(state.iterations() * hex.size());
+}
+BENCHMARK(BM_HexToStr)->Arg(16)->Arg(64)->Arg(1024);
+
+static void BM_NormalizeHex(benchmark::State& state) {
+    std::string in(state.range(0) * 2, 'A');
+    std::string out;
+    while (state.KeepRunning()) {
+        NormalizeHex(in, out);
+    }
+    state.SetBytesProcessed(state.iterations() * in.size());
+}
+BENCHMARK(BM_NormalizeHex)->Arg(16)->Arg(64)->Arg(1024);
+
+static void BM_generateKeyRef(benchmark::State& state) {
+    KeyBuffer key(kKeyBytes, 'k');
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(generateKeyRef(key.data(), key.size()));
+    }
+}
+BENCHMARK(BM_generateKeyRef);
+
+/* Device-mapper parameters, built the way the crypt volumes build them */
+static void BM_KeyBuffer_concat(benchmark::State& state) {
+    KeyBuffer hexKey(state.range(0) * 2, 'a');
+    while (state.KeepRunning()) {
+        auto params = KeyBuffer() + "AES-256-XTS " + hexKey + " " + "/dev/block/loop0" + " 0";
+        benchmark::DoNotOptimize(params.data());
+    }
+}
+BENCHMARK(BM_KeyBuffer_concat)->Arg(16)->Arg(32)->Arg(64);
+
+}  // namespace vold
+}  // namespace android
+
+BENCHMARK_MAIN();
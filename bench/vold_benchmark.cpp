@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures vold's own control-plane paths against loop-backed disks and
+ * images, in this process rather than the running daemon:
+ *
+ *   $ adb shell vold_benchmark [iterations]
+ *
+ * Each operation is timed as a phase with a histogram, and so is every
+ * phase it goes through, such as fsck or sgdisk runs; the result is the
+ * same report as "vdc dump timings". Needs root, and FBE for the key
+ * unlock benchmark. Only devices and mounts created here are touched.
+ */
+
+#include "Disk.h"
+#include "Ext4Crypt.h"
+#include "Loop.h"
+#include "Spawner.h"
+#include "Timings.h"
+#include "VolumeManager.h"
+#include "fs/Vfat.h"
+#include "sehandle.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <fs_mgr.h>
+#include <private/android_filesystem_config.h>
+#include <selinux/android.h>
+#include <sysutils/SocketListener.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct fstab *fstab;
+struct selabel_handle *sehandle;
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const char* kImageDir = "/data/local/tmp/vold_benchmark";
+static const int kDefaultIterations = 20;
+/* Sparse, and big enough for FAT32 */
+static const unsigned long kImageSectors = 64 * 1024 * 1024 / 512;
+/* Well above any user the framework creates */
+static const userid_t kBenchUser = 9999;
+/* An app uid with no processes, so remounting only pays for the lookup */
+static const uid_t kBenchUid = AID_APP + 9999;
+
+/* Sparse image attached to a loop device for the life of the object */
+class LoopImage {
+public:
+    explicit LoopImage(const std::string& name) : mPath(StringPrintf("%s/%s", kImageDir,
+            name.c_str())) {}
+
+    ~LoopImage() {
+        if (!mDevice.empty()) Loop::destroyByDevice(mDevice.c_str());
+        unlink(mPath.c_str());
+    }
+
+    status_t create(unsigned long sectors) {
+        if (Loop::createImageFile(mPath.c_str(), sectors)
+                || Loop::create(mPath, mDevice)) {
+            LOG(ERROR) << "Failed to set up " << mPath;
+            return -EIO;
+        }
+        return OK;
+    }
+
+    /* Detaches the loop device, leaving the image for callers that attach it themselves */
+    void detach() {
+        Loop::destroyByDevice(mDevice.c_str());
+        mDevice.clear();
+    }
+
+    const std::string& getPath() const { return mPath; }
+    const std::string& getDevice() const { return mDevice; }
+
+    dev_t getRdev() const {
+        struct stat sb;
+        return stat(mDevice.c_str(), &sb) == 0 ? sb.st_rdev : 0;
+    }
+
+private:
+    std::string mPath;
+    std::string mDevice;
+
+    DISALLOW_COPY_AND_ASSIGN(LoopImage);
+};
+
+/* Creating a disk is what scans it, up to DiskScanned */
+static void benchDiskScan(int iterations) {
+    LoopImage image("disk.img");
+    if (image.create(kImageSectors)) return;
+    dev_t device = image.getRdev();
+    {
+        Disk disk("virtual", device, "bench", Disk::Flags::kSd);
+        disk.create();
+        disk.partitionPublic();
+        disk.destroy();
+    }
+
+    for (int i = 0; i < iterations; i++) {
+        Disk disk("virtual", device, "bench", Disk::Flags::kSd);
+        {
+            Timing timing("bench Disk::create", true);
+            disk.create();
+        }
+        disk.destroy();
+    }
+}
+
+static void benchPublicMount(int iterations) {
+    LoopImage image("public.img");
+    if (image.create(kImageSectors)) return;
+    Disk disk("virtual", image.getRdev(), "bench", Disk::Flags::kSd);
+    disk.create();
+    disk.partitionPublic();
+
+    std::list<std::string> ids;
+    disk.listVolumes(VolumeBase::Type::kPublic, ids);
+    auto vol = ids.empty() ? nullptr : disk.findVolume(ids.front());
+    if (vol == nullptr) {
+        LOG(ERROR) << "No public volume on " << disk.getId();
+        disk.destroy();
+        return;
+    }
+    vol->setMountFlags(0);
+    vol->setMountUserId(0);
+
+    for (int i = 0; i < iterations; i++) {
+        {
+            Timing timing("bench PublicVolume mount", true);
+            vol->mount();
+        }
+        {
+            Timing timing("bench PublicVolume unmount", true);
+            vol->unmount();
+        }
+    }
+    disk.destroy();
+}
+
+static void benchRemountUid(int iterations) {
+    VolumeManager* vm = VolumeManager::Instance();
+    for (int i = 0; i < iterations; i++) {
+        Timing timing("bench remountUid", true);
+        vm->remountUid(kBenchUid, (i % 2) ? "read" : "default");
+    }
+}
+
+static void benchUnlockUserKey(int iterations) {
+    if (!e4crypt_is_native()) {
+        LOG(INFO) << "Skipping e4crypt_unlock_user_key without FBE";
+        return;
+    }
+    if (!e4crypt_vold_create_user_key(kBenchUser, 0, false)) {
+        LOG(ERROR) << "Failed to create keys for user " << kBenchUser;
+        return;
+    }
+    for (int i = 0; i < iterations; i++) {
+        e4crypt_lock_user_key(kBenchUser);
+        Timing timing("bench e4crypt_unlock_user_key", true);
+        e4crypt_unlock_user_key(kBenchUser, 0, "!", "!");
+    }
+    e4crypt_destroy_user_key(kBenchUser);
+}
+
+static void benchMountObb(int iterations) {
+    LoopImage image("bench.obb");
+    if (image.create(kImageSectors) || vfat::Format(image.getDevice(), 0)) return;
+    image.detach();
+
+    VolumeManager* vm = VolumeManager::Instance();
+    for (int i = 0; i < iterations; i++) {
+        {
+            Timing timing("bench mountObb", true);
+            if (vm->mountObb(image.getPath().c_str(), "none", AID_MEDIA_RW)) {
+                LOG(ERROR) << "Failed to mount " << image.getPath();
+                return;
+            }
+        }
+        {
+            Timing timing("bench unmountObb", true);
+            vm->unmountObb(image.getPath().c_str(), false);
+        }
+    }
+}
+
+}  // namespace vold
+}  // namespace android
+
+int main(int argc, char** argv) {
+    android::base::InitLogging(argv, android::base::StderrLogger);
+    using namespace android::vold;
+
+    int iterations = (argc > 1) ? atoi(argv[1]) : kDefaultIterations;
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    sehandle = selinux_android_file_context_handle();
+    if (sehandle) {
+        selinux_android_set_sehandle(sehandle);
+    }
+    fstab = fs_mgr_read_fstab_default();
+    StartSpawner();
+    mkdir("/dev/block/vold", 0755);
+    if (mkdir(kImageDir, 0700) && errno != EEXIST) {
+        PLOG(ERROR) << "Failed to create " << kImageDir;
+        return 1;
+    }
+
+    // Events go nowhere, since nothing connects to this listener
+    SocketListener broadcaster("vold_benchmark", true);
+    VolumeManager::Instance()->setBroadcaster(&broadcaster);
+    EnableTimingHistograms();
+
+    benchDiskScan(iterations);
+    benchPublicMount(iterations);
+    benchRemountUid(iterations);
+    benchUnlockUserKey(iterations);
+    benchMountObb(iterations);
+
+    std::vector<std::string> lines;
+    DumpTimings(lines);
+    for (const auto& line : lines) {
+        printf("%s\n", line.c_str());
+    }
+    rmdir(kImageDir);
+    return 0;
+}
@@ -44,6 +44,11 @@
 #include <fs_mgr.h>
 #include <time.h>
 #include <math.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <selinux/selinux.h>
 #include "cryptfs.h"
 #include "secontext.h"
@@ -61,6 +66,10 @@
 #include "CheckBattery.h"
 #include "EncryptInplace.h"
 #include "Process.h"
+#include "DeviceMapper.h"
+#include "KdfCache.h"
+#include "KeyBuffer.h"
+#include "Utils.h"
 #include "Keymaster.h"
 #include "android-base/properties.h"
 #include <bootloader_message/bootloader_message.h>
@@ -74,6 +83,7 @@ extern "C" {
 #define UNUSED __attribute__((unused))
 
 #define DM_CRYPT_BUF_SIZE 4096
+#define DM_NODE_TIMEOUT_SEC 5
 
 #define HASH_COUNT 2000
 #define KEY_LEN_BYTES 16
@@ -91,8 +101,6 @@ extern "C" {
 #define EXT4_FS 1
 #define F2FS_FS 2
 
-#define TABLE_LOAD_RETRIES 10
-
 #define RSA_KEY_SIZE 2048
 #define RSA_KEY_SIZE_BYTES (RSA_KEY_SIZE / 8)
 #define RSA_EXPONENT 0x10001
@@ -105,6 +113,8 @@ static unsigned char saved_master_key[KEY_LEN_BYTES];
 static char *saved_mount_point;
 static int  master_key_saved = 0;
 static struct crypt_persist_data *persist_data = NULL;
+/* Slot of each key in persist_data->persist_entry, kept in step with it */
+static std::unordered_map<std::string, unsigned int> persist_index;
 
 static int previous_type;
 
@@ -123,20 +133,8 @@ int cryptfs_check_passwd_hw(char *passwd);
 static void convert_key_to_hex_ascii_for_upgrade(const unsigned char *master_key,
                                      unsigned int keysize, char *master_key_ascii)
 {
-    unsigned int i, a;
-    unsigned char nibble;
-
-    for (i = 0, a = 0; i < keysize; i++, a += 2) {
-        /* For each byte, write out two ascii hex digits */
-        nibble = (master_key[i] >> 4) & 0xf;
-        master_key_ascii[a] = nibble + (nibble > 9 ? 0x57 : 0x30);
-
-        nibble = master_key[i] & 0xf;
-        master_key_ascii[a + 1] = nibble + (nibble > 9 ? 0x57 : 0x30);
-    }
-
-    /* Add the null termination */
-    master_key_ascii[a] = '\0';
+    android::vold::EncodeHex(master_key, keysize, master_key_ascii);
+    master_key_ascii[keysize * 2] = '\0';
 }
 
 static int get_keymaster_hw_fde_passwd(const char* passwd, unsigned char* newpw,
@@ -365,20 +363,6 @@ static void cryptfs_reboot(enum RebootType rt)
     return;
 }
 
-static void ioctl_init(struct dm_ioctl *io, size_t dataSize, const char *name, unsigned flags)
-{
-    memset(io, 0, dataSize);
-    io->data_size = dataSize;
-    io->data_start = sizeof(struct dm_ioctl);
-    io->version[0] = 4;
-    io->version[1] = 0;
-    io->version[2] = 0;
-    io->flags = flags;
-    if (name) {
-        strlcpy(io->name, name, sizeof(io->name));
-    }
-}
-
 /**
  * Gets the default device scrypt parameters for key derivation time tuning.
  * The parameters should lead to about one second derivation time for the
@@ -496,6 +480,24 @@ static void set_ftr_sha(struct crypt_mnt_ftr *crypt_ftr)
     SHA256_Final(crypt_ftr->sha256, &c);
 }
 
+/*
+ * The footer is read for nearly every framework request, but vold is its
+ * only writer and always goes through put_crypt_ftr_and_key(), so the last
+ * good read is kept in memory. Writes bump the generation, which stops a
+ * read that raced with one from being cached.
+ */
+static std::mutex cached_ftr_lock;
+static struct crypt_mnt_ftr cached_ftr;
+static bool cached_ftr_valid = false;
+static unsigned int cached_ftr_generation = 0;
+
+static void invalidate_cached_ftr(void)
+{
+    std::lock_guard<std::mutex> lock(cached_ftr_lock);
+    cached_ftr_valid = false;
+    cached_ftr_generation++;
+}
+
 /* key or salt can be NULL, in which case just skip writing that value.  Useful to
  * update the failed mount count but not change the key.
  */
@@ -512,6 +514,7 @@ static int put_crypt_ftr_and_key(struct crypt_mnt_ftr *crypt_ftr)
   struct stat statbuf;
 
   set_ftr_sha(crypt_ftr);
+  invalidate_cached_ftr();
 
   if (get_crypt_ftr_info(&fname, &starting_off)) {
     SLOGE("Unable to get crypt_ftr_info\n");
@@ -551,6 +554,8 @@ static int put_crypt_ftr_and_key(struct crypt_mnt_ftr *crypt_ftr)
 
 errout:
   close(fd);
+  /* Again, for reads that started while this write was in progress */
+  invalidate_cached_ftr();
   return rc;
 
 }
@@ -580,6 +585,24 @@ static void init_empty_persist_data(struct crypt_persist_data *pdata, int len)
     pdata->persist_valid_entries = 0;
 }
 
+static void rebuild_persist_index(void)
+{
+    persist_index.clear();
+    if (persist_data == NULL) {
+        return;
+    }
+    for (unsigned int i = 0; i < persist_data->persist_valid_entries; i++) {
+        const char* key = persist_data->persist_entry[i].key;
+        persist_index.emplace(std::string(key, strnlen(key, PROPERTY_KEY_MAX)), i);
+    }
+}
+
+static void set_persist_data(struct crypt_persist_data *pdata)
+{
+    persist_data = pdata;
+    rebuild_persist_index();
+}
+
 /* A routine to update the passed in crypt_ftr to the lastest version.
  * fd is open read/write on the device that holds the crypto footer and persistent
  * data, crypt_ftr is a pointer to the struct to be updated, and offset is the
@@ -658,6 +681,16 @@ static int get_crypt_ftr_and_key(struct crypt_mnt_ftr *crypt_ftr)
   int rc = -1;
   char *fname = NULL;
   struct stat statbuf;
+  unsigned int generation;
+
+  {
+    std::lock_guard<std::mutex> lock(cached_ftr_lock);
+    if (cached_ftr_valid) {
+      memcpy(crypt_ftr, &cached_ftr, sizeof(cached_ftr));
+      return 0;
+    }
+    generation = cached_ftr_generation;
+  }
 
   if (get_crypt_ftr_info(&fname, &starting_off)) {
     SLOGE("Unable to get crypt_ftr_info\n");
@@ -713,6 +746,14 @@ static int get_crypt_ftr_and_key(struct crypt_mnt_ftr *crypt_ftr)
     upgrade_crypt_ftr(fd, crypt_ftr, starting_off);
   }
 
+  {
+    std::lock_guard<std::mutex> lock(cached_ftr_lock);
+    if (generation == cached_ftr_generation) {
+      memcpy(&cached_ftr, crypt_ftr, sizeof(cached_ftr));
+      cached_ftr_valid = true;
+    }
+  }
+
   /* Success! */
   rc = 0;
 
@@ -767,7 +808,7 @@ static int load_persistent_data(void)
         pdata = (crypt_persist_data*)malloc(CRYPT_PERSIST_DATA_SIZE);
         if (pdata) {
             init_empty_persist_data(pdata, CRYPT_PERSIST_DATA_SIZE);
-            persist_data = pdata;
+            set_persist_data(pdata);
             return 0;
         }
         return -1;
@@ -825,7 +866,7 @@ static int load_persistent_data(void)
     }
 
     /* Success */
-    persist_data = pdata;
+    set_persist_data(pdata);
     close(fd);
     return 0;
 
@@ -946,50 +987,23 @@ err:
  */
 static void convert_key_to_hex_ascii(const unsigned char *master_key,
                                      unsigned int keysize, char *master_key_ascii) {
-    unsigned int i, a;
-    unsigned char nibble;
-
-    for (i=0, a=0; i<keysize; i++, a+=2) {
-        /* For each byte, write out two ascii hex digits */
-        nibble = (master_key[i] >> 4) & 0xf;
-        master_key_ascii[a] = nibble + (nibble > 9 ? 0x37 : 0x30);
-
-        nibble = master_key[i] & 0xf;
-        master_key_ascii[a+1] = nibble + (nibble > 9 ? 0x37 : 0x30);
-    }
-
-    /* Add the null termination */
-    master_key_ascii[a] = '\0';
-
+    /* Upper case, unlike the upgrade path above */
+    android::vold::EncodeHex(master_key, keysize, master_key_ascii, true);
+    master_key_ascii[keysize * 2] = '\0';
 }
 
-static int load_crypto_mapping_table(struct crypt_mnt_ftr *crypt_ftr,
+static void build_crypto_mapping_table(struct crypt_mnt_ftr *crypt_ftr,
         const unsigned char *master_key, const char *real_blk_name,
-        const char *name, int fd, const char *extra_params) {
-  alignas(struct dm_ioctl) char buffer[DM_CRYPT_BUF_SIZE];
-  struct dm_ioctl *io;
-  struct dm_target_spec *tgt;
-  char *crypt_params;
+        const char *extra_params, android::vold::DeviceMapper::Target *tgt) {
+  char crypt_params[DM_CRYPT_BUF_SIZE];
   char master_key_ascii[129]; /* Large enough to hold 512 bit key and null */
-  size_t buff_offset;
-  int i;
-
-  io = (struct dm_ioctl *) buffer;
 
-  /* Load the mapping table for this device */
-  tgt = (struct dm_target_spec *) &buffer[sizeof(struct dm_ioctl)];
-
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  io->target_count = 1;
-  tgt->status = 0;
-  tgt->sector_start = 0;
+  tgt->start = 0;
   tgt->length = crypt_ftr->fs_size;
-  crypt_params = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
-  buff_offset = crypt_params - buffer;
 
 #ifdef CONFIG_HW_DISK_ENCRYPTION
   if(is_hw_disk_encryption((char*)crypt_ftr->crypto_type_name)) {
-    strlcpy(tgt->target_type, "req-crypt",DM_MAX_TYPE_NAME);
+    tgt->type = "req-crypt";
     if (is_ice_enabled())
       convert_key_to_hex_ascii(master_key, sizeof(int), master_key_ascii);
     else
@@ -997,117 +1011,48 @@ static int load_crypto_mapping_table(struct crypt_mnt_ftr *crypt_ftr,
   }
   else {
     convert_key_to_hex_ascii(master_key, crypt_ftr->keysize, master_key_ascii);
-    strlcpy(tgt->target_type, "crypt", DM_MAX_TYPE_NAME);
+    tgt->type = "crypt";
   }
-  snprintf(crypt_params, sizeof(buffer) - buff_offset, "%s %s 0 %s 0 %s 0",
+  snprintf(crypt_params, sizeof(crypt_params), "%s %s 0 %s 0 %s 0",
            crypt_ftr->crypto_type_name, master_key_ascii,
            real_blk_name, extra_params);
 
-  SLOGI("target_type = %s", tgt->target_type);
+  SLOGI("target_type = %s", tgt->type.c_str());
   SLOGI("real_blk_name = %s, extra_params = %s", real_blk_name, extra_params);
 #else
   convert_key_to_hex_ascii(master_key, crypt_ftr->keysize, master_key_ascii);
-  strlcpy(tgt->target_type, "crypt", DM_MAX_TYPE_NAME);
-  snprintf(crypt_params, sizeof(buffer) - buff_offset, "%s %s 0 %s 0 %s",
+  tgt->type = "crypt";
+  snprintf(crypt_params, sizeof(crypt_params), "%s %s 0 %s 0 %s",
            crypt_ftr->crypto_type_name, master_key_ascii, real_blk_name,
            extra_params);
 #endif
 
-  crypt_params += strlen(crypt_params) + 1;
-  crypt_params = (char *) (((unsigned long)crypt_params + 7) & ~8); /* Align to an 8 byte boundary */
-  tgt->next = crypt_params - buffer;
-
-  for (i = 0; i < TABLE_LOAD_RETRIES; i++) {
-    if (! ioctl(fd, DM_TABLE_LOAD, io)) {
-      break;
-    }
-    usleep(500000);
-  }
-
-  if (i == TABLE_LOAD_RETRIES) {
-    /* We failed to load the table, return an error */
-    return -1;
-  } else {
-    return i + 1;
-  }
+  tgt->params.assign(crypt_params, crypt_params + strlen(crypt_params));
+  // Dead stores as far as the compiler can tell, so it could drop a memset
+  android::vold::memset_s(crypt_params, 0, sizeof(crypt_params));
+  android::vold::memset_s(master_key_ascii, 0, sizeof(master_key_ascii));
 }
 
-static int get_dm_crypt_version(int fd, const char *name,  int *version)
-{
-    char buffer[DM_CRYPT_BUF_SIZE];
-    struct dm_ioctl *io;
-    struct dm_target_versions *v;
-
-    io = (struct dm_ioctl *) buffer;
-
-    ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-
-    if (ioctl(fd, DM_LIST_VERSIONS, io)) {
-        return -1;
-    }
-
-    /* Iterate over the returned versions, looking for name of "crypt".
-     * When found, get and return the version.
-     */
-    v = (struct dm_target_versions *) &buffer[sizeof(struct dm_ioctl)];
-    while (v->next) {
-#ifdef CONFIG_HW_DISK_ENCRYPTION
-	if (! strcmp(v->name, "crypt") || ! strcmp(v->name, "req-crypt")) {
-#else
-        if (! strcmp(v->name, "crypt")) {
-#endif
-            /* We found the crypt driver, return the version, and get out */
-            version[0] = v->version[0];
-            version[1] = v->version[1];
-            version[2] = v->version[2];
-            return 0;
-        }
-        v = (struct dm_target_versions *)(((char *)v) + v->next);
-    }
+static int delete_crypto_blk_dev(const char *name);
 
-    return -1;
+/* The sector size the volume was encrypted with, not today's default */
+static uint32_t get_crypt_sector_size(const struct crypt_mnt_ftr *crypt_ftr) {
+  return crypt_ftr->sector_size ? crypt_ftr->sector_size : CRYPT_SECTOR_SIZE;
 }
 
 static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr,
         const unsigned char *master_key, const char *real_blk_name,
         char *crypto_blk_name, const char *name) {
-  char buffer[DM_CRYPT_BUF_SIZE];
-  struct dm_ioctl *io;
-  unsigned int minor;
-  int fd=0;
-  int err;
-  int retval = -1;
-  int version[3];
+  android::vold::DeviceMapper dm;
+  std::vector<android::vold::DeviceMapper::Target> table(1);
+  std::string crypto_blk_path;
+  std::string crypt_args;
   const char *extra_params;
-  int load_count;
 #ifdef CONFIG_HW_DISK_ENCRYPTION
   char encrypted_state[PROPERTY_VALUE_MAX] = {0};
   char progress[PROPERTY_VALUE_MAX] = {0};
 #endif
 
-  if ((fd = open("/dev/device-mapper", O_RDWR|O_CLOEXEC)) < 0 ) {
-    SLOGE("Cannot open device-mapper\n");
-    goto errout;
-  }
-
-  io = (struct dm_ioctl *) buffer;
-
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  err = ioctl(fd, DM_DEV_CREATE, io);
-  if (err) {
-    SLOGE("Cannot create dm-crypt device %s: %s\n", name, strerror(errno));
-    goto errout;
-  }
-
-  /* Get the device status, in particular, the name of it's device file */
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  if (ioctl(fd, DM_DEV_STATUS, io)) {
-    SLOGE("Cannot retrieve dm-crypt device status\n");
-    goto errout;
-  }
-  minor = (io->dev & 0xff) | ((io->dev >> 12) & 0xfff00);
-  snprintf(crypto_blk_name, MAXPATHLEN, "/dev/block/dm-%u", minor);
-
 #ifdef CONFIG_HW_DISK_ENCRYPTION
   if(is_hw_disk_encryption((char*)crypt_ftr->crypto_type_name)) {
     /* Set fde_enabled if either FDE completed or in-progress */
@@ -1121,82 +1066,51 @@ static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr,
     } else
       extra_params = "fde_disabled";
   } else {
-    extra_params = "";
-    if (! get_dm_crypt_version(fd, name, version)) {
-      /* Support for allow_discards was added in version 1.11.0 */
-      if ((version[0] >= 2) ||
-          ((version[0] == 1) && (version[1] >= 11))) {
-          extra_params = "1 allow_discards";
-          SLOGI("Enabling support for allow_discards in dmcrypt.\n");
-      }
+    /* Discards plus any tuning the kernel supports */
+    if (dm.getCryptOptionalArgs(get_crypt_sector_size(crypt_ftr), &crypt_args)
+            != android::OK) {
+      SLOGE("Cannot map dm-crypt device %s\n", name);
+      return -1;
     }
+    extra_params = crypt_args.c_str();
   }
 #else
-  extra_params = "";
-  if (! get_dm_crypt_version(fd, name, version)) {
-      /* Support for allow_discards was added in version 1.11.0 */
-      if ((version[0] >= 2) ||
-          ((version[0] == 1) && (version[1] >= 11))) {
-          extra_params = "1 allow_discards";
-          SLOGI("Enabling support for allow_discards in dmcrypt.\n");
-      }
+  /* Discards plus any tuning the kernel supports */
+  if (dm.getCryptOptionalArgs(get_crypt_sector_size(crypt_ftr), &crypt_args)
+          != android::OK) {
+    SLOGE("Cannot map dm-crypt device %s\n", name);
+    return -1;
   }
+  extra_params = crypt_args.c_str();
 #endif
 
-  load_count = load_crypto_mapping_table(crypt_ftr, master_key, real_blk_name, name,
-                                         fd, extra_params);
-  if (load_count < 0) {
-      SLOGE("Cannot load dm-crypt mapping table.\n");
-      goto errout;
-  } else if (load_count > 1) {
-      SLOGI("Took %d tries to load dmcrypt table.\n", load_count);
-  }
-
-  /* Resume this device to activate it */
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
+  build_crypto_mapping_table(crypt_ftr, master_key, real_blk_name, extra_params, &table[0]);
 
-  if (ioctl(fd, DM_DEV_SUSPEND, io)) {
-    SLOGE("Cannot resume the dm-crypt device\n");
-    goto errout;
+  /* Creates, loads and resumes the device in one go */
+  if (dm.createDevice(name, table, &crypto_blk_path) != android::OK) {
+    SLOGE("Cannot create dm-crypt device %s\n", name);
+    return -1;
   }
+  strlcpy(crypto_blk_name, crypto_blk_path.c_str(), MAXPATHLEN);
 
-  /* We made it here with no errors.  Woot! */
-  retval = 0;
-
-errout:
-  close(fd);   /* If fd is <0 from a failed open call, it's safe to just ignore the close error */
-
-  return retval;
+  /* Callers mount it right away, so wait for ueventd to create the node */
+  if (!android::vold::WaitForFile(crypto_blk_path, std::chrono::seconds(DM_NODE_TIMEOUT_SEC))) {
+    SLOGE("Timed out waiting for %s\n", crypto_blk_name);
+    delete_crypto_blk_dev(name);
+    return -1;
+  }
+  return 0;
 }
 
 static int delete_crypto_blk_dev(const char *name)
 {
-  int fd;
-  char buffer[DM_CRYPT_BUF_SIZE];
-  struct dm_ioctl *io;
-  int retval = -1;
-
-  if ((fd = open("/dev/device-mapper", O_RDWR|O_CLOEXEC)) < 0 ) {
-    SLOGE("Cannot open device-mapper\n");
-    goto errout;
-  }
-
-  io = (struct dm_ioctl *) buffer;
+  android::vold::DeviceMapper dm;
 
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  if (ioctl(fd, DM_DEV_REMOVE, io)) {
+  if (dm.deleteDevice(name) != android::OK) {
     SLOGE("Cannot remove dm-crypt device\n");
-    goto errout;
+    return -1;
   }
-
-  /* We made it here with no errors.  Woot! */
-  retval = 0;
-
-errout:
-  close(fd);    /* If fd is <0 from a failed open call, it's safe to just ignore the close error */
-
-  return retval;
-
+  return 0;
 }
 
 static int pbkdf2(const char *passwd, const unsigned char *salt,
@@ -1210,6 +1124,41 @@ static int pbkdf2(const char *passwd, const unsigned char *salt,
                                   ikey) != 1;
 }
 
+/*
+ * Cache of scrypt-derived keys, so that checking and then verifying the
+ * same password only pays for the derivation once. The keymaster variant
+ * also depends on the key blob, so that's part of the lookup.
+ */
+static android::vold::KdfCacheKey kdf_cache_key(const char* kdf, const char *passwd,
+                                                const unsigned char *salt,
+                                                const struct crypt_mnt_ftr *ftr)
+{
+    char params[32];
+    snprintf(params, sizeof(params), "%d %d %d", ftr->N_factor, ftr->r_factor, ftr->p_factor);
+    android::vold::KdfCacheKey key(kdf, params);
+    key.add(passwd, strlen(passwd)).add(salt, SALT_LEN);
+    if (!strcmp(kdf, "scrypt_keymaster")) {
+        key.add(ftr->keymaster_blob, std::min<size_t>(ftr->keymaster_blob_size,
+                                                     KEYMASTER_BLOB_SIZE));
+    }
+    return key;
+}
+
+static bool kdf_cache_lookup(const android::vold::KdfCacheKey& key, unsigned char *ikey)
+{
+    android::vold::KeyBuffer cached;
+    if (!key.lookup(&cached) || cached.size() != KEY_LEN_BYTES + IV_LEN_BYTES) {
+        return false;
+    }
+    memcpy(ikey, cached.data(), cached.size());
+    return true;
+}
+
+static void kdf_cache_store(const android::vold::KdfCacheKey& key, const unsigned char *ikey)
+{
+    key.store(android::vold::KeyBuffer(ikey, ikey + KEY_LEN_BYTES + IV_LEN_BYTES));
+}
+
 static int scrypt(const char *passwd, const unsigned char *salt,
                   unsigned char *ikey, void *params)
 {
@@ -1221,13 +1170,21 @@ static int scrypt(const char *passwd, const unsigned char *salt,
     int r = 1 << ftr->r_factor;
     int p = 1 << ftr->p_factor;
 
+    android::vold::KdfCacheKey cache_key = kdf_cache_key("scrypt", passwd, salt, ftr);
+    if (kdf_cache_lookup(cache_key, ikey)) {
+        return 0;
+    }
+
     /* Turn the password into a key and IV that can decrypt the master key */
-    unsigned int keysize;
-    crypto_scrypt((const uint8_t*)passwd, strlen(passwd),
-                  salt, SALT_LEN, N, r, p, ikey,
-                  KEY_LEN_BYTES + IV_LEN_BYTES);
+    if (crypto_scrypt((const uint8_t*)passwd, strlen(passwd),
+                      salt, SALT_LEN, N, r, p, ikey,
+                      KEY_LEN_BYTES + IV_LEN_BYTES)) {
+        SLOGE("scrypt failed");
+        return -1;
+    }
 
-   return 0;
+    kdf_cache_store(cache_key, ikey);
+    return 0;
 }
 
 static int scrypt_keymaster(const char *passwd, const unsigned char *salt,
@@ -1244,6 +1201,11 @@ static int scrypt_keymaster(const char *passwd, const unsigned char *salt,
     int r = 1 << ftr->r_factor;
     int p = 1 << ftr->p_factor;
 
+    android::vold::KdfCacheKey cache_key = kdf_cache_key("scrypt_keymaster", passwd, salt, ftr);
+    if (kdf_cache_lookup(cache_key, ikey)) {
+        return 0;
+    }
+
     rc = crypto_scrypt((const uint8_t*)passwd, strlen(passwd),
                        salt, SALT_LEN, N, r, p, ikey,
                        KEY_LEN_BYTES + IV_LEN_BYTES);
@@ -1268,6 +1230,7 @@ static int scrypt_keymaster(const char *passwd, const unsigned char *salt,
         return -1;
     }
 
+    kdf_cache_store(cache_key, ikey);
     return 0;
 }
 
@@ -1988,6 +1951,7 @@ int cryptfs_setup_ext_volume(const char* label, const char* real_blkdev,
         return -1;
     }
 
+    /* No footer records a sector size for these, so they always use 512 */
     struct crypt_mnt_ftr ext_crypt_ftr;
     memset(&ext_crypt_ftr, 0, sizeof(ext_crypt_ftr));
     ext_crypt_ftr.fs_size = nr_sec;
@@ -2234,6 +2198,7 @@ static int cryptfs_init_crypt_mnt_ftr(struct crypt_mnt_ftr *ftr)
     ftr->minor_version = CURRENT_MINOR_VERSION;
     ftr->ftr_size = sizeof(struct crypt_mnt_ftr);
     ftr->keysize = KEY_LEN_BYTES;
+    ftr->sector_size = android::vold::DeviceMapper().getNewCryptSectorSize();
 
     switch (keymaster_check_compatibility()) {
     case 1:
@@ -2390,7 +2355,11 @@ static int cryptfs_enable_all_volumes(struct crypt_mnt_ftr *crypt_ftr, int how,
         return 0;
     }
 
-    /* The size of the userdata partition, and add in the vold volumes below */
+    /*
+     * Only userdata is converted here; the footer has a single watermark
+     * and there are no other volumes to add in. Parallelism happens within
+     * the device instead, see encrypt_groups().
+     */
     tot_encryption_size = crypt_ftr->fs_size;
 
     if (how == CRYPTO_ENABLE_WIPE) {
@@ -2577,6 +2546,11 @@ int cryptfs_enable_internal(char *howarg, int crypt_type, const char *passwd,
         } else {
             crypt_ftr.fs_size = nr_sec;
         }
+        if (crypt_ftr.fs_size % (crypt_ftr.sector_size / CRYPT_SECTOR_SIZE)) {
+            SLOGW("Volume isn't a whole number of %u byte sectors, using %d",
+                  crypt_ftr.sector_size, CRYPT_SECTOR_SIZE);
+            crypt_ftr.sector_size = CRYPT_SECTOR_SIZE;
+        }
         /* At this point, we are in an inconsistent state. Until we successfully
            complete encryption, a reboot will leave us broken. So mark the
            encryption failed in case that happens.
@@ -2619,7 +2593,7 @@ int cryptfs_enable_internal(char *howarg, int crypt_type, const char *passwd,
             pdata = (crypt_persist_data *)malloc(CRYPT_PERSIST_DATA_SIZE);
            if (pdata) {
                init_empty_persist_data(pdata, CRYPT_PERSIST_DATA_SIZE);
-               persist_data = pdata;
+               set_persist_data(pdata);
            }
         }
         if (persist_data) {
@@ -2982,19 +2956,23 @@ static unsigned int persist_get_max_entries(int encrypted) {
     return max_persistent_entries;
 }
 
+static int persist_find_key(const char *fieldname)
+{
+    auto it = persist_index.find(std::string(fieldname, strnlen(fieldname, PROPERTY_KEY_MAX)));
+    return it == persist_index.end() ? -1 : (int) it->second;
+}
+
 static int persist_get_key(const char *fieldname, char *value)
 {
-    unsigned int i;
+    int i;
 
     if (persist_data == NULL) {
         return -1;
     }
-    for (i = 0; i < persist_data->persist_valid_entries; i++) {
-        if (!strncmp(persist_data->persist_entry[i].key, fieldname, PROPERTY_KEY_MAX)) {
-            /* We found it! */
-            strlcpy(value, persist_data->persist_entry[i].val, PROPERTY_VALUE_MAX);
-            return 0;
-        }
+    if ((i = persist_find_key(fieldname)) >= 0) {
+        /* We found it! */
+        strlcpy(value, persist_data->persist_entry[i].val, PROPERTY_VALUE_MAX);
+        return 0;
     }
 
     return -1;
@@ -3002,7 +2980,7 @@ static int persist_get_key(const char *fieldname, char *value)
 
 static int persist_set_key(const char *fieldname, const char *value, int encrypted)
 {
-    unsigned int i;
+    int i;
     unsigned int num;
     unsigned int max_persistent_entries;
 
@@ -3014,13 +2992,11 @@ static int persist_set_key(const char *fieldname, const char *value, int encrypt
 
     num = persist_data->persist_valid_entries;
 
-    for (i = 0; i < num; i++) {
-        if (!strncmp(persist_data->persist_entry[i].key, fieldname, PROPERTY_KEY_MAX)) {
-            /* We found an existing entry, update it! */
-            memset(persist_data->persist_entry[i].val, 0, PROPERTY_VALUE_MAX);
-            strlcpy(persist_data->persist_entry[i].val, value, PROPERTY_VALUE_MAX);
-            return 0;
-        }
+    if ((i = persist_find_key(fieldname)) >= 0) {
+        /* We found an existing entry, update it! */
+        memset(persist_data->persist_entry[i].val, 0, PROPERTY_VALUE_MAX);
+        strlcpy(persist_data->persist_entry[i].val, value, PROPERTY_VALUE_MAX);
+        return 0;
     }
 
     /* We didn't find it, add it to the end, if there is room */
@@ -3029,6 +3005,8 @@ static int persist_set_key(const char *fieldname, const char *value, int encrypt
         strlcpy(persist_data->persist_entry[num].key, fieldname, PROPERTY_KEY_MAX);
         strlcpy(persist_data->persist_entry[num].val, value, PROPERTY_VALUE_MAX);
         persist_data->persist_valid_entries++;
+        const char* key = persist_data->persist_entry[num].key;
+        persist_index.emplace(std::string(key, strnlen(key, PROPERTY_KEY_MAX)), num);
         return 0;
     }
 
@@ -3098,6 +3076,8 @@ static int persist_del_keys(const char *fieldname, unsigned index)
         persist_data->persist_valid_entries = j;
         // Zeroise the remaining entries
         memset(&persist_data->persist_entry[j], 0, (num - j) * sizeof(struct crypt_persist_entry));
+        // Later entries moved down
+        rebuild_persist_index();
         return PERSIST_DEL_KEY_OK;
     } else {
         // Did not find an entry matching the given fieldname
@@ -3190,36 +3170,14 @@ out:
     return rc;
 }
 
-/* Set the value of the specified field. */
-int cryptfs_setfield(const char *fieldname, const char *value)
+/* Updates one field in memory; the caller saves persist_data. */
+static int persist_set_field(const char *fieldname, const char *value, int encrypted)
 {
-    if (e4crypt_is_native()) {
-        SLOGE("Cannot set field when file encrypted");
-        return -1;
-    }
-
-    char encrypted_state[PROPERTY_VALUE_MAX];
-    /* 0 is success, negative values are error */
-    int rc = CRYPTO_SETFIELD_ERROR_OTHER;
-    int encrypted = 0;
     unsigned int field_id;
     char temp_field[PROPERTY_KEY_MAX];
     unsigned int num_entries;
     unsigned int max_keylen;
 
-    if (persist_data == NULL) {
-        load_persistent_data();
-        if (persist_data == NULL) {
-            SLOGE("Setfield error, cannot load persistent data");
-            goto out;
-        }
-    }
-
-    property_get("ro.crypto.state", encrypted_state, "");
-    if (!strcmp(encrypted_state, "encrypted") ) {
-        encrypted = 1;
-    }
-
     // Compute the number of entries required to store value, each entry can store up to
     // (PROPERTY_VALUE_MAX - 1) chars
     if (strlen(value) == 0) {
@@ -3235,15 +3193,13 @@ int cryptfs_setfield(const char *fieldname, const char *value)
         max_keylen += 1 + log10(num_entries);
     }
     if (max_keylen > PROPERTY_KEY_MAX - 1) {
-        rc = CRYPTO_SETFIELD_ERROR_FIELD_TOO_LONG;
-        goto out;
+        return CRYPTO_SETFIELD_ERROR_FIELD_TOO_LONG;
     }
 
     // Make sure we have enough space to write the new value
     if (persist_data->persist_valid_entries + num_entries - persist_count_keys(fieldname) >
         persist_get_max_entries(encrypted)) {
-        rc = CRYPTO_SETFIELD_ERROR_VALUE_TOO_LONG;
-        goto out;
+        return CRYPTO_SETFIELD_ERROR_VALUE_TOO_LONG;
     }
 
     // Now that we know persist_data has enough space for value, let's delete the old field first
@@ -3253,7 +3209,7 @@ int cryptfs_setfield(const char *fieldname, const char *value)
     if (persist_set_key(fieldname, value, encrypted)) {
         // fail to set key, should not happen as we have already checked the available space
         SLOGE("persist_set_key() error during setfield()");
-        goto out;
+        return CRYPTO_SETFIELD_ERROR_OTHER;
     }
 
     for (field_id = 1; field_id < num_entries; field_id++) {
@@ -3262,7 +3218,65 @@ int cryptfs_setfield(const char *fieldname, const char *value)
         if (persist_set_key(temp_field, value + field_id * (PROPERTY_VALUE_MAX - 1), encrypted)) {
             // fail to set key, should not happen as we have already checked the available space.
             SLOGE("persist_set_key() error during setfield()");
-            goto out;
+            return CRYPTO_SETFIELD_ERROR_OTHER;
+        }
+    }
+
+    return CRYPTO_SETFIELD_OK;
+}
+
+/* Set the value of the specified field. */
+int cryptfs_setfield(const char *fieldname, const char *value)
+{
+    return cryptfs_setfields(&fieldname, &value, 1);
+}
+
+/*
+ * Set several fields at once, saving the persistent data only once. Stops
+ * at the first field that can't be set, in which case none of them are.
+ */
+int cryptfs_setfields(const char* const* fieldnames, const char* const* values, int count)
+{
+    if (e4crypt_is_native()) {
+        SLOGE("Cannot set field when file encrypted");
+        return -1;
+    }
+
+    char encrypted_state[PROPERTY_VALUE_MAX];
+    /* 0 is success, negative values are error */
+    int rc;
+    int encrypted = 0;
+    int i;
+
+    if (persist_data == NULL) {
+        load_persistent_data();
+        if (persist_data == NULL) {
+            SLOGE("Setfield error, cannot load persistent data");
+            return CRYPTO_SETFIELD_ERROR_OTHER;
+        }
+    }
+
+    property_get("ro.crypto.state", encrypted_state, "");
+    if (!strcmp(encrypted_state, "encrypted") ) {
+        encrypted = 1;
+    }
+
+    /* Everything the batch can touch, to put back if a field fails */
+    unsigned int max_entries = persist_get_max_entries(encrypted);
+    if (max_entries == (unsigned int) -1) {
+        SLOGE("Setfield error, cannot read persistent data size");
+        return CRYPTO_SETFIELD_ERROR_OTHER;
+    }
+    size_t snapshot_size = sizeof(struct crypt_persist_data)
+            + max_entries * sizeof(struct crypt_persist_entry);
+    std::vector<char> snapshot((char*) persist_data, (char*) persist_data + snapshot_size);
+
+    for (i = 0; i < count; i++) {
+        rc = persist_set_field(fieldnames[i], values[i], encrypted);
+        if (rc != CRYPTO_SETFIELD_OK) {
+            memcpy(persist_data, snapshot.data(), snapshot_size);
+            rebuild_persist_index();
+            return rc;
         }
     }
 
@@ -3270,14 +3284,11 @@ int cryptfs_setfield(const char *fieldname, const char *value)
     if (encrypted) {
         if (save_persistent_data()) {
             SLOGE("Setfield error, cannot save persistent data");
-            goto out;
+            return CRYPTO_SETFIELD_ERROR_OTHER;
         }
     }
 
-    rc = CRYPTO_SETFIELD_OK;
-
-out:
-    return rc;
+    return CRYPTO_SETFIELD_OK;
 }
 
 /* Checks userdata. Attempt to mount the volume if default-
@@ -3359,6 +3370,7 @@ void cryptfs_clear_password()
         password = 0;
         password_expiry_time = 0;
     }
+    android::vold::ClearKdfCache();
 }
 
 int cryptfs_isConvertibleToFBE()
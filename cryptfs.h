@@ -115,7 +115,8 @@ struct crypt_mnt_ftr {
   unsigned char crypto_type_name[MAX_CRYPTO_TYPE_NAME_LEN]; /* The type of encryption
                                                                needed to decrypt this
                                                                partition, null terminated */
-  __le32 spare2;        /* ignored */
+  __le32 sector_size;   /* dm-crypt sector size the data was encrypted with, set
+                         * when the footer is created; 0 (older footers) is 512 */
   unsigned char master_key[MAX_KEY_LEN]; /* The encrypted key for decrypting the filesystem */
   unsigned char salt[SALT_LEN];   /* The salt used for this encryption */
   __le64 persist_data_offset[2];  /* Absolute offset to both copies of crypt_persist_data
@@ -215,7 +216,7 @@ struct crypt_persist_data {
 #define CRYPTO_GETFIELD_ERROR_OTHER         (-2)
 #define CRYPTO_GETFIELD_ERROR_BUF_TOO_SMALL (-3)
 
-/* Return values for cryptfs_setfield */
+/* Return values for cryptfs_setfield and cryptfs_setfields */
 #define CRYPTO_SETFIELD_OK                    0
 #define CRYPTO_SETFIELD_ERROR_OTHER          (-1)
 #define CRYPTO_SETFIELD_ERROR_FIELD_TOO_LONG (-2)
@@ -247,6 +248,7 @@ extern "C" {
   int cryptfs_revert_ext_volume(const char* label);
   int cryptfs_getfield(const char *fieldname, char *value, int len);
   int cryptfs_setfield(const char *fieldname, const char *value);
+  int cryptfs_setfields(const char* const* fieldnames, const char* const* values, int count);
   int cryptfs_mount_default_encrypted(void);
   int cryptfs_get_password_type(void);
   const char* cryptfs_get_password(void);
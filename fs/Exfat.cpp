@@ -15,6 +15,7 @@
  */
 
 #include "Exfat.h"
+#include "Timings.h"
 #include "Utils.h"
 
 #define LOG_TAG "Vold"
@@ -46,12 +47,24 @@ bool IsSupported() {
             && IsFilesystemSupported("exfat");
 }
 
-status_t Check(const std::string& source) {
+status_t Check(const std::string& source, CheckControl* control) {
+    Timing timing("fsck exfat");
     std::vector<std::string> cmd;
     cmd.push_back(kFsckPath);
     cmd.push_back(source);
 
-    // Exfat devices are currently always untrusted
+    // Exfat devices are currently always untrusted. exfatfsck only reports
+    // problems, so it's also safe to run against a read-only mount.
+    if (control) {
+        status_t res = ForkExecvpCancellable(cmd, sFsckUntrustedContext, control->cancel,
+                nullptr);
+        if (res == -ECANCELED) {
+            SLOGI("Filesystem check cancelled");
+            errno = ECANCELED;
+            return -1;
+        }
+        return res;
+    }
     return ForkExecvp(cmd, sFsckUntrustedContext);
 }
 
@@ -85,9 +98,13 @@ status_t Mount(const std::string& source, const std::string& target, bool ro,
     return rc;
 }
 
-status_t Format(const std::string& source) {
+status_t Format(const std::string& source, unsigned int clusterBytes) {
     std::vector<std::string> cmd;
     cmd.push_back(kMkfsPath);
+    if (clusterBytes) {
+        cmd.push_back("-s");
+        cmd.push_back(StringPrintf("%u", clusterBytes / 512));
+    }
     cmd.push_back(source);
 
     return ForkExecvp(cmd);
@@ -23,14 +23,18 @@
 
 namespace android {
 namespace vold {
+
+struct CheckControl;
+
 namespace exfat {
 
 bool IsSupported();
 
-status_t Check(const std::string& source);
+status_t Check(const std::string& source, CheckControl* control = nullptr);
 status_t Mount(const std::string& source, const std::string& target, bool ro,
         bool remount, bool executable, int ownerUid, int ownerGid, int permMask);
-status_t Format(const std::string& source);
+/* |clusterBytes| of 0 leaves the cluster size to mkfs.exfat */
+status_t Format(const std::string& source, unsigned int clusterBytes = 0);
 
 }  // namespace exfat
 }  // namespace vold
@@ -32,6 +32,7 @@
 #include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #include <linux/kdev_t.h>
 
@@ -40,6 +41,7 @@
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
 #include <cutils/log.h>
 #include <cutils/properties.h>
 #include <logwrap/logwrap.h>
@@ -47,6 +49,7 @@
 
 #include "Ext4.h"
 #include "Ext4Crypt.h"
+#include "Timings.h"
 #include "Utils.h"
 #include "VoldUtil.h"
 
@@ -60,6 +63,70 @@ static const char* kResizefsPath = "/system/bin/resize2fs";
 static const char* kMkfsPath = "/system/bin/mke2fs";
 static const char* kFsckPath = "/system/bin/e2fsck";
 
+// Where the primary superblock lives, and the fields of it we look at
+static const off64_t kSuperblockOffset = 1024;
+static const size_t kSuperblockSize = 1024;
+static const uint16_t kSuperMagic = 0xEF53;
+static const uint16_t kStateValid = 0x0001;
+static const uint16_t kStateError = 0x0002;
+static const uint32_t kIncompatRecover = 0x0004;
+
+static uint16_t le16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+/*
+ * Reads the superblock of |source| to tell whether the kernel has a
+ * journal or orphans to replay, and whether e2fsck would do more than
+ * confirm the filesystem is clean. Returns false when the superblock
+ * can't be trusted, in which case both are needed.
+ */
+static bool readCheckNeeds(const std::string& source, bool* replay, bool* fsck,
+        std::string* reason) {
+    *replay = true;
+    *fsck = true;
+    *reason = "superblock unreadable";
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(source.c_str(), O_RDONLY | O_CLOEXEC)));
+    uint8_t sb[kSuperblockSize];
+    if (fd == -1 || TEMP_FAILURE_RETRY(pread64(fd, sb, sizeof(sb), kSuperblockOffset))
+            != static_cast<ssize_t>(sizeof(sb))) {
+        PLOG(WARNING) << "Failed to read superblock of " << source;
+        return false;
+    }
+    if (le16(sb + 0x38) != kSuperMagic) {
+        LOG(WARNING) << "Bad superblock magic on " << source;
+        return false;
+    }
+
+    uint16_t state = le16(sb + 0x3A);
+    uint16_t mountCount = le16(sb + 0x34);
+    int16_t maxMountCount = static_cast<int16_t>(le16(sb + 0x36));
+    uint32_t lastCheck = le32(sb + 0x40);
+    uint32_t checkInterval = le32(sb + 0x44);
+    uint32_t incompat = le32(sb + 0x60);
+    uint32_t lastOrphan = le32(sb + 0xE8);
+    uint32_t errorCount = le32(sb + 0x194);
+
+    *replay = (incompat & kIncompatRecover) || lastOrphan != 0;
+    if (!(state & kStateValid)) {
+        *reason = "not cleanly unmounted";
+    } else if ((state & kStateError) || errorCount != 0) {
+        *reason = StringPrintf("%u errors recorded", errorCount);
+    } else if (maxMountCount > 0 && mountCount >= maxMountCount) {
+        *reason = StringPrintf("mounted %u times", mountCount);
+    } else if (checkInterval != 0 && time(nullptr) >= static_cast<time_t>(lastCheck) + checkInterval) {
+        *reason = "check interval elapsed";
+    } else {
+        *fsck = false;
+        *reason = *replay ? "journal or orphans to replay" : "clean";
+    }
+    return true;
+}
+
 bool IsSupported() {
     return access(kMkfsPath, X_OK) == 0
             && access(kFsckPath, X_OK) == 0
@@ -67,6 +134,7 @@ bool IsSupported() {
 }
 
 status_t Check(const std::string& source, const std::string& target, bool trusted) {
+    Timing timing("fsck ext4");
     // The following is shamelessly borrowed from fs_mgr.c, so it should be
     // kept in sync with any changes over there.
 
@@ -78,6 +146,21 @@ status_t Check(const std::string& source, const std::string& target, bool truste
     long tmpmnt_flags = MS_NOATIME | MS_NOEXEC | MS_NOSUID;
     char *tmpmnt_opts = (char*) "nomblk_io_submit,errors=remount-ro";
 
+    // A clean superblock means both steps below would be no-ops. Anyone
+    // can write one onto removable media, so only trust our own volumes'.
+    bool replay = true;
+    bool fsck = true;
+    std::string reason(trusted ? "superblock check disabled" : "untrusted");
+    if (trusted && android::base::GetBoolProperty("vold.ext4_superblock_check", true)) {
+        readCheckNeeds(source, &replay, &fsck, &reason);
+    }
+    LOG(INFO) << "Checking " << source << " (" << reason << "):"
+            << (replay ? " replay" : "") << (fsck ? " e2fsck" : "")
+            << (replay || fsck ? "" : " nothing to do");
+    if (!replay && !fsck) {
+        return 0;
+    }
+
     /*
      * First try to mount and unmount the filesystem.  We do this because
      * the kernel is more efficient than e2fsck in running the journal and
@@ -91,7 +174,7 @@ status_t Check(const std::string& source, const std::string& target, bool truste
      * filesytsem due to an error, e2fsck is still run to do a full check
      * fix the filesystem.
      */
-    ret = mount(c_source, c_target, "ext4", tmpmnt_flags, tmpmnt_opts);
+    ret = replay ? mount(c_source, c_target, "ext4", tmpmnt_flags, tmpmnt_opts) : -1;
     if (!ret) {
         int i;
         for (i = 0; i < 5; i++) {
@@ -104,6 +187,18 @@ status_t Check(const std::string& source, const std::string& target, bool truste
             ALOGW("%s(): umount(%s)=%d: %s\n", __func__, c_target, result, strerror(errno));
             sleep(1);
         }
+
+        // The kernel records anything it trips over while replaying
+        bool replayAgain;
+        if (!fsck && readCheckNeeds(source, &replayAgain, &fsck, &reason) && fsck) {
+            LOG(INFO) << "Checking " << source << " after replay (" << reason << "): e2fsck";
+        }
+    } else if (replay) {
+        // Mount failed, so leave it all to a full e2fsck
+        fsck = true;
+    }
+    if (!fsck) {
+        return 0;
     }
 
     /*
@@ -182,7 +277,7 @@ status_t Resize(const std::string& source, unsigned long numSectors) {
 }
 
 status_t Format(const std::string& source, unsigned long numSectors,
-        const std::string& target) {
+        const std::string& target, int flags, unsigned int stripeBlocks) {
     std::vector<std::string> cmd;
     cmd.push_back(kMkfsPath);
 
@@ -206,6 +301,24 @@ status_t Format(const std::string& source, unsigned long numSectors,
     cmd.push_back("-O");
     cmd.push_back(options);
 
+    std::string extended;
+    if (flags & kLazyInodeTables) {
+        extended += ",lazy_itable_init=1";
+    }
+    if (flags & kLazyJournal) {
+        extended += ",lazy_journal_init=1";
+    }
+    if (flags & kNoDiscard) {
+        extended += ",nodiscard";
+    }
+    if (stripeBlocks > 1) {
+        extended += StringPrintf(",stride=%u,stripe_width=%u", stripeBlocks, stripeBlocks);
+    }
+    if (!extended.empty()) {
+        cmd.push_back("-E");
+        cmd.push_back(extended.substr(1));
+    }
+
     cmd.push_back(source);
 
     if (numSectors) {
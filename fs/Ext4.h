@@ -32,8 +32,18 @@ status_t Check(const std::string& source, const std::string& target,
 status_t Mount(const std::string& source, const std::string& target, bool ro,
         bool remount, bool executable, const std::string& opts = "",
         bool trusted = false, bool portable = false);
+enum FormatFlags {
+    /* Leave inode tables for the kernel to zero after mounting */
+    kLazyInodeTables = 1 << 0,
+    /* Skip zeroing the journal; only safe when |source| reads as zeros */
+    kLazyJournal = 1 << 1,
+    /* Don't discard |source| first, so preallocated space stays allocated */
+    kNoDiscard = 1 << 2,
+};
+
+/* |stripeBlocks| lines allocation up with flash erase blocks, in 4KiB blocks */
 status_t Format(const std::string& source, unsigned long numSectors,
-        const std::string& target);
+        const std::string& target, int flags = 0, unsigned int stripeBlocks = 0);
 status_t Resize(const std::string& source, unsigned long numSectors);
 
 }  // namespace ext4
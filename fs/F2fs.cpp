@@ -15,6 +15,7 @@
  */
 
 #include "F2fs.h"
+#include "Timings.h"
 #include "Utils.h"
 
 #include <android-base/logging.h>
@@ -40,7 +41,39 @@ bool IsSupported() {
             && IsFilesystemSupported("f2fs");
 }
 
+const char* ProfileName(Profile profile) {
+    switch (profile) {
+    case Profile::kSdCard: return "sdcard";
+    case Profile::kFast: return "fast";
+    default: return "default";
+    }
+}
+
+bool ParseProfile(const std::string& name, Profile* profile) {
+    for (Profile p : { Profile::kDefault, Profile::kSdCard, Profile::kFast }) {
+        if (name == ProfileName(p)) {
+            *profile = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string ProfileOptions(Profile profile) {
+    switch (profile) {
+    case Profile::kSdCard:
+        return "background_gc=on,nodiscard,inline_xattr,inline_data,active_logs=2,"
+                "alloc_mode=reuse";
+    case Profile::kFast:
+        return "background_gc=on,discard,inline_xattr,inline_data,active_logs=6,"
+                "alloc_mode=default";
+    default:
+        return "";
+    }
+}
+
 status_t Check(const std::string& source, bool trusted) {
+    Timing timing("fsck f2fs");
     std::vector<std::string> cmd;
     cmd.push_back(kFsckPath);
     cmd.push_back("-a");
@@ -90,9 +123,13 @@ status_t Mount(const std::string& source, const std::string& target,
     return res;
 }
 
-status_t Format(const std::string& source) {
+status_t Format(const std::string& source, unsigned int segmentsPerSection) {
     std::vector<std::string> cmd;
     cmd.push_back(kMkfsPath);
+    if (segmentsPerSection > 1) {
+        cmd.push_back("-s");
+        cmd.push_back(StringPrintf("%u", segmentsPerSection));
+    }
     cmd.push_back(source);
 
     return ForkExecvp(cmd);
@@ -27,11 +27,28 @@ namespace f2fs {
 
 bool IsSupported();
 
+/*
+ * Mount options tuned for a class of device. Cards with slow random
+ * writes and few open erase blocks get fewer logs, segment reuse and no
+ * online discard, leaving that to idle maintenance trims; fast flash
+ * keeps six logs and discards as it goes.
+ */
+enum class Profile {
+    kDefault,
+    kSdCard,
+    kFast,
+};
+
+const char* ProfileName(Profile profile);
+bool ParseProfile(const std::string& name, Profile* profile);
+std::string ProfileOptions(Profile profile);
+
 status_t Check(const std::string& source, bool trusted);
 status_t Mount(const std::string& source, const std::string& target,
         const std::string& opts = "", bool trusted = false,
         bool portable = false);
-status_t Format(const std::string& source);
+/* |segmentsPerSection| of 2MiB segments, so sections match erase blocks */
+status_t Format(const std::string& source, unsigned int segmentsPerSection = 0);
 
 }  // namespace f2fs
 }  // namespace vold
@@ -15,6 +15,7 @@
  */
 
 #include "Ntfs.h"
+#include "Timings.h"
 #include "Utils.h"
 
 #include <android-base/logging.h>
@@ -43,6 +44,7 @@ bool IsSupported() {
 }
 
 status_t Check(const std::string& source) {
+    Timing timing("fsck ntfs");
     std::vector<std::string> cmd;
     cmd.push_back(kFsckPath);
     cmd.push_back("-n");
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Sdcardfs.h"
+#include "Utils.h"
+
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <cutils/fs.h>
+#include <private/android_filesystem_config.h>
+
+#include <sys/mount.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+namespace sdcardfs {
+
+bool IsSupported() {
+    if (!android::base::GetBoolProperty("vold.sdcardfs_in_process", false)) return false;
+    // Same choice the sdcard daemon makes, so both paths agree
+    std::string force = android::base::GetProperty("persist.sys.sdcardfs", "");
+    if (force == "force_off") return false;
+    if (force != "force_on" && !android::base::GetBoolProperty("ro.sys.sdcardfs", true)) {
+        return false;
+    }
+    return IsFilesystemSupported("sdcardfs");
+}
+
+static status_t mountView(const std::string& source, const std::string& target, uid_t uid,
+        gid_t gid, userid_t userId, bool multiUser, bool deriveGid, gid_t viewGid,
+        mode_t mask) {
+    auto opts = StringPrintf("fsuid=%d,fsgid=%d,%s%smask=%d,userid=%d,gid=%d", uid, gid,
+            multiUser ? "multiuser," : "", deriveGid ? "derive_gid," : "", mask, userId,
+            viewGid);
+    if (mount(source.c_str(), target.c_str(), "sdcardfs",
+            MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_NOATIME, opts.c_str()) != 0) {
+        PLOG(ERROR) << "Failed to mount sdcardfs at " << target;
+        return -errno;
+    }
+    return OK;
+}
+
+status_t MountViews(const std::string& source, const std::string& label, uid_t uid,
+        gid_t gid, userid_t userId, bool multiUser, bool fullWrite, bool deriveGid) {
+    std::string views[] = {
+        "/mnt/runtime/default/" + label,
+        "/mnt/runtime/read/" + label,
+        "/mnt/runtime/write/" + label,
+    };
+    // Multi-user storage masks off "other" entirely; physical storage is
+    // readable by everyone unless it's fully writable
+    mode_t readMask = (multiUser || fullWrite) ? 0027 : 0022;
+    mode_t writeMask = fullWrite ? 0007 : readMask;
+    mode_t masks[] = { 0006, readMask, writeMask };
+    gid_t gids[] = { AID_SDCARD_RW, AID_EVERYBODY, AID_EVERYBODY };
+
+    for (size_t i = 0; i < 3; i++) {
+        status_t res = mountView(source, views[i], uid, gid, userId, multiUser, deriveGid,
+                gids[i], masks[i]);
+        if (res != OK) {
+            while (i-- > 0) {
+                ForceUnmount(views[i]);
+            }
+            return res;
+        }
+    }
+
+    if (multiUser) {
+        std::string obb = source + "/obb";
+        if (fs_prepare_dir(obb.c_str(), 0775, uid, gid)) {
+            PLOG(WARNING) << "Failed to prepare " << obb;
+        }
+    }
+    return OK;
+}
+
+}  // namespace sdcardfs
+}  // namespace vold
+}  // namespace android
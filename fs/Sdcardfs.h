@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_SDCARDFS_H
+#define ANDROID_VOLD_SDCARDFS_H
+
+#include <cutils/multiuser.h>
+#include <utils/Errors.h>
+
+#include <string>
+
+#include <sys/types.h>
+
+namespace android {
+namespace vold {
+namespace sdcardfs {
+
+/*
+ * Whether vold should mount the runtime views itself rather than spawning
+ * the sdcard daemon: the kernel has sdcardfs, the device would use it
+ * anyway, and vold.sdcardfs_in_process is set.
+ */
+bool IsSupported();
+
+/*
+ * Mounts |source| at /mnt/runtime/{default,read,write}/|label| with the
+ * same options the sdcard daemon would use, unmounting any views already
+ * done if one fails.
+ */
+status_t MountViews(const std::string& source, const std::string& label, uid_t uid,
+        gid_t gid, userid_t userId, bool multiUser, bool fullWrite, bool deriveGid);
+
+}  // namespace sdcardfs
+}  // namespace vold
+}  // namespace android
+
+#endif
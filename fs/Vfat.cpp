@@ -35,6 +35,8 @@
 
 #include <linux/kdev_t.h>
 
+#include <algorithm>
+
 #define LOG_TAG "Vold"
 
 #include <android-base/logging.h>
@@ -46,6 +48,7 @@
 #include <logwrap/logwrap.h>
 
 #include "Vfat.h"
+#include "Timings.h"
 #include "Utils.h"
 #include "VoldUtil.h"
 
@@ -64,7 +67,11 @@ bool IsSupported() {
             && IsFilesystemSupported("vfat");
 }
 
-status_t Check(const std::string& source) {
+/* fsck_msdos announces each of its passes as "** Phase N - ..." */
+static const int kFsckPhases = 4;
+
+status_t Check(const std::string& source, CheckControl* control) {
+    Timing timing("fsck vfat");
     if (access(kFsckPath, X_OK)) {
         SLOGW("Skipping fs checks\n");
         return 0;
@@ -75,13 +82,28 @@ status_t Check(const std::string& source) {
     do {
         std::vector<std::string> cmd;
         cmd.push_back(kFsckPath);
-        cmd.push_back("-p");
+        cmd.push_back((control && control->readOnly) ? "-n" : "-p");
         cmd.push_back("-f");
         cmd.push_back(source);
 
         // Fat devices are currently always untrusted
-        rc = ForkExecvp(cmd, sFsckUntrustedContext);
+        if (control) {
+            rc = ForkExecvpCancellable(cmd, sFsckUntrustedContext, control->cancel,
+                    [&](const std::string& line) {
+                int phase;
+                if (control->progress && sscanf(line.c_str(), "** Phase %d", &phase) == 1) {
+                    control->progress(std::min(phase - 1, kFsckPhases) * 100 / kFsckPhases);
+                }
+            });
+        } else {
+            rc = ForkExecvp(cmd, sFsckUntrustedContext);
+        }
 
+        if (rc == -ECANCELED) {
+            SLOGI("Filesystem check cancelled");
+            errno = ECANCELED;
+            return -1;
+        }
         if (rc < 0) {
             SLOGE("Filesystem check failed due to logwrap error");
             errno = EIO;
@@ -169,7 +191,58 @@ status_t Mount(const std::string& source, const std::string& target, bool ro,
     return rc;
 }
 
-status_t Format(const std::string& source, unsigned long numSectors) {
+/* The reserved sector count is a 16 bit field */
+static const unsigned int kMaxReservedSectors = 0xffff;
+
+/* Reads |name|'s value from a line of the parameters newfs_msdos -N prints */
+static void readLayoutField(const std::string& line, const char* name, unsigned int* value) {
+    size_t pos = line.find(name);
+    if (pos != std::string::npos) {
+        *value = strtoul(line.c_str() + pos + strlen(name), nullptr, 10);
+    }
+}
+
+/*
+ * Number of reserved sectors that puts the data area of the filesystem
+ * |cmd| would make on an |alignBytes| boundary of the disk, the volume
+ * starting |offsetBytes| into it, or 0 if none does. newfs_msdos -N reports
+ * the layout it would pick; more reserved sectors can shrink the FATs a
+ * little, so it takes a few rounds to settle.
+ */
+static unsigned int alignedReservedSectors(const std::vector<std::string>& cmd,
+        const std::string& source, uint64_t alignBytes, uint64_t offsetBytes) {
+    uint64_t align = alignBytes / 512;
+    uint64_t offset = offsetBytes / 512;
+    unsigned int reserved = 32;
+    for (int i = 0; i < 4; i++) {
+        std::vector<std::string> dry(cmd);
+        dry.push_back("-N");
+        dry.push_back("-r");
+        dry.push_back(StringPrintf("%u", reserved));
+        dry.push_back(source);
+        std::vector<std::string> output;
+        if (ForkExecvp(dry, output) != OK) return 0;
+
+        unsigned int res = 0, fats = 0, fatSecs = 0;
+        for (const auto& line : output) {
+            readLayoutField(line, "ResSectors=", &res);
+            readLayoutField(line, "FATs=", &fats);
+            readLayoutField(line, "FATsecs=", &fatSecs);
+        }
+        if (res == 0 || fats == 0 || fatSecs == 0) {
+            LOG(WARNING) << "Couldn't read the FAT layout for " << source;
+            return 0;
+        }
+        uint64_t start = offset + res + (uint64_t) fats * fatSecs;
+        if (start % align == 0) return res;
+        reserved = res + (align - start % align);
+        if (reserved > kMaxReservedSectors) return 0;
+    }
+    return 0;
+}
+
+status_t Format(const std::string& source, unsigned long numSectors,
+        unsigned int clusterBytes, uint64_t alignBytes, uint64_t offsetBytes) {
     std::vector<std::string> cmd;
     cmd.push_back(kMkfsPath);
     cmd.push_back("-F");
@@ -177,14 +250,27 @@ status_t Format(const std::string& source, unsigned long numSectors) {
     cmd.push_back("-O");
     cmd.push_back("android");
     cmd.push_back("-c");
-    cmd.push_back("64");
-    cmd.push_back("-A");
+    cmd.push_back(clusterBytes ? StringPrintf("%u", clusterBytes / 512) : "64");
 
     if (numSectors) {
         cmd.push_back("-s");
         cmd.push_back(StringPrintf("%lu", numSectors));
     }
 
+    unsigned int reserved = 0;
+    if (alignBytes >= 512 && alignBytes % 512 == 0) {
+        reserved = alignedReservedSectors(cmd, source, alignBytes, offsetBytes);
+    }
+    if (reserved) {
+        LOG(INFO) << "Using " << reserved << " reserved sectors to start the data area of "
+                << source << " on a " << alignBytes << " byte boundary";
+        cmd.push_back("-r");
+        cmd.push_back(StringPrintf("%u", reserved));
+    } else {
+        // Starts the data area on a cluster boundary of the volume
+        cmd.push_back("-A");
+    }
+
     cmd.push_back(source);
 
     int rc = ForkExecvp(cmd);
@@ -23,15 +23,24 @@
 
 namespace android {
 namespace vold {
+
+struct CheckControl;
+
 namespace vfat {
 
 bool IsSupported();
 
-status_t Check(const std::string& source);
+status_t Check(const std::string& source, CheckControl* control = nullptr);
 status_t Mount(const std::string& source, const std::string& target, bool ro,
         bool remount, bool executable, int ownerUid, int ownerGid, int permMask,
         bool createLost);
-status_t Format(const std::string& source, unsigned long numSectors);
+/*
+ * |clusterBytes| of 0 keeps newfs_msdos' 32KiB clusters. With |alignBytes|,
+ * the data area starts on a boundary of that many bytes of the disk, the
+ * volume itself starting |offsetBytes| into it.
+ */
+status_t Format(const std::string& source, unsigned long numSectors,
+        unsigned int clusterBytes = 0, uint64_t alignBytes = 0, uint64_t offsetBytes = 0);
 
 }  // namespace vfat
 }  // namespace vold
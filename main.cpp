@@ -18,21 +18,35 @@
 #include "VolumeManager.h"
 #include "CommandListener.h"
 #include "CryptCommandListener.h"
+#include "IoStats.h"
 #include "NetlinkManager.h"
+#include "Spawner.h"
+#include "Timings.h"
 #include "cryptfs.h"
 #include "sehandle.h"
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 #include <cutils/klog.h>
 #include <cutils/properties.h>
 #include <cutils/sockets.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <getopt.h>
 #include <fcntl.h>
@@ -41,6 +55,7 @@
 
 static int process_config(VolumeManager *vm, bool* has_adoptable, bool* has_quota);
 static void coldboot(const char *path);
+static void coldboot_sources(VolumeManager *vm);
 static void parse_args(int argc, char** argv);
 
 struct fstab *fstab;
@@ -78,6 +93,9 @@ int main(int argc, char** argv) {
     fcntl(android_get_control_socket("vold"), F_SETFD, FD_CLOEXEC);
     fcntl(android_get_control_socket("cryptd"), F_SETFD, FD_CLOEXEC);
 
+    // Fork the spawner while we're still small and single-threaded
+    android::vold::StartSpawner();
+
     mkdir("/dev/block/vold", 0755);
 
     /* For when cryptfs checks and mounts an encrypted filesystem */
@@ -103,21 +121,36 @@ int main(int argc, char** argv) {
     vm->setBroadcaster((SocketListener *) cl);
     nm->setBroadcaster((SocketListener *) cl);
 
-    if (vm->start()) {
-        PLOG(ERROR) << "Unable to start VolumeManager";
-        exit(1);
+    {
+        android::vold::Timing timing("VolumeManager::start");
+        if (vm->start()) {
+            PLOG(ERROR) << "Unable to start VolumeManager";
+            exit(1);
+        }
     }
 
     bool has_adoptable;
     bool has_quota;
 
-    if (process_config(vm, &has_adoptable, &has_quota)) {
-        PLOG(ERROR) << "Error reading configuration... continuing anyways";
+    {
+        android::vold::Timing timing("process_config");
+        if (process_config(vm, &has_adoptable, &has_quota)) {
+            PLOG(ERROR) << "Error reading configuration... continuing anyways";
+        }
     }
 
-    if (nm->start()) {
-        PLOG(ERROR) << "Unable to start NetlinkManager";
-        exit(1);
+    {
+        android::vold::Timing timing("NetlinkManager::start");
+        if (nm->start()) {
+            PLOG(ERROR) << "Unable to start NetlinkManager";
+            exit(1);
+        }
+    }
+
+    // Cheap enough to leave on; 0 turns sampling off
+    int iostatsMs = property_get_int32("vold.iostats_interval_ms", 1000);
+    if (iostatsMs > 0) {
+        android::vold::StartIoStats(ms2ns(iostatsMs));
     }
 
     /*
@@ -141,7 +174,14 @@ int main(int argc, char** argv) {
     // Do coldboot here so it won't block booting,
     // also the cold boot is needed in case we have flash drive
     // connected before Vold launched
-    coldboot("/sys/block");
+    {
+        android::vold::Timing timing("coldboot");
+        if (property_get_bool("vold.coldboot_full", false)) {
+            coldboot("/sys/block");
+        } else {
+            coldboot_sources(vm);
+        }
+    }
     // Eventually we'll become the monitoring thread
     while(1) {
         pause();
@@ -218,6 +258,84 @@ static void coldboot(const char *path) {
     }
 }
 
+static const int kColdbootThreads = 4;
+static const std::chrono::seconds kColdbootTimeout(10);
+
+/* Runs |fn| over [0, count) on a few threads */
+static void parallel_for(size_t count, const std::function<void(size_t)>& fn) {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < count;) fn(i);
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min<size_t>(kColdbootThreads, count); i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads) t.join();
+}
+
+/*
+ * Only disks that some DiskSource will pick up matter to us, so instead of
+ * replaying "add" for everything under /sys/block (loop, dm, zram, and
+ * all their children), trigger just those and wait for them to be handled.
+ */
+static void coldboot_sources(VolumeManager *vm) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::string> names;
+    DIR *d = opendir("/sys/block");
+    if (!d) {
+        PLOG(ERROR) << "Failed to open /sys/block";
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] != '.') names.push_back(de->d_name);
+    }
+    closedir(d);
+
+    // Resolve each entry to its DEVPATH, which is what sources match on
+    std::vector<dev_t> devices(names.size(), 0);
+    parallel_for(names.size(), [&](size_t i) {
+        std::string base = "/sys/block/" + names[i];
+        char real[PATH_MAX];
+        if (!realpath(base.c_str(), real) || strncmp(real, "/sys/", 5)) return;
+        if (!vm->matchesDiskSource(real + 4)) return;
+
+        std::string dev;
+        unsigned int maj, min;
+        if (!android::base::ReadFileToString(base + "/dev", &dev)
+                || sscanf(dev.c_str(), "%u:%u", &maj, &min) != 2) return;
+        devices[i] = makedev(maj, min);
+    });
+
+    std::set<dev_t> pending;
+    for (dev_t dev : devices) {
+        if (dev) pending.insert(dev);
+    }
+    vm->setColdbootPending(pending);
+
+    parallel_for(names.size(), [&](size_t i) {
+        if (!devices[i]) return;
+        std::string path = "/sys/block/" + names[i] + "/uevent";
+        if (!android::base::WriteStringToFile("add\n", path)) {
+            PLOG(WARNING) << "Failed to trigger " << path;
+        }
+    });
+
+    bool complete = vm->waitForColdboot(kColdbootTimeout);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    if (complete) {
+        LOG(INFO) << "Coldboot complete: " << pending.size() << " of " << names.size()
+                << " block devices in " << ms << "ms";
+        property_set("vold.coldboot_done", "1");
+    } else {
+        LOG(WARNING) << "Coldboot still waiting on devices after " << ms << "ms";
+    }
+}
+
 static int process_config(VolumeManager *vm, bool* has_adoptable, bool* has_quota) {
     fstab = fs_mgr_read_fstab_default();
     if (!fstab) {
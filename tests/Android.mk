@@ -9,7 +9,17 @@ LOCAL_C_INCLUDES := \
 
 LOCAL_STATIC_LIBRARIES := libselinux libvold liblog libcrypto
 
-LOCAL_SRC_FILES := VolumeManager_test.cpp
+LOCAL_SRC_FILES := \
+    BenchHistory_test.cpp \
+    BenchmarkTrace_test.cpp \
+    FsProbe_test.cpp \
+    KeyBuffer_test.cpp \
+    PartitionTable_test.cpp \
+    PatternMatcher_test.cpp \
+    TreeCopier_test.cpp \
+    Uevent_test.cpp \
+    VolumeManager_test.cpp \
+
 LOCAL_MODULE := vold_tests
 LOCAL_MODULE_TAGS := eng tests
 
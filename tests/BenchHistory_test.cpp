@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../BenchHistory.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+namespace android {
+namespace vold {
+
+static const int64_t kDay = 24 * 60 * 60;
+
+static std::vector<BenchRun> daily(const std::vector<nsecs_t>& values) {
+    std::vector<BenchRun> runs;
+    for (size_t i = 0; i < values.size(); i++) {
+        runs.push_back(BenchRun{ (int64_t) (1000000 + i * kDay), values[i] });
+    }
+    return runs;
+}
+
+TEST(BenchHistoryTest, Empty) {
+    auto trend = ComputeBenchTrend({}, 100, 0.5);
+    EXPECT_EQ(0u, trend.runs);
+    EXPECT_FALSE(trend.regressed);
+}
+
+TEST(BenchHistoryTest, SteadyIsFlat) {
+    auto trend = ComputeBenchTrend(daily({ 100, 100, 100, 100, 100, 100 }), 100, 0.5);
+    EXPECT_EQ(6u, trend.runs);
+    EXPECT_EQ(100, trend.recent);
+    EXPECT_DOUBLE_EQ(0, trend.change);
+    EXPECT_DOUBLE_EQ(0, trend.slope);
+    EXPECT_FALSE(trend.regressed);
+}
+
+TEST(BenchHistoryTest, RecentIsMedian) {
+    // One slow outlier among the latest runs doesn't move the median
+    auto trend = ComputeBenchTrend(daily({ 100, 100, 100, 900, 100, 100 }), 100, 0.5);
+    EXPECT_EQ(100, trend.recent);
+    EXPECT_FALSE(trend.regressed);
+}
+
+TEST(BenchHistoryTest, Regressed) {
+    auto trend = ComputeBenchTrend(daily({ 100, 100, 200, 200, 200, 200, 200 }), 100, 0.5);
+    EXPECT_EQ(200, trend.recent);
+    EXPECT_DOUBLE_EQ(1.0, trend.change);
+    EXPECT_TRUE(trend.regressed);
+    EXPECT_GT(trend.slope, 0);
+
+    // Not past the threshold
+    EXPECT_FALSE(ComputeBenchTrend(daily({ 140, 140, 140, 140, 140 }), 100, 0.5).regressed);
+}
+
+TEST(BenchHistoryTest, NeedsEnoughRuns) {
+    auto trend = ComputeBenchTrend(daily({ 300, 300 }), 100, 0.5);
+    EXPECT_EQ(300, trend.recent);
+    EXPECT_FALSE(trend.regressed);
+}
+
+TEST(BenchHistoryTest, NoBaseline) {
+    auto trend = ComputeBenchTrend(daily({ 300, 300, 300, 300, 300 }), 0, 0.5);
+    EXPECT_EQ(300, trend.recent);
+    EXPECT_FALSE(trend.regressed);
+}
+
+TEST(BenchHistoryTest, Slope) {
+    // Ten percent of baseline slower per day is three times over per 30 days
+    auto trend = ComputeBenchTrend(daily({ 100, 110, 120, 130, 140 }), 100, 0.5);
+    EXPECT_NEAR(3.0, trend.slope, 1e-9);
+}
+
+}  // namespace vold
+}  // namespace android
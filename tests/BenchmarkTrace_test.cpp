@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../BenchmarkTrace.h"
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+
+#include <gtest/gtest.h>
+
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+class BenchmarkTraceTest : public testing::Test {
+protected:
+    typedef BenchmarkTrace T;
+
+    char mVersion = '1';
+    /* Trace time given to the events added next */
+    int64_t mNow = 0;
+    std::string mName = "test";
+    std::vector<uint64_t> mFiles;
+    uint32_t mHandles = 0;
+    std::vector<std::vector<T::Event>> mThreads;
+
+    template <class V>
+    static void put(std::string& out, V v, size_t len = sizeof(V)) {
+        for (size_t i = 0; i < len; i++) {
+            out.push_back((char) ((uint64_t) v >> (8 * i)));
+        }
+    }
+
+    void add(size_t thread, uint8_t op, uint32_t handle, uint32_t arg = 0,
+            int64_t offset = 0, int64_t count = 0, uint8_t flags = 0) {
+        if (mThreads.size() <= thread) mThreads.resize(thread + 1);
+        mHandles = std::max(mHandles, handle + 1);
+        mThreads[thread].push_back(T::Event{ op, flags, handle, arg, 0644, offset, count,
+                mNow, T::kUnordered });
+    }
+
+    std::string build() {
+        std::string out("VBT");
+        out += mVersion;
+        put<uint32_t>(out, mFiles.size());
+        put<uint32_t>(out, mHandles);
+        put<uint32_t>(out, mThreads.size());
+        put<uint32_t>(out, mName.size());
+        out += mName;
+        for (uint64_t size : mFiles) put(out, size);
+        for (const auto& thread : mThreads) {
+            put<uint32_t>(out, thread.size());
+            for (const auto& e : thread) {
+                put(out, e.op);
+                put(out, e.flags);
+                put<uint16_t>(out, 0);
+                put(out, e.handle);
+                put(out, e.arg);
+                put(out, e.mode);
+                put(out, e.offset);
+                put(out, e.count);
+                if (mVersion == '2') put(out, e.time);
+            }
+        }
+        return out;
+    }
+
+    /* Two threads, each reading its own file and one writing a new one */
+    void addWorkload() {
+        mFiles = { 8192, 4096, 0 };
+        add(0, T::kOpen, 0, 0);
+        add(0, T::kPread, 0, 0, 4096, 4096);
+        add(0, T::kClose, 0);
+        add(1, T::kOpen, 1, 1);
+        add(1, T::kRead, 1, 0, 0, 4096);
+        add(1, T::kOpen, 2, 2, 0, 0, T::kWriteOnly | T::kCreate);
+        add(1, T::kWrite, 2, 0, 0, 1000);
+        add(1, T::kFsync, 2);
+    }
+};
+
+TEST_F(BenchmarkTraceTest, ParseValid) {
+    addWorkload();
+    BenchmarkTrace trace;
+    EXPECT_EQ(OK, trace.parse(build()));
+    EXPECT_EQ("test:r2:w1:s1", trace.ident());
+}
+
+TEST_F(BenchmarkTraceTest, ParseRejectsTruncated) {
+    addWorkload();
+    std::string data = build();
+    BenchmarkTrace trace;
+    EXPECT_NE(OK, trace.parse(data.substr(0, data.size() - 1)));
+    EXPECT_NE(OK, trace.parse(data + '\0'));
+    EXPECT_NE(OK, trace.parse(""));
+}
+
+TEST_F(BenchmarkTraceTest, ParseRejectsBadName) {
+    addWorkload();
+    mName = "../evil";
+    BenchmarkTrace trace;
+    EXPECT_NE(OK, trace.parse(build()));
+}
+
+TEST_F(BenchmarkTraceTest, ParseRejectsSharedHandle) {
+    addWorkload();
+    add(1, T::kClose, 0);
+    BenchmarkTrace trace;
+    EXPECT_NE(OK, trace.parse(build()));
+}
+
+TEST_F(BenchmarkTraceTest, ParseRejectsTimeGoingBack) {
+    mVersion = '2';
+    mNow = 100;
+    addWorkload();
+    mNow = 50;
+    add(0, T::kOpen, 0, 0);
+    BenchmarkTrace trace;
+    EXPECT_NE(OK, trace.parse(build()));
+}
+
+TEST_F(BenchmarkTraceTest, ParseRejectsBadEvents) {
+    BenchmarkTrace trace;
+
+    addWorkload();
+    add(0, T::kOpen, 0, 3);
+    EXPECT_NE(OK, trace.parse(build()));
+
+    mThreads.clear();
+    addWorkload();
+    add(0, T::kRead, 0, 0, 0, 2 * 1024 * 1024);
+    EXPECT_NE(OK, trace.parse(build()));
+
+    mThreads.clear();
+    addWorkload();
+    add(0, T::kLseek, 0, 42);
+    EXPECT_NE(OK, trace.parse(build()));
+
+    mThreads.clear();
+    addWorkload();
+    add(0, 0, 0);
+    EXPECT_NE(OK, trace.parse(build()));
+}
+
+TEST_F(BenchmarkTraceTest, Replay) {
+    addWorkload();
+    BenchmarkTrace trace;
+    ASSERT_EQ(OK, trace.parse(build()));
+
+    TemporaryDir dir;
+    char cwd[PATH_MAX];
+    ASSERT_TRUE(getcwd(cwd, sizeof(cwd)) != nullptr);
+    ASSERT_EQ(0, chdir(dir.path));
+
+    EXPECT_EQ(OK, trace.create());
+    struct stat sb;
+    EXPECT_EQ(0, stat("file0", &sb));
+    EXPECT_EQ(8192, sb.st_size);
+
+    EXPECT_EQ(OK, trace.run());
+    EXPECT_EQ(0, stat("file2", &sb));
+    EXPECT_EQ(1000, sb.st_size);
+
+    EXPECT_EQ(OK, trace.destroy());
+    EXPECT_EQ(-1, stat("file0", &sb));
+
+    ASSERT_EQ(0, chdir(cwd));
+}
+
+TEST_F(BenchmarkTraceTest, Latencies) {
+    addWorkload();
+    add(0, T::kOpen, 0, 0);
+    add(0, T::kPread, 0, 0, 0, 8192);
+    BenchmarkTrace trace;
+    ASSERT_EQ(OK, trace.parse(build()));
+    trace.setKeepSamples(true);
+
+    TemporaryDir dir;
+    char cwd[PATH_MAX];
+    ASSERT_TRUE(getcwd(cwd, sizeof(cwd)) != nullptr);
+    ASSERT_EQ(0, chdir(dir.path));
+    ASSERT_EQ(OK, trace.create());
+    ASSERT_EQ(OK, trace.run());
+    EXPECT_EQ(OK, trace.writeSamples("samples"));
+    EXPECT_EQ(OK, trace.destroy());
+
+    std::map<std::string, uint64_t> counts;
+    for (const auto& l : trace.latencies()) {
+        counts[l.op] = l.count;
+        EXPECT_LE(l.p50, l.p90);
+        EXPECT_LE(l.p90, l.p99);
+        EXPECT_LE(l.p99, l.max);
+    }
+    std::map<std::string, uint64_t> expected = {
+        { "open", 4 }, { "read_4k", 2 }, { "read_64k", 1 }, { "write_4k", 1 }, { "sync", 1 },
+    };
+    EXPECT_EQ(expected, counts);
+
+    std::string samples;
+    ASSERT_TRUE(android::base::ReadFileToString("samples", &samples));
+    EXPECT_EQ(9, std::count(samples.begin(), samples.end(), '\n'));
+    EXPECT_EQ(0, unlink("samples"));
+
+    ASSERT_EQ(0, chdir(cwd));
+}
+
+/* One thread opens and closes a file, another writes to it in between */
+TEST_F(BenchmarkTraceTest, SharedHandle) {
+    mVersion = '2';
+    mFiles = { 0 };
+    add(0, T::kOpen, 0, 0, 0, 0, T::kWriteOnly);
+    mNow = 1000;
+    add(1, T::kPwrite, 0, 0, 4096, 100);
+    mNow = 2000;
+    add(0, T::kClose, 0);
+    BenchmarkTrace trace;
+    ASSERT_EQ(OK, trace.parse(build()));
+    trace.setPaced(true);
+    EXPECT_EQ("test:r0:w1:s0:paced", trace.ident());
+
+    TemporaryDir dir;
+    char cwd[PATH_MAX];
+    ASSERT_TRUE(getcwd(cwd, sizeof(cwd)) != nullptr);
+    ASSERT_EQ(0, chdir(dir.path));
+    ASSERT_EQ(OK, trace.create());
+
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    ASSERT_EQ(OK, trace.run());
+    EXPECT_GE(systemTime(SYSTEM_TIME_MONOTONIC) - start, us2ns(2000));
+
+    struct stat sb;
+    EXPECT_EQ(0, stat("file0", &sb));
+    EXPECT_EQ(4196, sb.st_size);
+    EXPECT_EQ(OK, trace.destroy());
+    ASSERT_EQ(0, chdir(cwd));
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../FsProbe.h"
+
+#include <android-base/test_utils.h>
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace android {
+namespace vold {
+
+class FsProbeTest : public testing::TestWithParam<bool> {
+protected:
+    std::vector<uint8_t> mImage;
+
+    virtual void SetUp() {
+        mImage.assign(1024 * 1024, 0);
+    }
+
+    void put16(size_t off, uint16_t v) { memcpy(&mImage[off], &v, sizeof(v)); }
+    void put32(size_t off, uint32_t v) { memcpy(&mImage[off], &v, sizeof(v)); }
+    void putString(size_t off, const char* s) { memcpy(&mImage[off], s, strlen(s)); }
+
+    void putExt4() {
+        size_t sb = 1024;
+        put16(sb + 0x38, 0xEF53);
+        put32(sb + 0x5C, 0x0004);
+        put32(sb + 0x60, 0x0002 | 0x0040);
+        for (int i = 0; i < 16; i++) mImage[sb + 0x68 + i] = 0xA0 + i;
+        putString(sb + 0x78, "Photos");
+    }
+
+    void putFat32(const char* rootLabel) {
+        putString(3, "MSWIN4.1");
+        put16(11, 512);
+        mImage[13] = 1;
+        put16(14, 32);
+        mImage[16] = 2;
+        put32(0x24, 8);
+        put32(0x2C, 2);
+        put32(0x43, 0x12345678);
+        putString(0x47, "NO NAME    ");
+        putString(0x52, "FAT32   ");
+        mImage[510] = 0x55;
+        mImage[511] = 0xAA;
+        if (rootLabel) {
+            size_t root = (32 + 2 * 8) * 512;
+            putString(root, rootLabel);
+            mImage[root + 11] = 0x08;
+        }
+    }
+
+    status_t probe(std::string& type, std::string& uuid, std::string& label) {
+        TemporaryFile tf;
+        EXPECT_TRUE(write(tf.fd, mImage.data(), mImage.size()) == (ssize_t) mImage.size());
+        return ProbeFilesystem(tf.path, type, uuid, label, GetParam());
+    }
+};
+
+TEST_P(FsProbeTest, Ext4) {
+    putExt4();
+    std::string type, uuid, label;
+    EXPECT_EQ(OK, probe(type, uuid, label));
+    EXPECT_EQ("ext4", type);
+    EXPECT_EQ("a0a1a2a3-a4a5-a6a7-a8a9-aaabacadaeaf", uuid);
+    EXPECT_EQ("Photos", label);
+}
+
+TEST_P(FsProbeTest, Fat32RootLabel) {
+    putFat32("CARD       ");
+    std::string type, uuid, label;
+    EXPECT_EQ(OK, probe(type, uuid, label));
+    EXPECT_EQ("vfat", type);
+    EXPECT_EQ("1234-5678", uuid);
+    EXPECT_EQ("CARD", label);
+}
+
+TEST_P(FsProbeTest, Fat32NoName) {
+    putFat32(nullptr);
+    std::string type, uuid, label;
+    EXPECT_EQ(OK, probe(type, uuid, label));
+    EXPECT_EQ("vfat", type);
+    EXPECT_EQ("", label);
+}
+
+TEST_P(FsProbeTest, AmbiguousFallsBack) {
+    putExt4();
+    putFat32(nullptr);
+    std::string type, uuid, label;
+    EXPECT_EQ(-ENOENT, probe(type, uuid, label));
+}
+
+TEST_P(FsProbeTest, UnknownFallsBack) {
+    std::string type, uuid, label;
+    EXPECT_EQ(-ENOENT, probe(type, uuid, label));
+}
+
+INSTANTIATE_TEST_CASE_P(Sandboxed, FsProbeTest, testing::Bool());
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../KeyBuffer.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+TEST(KeyBufferTest, SmallBuffersAreZeroedAndReused) {
+    char* first;
+    {
+        KeyBuffer key(64, 'k');
+        first = key.data();
+        // Without CAP_IPC_LOCK everything stays on the heap
+        if (!IsLockedKeyMemory(first)) return;
+    }
+    // Freed blocks are zeroed and handed out again for the same size class.
+    // A KeyBuffer would value-initialise its contents, so take the block
+    // back raw to see what the free left in it.
+    char* again = static_cast<char*>(AllocateKeyMemory(64));
+    EXPECT_EQ(first, again);
+    for (size_t i = 0; i < 64; i++) {
+        EXPECT_EQ(0, again[i]) << "at " << i;
+    }
+    FreeKeyMemory(again, 64);
+}
+
+TEST(KeyBufferTest, LargeBuffersWork) {
+    KeyBuffer big(64 * 1024, 'x');
+    EXPECT_FALSE(IsLockedKeyMemory(big.data()));
+    EXPECT_EQ('x', big.back());
+}
+
+TEST(KeyBufferTest, ConcatAllocatesOnce) {
+    KeyBuffer hex = KeyBuffer() + "00112233";
+    auto res = ConcatKeyBuffer({ "AES-256-XTS ", hex, " ", "/dev/block/sda1", " 0" });
+    EXPECT_EQ("AES-256-XTS 00112233 /dev/block/sda1 0", std::string(res.data(), res.size()));
+    EXPECT_EQ(res.size(), res.capacity());
+}
+
+TEST(KeyBufferTest, ManyBuffersOutgrowTheArena) {
+    std::vector<KeyBuffer> keys;
+    for (int i = 0; i < 2048; i++) {
+        keys.emplace_back(64, static_cast<char>(i));
+    }
+    for (int i = 0; i < 2048; i++) {
+        EXPECT_EQ(static_cast<char>(i), keys[i][63]);
+    }
+}
+
+}  // namespace vold
+}  // namespace android
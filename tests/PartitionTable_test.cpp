@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../PartitionTable.h"
+
+#include <android-base/test_utils.h>
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace android {
+namespace vold {
+
+static const uint32_t kSector = 512;
+static const uint64_t kSectors = 2048;
+
+// Android expand and basic data type GUIDs, in on-disk byte order
+static const uint8_t kExpandType[16] = { 0xA4, 0x1E, 0x3D, 0x19, 0xCA, 0xB3, 0xE4, 0x11,
+        0xB0, 0x75, 0x10, 0x60, 0x4B, 0x88, 0x9D, 0xCF };
+static const uint8_t kBasicType[16] = { 0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+        0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7 };
+
+class PartitionTableTest : public testing::Test {
+protected:
+    std::vector<uint8_t> mImage;
+
+    virtual void SetUp() {
+        mImage.assign(kSectors * kSector, 0);
+    }
+
+    void put32(size_t off, uint32_t v) { memcpy(&mImage[off], &v, sizeof(v)); }
+    void put64(size_t off, uint64_t v) { memcpy(&mImage[off], &v, sizeof(v)); }
+
+    void putMbrEntry(size_t sector, int slot, uint8_t type, uint32_t first, uint32_t count) {
+        size_t off = sector * kSector + 446 + slot * 16;
+        mImage[off + 4] = type;
+        put32(off + 8, first);
+        put32(off + 12, count);
+        mImage[sector * kSector + 510] = 0x55;
+        mImage[sector * kSector + 511] = 0xAA;
+    }
+
+    static uint32_t crc32(const uint8_t* buf, size_t len) {
+        uint32_t crc = 0xFFFFFFFF;
+        for (size_t i = 0; i < len; i++) {
+            crc ^= buf[i];
+            for (int k = 0; k < 8; k++) {
+                crc = (crc & 1) ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+            }
+        }
+        return crc ^ 0xFFFFFFFF;
+    }
+
+    void putGpt(uint64_t headerLba, uint64_t entriesLba) {
+        const uint32_t entries = 128;
+        const uint32_t entrySize = 128;
+        size_t e = entriesLba * kSector;
+        memcpy(&mImage[e], kBasicType, 16);
+        memset(&mImage[e + 16], 0x11, 16);
+        memcpy(&mImage[e + 2 * entrySize], kExpandType, 16);
+        for (int i = 0; i < 16; i++) mImage[e + 2 * entrySize + 16 + i] = i;
+
+        size_t h = headerLba * kSector;
+        memcpy(&mImage[h], "EFI PART", 8);
+        put32(h + 8, 0x00010000);
+        put32(h + 12, 92);
+        put32(h + 16, 0);
+        put64(h + 24, headerLba);
+        put64(h + 72, entriesLba);
+        put32(h + 80, entries);
+        put32(h + 84, entrySize);
+        put32(h + 88, crc32(&mImage[e], entries * entrySize));
+        put32(h + 16, crc32(&mImage[h], 92));
+    }
+
+    PartitionTable read() {
+        TemporaryFile tf;
+        EXPECT_TRUE(write(tf.fd, mImage.data(), mImage.size()) == (ssize_t) mImage.size());
+        PartitionTable table;
+        EXPECT_EQ(OK, ReadPartitionTable(tf.fd, kSector, mImage.size(), table));
+        return table;
+    }
+};
+
+TEST_F(PartitionTableTest, Empty) {
+    EXPECT_EQ(PartitionTable::Type::kUnknown, read().type);
+}
+
+TEST_F(PartitionTableTest, MbrWithLogical) {
+    putMbrEntry(0, 0, 0x0c, 64, 100);
+    putMbrEntry(0, 1, 0x05, 200, 800);
+    // Two logical partitions chained from the extended one
+    putMbrEntry(200, 0, 0x83, 8, 100);
+    putMbrEntry(200, 1, 0x05, 300, 400);
+    putMbrEntry(500, 0, 0x07, 8, 100);
+
+    PartitionTable table = read();
+    ASSERT_EQ(PartitionTable::Type::kMbr, table.type);
+    ASSERT_EQ(4U, table.partitions.size());
+    EXPECT_EQ(1, table.partitions[0].index);
+    EXPECT_EQ(0x0c, table.partitions[0].mbrType);
+    EXPECT_EQ(2, table.partitions[1].index);
+    EXPECT_EQ(0x05, table.partitions[1].mbrType);
+    EXPECT_EQ(5, table.partitions[2].index);
+    EXPECT_EQ(0x83, table.partitions[2].mbrType);
+    EXPECT_EQ(6, table.partitions[3].index);
+    EXPECT_EQ(0x07, table.partitions[3].mbrType);
+
+    // Logical partitions start relative to their own EBR
+    EXPECT_EQ(64U, table.partitions[0].firstLba);
+    EXPECT_EQ(100U, table.partitions[0].sectors);
+    EXPECT_EQ(208U, table.partitions[2].firstLba);
+    EXPECT_EQ(508U, table.partitions[3].firstLba);
+    EXPECT_EQ(100U, table.partitions[3].sectors);
+}
+
+TEST_F(PartitionTableTest, Gpt) {
+    putMbrEntry(0, 0, 0xEE, 1, kSectors - 1);
+    putGpt(1, 2);
+
+    PartitionTable table = read();
+    ASSERT_EQ(PartitionTable::Type::kGpt, table.type);
+    ASSERT_EQ(2U, table.partitions.size());
+    EXPECT_EQ(1, table.partitions[0].index);
+    EXPECT_EQ("EBD0A0A2-B9E5-4433-87C0-68B6B72699C7", table.partitions[0].typeGuid);
+    EXPECT_EQ("11111111-1111-1111-1111-111111111111", table.partitions[0].partGuid);
+    EXPECT_EQ(3, table.partitions[1].index);
+    EXPECT_EQ("193D1EA4-B3CA-11E4-B075-10604B889DCF", table.partitions[1].typeGuid);
+    EXPECT_EQ("03020100-0504-0706-0809-0A0B0C0D0E0F", table.partitions[1].partGuid);
+}
+
+TEST_F(PartitionTableTest, GptBackup) {
+    putMbrEntry(0, 0, 0xEE, 1, kSectors - 1);
+    putGpt(kSectors - 1, kSectors - 33);
+    // Primary header present but corrupt
+    memcpy(&mImage[kSector], "EFI PART", 8);
+
+    PartitionTable table = read();
+    ASSERT_EQ(PartitionTable::Type::kGpt, table.type);
+    EXPECT_EQ(2U, table.partitions.size());
+}
+
+TEST_F(PartitionTableTest, GptBadEntriesCrc) {
+    putMbrEntry(0, 0, 0xEE, 1, kSectors - 1);
+    putGpt(1, 2);
+    mImage[2 * kSector + 100] ^= 1;
+
+    EXPECT_EQ(PartitionTable::Type::kUnknown, read().type);
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../PatternMatcher.h"
+
+#include <gtest/gtest.h>
+
+#include <fnmatch.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+// Typical voldmanaged entries from fstabs
+static const std::vector<std::string> kPatterns = {
+    "/devices/platform/soc/7864900.sdhci/mmc_host*",
+    "/devices/*/xhci-hcd.0.auto*",
+    "/devices/platform/soc/7864900.sdhci/mmc_host/mmc1/mmc1:0001/block/mmcblk1",
+    "/devices/platform/soc/a800000.ssusb/*",
+    "/devices/platform/soc/7864900.sdhci/mmc_host/mmc?/*",
+    "/devices/pci0000:00/0000:00:1[0-9].0/*",
+    "/devices/platform/soc/7864900.sdhci/mmc_host/mmc1/mmc1:0001/block/mmcblk1",
+};
+
+static const std::vector<std::string> kPaths = {
+    "/devices/platform/soc/7864900.sdhci/mmc_host/mmc1/mmc1:0001/block/mmcblk1",
+    "/devices/platform/soc/7864900.sdhci/mmc_host/mmc0/mmc0:0001/block/mmcblk0",
+    "/devices/platform/soc/a800000.ssusb/a800000.dwc3/xhci-hcd.0.auto/usb1/1-1/block/sda",
+    "/devices/pci0000:00/0000:00:14.0/usb2/2-1/block/sdb",
+    "/devices/pci0000:00/0000:00:04.0/virtio1/block/vda",
+    "/devices/virtual/block/loop0",
+    "/devices/platform/soc/7864900.sdhci",
+    "",
+};
+
+// What looping over the patterns with fnmatch() would have picked
+static int reference(const std::vector<std::string>& patterns, const std::string& path) {
+    for (size_t i = 0; i < patterns.size(); i++) {
+        if (!fnmatch(patterns[i].c_str(), path.c_str(), 0)) return i;
+    }
+    return -1;
+}
+
+TEST(PatternMatcherTest, MatchesLikeFnmatch) {
+    // Every suffix of the list, so earlier patterns stop shadowing later ones
+    for (size_t start = 0; start < kPatterns.size(); start++) {
+        std::vector<std::string> patterns(kPatterns.begin() + start, kPatterns.end());
+        PatternMatcher matcher;
+        for (const auto& pattern : patterns) {
+            matcher.add(pattern);
+        }
+        for (const auto& path : kPaths) {
+            EXPECT_EQ(reference(patterns, path), matcher.match(path)) << path;
+        }
+    }
+}
+
+TEST(PatternMatcherTest, Literals) {
+    PatternMatcher matcher;
+    matcher.add("/devices/a");
+    matcher.add("/devices/ab");
+    EXPECT_EQ(0, matcher.match("/devices/a"));
+    EXPECT_EQ(1, matcher.match("/devices/ab"));
+    EXPECT_EQ(-1, matcher.match("/devices/abc"));
+    EXPECT_EQ(-1, matcher.match("/devices/"));
+}
+
+TEST(PatternMatcherTest, Clear) {
+    PatternMatcher matcher;
+    matcher.add("*");
+    EXPECT_EQ(0, matcher.match("/anything"));
+    matcher.clear();
+    EXPECT_EQ(0u, matcher.size());
+    EXPECT_EQ(-1, matcher.match("/anything"));
+}
+
+}  // namespace vold
+}  // namespace android
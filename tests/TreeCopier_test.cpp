@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../TreeCopier.h"
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+
+#include <gtest/gtest.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace android {
+namespace vold {
+
+static bool exists(const std::string& path) {
+    struct stat sb;
+    return lstat(path.c_str(), &sb) == 0;
+}
+
+static status_t copyTree(const std::string& from, const std::string& to, bool resume) {
+    TreeCopier copier(from, to);
+    std::string journal = to + "/" + TreeCopier::kJournalName;
+    if (copier.scan() != OK || copier.openJournal(journal, resume) != OK) return -1;
+    if (resume && copier.prune(2) != OK) return -1;
+    return copier.copy(nullptr);
+}
+
+TEST(TreeCopierTest, ResumeDropsFilesDeletedFromSource) {
+    TemporaryDir from;
+    TemporaryDir to;
+    std::string src(from.path);
+    std::string dst(to.path);
+
+    ASSERT_EQ(0, mkdir((src + "/top").c_str(), 0700));
+    ASSERT_EQ(0, mkdir((src + "/top/sub").c_str(), 0700));
+    ASSERT_TRUE(android::base::WriteStringToFile("keep", src + "/top/keep"));
+    ASSERT_TRUE(android::base::WriteStringToFile("gone", src + "/top/gone"));
+    ASSERT_TRUE(android::base::WriteStringToFile("deep", src + "/top/sub/deep"));
+    ASSERT_TRUE(android::base::WriteStringToFile("old", src + "/old"));
+    ASSERT_EQ(OK, copyTree(src, dst, false));
+    ASSERT_TRUE(exists(dst + "/top/gone"));
+
+    // Deleted, or replaced with another type, between the two attempts
+    ASSERT_EQ(0, unlink((src + "/top/gone").c_str()));
+    ASSERT_EQ(0, unlink((src + "/top/sub/deep").c_str()));
+    ASSERT_EQ(0, rmdir((src + "/top/sub").c_str()));
+    ASSERT_TRUE(android::base::WriteStringToFile("now a file", src + "/top/sub"));
+    ASSERT_EQ(0, unlink((src + "/old").c_str()));
+
+    ASSERT_TRUE(TreeCopier::isJournalFor(dst + "/" + TreeCopier::kJournalName, src));
+    ASSERT_EQ(OK, copyTree(src, dst, true));
+
+    std::string content;
+    EXPECT_TRUE(android::base::ReadFileToString(dst + "/top/keep", &content));
+    EXPECT_EQ("keep", content);
+    EXPECT_FALSE(exists(dst + "/top/gone"));
+    EXPECT_TRUE(android::base::ReadFileToString(dst + "/top/sub", &content));
+    EXPECT_EQ("now a file", content);
+    // Top-level entries are kept, the way a fresh move empties them
+    EXPECT_TRUE(exists(dst + "/old"));
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../Uevent.h"
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace android {
+namespace vold {
+
+// Lays out a uevent the way the kernel does, fields NUL-separated
+static std::string uevent(const std::string& action, const std::string& devPath,
+        const std::string& subsystem, const std::string& rest = "") {
+    std::string msg = action + "@" + devPath + '\0';
+    msg += "ACTION=" + action + '\0';
+    msg += "DEVPATH=" + devPath + '\0';
+    msg += "SUBSYSTEM=" + subsystem + '\0';
+    msg += rest;
+    return msg;
+}
+
+static const std::string kDiskFields = std::string("MAJOR=8") + '\0' + "MINOR=16" + '\0'
+        + "DEVNAME=sdb" + '\0' + "DEVTYPE=disk" + '\0' + "SEQNUM=2101" + '\0';
+
+TEST(UeventTest, ParsesInPlace) {
+    auto msg = uevent("add", "/devices/platform/usb1/1-1/host0/block/sdb", "block", kDiskFields);
+    Uevent evt;
+    ASSERT_TRUE(ParseUevent(msg.data(), msg.size(), &evt));
+    EXPECT_STREQ("add", evt.action);
+    EXPECT_STREQ("/devices/platform/usb1/1-1/host0/block/sdb", evt.devPath);
+    EXPECT_STREQ("block", evt.subsystem);
+    EXPECT_STREQ("disk", evt.devType);
+    EXPECT_EQ(8, evt.major);
+    EXPECT_EQ(16, evt.minor);
+    EXPECT_GE(evt.devPath, msg.data());
+    EXPECT_LT(evt.devPath, msg.data() + msg.size());
+}
+
+TEST(UeventTest, MissingFields) {
+    auto msg = uevent("change", "/devices/virtual/thermal/thermal_zone0", "thermal");
+    Uevent evt;
+    ASSERT_TRUE(ParseUevent(msg.data(), msg.size(), &evt));
+    EXPECT_STREQ("thermal", evt.subsystem);
+    EXPECT_EQ(nullptr, evt.devType);
+    EXPECT_EQ(-1, evt.major);
+    EXPECT_EQ(-1, evt.minor);
+}
+
+TEST(UeventTest, RejectsMalformed) {
+    Uevent evt;
+    std::string udev = std::string("libudev") + '\0' + "ACTION=add" + '\0';
+    EXPECT_FALSE(ParseUevent(udev.data(), udev.size(), &evt));
+
+    auto msg = uevent("add", "/devices/virtual/block/loop0", "block");
+    EXPECT_FALSE(ParseUevent(msg.data(), msg.size() - 1, &evt));
+    EXPECT_FALSE(ParseUevent(msg.data(), 0, &evt));
+}
+
+class UeventFilterTest : public testing::Test {
+protected:
+    int mFds[2];
+
+    virtual void SetUp() {
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, mFds));
+        auto prog = BlockUeventFilter();
+        ASSERT_LE(prog.size(), static_cast<size_t>(BPF_MAXINSNS));
+        sock_fprog fprog = { static_cast<unsigned short>(prog.size()), prog.data() };
+        ASSERT_EQ(0, setsockopt(mFds[1], SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)));
+        ASSERT_EQ(0, fcntl(mFds[1], F_SETFL, O_NONBLOCK));
+    }
+
+    virtual void TearDown() {
+        close(mFds[0]);
+        close(mFds[1]);
+    }
+
+    bool admitted(const std::string& msg) {
+        EXPECT_EQ(static_cast<ssize_t>(msg.size()), send(mFds[0], msg.data(), msg.size(), 0));
+        char buf[4096];
+        return recv(mFds[1], buf, sizeof(buf), 0) == static_cast<ssize_t>(msg.size());
+    }
+};
+
+TEST_F(UeventFilterTest, AdmitsBlock) {
+    EXPECT_TRUE(admitted(uevent("add", "/devices/virtual/block/loop0", "block", kDiskFields)));
+    EXPECT_TRUE(admitted(uevent("remove", "/devices/platform/soc/7824900.sdhci/mmc_host/mmc0/"
+            "mmc0:0001/block/mmcblk0/mmcblk0p12", "block")));
+}
+
+TEST_F(UeventFilterTest, DropsOthers) {
+    EXPECT_FALSE(admitted(uevent("change", "/devices/platform/battery/power_supply/battery",
+            "power_supply", "POWER_SUPPLY_CAPACITY=87" + std::string(1, '\0'))));
+    EXPECT_FALSE(admitted(uevent("add", "/devices/virtual/block_like/x", "blocks")));
+    EXPECT_FALSE(admitted(uevent("add", "/devices/virtual/misc/x", "bloc")));
+}
+
+TEST_F(UeventFilterTest, AdmitsLongHeaders) {
+    std::string deep(600, 'd');
+    EXPECT_TRUE(admitted(uevent("change", "/devices/" + deep, "power_supply")));
+}
+
+}  // namespace vold
+}  // namespace android
@@ -30,6 +30,11 @@
 #include <sys/types.h>
 #include <sys/un.h>
 
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 
@@ -39,8 +44,36 @@
 static void usage(char *progname);
 static int do_monitor(int sock, int stop_after_cmd);
 static int do_cmd(int sock, int argc, char **argv);
+static int do_batch(const char* path, bool wait_for_socket, size_t window);
 
 static constexpr int kCommandTimeoutMs = 20 * 1000;
+/*
+ * Commands in flight at once in batch mode, unless --window says. With
+ * more than one, a command can run before one sent just ahead of it.
+ */
+static constexpr size_t kDefaultWindow = 1;
+/*
+ * FrameworkListener reads into a CMD_BUF_SIZE (1024) byte buffer and drops
+ * all of it if the read doesn't end on a command boundary, answering with
+ * a single unnumbered 500. Batches never have more unanswered bytes
+ * outstanding than fit in one read, with room to spare.
+ */
+static constexpr size_t kMaxInflightBytes = 768;
+
+static int connect_socket(const char* sockname, bool wait_for_socket) {
+    int sock;
+    while ((sock = socket_local_client(sockname,
+                                 ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                 SOCK_STREAM)) < 0) {
+        if (!wait_for_socket) {
+            PLOG(ERROR) << "Error connecting to " << sockname;
+            return -1;
+        } else {
+            usleep(10000);
+        }
+    }
+    return sock;
+}
 
 int main(int argc, char **argv) {
     int sock;
@@ -67,20 +100,31 @@ int main(int argc, char **argv) {
         exit(5);
     }
 
+    if (!strcmp(argv[1], "--batch")) {
+        long window = kDefaultWindow;
+        if (argc > 3 && !strcmp(argv[2], "--window")) {
+            char* end;
+            errno = 0;
+            window = strtol(argv[3], &end, 10);
+            if (errno || end == argv[3] || *end) window = 0;
+            argv += 2;
+            argc -= 2;
+        }
+        if (window <= 0 || argc > 3) {
+            usage(progname);
+            exit(5);
+        }
+        exit(do_batch(argc > 2 ? argv[2] : "-", wait_for_socket, window));
+    }
+
     const char* sockname = "vold";
     if (!strcmp(argv[1], "cryptfs")) {
         sockname = "cryptd";
     }
 
-    while ((sock = socket_local_client(sockname,
-                                 ANDROID_SOCKET_NAMESPACE_RESERVED,
-                                 SOCK_STREAM)) < 0) {
-        if (!wait_for_socket) {
-            PLOG(ERROR) << "Error connecting to " << sockname;
-            exit(4);
-        } else {
-            usleep(10000);
-        }
+    sock = connect_socket(sockname, wait_for_socket);
+    if (sock < 0) {
+        exit(4);
     }
 
     if (!strcmp(argv[1], "monitor")) {
@@ -176,6 +220,179 @@ static int do_monitor(int sock, int stop_after_seq) {
     return EIO;
 }
 
+/*
+ * One socket in batch mode, opened when the first command for it comes
+ * up. Responses are split into messages here, since one read can end
+ * partway through a message.
+ */
+struct Connection {
+    struct Pending {
+        int seq;
+        std::string cmd;
+        /* What went on the wire: sequence number, command and NUL */
+        size_t bytes;
+        std::chrono::steady_clock::time_point sent;
+    };
+
+    const char* sockname;
+    int sock;
+    std::string buffer;
+    std::deque<Pending> inflight;
+    size_t inflightBytes;
+};
+
+static bool read_commands(const char* path, std::vector<std::string>& commands) {
+    FILE* in = strcmp(path, "-") ? fopen(path, "re") : stdin;
+    if (in == nullptr) {
+        PLOG(ERROR) << "Failed to open " << path;
+        return false;
+    }
+    char* line = nullptr;
+    size_t len = 0;
+    while (getline(&line, &len, in) != -1) {
+        std::string cmd(line);
+        while (!cmd.empty() && strchr(" \t\r\n", cmd.back())) cmd.pop_back();
+        size_t start = cmd.find_first_not_of(" \t");
+        if (start == std::string::npos || cmd[start] == '#') continue;
+        commands.push_back(cmd.substr(start));
+    }
+    free(line);
+    if (in != stdin) fclose(in);
+    return true;
+}
+
+/* Handles the messages read so far, returning the first failure code seen */
+static int handle_messages(Connection& conn, int result) {
+    size_t offset = 0;
+    size_t end;
+    while ((end = conn.buffer.find('\0', offset)) != std::string::npos) {
+        std::string msg(conn.buffer, offset, end - offset);
+        offset = end + 1;
+        fprintf(stdout, "%s\n", msg.c_str());
+
+        int code = 0;
+        int seq = 0;
+        if (sscanf(msg.c_str(), "%d %d", &code, &seq) != 2 || code < 200 || code >= 600) {
+            continue;
+        }
+        for (auto it = conn.inflight.begin(); it != conn.inflight.end(); ++it) {
+            if (it->seq != seq) continue;
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - it->sent).count();
+            LOG(INFO) << "[" << seq << "] " << it->cmd << ": " << code << " in " << ms << "ms";
+            if (code != 200 && result == 0) {
+                result = code;
+            }
+            conn.inflightBytes -= it->bytes;
+            conn.inflight.erase(it);
+            break;
+        }
+    }
+    conn.buffer.erase(0, offset);
+    return result;
+}
+
+/*
+ * Runs every command in |path|, or on stdin, over one connection per
+ * socket. Up to |window| commands are in flight across both, so ones sent
+ * together may run and finish in any order, but they're always sent in
+ * order; a window of 1 runs the file strictly in order.
+ */
+static int do_batch(const char* path, bool wait_for_socket, size_t window) {
+    std::vector<std::string> commands;
+    if (!read_commands(path, commands)) {
+        return 5;
+    }
+
+    Connection conns[] = {
+        { "vold", -1, "", {}, 0 },
+        { "cryptd", -1, "", {}, 0 },
+    };
+    int result = 0;
+    int seq = 1;
+    size_t next = 0;
+    while (true) {
+        // Send as much as the window allows, stopping at the first command
+        // that has to wait, so nothing overtakes it
+        while (next < commands.size()) {
+            const std::string& cmd = commands[next];
+            bool crypt = cmd.compare(0, 7, "cryptfs") == 0
+                    && (cmd.size() == 7 || cmd[7] == ' ' || cmd[7] == '\t');
+            Connection& conn = conns[crypt ? 1 : 0];
+            std::string msg(android::base::StringPrintf("%d %s", seq, cmd.c_str()));
+            size_t bytes = msg.length() + 1;
+            size_t inflight = conns[0].inflight.size() + conns[1].inflight.size();
+            if (inflight >= window || (!conn.inflight.empty()
+                    && conn.inflightBytes + bytes > kMaxInflightBytes)) {
+                break;
+            }
+            if (conn.sock < 0) {
+                conn.sock = connect_socket(conn.sockname, wait_for_socket);
+                if (conn.sock < 0) {
+                    return 4;
+                }
+            }
+
+            if (TEMP_FAILURE_RETRY(write(conn.sock, msg.c_str(), bytes)) < 0) {
+                PLOG(ERROR) << "Failed to write command";
+                return errno;
+            }
+            conn.inflight.push_back(Connection::Pending{ seq++, cmd, bytes,
+                    std::chrono::steady_clock::now() });
+            conn.inflightBytes += bytes;
+            next++;
+        }
+
+        std::vector<struct pollfd> fds;
+        std::vector<Connection*> polled;
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        for (auto& conn : conns) {
+            if (conn.inflight.empty()) continue;
+            fds.push_back({ conn.sock, POLLIN, 0 });
+            polled.push_back(&conn);
+            deadline = std::min(deadline, conn.inflight.front().sent
+                    + std::chrono::milliseconds(kCommandTimeoutMs));
+        }
+        if (fds.empty()) {
+            break;
+        }
+
+        auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+        int rc = TEMP_FAILURE_RETRY(poll(fds.data(), fds.size(), std::max<int64_t>(timeout, 0)));
+        if (rc == 0) {
+            for (auto conn : polled) {
+                LOG(ERROR) << "Timeout waiting for " << conn->inflight.front().seq;
+            }
+            return ETIMEDOUT;
+        } else if (rc < 0) {
+            PLOG(ERROR) << "Failed during poll";
+            return errno;
+        }
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            char buffer[4096];
+            rc = TEMP_FAILURE_RETRY(read(fds[i].fd, buffer, sizeof(buffer)));
+            if (rc == 0) {
+                LOG(ERROR) << "Lost connection, did " << polled[i]->sockname << " crash?";
+                return ECONNRESET;
+            } else if (rc < 0) {
+                PLOG(ERROR) << "Error reading data";
+                return errno;
+            }
+            polled[i]->buffer.append(buffer, rc);
+            result = handle_messages(*polled[i], result);
+        }
+    }
+
+    for (auto& conn : conns) {
+        if (conn.sock >= 0) close(conn.sock);
+    }
+    return result;
+}
+
 static void usage(char *progname) {
     LOG(INFO) << "Usage: " << progname << " [--wait] <monitor>|<cmd> [arg1] [arg2...]";
+    LOG(INFO) << "       " << progname << " [--wait] --batch [--window N] [file|-]";
 }